@@ -0,0 +1,570 @@
+/* msemu-batch, run many headless emulators in parallel from a job manifest
+ *
+ * The manifest is a text file with one job per line. Blank lines and
+ * everything after a '#' are ignored. A line is a command followed by
+ * whitespace separated key=value pairs, values can not contain whitespace:
+ *
+ *	# Defaults for every job after this line
+ *	set codeflash=codeflash.bin dataflash=dataflash.bin epoch=0
+ *	job name=boot script=tests/boot.script lcd-log=out/boot.lcd
+ *	job name=menu snapshot=out/boot.snap script=tests/menu.script ram=out/menu.ram
+ *	job name=idle stop=time:30000
+ *
+ * "set" changes the defaults, "job" queues a job with the defaults plus its
+ * own keys:
+ *
+ *	name=<str>		Name in the report, defaults to job<line number>
+ *	codeflash=<path>	Codeflash image, loaded once per distinct path and
+ *				shared by every job using it (required)
+ *	dataflash=<path>	Dataflash image, never written back. A blank one
+ *				is used if missing
+ *	snapshot=<path>		Start from a snapshot, see snapshot.h
+ *	script=<path>		Input script, see script.h
+ *	stop=<cond>		When the job is done:
+ *				  script       the script finishes (default
+ *				               with a script)
+ *				  pc:<addr>    PC reaches <addr>
+ *				  time:<ms>    <ms> of emulated time has run
+ *				               (default without, at the limit)
+ *	limit=<ms>		Emulated time a job may run before it is counted
+ *				as timed out, default 600000
+ *	epoch=<secs>		RTC start and RAM seed, see --epoch. Defaults to
+ *				a fixed time so runs are repeatable, -1 to use
+ *				the host clock
+ *
+ * and outputs written when the job stops:
+ *
+ *	ram=<path>		RAM contents
+ *	df-out=<path>		Dataflash contents
+ *	snapshot-out=<path>	Snapshot to start later jobs from
+ *	coverage=<path>		Coverage bitmaps, see coverage.h
+ *	lcd-log=<path>		LCD frame hash log of the whole run
+ *
+ * A job with neither a script nor a snapshot is powered on at the start.
+ *
+ * Jobs are run on a work stealing pool, see pool.h. Once all are done, a JSON
+ * report of every job's status, script exit code, T states, PC, LCD hash and
+ * opcode bytes executed, plus totals, is written to the -o file. Not to
+ * stdout, which the instances and their scripts print to as they run. A job
+ * passes if it is done or powered off, msemu-batch exits non-zero if
+ * any job did not pass.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "coverage.h"
+#include "debug.h"
+#include "hash.h"
+#include "lcd.h"
+#include "mem.h"
+#include "msemu.h"
+#include "pool.h"
+#include "snapshot.h"
+#include "tool.h"
+
+#include <SDL2/SDL.h>
+#include <z80ex/z80ex.h>
+#if defined(_MSC_VER)
+	#include "platform/windows/getopt.h"
+#else
+	#include <getopt.h>
+#endif
+
+#define BATCH_LIMIT_MS		600000
+#define BATCH_TSTATES_MS	(MS_CPU_HZ / 1000)
+
+enum batch_stop {
+	BATCH_STOP_DEFAULT = 0,
+	BATCH_STOP_SCRIPT,
+	BATCH_STOP_PC,
+	BATCH_STOP_TIME,
+};
+
+enum batch_status {
+	BATCH_DONE = 0,		// Reached the stop condition
+	BATCH_OFF,		// Powered off, with nothing to power it on
+	BATCH_FAILED,		// Script failed or exited non-zero
+	BATCH_TIMEOUT,		// Hit the limit
+	BATCH_ERROR,		// Could not be started
+};
+
+static const char* const batch_status_text[] = {
+	"done", "off", "failed", "timeout", "error",
+};
+
+struct batch_job {
+	// From the manifest, strings point in to the manifest buffer
+	char *name;
+	char *cf_path;
+	char *df_path;
+	char *snap_path;
+	char *script_path;
+	char *ram_out;
+	char *df_out;
+	char *snap_out;
+	char *cov_out;
+	char *lcdlog_out;
+	int stop;
+	uint32_t stop_val;
+	uint64_t limit_ms;
+	int64_t epoch;
+	int lineno;
+	char def_name[16];
+	const uint8_t *cf;
+
+	// Results
+	int status;
+	int exit;
+	uint64_t tstates;
+	uint16_t pc;
+	uint64_t lcd_hash;
+	uint32_t cov[DEV_CNT];
+	double secs;
+};
+
+struct batch_cf {
+	const char *path;
+	const uint8_t *cf;
+};
+
+static void usage(const char *path_arg)
+{
+	printf(
+	  "\nMailstation Emulator batch runner\n\n"
+
+	  "Usage: \n"
+	  "  %s [-j <threads>] -o <path> <manifest>\n"
+	  "  %s -h | --help\n\n"
+
+	  "  -j <n>, --jobs <n>      Worker threads (def: one per CPU)\n"
+	  "  -o <path>, --output <path>\n"
+	  "                          Write the JSON report to <path>\n"
+	  "  -h, --help              Show this help\n\n"
+
+	  "See the top of src/batch.c for the manifest format.\n",
+	  path_arg, path_arg);
+}
+
+static int dump(const char *path, struct ms_page *const *tbl, int cnt)
+{
+	FILE *fd;
+	int err = 0;
+	int i;
+
+	fd = fopen(path, "wb");
+	if (fd == NULL) {
+		log_error("Failed to open '%s': %s\n", path, strerror(errno));
+		return MS_ERR;
+	}
+	for (i = 0; i < cnt; i++)
+		err |= (fwrite(tbl[i]->data, 1, MS_PAGE_LEN, fd) != MS_PAGE_LEN);
+	err |= fclose(fd);
+	if (err) {
+		log_error("Failed to write '%s'\n", path);
+		return MS_ERR;
+	}
+
+	return MS_OK;
+}
+
+static void batch_run(void *arg, int worker)
+{
+	struct batch_job *j = (struct batch_job *)arg;
+	ms_opts opts;
+	ms_ctx *ms;
+	uint64_t start, end;
+	int ret;
+
+	(void)worker;
+	start = SDL_GetPerformanceCounter();
+
+	ms_opts_init(&opts);
+	opts.cf_shared = j->cf;
+	opts.df_path = j->df_path;
+	opts.df_save_to_disk = 0;
+	opts.script_path = j->script_path;
+	opts.framelog_path = j->lcdlog_out;
+	opts.epoch = j->epoch;
+
+	j->status = BATCH_ERROR;
+	ms = ms_create(&opts);
+	if (ms == NULL) goto out;
+
+	if (j->snap_path != NULL && snap_load(ms, j->snap_path)) goto out;
+	coverage_init(ms, NULL);
+	if (j->script_path == NULL && j->snap_path == NULL)
+		ms_power_on_reset(ms);
+
+	if (j->stop == BATCH_STOP_TIME) {
+		end = ms->tstates + (uint64_t)j->stop_val * BATCH_TSTATES_MS;
+	} else {
+		end = ms->tstates + j->limit_ms * BATCH_TSTATES_MS;
+	}
+	if (j->stop == BATCH_STOP_PC) ms->bp.pc = j->stop_val;
+
+	for (;;) {
+		ret = ms_step(ms, end - ms->tstates);
+		if (ret == MS_STEP_SCRIPT) {
+			// Carry on past the script to some other stop condition
+			j->exit = ms->script_exit;
+			if (j->stop != BATCH_STOP_SCRIPT && !j->exit) continue;
+			j->status = j->exit ? BATCH_FAILED : BATCH_DONE;
+		} else if (ret == MS_STEP_DONE) {
+			j->status = (j->stop == BATCH_STOP_TIME) ?
+			  BATCH_DONE : BATCH_TIMEOUT;
+		} else if (ret == MS_STEP_BREAK) {
+			j->status = BATCH_DONE;
+		} else if (ret == MS_STEP_OFF) {
+			j->status = BATCH_OFF;
+		} else {
+			j->exit = ms->script_exit;
+			j->status = BATCH_FAILED;
+		}
+		break;
+	}
+
+	j->tstates = ms->tstates;
+	j->pc = z80ex_get_reg(ms->z80, regPC);
+	j->lcd_hash = hash64(ms->lcd_dat1bit,
+	  (MS_LCD_WIDTH * MS_LCD_HEIGHT) / 8, 0);
+	j->cov[CF] = coverage_executed(ms, CF);
+	j->cov[DF] = coverage_executed(ms, DF);
+	j->cov[RAM] = coverage_executed(ms, RAM);
+
+	ret = MS_OK;
+	if (j->ram_out != NULL) ret |= dump(j->ram_out, ms->ram, MS_RAM_PAGES);
+	if (j->df_out != NULL) ret |= dump(j->df_out, ms->df, MS_DF_PAGES);
+	if (j->snap_out != NULL) ret |= snap_save(ms, j->snap_out);
+	if (j->cov_out != NULL) ret |= coverage_save(ms, j->cov_out);
+	if (ret) j->status = BATCH_ERROR;
+
+out:
+	if (j->status == BATCH_ERROR)
+		log_error("Job '%s' stopped with an error\n", j->name);
+	if (ms != NULL) ms_destroy(ms);
+	j->secs = (double)(SDL_GetPerformanceCounter() - start) /
+	  SDL_GetPerformanceFrequency();
+}
+
+static int batch_key(struct batch_job *j, char *key, char *val,
+  const char *path)
+{
+	char *end;
+
+	if (!strcmp(key, "name")) {
+		j->name = val;
+	} else if (!strcmp(key, "codeflash")) {
+		j->cf_path = val;
+	} else if (!strcmp(key, "dataflash")) {
+		j->df_path = val;
+	} else if (!strcmp(key, "snapshot")) {
+		j->snap_path = val;
+	} else if (!strcmp(key, "script")) {
+		j->script_path = val;
+	} else if (!strcmp(key, "ram")) {
+		j->ram_out = val;
+	} else if (!strcmp(key, "df-out")) {
+		j->df_out = val;
+	} else if (!strcmp(key, "snapshot-out")) {
+		j->snap_out = val;
+	} else if (!strcmp(key, "coverage")) {
+		j->cov_out = val;
+	} else if (!strcmp(key, "lcd-log")) {
+		j->lcdlog_out = val;
+	} else if (!strcmp(key, "stop")) {
+		if (!strcmp(val, "script")) {
+			j->stop = BATCH_STOP_SCRIPT;
+			return MS_OK;
+		} else if (!strncmp(val, "pc:", 3)) {
+			j->stop = BATCH_STOP_PC;
+			val += 3;
+		} else if (!strncmp(val, "time:", 5)) {
+			j->stop = BATCH_STOP_TIME;
+			val += 5;
+		} else {
+			log_error("%s:%d: Invalid stop condition '%s'\n", path,
+			  j->lineno, val);
+			return MS_ERR;
+		}
+		j->stop_val = strtoul(val, &end, 0);
+		if (!*val || *end ||
+		    (j->stop == BATCH_STOP_PC && j->stop_val > 0xFFFF)) {
+			log_error("%s:%d: Invalid number '%s'\n", path,
+			  j->lineno, val);
+			return MS_ERR;
+		}
+	} else if (!strcmp(key, "limit")) {
+		j->limit_ms = strtoull(val, &end, 0);
+		if (!*val || *end) {
+			log_error("%s:%d: Invalid number '%s'\n", path,
+			  j->lineno, val);
+			return MS_ERR;
+		}
+	} else if (!strcmp(key, "epoch")) {
+		j->epoch = strtoll(val, &end, 0);
+		if (!*val || *end) {
+			log_error("%s:%d: Invalid number '%s'\n", path,
+			  j->lineno, val);
+			return MS_ERR;
+		}
+	} else {
+		log_error("%s:%d: Unknown key '%s'\n", path, j->lineno, key);
+		return MS_ERR;
+	}
+
+	return MS_OK;
+}
+
+/* Parse the manifest in buf, which is modified in place and must outlive
+ * the jobs. Returns the number of jobs, -1 on error */
+static int batch_parse(char *buf, const char *path, struct batch_job **jobs)
+{
+	struct batch_job def, *j = NULL;
+	char *line, *next, *tok, *val;
+	int lineno = 0, cnt = 0, size = 0, is_job;
+	static const char *delim = " \t\r";
+
+	memset(&def, 0, sizeof(def));
+	def.limit_ms = BATCH_LIMIT_MS;
+	def.epoch = TOOL_EPOCH;
+
+	for (line = buf; line != NULL; line = next) {
+		lineno++;
+		next = strchr(line, '\n');
+		if (next != NULL) *next++ = '\0';
+		line[strcspn(line, "#")] = '\0';
+
+		tok = strtok(line, delim);
+		if (tok == NULL) continue;
+
+		if (!strcmp(tok, "job")) {
+			is_job = 1;
+			if (cnt == size) {
+				size = size ? size * 2 : 64;
+				*jobs = (struct batch_job *)realloc(*jobs,
+				  size * sizeof(struct batch_job));
+				if (*jobs == NULL) {
+					printf("Unable to allocate jobs\n");
+					exit(EXIT_FAILURE);
+				}
+			}
+			j = &(*jobs)[cnt];
+			*j = def;
+		} else if (!strcmp(tok, "set")) {
+			is_job = 0;
+			j = &def;
+		} else {
+			log_error("%s:%d: Unknown command '%s'\n", path, lineno,
+			  tok);
+			return -1;
+		}
+		j->lineno = lineno;
+
+		while ((tok = strtok(NULL, delim)) != NULL) {
+			val = strchr(tok, '=');
+			if (val == NULL || val == tok) {
+				log_error("%s:%d: Expected key=value, got '%s'\n",
+				  path, lineno, tok);
+				return -1;
+			}
+			*val++ = '\0';
+			if (batch_key(j, tok, val, path)) return -1;
+		}
+		if (!is_job) continue;
+
+		if (j->cf_path == NULL) {
+			log_error("%s:%d: No codeflash given\n", path, lineno);
+			return -1;
+		}
+		if (j->stop == BATCH_STOP_DEFAULT) {
+			if (j->script_path != NULL) {
+				j->stop = BATCH_STOP_SCRIPT;
+			} else {
+				j->stop = BATCH_STOP_TIME;
+				j->stop_val = (uint32_t)j->limit_ms;
+			}
+		}
+		if (j->stop == BATCH_STOP_SCRIPT && j->script_path == NULL) {
+			log_error("%s:%d: stop=script with no script\n", path,
+			  lineno);
+			return -1;
+		}
+		cnt++;
+	}
+
+	// Only now that the jobs array has stopped moving
+	for (j = *jobs; j < *jobs + cnt; j++) {
+		if (j->name != NULL) continue;
+		snprintf(j->def_name, sizeof(j->def_name), "job%d", j->lineno);
+		j->name = j->def_name;
+	}
+
+	return cnt;
+}
+
+static char *batch_read(const char *path)
+{
+	FILE *fd;
+	char *buf;
+	long len;
+
+	fd = fopen(path, "rb");
+	if (fd == NULL) {
+		log_error("Failed to open manifest '%s': %s\n", path,
+		  strerror(errno));
+		return NULL;
+	}
+	fseek(fd, 0, SEEK_END);
+	len = ftell(fd);
+	fseek(fd, 0, SEEK_SET);
+	if (len < 0) len = 0;
+
+	buf = (char *)malloc(len + 1);
+	if (buf == NULL) {
+		printf("Unable to allocate manifest\n");
+		exit(EXIT_FAILURE);
+	}
+	len = (long)fread(buf, 1, len, fd);
+	buf[len] = '\0';
+	fclose(fd);
+
+	return buf;
+}
+
+static int batch_report(const char *path, struct batch_job *jobs, int cnt,
+  int threads, double secs)
+{
+	struct batch_job *j;
+	int i, passed = 0, status[BATCH_ERROR + 1] = { 0 };
+	FILE *fd;
+
+	fd = fopen(path, "w");
+	if (fd == NULL) {
+		log_error("Failed to open report '%s': %s\n", path,
+		  strerror(errno));
+		return MS_ERR;
+	}
+
+	fprintf(fd, "{\n  \"jobs\": [\n");
+	for (i = 0; i < cnt; i++) {
+		j = &jobs[i];
+		status[j->status]++;
+		if (j->status <= BATCH_OFF) passed++;
+
+		fprintf(fd, "    {\"name\":");
+		tool_json_str(fd, j->name);
+		fprintf(fd, ",\"status\":\"%s\",\"exit\":%d,\"tstates\":%llu,"
+		  "\"pc\":%u,\"lcd_hash\":\"%016llX\",\"coverage\":"
+		  "{\"cf\":%u,\"df\":%u,\"ram\":%u},\"seconds\":%.3f}%s\n",
+		  batch_status_text[j->status], j->exit,
+		  (unsigned long long)j->tstates, j->pc,
+		  (unsigned long long)j->lcd_hash, j->cov[CF], j->cov[DF],
+		  j->cov[RAM], j->secs, (i + 1 < cnt) ? "," : "");
+	}
+	fprintf(fd, "  ],\n  \"summary\": {\"jobs\":%d,\"passed\":%d,", cnt,
+	  passed);
+	for (i = 0; i <= BATCH_ERROR; i++)
+		fprintf(fd, "\"%s\":%d,", batch_status_text[i], status[i]);
+	fprintf(fd, "\"threads\":%d,\"seconds\":%.3f}\n}\n", threads, secs);
+
+	if (fclose(fd)) {
+		log_error("Failed to write report '%s'\n", path);
+		return MS_ERR;
+	}
+
+	return MS_OK;
+}
+
+int main(int argc, char *argv[])
+{
+	struct batch_job *jobs = NULL;
+	struct batch_cf *cfs;
+	struct ms_pool *pool;
+	char *manifest, *report = NULL;
+	uint64_t start;
+	int c, i, k, cnt, ncf = 0, threads = 0, ret = EXIT_SUCCESS;
+	int option_index = 0;
+
+	static struct option long_options[] = {
+		{"jobs", required_argument, 0, 'j'},
+		{"output", required_argument, 0, 'o'},
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0},
+	};
+
+	while ((c = getopt_long(argc, argv, "j:o:h", long_options,
+	    &option_index)) != -1) {
+		switch (c) {
+		case 'j':
+			threads = atoi(optarg);
+			break;
+		case 'o':
+			report = optarg;
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			exit(c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+	}
+	if (optind != argc - 1 || report == NULL) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	log_start();
+
+	manifest = batch_read(argv[optind]);
+	if (manifest == NULL) exit(EXIT_FAILURE);
+	cnt = batch_parse(manifest, argv[optind], &jobs);
+	if (cnt < 0) exit(EXIT_FAILURE);
+
+	// Every distinct codeflash is loaded once and shared
+	cfs = (struct batch_cf *)calloc(cnt ? cnt : 1, sizeof(struct batch_cf));
+	if (cfs == NULL) {
+		printf("Unable to allocate jobs\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < cnt; i++) {
+		for (k = 0; k < ncf; k++) {
+			if (!strcmp(cfs[k].path, jobs[i].cf_path)) break;
+		}
+		if (k == ncf) {
+			cfs[k].path = jobs[i].cf_path;
+			cfs[k].cf = ms_cf_load(jobs[i].cf_path);
+			if (cfs[k].cf == NULL) exit(EXIT_FAILURE);
+			ncf++;
+		}
+		jobs[i].cf = cfs[k].cf;
+	}
+
+	pool = pool_create(threads);
+	if (pool == NULL) exit(EXIT_FAILURE);
+	threads = pool_threads(pool);
+
+	start = SDL_GetPerformanceCounter();
+	for (i = 0; i < cnt; i++) pool_submit(pool, batch_run, &jobs[i]);
+	pool_wait(pool);
+	pool_destroy(pool);
+
+	if (batch_report(report, jobs, cnt, threads,
+	    (double)(SDL_GetPerformanceCounter() - start) /
+	    SDL_GetPerformanceFrequency())) {
+		ret = EXIT_FAILURE;
+	}
+	for (i = 0; i < cnt; i++) {
+		if (jobs[i].status > BATCH_OFF) ret = EXIT_FAILURE;
+	}
+
+	for (k = 0; k < ncf; k++) ms_cf_free(cfs[k].cf);
+	free(cfs);
+	free(jobs);
+	free(manifest);
+	log_stop();
+
+	return ret;
+}
@@ -0,0 +1,439 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL2/SDL.h>
+
+#include "capture.h"
+#include "debug.h"
+#include "lcd.h"
+#include "msemu.h"
+#include "ui.h"
+
+#define CAPTURE_BUF_LEN		((MS_LCD_WIDTH * MS_LCD_HEIGHT) / 8)
+#define CAPTURE_PIXELS		(MS_LCD_WIDTH * MS_LCD_HEIGHT)
+
+/* Number of frames the writer may fall behind before frames are dropped.
+ * Must be a power of 2 */
+#define CAPTURE_RING_LEN	64
+
+// Shortest delay, in 1/100 s, that viewers reliably honor
+#define CAPTURE_MIN_DELAY	2
+// Longest delay a single GIF frame can have
+#define CAPTURE_MAX_DELAY	0xFFFF
+
+#define GIF_MIN_CODE_SIZE	2
+#define GIF_CLEAR		(1 << GIF_MIN_CODE_SIZE)
+#define GIF_EOI			(GIF_CLEAR + 1)
+#define GIF_MAX_CODES		4096
+
+struct capture_slot {
+	uint64_t tstate;
+	int last;	// Marks end of capture, no frame data
+	uint8_t buf[CAPTURE_BUF_LEN];
+};
+
+/* LZW encoder state for a single image */
+struct gif_lzw {
+	FILE *fd;
+	uint8_t block[255];
+	int blen;
+	uint32_t acc;
+	int nbits;
+	int code_size;
+	int next;
+	// Codes are extended one pixel at a time, and pixels are only 0 or 1
+	uint16_t dict[GIF_MAX_CODES][2];
+};
+
+struct ms_capture {
+	/* Single producer, the emulation loop, single consumer, the writer
+	 * thread. head and tail count up forever, the slot is the count
+	 * modulo CAPTURE_RING_LEN */
+	struct capture_slot *ring;
+	SDL_atomic_t head;
+	SDL_atomic_t tail;
+	SDL_sem *avail;
+	SDL_Thread *thread;
+
+	// Producer side, the last frame queued for comparison
+	uint8_t last[CAPTURE_BUF_LEN];
+	int have_last;
+	uint32_t dropped;
+
+	// Writer side
+	FILE *fd;
+	uint8_t *shown;		// Canvas as of the last written frame
+	uint8_t *pend;		// Frame waiting to know its delay
+	int have_pend;
+	int have_shown;
+	uint64_t start;		// T state of the first frame
+	uint64_t pend_cs;	// Start time of pend in 1/100 s from start
+	uint32_t frames;
+	struct gif_lzw lzw;
+};
+
+static void put16(FILE *fd, unsigned int v)
+{
+	fputc(v & 0xFF, fd);
+	fputc((v >> 8) & 0xFF, fd);
+}
+
+static void gif_flush_block(struct gif_lzw *l)
+{
+	if (!l->blen) return;
+
+	fputc(l->blen, l->fd);
+	fwrite(l->block, 1, l->blen, l->fd);
+	l->blen = 0;
+}
+
+static void gif_emit(struct gif_lzw *l, int code)
+{
+	l->acc |= ((uint32_t)code << l->nbits);
+	l->nbits += l->code_size;
+
+	while (l->nbits >= 8) {
+		l->block[l->blen++] = (uint8_t)l->acc;
+		if (l->blen == sizeof(l->block)) gif_flush_block(l);
+		l->acc >>= 8;
+		l->nbits -= 8;
+	}
+}
+
+static void gif_reset(struct gif_lzw *l)
+{
+	memset(l->dict, 0, sizeof(l->dict));
+	l->code_size = GIF_MIN_CODE_SIZE + 1;
+	l->next = GIF_EOI + 1;
+}
+
+/* Account for the code the decoder adds after every code it reads. The
+ * decoder widens its codes as soon as that new code no longer fits. */
+static void gif_next_code(struct gif_lzw *l)
+{
+	l->next++;
+	if (l->next > (1 << l->code_size) && l->code_size < 12)
+		l->code_size++;
+}
+
+/* Write the LZW compressed pixels of a rectangle of the frame */
+static void gif_write_pixels(struct gif_lzw *l, const uint8_t *pix,
+  int x, int y, int w, int h)
+{
+	int prefix = -1;
+	int px, py, p;
+
+	l->blen = 0;
+	l->acc = 0;
+	l->nbits = 0;
+	gif_reset(l);
+
+	fputc(GIF_MIN_CODE_SIZE, l->fd);
+	gif_emit(l, GIF_CLEAR);
+
+	for (py = y; py < y + h; py++) {
+		for (px = x; px < x + w; px++) {
+			p = pix[(py * MS_LCD_WIDTH) + px];
+			if (prefix < 0) {
+				prefix = p;
+				continue;
+			}
+			if (l->dict[prefix][p]) {
+				prefix = l->dict[prefix][p];
+				continue;
+			}
+
+			gif_emit(l, prefix);
+			if (l->next < GIF_MAX_CODES) {
+				l->dict[prefix][p] = l->next;
+				gif_next_code(l);
+			} else {
+				gif_emit(l, GIF_CLEAR);
+				gif_reset(l);
+			}
+			prefix = p;
+		}
+	}
+
+	gif_emit(l, prefix);
+	if (l->next < GIF_MAX_CODES) gif_next_code(l);
+	gif_emit(l, GIF_EOI);
+	if (l->nbits) {
+		l->block[l->blen++] = (uint8_t)l->acc;
+		if (l->blen == sizeof(l->block)) gif_flush_block(l);
+	}
+	gif_flush_block(l);
+	fputc(0, l->fd);
+}
+
+static void gif_write_header(FILE *fd)
+{
+	fwrite("GIF89a", 1, 6, fd);
+	put16(fd, MS_LCD_WIDTH);
+	put16(fd, MS_LCD_HEIGHT);
+	// Global color table of 2 entries, 8 bit color resolution
+	fputc(0xF0, fd);
+	fputc(0, fd);
+	fputc(0, fd);
+
+	// Index 0 is a light pixel, 1 a dark pixel, colors match the UI
+	fputc((UI_LCD_PIXEL_OFF >> 24) & 0xFF, fd);
+	fputc((UI_LCD_PIXEL_OFF >> 16) & 0xFF, fd);
+	fputc((UI_LCD_PIXEL_OFF >> 8) & 0xFF, fd);
+	fputc((UI_LCD_PIXEL_ON >> 24) & 0xFF, fd);
+	fputc((UI_LCD_PIXEL_ON >> 16) & 0xFF, fd);
+	fputc((UI_LCD_PIXEL_ON >> 8) & 0xFF, fd);
+
+	// Loop forever
+	fputc(0x21, fd);
+	fputc(0xFF, fd);
+	fputc(11, fd);
+	fwrite("NETSCAPE2.0", 1, 11, fd);
+	fputc(3, fd);
+	fputc(1, fd);
+	put16(fd, 0);
+	fputc(0, fd);
+}
+
+/* Write one frame that covers only the pixels that differ from what is
+ * already on the canvas, and is shown for delay 1/100 s */
+static void gif_write_frame(struct ms_capture *cap, unsigned int delay)
+{
+	int x0 = MS_LCD_WIDTH, y0 = MS_LCD_HEIGHT, x1 = -1, y1 = -1;
+	int x, y, i;
+
+	if (!cap->have_shown) {
+		x0 = y0 = 0;
+		x1 = MS_LCD_WIDTH - 1;
+		y1 = MS_LCD_HEIGHT - 1;
+	} else {
+		for (y = 0; y < MS_LCD_HEIGHT; y++) {
+			i = y * MS_LCD_WIDTH;
+			if (!memcmp(cap->shown + i, cap->pend + i, MS_LCD_WIDTH))
+				continue;
+			if (y < y0) y0 = y;
+			y1 = y;
+			for (x = 0; x < MS_LCD_WIDTH; x++) {
+				if (cap->shown[i + x] == cap->pend[i + x]) continue;
+				if (x < x0) x0 = x;
+				if (x > x1) x1 = x;
+			}
+		}
+		// Nothing changed, a single pixel holds the delay
+		if (x1 < 0) x0 = x1 = y0 = y1 = 0;
+	}
+
+	// Graphic control extension, leave frame in place when done
+	fputc(0x21, cap->fd);
+	fputc(0xF9, cap->fd);
+	fputc(4, cap->fd);
+	fputc(0x04, cap->fd);
+	put16(cap->fd, delay);
+	fputc(0, cap->fd);
+	fputc(0, cap->fd);
+
+	// Image descriptor, no local color table
+	fputc(0x2C, cap->fd);
+	put16(cap->fd, x0);
+	put16(cap->fd, y0);
+	put16(cap->fd, x1 - x0 + 1);
+	put16(cap->fd, y1 - y0 + 1);
+	fputc(0, cap->fd);
+
+	gif_write_pixels(&cap->lzw, cap->pend, x0, y0, x1 - x0 + 1,
+	  y1 - y0 + 1);
+
+	memcpy(cap->shown, cap->pend, CAPTURE_PIXELS);
+	cap->have_shown = 1;
+	cap->frames++;
+}
+
+/* Write out the pending frame now that it is known to end at tstate */
+static void capture_flush_pend(struct ms_capture *cap, uint64_t tstate,
+  int last)
+{
+	uint64_t end_cs = ((tstate - cap->start) * 100) / MS_CPU_HZ;
+	uint64_t delay = end_cs - cap->pend_cs;
+
+	if (!cap->have_pend) return;
+
+	/* Too short to be seen, let the next frame replace it. The last frame
+	 * is always written so the capture ends on the final screen */
+	if (delay < CAPTURE_MIN_DELAY && !last) return;
+
+	while (delay > CAPTURE_MAX_DELAY) {
+		gif_write_frame(cap, CAPTURE_MAX_DELAY);
+		delay -= CAPTURE_MAX_DELAY;
+	}
+	gif_write_frame(cap, (unsigned int)delay);
+
+	cap->pend_cs = end_cs;
+	cap->have_pend = 0;
+}
+
+static int capture_thread(void *data)
+{
+	struct ms_capture *cap = (struct ms_capture *)data;
+	struct capture_slot *slot;
+	int tail;
+	int x, y, b;
+	uint8_t bits;
+
+	for (;;) {
+		SDL_SemWait(cap->avail);
+
+		tail = SDL_AtomicGet(&cap->tail);
+		if (tail == SDL_AtomicGet(&cap->head)) continue;
+		slot = &cap->ring[tail & (CAPTURE_RING_LEN - 1)];
+
+		if (!cap->frames && !cap->have_pend) {
+			cap->start = slot->tstate;
+			cap->pend_cs = 0;
+		}
+		capture_flush_pend(cap, slot->tstate, slot->last);
+
+		if (slot->last) {
+			SDL_AtomicSet(&cap->tail, tail + 1);
+			break;
+		}
+
+		for (y = 0; y < MS_LCD_HEIGHT; y++) {
+			for (x = 0; x < MS_LCD_COLS; x++) {
+				bits = lcd_buf_get_byte(slot->buf, x, y);
+				for (b = 0; b < 8; b++) {
+					cap->pend[(y * MS_LCD_WIDTH) + (x * 8) + b] =
+					  (bits >> b) & 1;
+				}
+			}
+		}
+		cap->have_pend = 1;
+
+		SDL_AtomicSet(&cap->tail, tail + 1);
+	}
+
+	fputc(0x3B, cap->fd);
+
+	return 0;
+}
+
+/* Claim the next free slot, NULL if the ring is full */
+static struct capture_slot *capture_slot_get(struct ms_capture *cap)
+{
+	int head = SDL_AtomicGet(&cap->head);
+
+	if ((head - SDL_AtomicGet(&cap->tail)) >= CAPTURE_RING_LEN) return NULL;
+
+	return &cap->ring[head & (CAPTURE_RING_LEN - 1)];
+}
+
+static void capture_slot_put(struct ms_capture *cap)
+{
+	SDL_AtomicAdd(&cap->head, 1);
+	SDL_SemPost(cap->avail);
+}
+
+int capture_start(ms_ctx *ms, const char *path)
+{
+	struct ms_capture *cap;
+
+	capture_stop(ms);
+
+	cap = (struct ms_capture *)calloc(1, sizeof(struct ms_capture));
+	if (cap == NULL) {
+		printf("Unable to allocate capture\n");
+		exit(EXIT_FAILURE);
+	}
+	cap->ring = (struct capture_slot *)calloc(CAPTURE_RING_LEN,
+	  sizeof(struct capture_slot));
+	cap->shown = (uint8_t *)calloc(1, CAPTURE_PIXELS);
+	cap->pend = (uint8_t *)calloc(1, CAPTURE_PIXELS);
+	if (cap->ring == NULL || cap->shown == NULL || cap->pend == NULL) {
+		printf("Unable to allocate capture\n");
+		exit(EXIT_FAILURE);
+	}
+
+	cap->fd = fopen(path, "wb");
+	if (!cap->fd) {
+		log_error("Failed to open capture file '%s'\n", path);
+		goto err;
+	}
+	cap->lzw.fd = cap->fd;
+	gif_write_header(cap->fd);
+
+	cap->avail = SDL_CreateSemaphore(0);
+	if (cap->avail == NULL) goto err_sdl;
+	cap->thread = SDL_CreateThread(capture_thread, "capture", cap);
+	if (cap->thread == NULL) goto err_sdl;
+
+	ms->capture = cap;
+	printf("Capturing LCD to '%s'\n", path);
+
+	return MS_OK;
+
+err_sdl:
+	log_error("Failed to start capture: %s\n", SDL_GetError());
+err:
+	if (cap->avail) SDL_DestroySemaphore(cap->avail);
+	if (cap->fd) fclose(cap->fd);
+	free(cap->ring);
+	free(cap->shown);
+	free(cap->pend);
+	free(cap);
+	return MS_ERR;
+}
+
+void capture_frame(ms_ctx *ms)
+{
+	struct ms_capture *cap = ms->capture;
+	struct capture_slot *slot;
+
+	if (cap == NULL) return;
+
+	if (cap->have_last && !memcmp(cap->last, ms->lcd_dat1bit, CAPTURE_BUF_LEN))
+		return;
+
+	slot = capture_slot_get(cap);
+	if (slot == NULL) {
+		/* Leave last alone so this change is picked up again by the
+		 * next frame that gets a slot */
+		cap->dropped++;
+		return;
+	}
+
+	slot->tstate = ms->tstates;
+	slot->last = 0;
+	memcpy(slot->buf, ms->lcd_dat1bit, CAPTURE_BUF_LEN);
+	memcpy(cap->last, ms->lcd_dat1bit, CAPTURE_BUF_LEN);
+	cap->have_last = 1;
+	capture_slot_put(cap);
+}
+
+void capture_stop(ms_ctx *ms)
+{
+	struct ms_capture *cap = ms->capture;
+	struct capture_slot *slot;
+
+	if (cap == NULL) return;
+
+	/* The end marker must get through, the writer is always making
+	 * progress so this does not wait long */
+	while ((slot = capture_slot_get(cap)) == NULL) SDL_Delay(1);
+	slot->tstate = ms->tstates;
+	slot->last = 1;
+	capture_slot_put(cap);
+
+	SDL_WaitThread(cap->thread, NULL);
+	SDL_DestroySemaphore(cap->avail);
+
+	if (fclose(cap->fd)) log_error("Failed to write capture file\n");
+	printf("Captured %u frames", cap->frames);
+	if (cap->dropped) printf(", dropped %u", cap->dropped);
+	printf("\n");
+
+	free(cap->ring);
+	free(cap->shown);
+	free(cap->pend);
+	free(cap);
+	ms->capture = NULL;
+}
@@ -0,0 +1,43 @@
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#include "msemu.h"
+
+/* LCD capture to animated GIF
+ *
+ * At the end of every frame the 1-bit LCD buffer is compared with the last
+ * captured frame. Frames that changed are copied in to a ring and a
+ * background thread encodes them, so the emulation loop only ever does a
+ * compare and a 9600 byte copy. If the writer falls behind, frames are
+ * dropped rather than stalling emulation.
+ *
+ * Unchanged frames are never stored, the previous frame is simply shown for
+ * longer. Frame delays come from emulated time, so a capture plays back at
+ * the Mailstation's speed regardless of how fast the host ran it. Each GIF
+ * frame only covers the bounding box of the pixels that changed, and with
+ * a two color palette an idle screen costs a few bytes per second.
+ *
+ * GIF delays are in 1/100 s and most viewers do not honor delays below
+ * 2/100 s, so screens that are replaced faster than that are skipped.
+ */
+
+/**
+ * Start capturing to a GIF file. Stops any capture already running.
+ *
+ * Returns MS_OK on success, MS_ERR if the file could not be opened
+ */
+int capture_start(ms_ctx *ms, const char *path);
+
+/**
+ * Queue the current LCD contents if they differ from the last captured frame.
+ * Called at the end of every frame, does nothing if not capturing.
+ */
+void capture_frame(ms_ctx *ms);
+
+/**
+ * Stop capturing, wait for the writer to finish and close the file.
+ * Does nothing if not capturing.
+ */
+void capture_stop(ms_ctx *ms);
+
+#endif // __CAPTURE_H__
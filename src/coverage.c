@@ -0,0 +1,268 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "coverage.h"
+#include "debug.h"
+#include "msemu.h"
+#include "sizes.h"
+#include "symbols.h"
+
+#define COVERAGE_HDR_LEN	8
+
+extern const char* const ms_dev_map_text[];
+
+static const struct {
+	int dev;
+	uint32_t size;
+} coverage_devs[] = {
+	{ CF, SZ_1M },
+	{ DF, SZ_512K },
+	{ RAM, SZ_128K },
+};
+#define NUM_COV_DEVS (sizeof(coverage_devs) / sizeof(coverage_devs[0]))
+
+static void put32(uint8_t *p, uint32_t v)
+{
+	p[0] = v & 0xFF;
+	p[1] = (v >> 8) & 0xFF;
+	p[2] = (v >> 16) & 0xFF;
+	p[3] = (v >> 24) & 0xFF;
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int popcount8(uint8_t v)
+{
+	int n = 0;
+
+	for (; v; v &= v - 1) n++;
+	return n;
+}
+
+/* Number of marked bytes from addr up to, not including, end */
+static uint32_t coverage_count(struct ms_coverage *cov, int dev,
+  uint32_t addr, uint32_t end)
+{
+	uint8_t *map = cov->map[dev];
+	uint32_t n = 0;
+
+	for (; addr < end && (addr & 7); addr++)
+		n += (map[addr >> 3] >> (addr & 7)) & 1;
+	for (; addr + 8 <= end; addr += 8)
+		n += popcount8(map[addr >> 3]);
+	for (; addr < end; addr++)
+		n += (map[addr >> 3] >> (addr & 7)) & 1;
+
+	return n;
+}
+
+int coverage_init(ms_ctx *ms, const char *path)
+{
+	struct ms_coverage *cov;
+	FILE *fd;
+	int i, dev;
+
+	if (ms->coverage != NULL) return MS_OK;
+
+	cov = (struct ms_coverage *)calloc(1, sizeof(struct ms_coverage));
+	if (cov == NULL) {
+		printf("Unable to allocate coverage bitmaps\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < (int)NUM_COV_DEVS; i++) {
+		dev = coverage_devs[i].dev;
+		cov->map[dev] = (uint8_t *)calloc(coverage_devs[i].size / 8, 1);
+		if (cov->map[dev] == NULL) {
+			printf("Unable to allocate coverage bitmaps\n");
+			exit(EXIT_FAILURE);
+		}
+		cov->mask[dev] = coverage_devs[i].size - 1;
+	}
+	ms->coverage = cov;
+
+	/* Carry on from earlier runs */
+	if (path == NULL) return MS_OK;
+	fd = fopen(path, "rb");
+	if (fd == NULL) return MS_OK;
+	fclose(fd);
+
+	if (coverage_merge(ms, path)) {
+		coverage_free(ms);
+		return MS_ERR;
+	}
+
+	return MS_OK;
+}
+
+int coverage_merge(ms_ctx *ms, const char *path)
+{
+	struct ms_coverage *cov = ms->coverage;
+	uint8_t hdr[COVERAGE_HDR_LEN], buf[SZ_4K];
+	uint32_t dev, len, done, i, n;
+	FILE *fd;
+
+	if (cov == NULL) return MS_ERR;
+
+	fd = fopen(path, "rb");
+	if (fd == NULL) {
+		log_error("Failed to open coverage file '%s': %s\n", path,
+		  strerror(errno));
+		return MS_ERR;
+	}
+
+	if (fread(hdr, 1, sizeof(hdr), fd) != sizeof(hdr) ||
+	    memcmp(hdr, "MSCV", 4) || get32(hdr + 4) != COVERAGE_VERSION) {
+		log_error("'%s' is not a coverage file\n", path);
+		fclose(fd);
+		return MS_ERR;
+	}
+
+	while (fread(hdr, 1, sizeof(hdr), fd) == sizeof(hdr)) {
+		dev = get32(hdr);
+		len = get32(hdr + 4);
+		if (dev >= DEV_CNT || cov->map[dev] == NULL ||
+		    len != (cov->mask[dev] + 1) / 8) {
+			log_error("'%s' has an invalid bitmap\n", path);
+			fclose(fd);
+			return MS_ERR;
+		}
+
+		for (done = 0; done < len; done += n) {
+			n = len - done;
+			if (n > sizeof(buf)) n = sizeof(buf);
+			if (fread(buf, 1, n, fd) != n) {
+				log_error("'%s' is truncated\n", path);
+				fclose(fd);
+				return MS_ERR;
+			}
+			for (i = 0; i < n; i++) cov->map[dev][done + i] |= buf[i];
+		}
+	}
+	fclose(fd);
+
+	return MS_OK;
+}
+
+int coverage_save(ms_ctx *ms, const char *path)
+{
+	struct ms_coverage *cov = ms->coverage;
+	uint8_t hdr[COVERAGE_HDR_LEN] = { 'M', 'S', 'C', 'V' };
+	uint32_t len;
+	int i, dev, err = 0;
+	FILE *fd;
+
+	if (cov == NULL) return MS_ERR;
+
+	fd = fopen(path, "wb");
+	if (fd == NULL) {
+		log_error("Failed to open coverage file '%s': %s\n", path,
+		  strerror(errno));
+		return MS_ERR;
+	}
+
+	put32(hdr + 4, COVERAGE_VERSION);
+	err |= (fwrite(hdr, 1, sizeof(hdr), fd) != sizeof(hdr));
+	for (i = 0; i < (int)NUM_COV_DEVS; i++) {
+		dev = coverage_devs[i].dev;
+		len = coverage_devs[i].size / 8;
+		put32(hdr, dev);
+		put32(hdr + 4, len);
+		err |= (fwrite(hdr, 1, sizeof(hdr), fd) != sizeof(hdr));
+		err |= (fwrite(cov->map[dev], 1, len, fd) != len);
+	}
+	err |= fclose(fd);
+
+	if (err) {
+		log_error("Failed to write coverage file '%s'\n", path);
+		return MS_ERR;
+	}
+
+	return MS_OK;
+}
+
+int coverage_report(ms_ctx *ms, const char *path)
+{
+	struct ms_coverage *cov = ms->coverage;
+	const struct ms_sym *sym;
+	uint32_t end, n;
+	int i, cnt, dev, hit = 0;
+	FILE *fd = stdout;
+
+	if (cov == NULL) {
+		printf("Coverage is not being tracked, see --coverage\n");
+		return MS_ERR;
+	}
+
+	if (path != NULL && strcmp(path, "-")) {
+		fd = fopen(path, "w");
+		if (fd == NULL) {
+			log_error("Failed to open coverage report '%s'\n", path);
+			return MS_ERR;
+		}
+	}
+
+	fprintf(fd, "Opcode bytes executed:\n");
+	for (i = 0; i < (int)NUM_COV_DEVS; i++) {
+		dev = coverage_devs[i].dev;
+		fprintf(fd, "  %-5s %7u\n", ms_dev_map_text[dev],
+		  coverage_count(cov, dev, 0, coverage_devs[i].size));
+	}
+
+	sym = sym_table(ms, &cnt);
+	if (sym != NULL) {
+		fprintf(fd, "\nBy symbol:\n");
+		for (i = 0; i < cnt; i++) {
+			dev = sym[i].dev;
+			if (cov->map[dev] == NULL) continue;
+
+			end = cov->mask[dev] + 1;
+			if (i + 1 < cnt && sym[i + 1].dev == dev)
+				end = sym[i + 1].addr;
+			n = 0;
+			if (sym[i].addr < end)
+				n = coverage_count(cov, dev, sym[i].addr, end);
+			if (n) hit++;
+
+			fprintf(fd, "  %-5s %06X %7u %s\n", ms_dev_map_text[dev],
+			  sym[i].addr, n, sym[i].name);
+		}
+		fprintf(fd, "\n%d of %d symbols executed\n", hit, cnt);
+	}
+
+	if (fd == stdout) {
+		fflush(fd);
+	} else if (fclose(fd)) {
+		log_error("Failed to write coverage report '%s'\n", path);
+		return MS_ERR;
+	}
+
+	return MS_OK;
+}
+
+uint32_t coverage_executed(ms_ctx *ms, int dev)
+{
+	struct ms_coverage *cov = ms->coverage;
+
+	if (cov == NULL || cov->map[dev] == NULL) return 0;
+
+	return coverage_count(cov, dev, 0, cov->mask[dev] + 1);
+}
+
+void coverage_free(ms_ctx *ms)
+{
+	struct ms_coverage *cov = ms->coverage;
+	int i;
+
+	if (cov == NULL) return;
+
+	for (i = 0; i < DEV_CNT; i++) free(cov->map[i]);
+	free(cov);
+	ms->coverage = NULL;
+}
@@ -0,0 +1,84 @@
+#ifndef __COVERAGE_H__
+#define __COVERAGE_H__
+
+#include <stdint.h>
+#include "msemu.h"
+
+/* Code coverage
+ *
+ * Keeps one bit for every byte of codeflash, dataflash and RAM, set whenever
+ * the Z80 fetches an opcode (M1 cycle) from that byte. Setting the bit is a
+ * mask, a shift and an or, cheap enough to leave on for automated test runs,
+ * and shows which paths through the firmware, or custom code loaded in to
+ * dataflash or RAM, a test suite actually reaches.
+ *
+ * Bitmaps are saved to a file which is merged with, rather than replaced by,
+ * later runs. The file is binary, all values little endian:
+ *   Header:  "MSCV", uint32_t version
+ *   Then for each device: uint32_t dev (enum ms_dev_map), uint32_t len,
+ *   len bytes of bitmap. Bit n of byte m is address m * 8 + n.
+ *
+ * With a symbol map loaded (see symbols.h), a report lists each symbol with
+ * the number of opcode bytes executed in it.
+ */
+
+#define COVERAGE_VERSION	1
+
+struct ms_coverage {
+	uint8_t *map[DEV_CNT];
+	uint32_t mask[DEV_CNT];		// Device size - 1
+};
+
+/**
+ * Start tracking coverage, and merge in the file at path if it exists.
+ *
+ * *path	- Coverage file, may be NULL
+ *
+ * Returns MS_OK on success, MS_ERR if the file exists but is invalid
+ */
+int coverage_init(ms_ctx *ms, const char *path);
+
+/**
+ * Merge a coverage file in to the current bitmaps.
+ *
+ * Returns MS_OK on success, MS_ERR if the file could not be read or is
+ * invalid
+ */
+int coverage_merge(ms_ctx *ms, const char *path);
+
+/**
+ * Save the current bitmaps.
+ *
+ * Returns MS_OK on success, MS_ERR if the file could not be written
+ */
+int coverage_save(ms_ctx *ms, const char *path);
+
+/**
+ * Write a report of bytes executed per device, and per symbol if a symbol
+ * map is loaded.
+ *
+ * *path	- File to write to, NULL or "-" for stdout
+ *
+ * Returns MS_OK on success, MS_ERR if the file could not be written
+ */
+int coverage_report(ms_ctx *ms, const char *path);
+
+/**
+ * Number of opcode bytes executed in dev, 0 if dev is not tracked.
+ */
+uint32_t coverage_executed(ms_ctx *ms, int dev);
+
+void coverage_free(ms_ctx *ms);
+
+/* Mark an opcode fetch from addr inside dev, one of CF, DF or RAM */
+static inline void coverage_mark(ms_ctx *ms, int dev, uint32_t addr)
+{
+	struct ms_coverage *cov = ms->coverage;
+
+	if (cov == NULL) return;
+
+	addr &= cov->mask[dev];
+	cov->map[dev][addr >> 3] |= (uint8_t)(1 << (addr & 7));
+}
+
+#endif // __COVERAGE_H__
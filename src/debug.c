@@ -1,3 +1,4 @@
+#include <ctype.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdint.h>
@@ -8,6 +9,15 @@
 #include "debug.h"
 #include "msemu.h"
 #include "io.h"
+#include "lcd.h"
+#include "mem.h"
+#include "text.h"
+#include "capture.h"
+#include "coverage.h"
+#include "snapshot.h"
+#include "sizes.h"
+#include "stats.h"
+#include "symbols.h"
 
 #include <z80ex/z80ex_dasm.h>
 #include <z80ex/z80ex.h>
@@ -15,53 +25,52 @@
 enum arguments {
 	no_arg = 0,
 	int_arg = 1,
-};
-
-enum levels {
-	LOG_TRACE = 0x01,
-	LOG_DBG   = 0x02,
+	str_arg = 2,
 };
 
 struct cmdtable {
 	const char *cmd;
 	uint8_t cmdlen;
-	void (*func)(void *);
+	void (*func)(ms_ctx *, void *);
 	const char *doc;
 	char arg;
 };
 
-typedef struct debug_bp {
-	int32_t mr;
-	int32_t mw;
-	int32_t pc;
-	int32_t hits;
-} debug_bp;
-
 z80ex_mread_cb ms_mread;
 
-static ms_ctx *ms;
-static debug_bp bp;
+/* ctrl+c in the terminal, taken as a break by the instance that has
+ * ms_bp.sigint set */
+static volatile sig_atomic_t sigint_hits;
 #if !defined(_MSC_VER)
 static struct sigaction sigact;
 #endif
 extern const char* const ms_dev_map_text[];
 
-static int dbg_level;
-
-static void leave_prompt(void *nan);
-static void help(void *nan);
-static void md(void *addr);
-static void mw(void *addr);
-static void list_bp(void *nan);
-static void set_bpc(void *pc);
-static void set_bmw(void *addr);
-static void set_bmr(void *addr);
-static void examine(void *nan);
-static void trace_on(void *nan);
-static void trace_off(void *nan);
-static void dbg_on(void *nan);
-static void dbg_off(void *nan);
-static void dump_stack(void *nan);
+static void leave_prompt(ms_ctx *ms, void *nan);
+static void help(ms_ctx *ms, void *nan);
+static void md(ms_ctx *ms, void *addr);
+static void mw(ms_ctx *ms, void *addr);
+static void list_bp(ms_ctx *ms, void *nan);
+static void set_bpc(ms_ctx *ms, void *pc);
+static void set_bmw(ms_ctx *ms, void *addr);
+static void set_bmr(ms_ctx *ms, void *addr);
+static void examine(ms_ctx *ms, void *nan);
+static void trace_on(ms_ctx *ms, void *nan);
+static void trace_off(ms_ctx *ms, void *nan);
+static void dbg_on(ms_ctx *ms, void *args);
+static void dbg_off(ms_ctx *ms, void *args);
+static void dump_stack(ms_ctx *ms, void *nan);
+static void lcd_hash(ms_ctx *ms, void *args);
+static void text_show(ms_ctx *ms, void *nan);
+static void text_cell_set(ms_ctx *ms, void *args);
+static void text_learn_cmd(ms_ctx *ms, void *args);
+static void text_load(ms_ctx *ms, void *args);
+static void text_save(ms_ctx *ms, void *args);
+static void capture_cmd(ms_ctx *ms, void *args);
+static void stats_cmd(ms_ctx *ms, void *args);
+static void coverage_cmd(ms_ctx *ms, void *args);
+static void snap_save_cmd(ms_ctx *ms, void *args);
+static void snap_load_cmd(ms_ctx *ms, void *args);
 
 static const struct cmdtable cmds[] = {
 	{ "q", 1, leave_prompt, "[Q]uit emulation and exit completely", no_arg },
@@ -78,122 +87,121 @@ static const struct cmdtable cmds[] = {
 	{ "mw", 2, mw, "Edit memory at address, \'mw <addr> <val>\' "
 	  "(UNIMPLEMENTED)", int_arg },
 	{ "e", 1, examine, "[E]xamine current register state", no_arg },
-	{ "dbgoff", 5, dbg_off, "Disable debug output during exec", no_arg },
-	{ "dbgon", 4, dbg_on, "Enable debug output during exec", no_arg },
+	{ "dbgoff", 6, dbg_off, "Disable debug output during exec, "
+	  "\'dbgoff [<section>,...]\', all if none given", str_arg },
+	{ "dbgon", 5, dbg_on, "Enable debug output during exec, "
+	  "\'dbgon [<section>[:<port>[-<port>]],...]\', all if none given",
+	  str_arg },
 	{ "troff", 5, trace_off, "Disable trace output during exec", no_arg },
 	{ "tron", 4, trace_on, "Enable trace output during exec", no_arg },
 	{ "dumpstack", 9, dump_stack, "Dump stack from SP to 0xFFFF", no_arg },
+	{ "lcdhash", 7, lcd_hash, "Hash LCD region for scripts, "
+	  "\'lcdhash <x> <y> <w> <h>\'", str_arg },
+	{ "text", 4, text_show, "Show text on LCD using glyph table", no_arg },
+	{ "textcell", 8, text_cell_set, "Start new glyph table, "
+	  "\'textcell <w> <h> [<x> <y>]\'", str_arg },
+	{ "textlearn", 9, text_learn_cmd, "Learn glyphs from LCD, "
+	  "\'textlearn <row> <col> <text>\'", str_arg },
+	{ "textload", 8, text_load, "Load glyph table, \'textload <path>\'",
+	  str_arg },
+	{ "textsave", 8, text_save, "Save glyph table, \'textsave <path>\'",
+	  str_arg },
+	{ "capture", 7, capture_cmd, "Record LCD to GIF, \'capture <path>\', "
+	  "no path to stop", str_arg },
+	{ "stats", 5, stats_cmd, "Dump access counters as JSON, "
+	  "\'stats [<path>]\'", str_arg },
+	{ "coverage", 8, coverage_cmd, "Coverage report, \'coverage [<path>]\', "
+	  "or save bitmaps, \'coverage save <path>\'", str_arg },
+	{ "snapsave", 8, snap_save_cmd, "Save machine snapshot, "
+	  "\'snapsave <path>\'", str_arg },
+	{ "snapload", 8, snap_load_cmd, "Restore machine snapshot, "
+	  "\'snapload <path>\'", str_arg },
 	{ "h", 1, help, "Display this [H]elp menu", no_arg },
 };
 #define NUMCMDS sizeof cmds / sizeof cmds[0]
 
-void log_debug(char *str, ...)
-{
-	va_list argp;
-
-	if (!(dbg_level & LOG_DBG)) {
-	        return;
-	}
-
-	va_start(argp, str);
-	vprintf(str, argp);
-	va_end(argp);
-}
-
-void log_trace(char *str, ...)
-{
-	va_list argp;
-
-	/* Only print if trace level is enabled and/or we're in a break */
-	if (!(dbg_level & LOG_TRACE) && !debug_isbreak()) {
-	        return;
-	}
-
-	va_start(argp, str);
-	vprintf(str, argp);
-	va_end(argp);
-}
-
-void log_error(char *str, ...)
-{
-	va_list argp;
-
-	va_start(argp, str);
-	vprintf(str, argp);
-	va_end(argp);
-}
-
-static void leave_prompt(void *nan)
+static void leave_prompt(ms_ctx *ms, void *nan)
 {
 	;
 }
 
-static void help(void *nan)
+static void help(ms_ctx *ms, void *nan)
 {
 	int i = NUMCMDS;
 	printf("Available commands:\n");
 	while(i--) printf("%-8s - %s\n", cmds[i].cmd, cmds[i].doc);
 }
 
-static void trace_on(void *nan)
+static void trace_on(ms_ctx *ms, void *nan)
 {
+#if LOG_MIN_LEVEL > LOG_LEVEL_TRACE
+	printf("Trace output not built, configure with -DLOG_LEVEL=TRACE\n");
+#endif
 	dbg_level |= LOG_TRACE;
 }
 
-static void trace_off(void *nan)
+static void trace_off(ms_ctx *ms, void *nan)
 {
 	dbg_level &= ~LOG_TRACE;
 }
 
-static void dbg_on(void *nan)
+static void dbg_on(ms_ctx *ms, void *args)
 {
-	dbg_level |= LOG_DBG;
+#if LOG_MIN_LEVEL > LOG_LEVEL_DEBUG
+	printf("Debug output not built, configure with -DLOG_LEVEL=DEBUG\n");
+#endif
+	log_sections_set((char *)args, 1);
+	log_sections_show();
 }
 
-static void dbg_off(void *nan)
+static void dbg_off(ms_ctx *ms, void *args)
 {
-	dbg_level &= ~LOG_DBG;
+	log_sections_set((char *)args, 0);
+	log_sections_show();
 }
 
-static void md(void *addr)
+static void md(ms_ctx *ms, void *addr)
 {
 	uint16_t new_addr = *(unsigned long *)addr;
 
 	printf("0x%04X: 0x%02X\n", new_addr, ms_mread(ms->z80, new_addr, 0, ms));
 }
 
-static void mw(void *nan)
+static void mw(ms_ctx *ms, void *nan)
 {
 }
 
-static void list_bp(void *nan)
+static void list_bp(ms_ctx *ms, void *nan)
 {
-	printf("PC breakpoint is 0x%04X\n", bp.pc);
-	printf("MEM read breakpoint is 0x%04X\n", bp.mr);
-	printf("MEM write breakpoint is 0x%04X\n", bp.mw);
+	printf("PC breakpoint is 0x%04X\n", ms->bp.pc);
+	printf("MEM read breakpoint is 0x%04X\n", ms->bp.mr);
+	printf("MEM write breakpoint is 0x%04X\n", ms->bp.mw);
 }
 
-static void set_bpc(void *pc)
+static void set_bpc(ms_ctx *ms, void *pc)
 {
 	int32_t new_bp = *(unsigned long *)pc;
-	bp.pc = new_bp;
+	ms->bp.pc = new_bp;
 }
 
-static void set_bmw(void *addr)
+static void set_bmw(ms_ctx *ms, void *addr)
 {
 	int32_t new_bp = *(unsigned long *)addr;
-	bp.mw = new_bp;
+	ms->bp.mw = new_bp;
 }
 
-static void set_bmr(void *addr)
+static void set_bmr(ms_ctx *ms, void *addr)
 {
 	int32_t new_bp = *(unsigned long *)addr;
-	bp.mr = new_bp;
+	ms->bp.mr = new_bp;
 }
 
-static void dump_stack(void *nan)
+static void dump_stack(ms_ctx *ms, void *nan)
 {
 	uint16_t sp = z80ex_get_reg(ms->z80,regSP);
+	uint16_t top = sp;
+	char sym[64];
+	uint16_t val;
 
 	/* This covers both even and odd SP start locations. The MS firmware
 	 * uses 0xFFFF as the reset SP, while custom code could be using 0x0000
@@ -201,14 +209,26 @@ static void dump_stack(void *nan)
 	 * most recent byte on the stack; any stack operations first dec SP. */
 	for (; sp != 0x0000; ) {
 		// prints 0x00SP 0x(SP)(SP+1)
-		printf("0x%04X: 0x%02X\n", sp, ms_mread(ms->z80, sp, 0, ms));
+		printf("0x%04X: 0x%02X", sp, ms_mread(ms->z80, sp, 0, ms));
+
+		/* Name each word pushed, return addresses being what is
+		 * mostly of interest */
+		if (!((sp - top) & 1) && sp != 0xFFFF) {
+			val = ms_mread(ms->z80, sp, 0, ms) |
+			  (ms_mread(ms->z80, (uint16_t)(sp + 1), 0, ms) << 8);
+			if (sym_format(ms, val, sym, sizeof(sym)))
+				printf("\t0x%04X %s", val, sym);
+		}
+		printf("\n");
 		sp++;
 	};
 
 }
 
-static void examine(void *nan)
+static void examine(ms_ctx *ms, void *nan)
 {
+	char sym[64];
+
 	printf("AF:  0x%04X\tBC:  0x%04X\tDE:  0x%04X\tHL:  0x%04X\n"
 	       "AF': 0x%04X\tBC': 0x%04X\tDE': 0x%04X\tHL': 0x%04X\n"
 	       "IX:  0x%04X\tIY:  0x%04X\tPC:  0x%04X\tSP:  0x%04X\n"
@@ -227,24 +247,167 @@ static void examine(void *nan)
 	  ms->io[SLOT4_PAGE]);
 	printf("slot8000: %sp%02d\n", ms_dev_map_text[ms->io[SLOT8_DEV] & 0x0F],
 	  ms->io[SLOT8_PAGE]);
+
+	if (sym_format(ms, z80ex_get_reg(ms->z80, regPC), sym, sizeof(sym)))
+		printf("PC is in %s\n", sym);
+}
+
+static void lcd_hash(ms_ctx *ms, void *args)
+{
+	int x, y, w, h;
+
+	if (sscanf((char *)args, "%i %i %i %i", &x, &y, &w, &h) != 4) {
+		printf("Usage: lcdhash <x> <y> <w> <h>\n");
+		return;
+	}
+
+	printf("lcdhash %d %d %d %d 0x%016llX\n", x, y, w, h,
+	  (unsigned long long)lcd_region_hash(ms, x, y, w, h));
+}
+
+static void text_show(ms_ctx *ms, void *nan)
+{
+	char buf[(MS_LCD_WIDTH + 1) * 30 + 1];
+	int row;
+
+	if (!text_rows(ms)) {
+		printf("No glyph table, use textload or textlearn\n");
+		return;
+	}
+
+	for (row = 0; row < text_rows(ms); row++) {
+		text_row(ms, row, buf, sizeof(buf));
+		printf("%2d|%s\n", row, buf);
+	}
+}
+
+/* Strip leading whitespace and the trailing newline from a str_arg */
+static char *str_arg_trim(char *str)
+{
+	str += strspn(str, " \t");
+	str[strcspn(str, "\r\n")] = '\0';
+	return str;
+}
+
+static void text_cell_set(ms_ctx *ms, void *args)
+{
+	int w, h, x = 0, y = 0;
+
+	if (sscanf((char *)args, "%i %i %i %i", &w, &h, &x, &y) < 2) {
+		printf("Usage: textcell <w> <h> [<x> <y>]\n");
+		return;
+	}
+
+	text_init(ms, w, h, x, y);
+}
+
+static void text_learn_cmd(ms_ctx *ms, void *args)
+{
+	int row, col, n = 0;
+
+	if (sscanf((char *)args, "%i %i %n", &row, &col, &n) < 2 || !n) {
+		printf("Usage: textlearn <row> <col> <text>\n");
+		return;
+	}
+
+	n = text_learn(ms, row, col, str_arg_trim((char *)args + n));
+	if (n < 0) {
+		printf("Invalid row or column\n");
+	} else {
+		printf("Learned %d glyphs\n", n);
+	}
+}
+
+static void text_load(ms_ctx *ms, void *args)
+{
+	text_load_font(ms, str_arg_trim((char *)args));
+}
+
+static void text_save(ms_ctx *ms, void *args)
+{
+	text_save_font(ms, str_arg_trim((char *)args));
+}
+
+static void capture_cmd(ms_ctx *ms, void *args)
+{
+	char *path = str_arg_trim((char *)args);
+
+	if (*path) {
+		capture_start(ms, path);
+	} else {
+		capture_stop(ms);
+	}
+}
+
+static void stats_cmd(ms_ctx *ms, void *args)
+{
+	char *path = str_arg_trim((char *)args);
+
+	stats_save(ms, *path ? path : NULL);
+}
+
+static void coverage_cmd(ms_ctx *ms, void *args)
+{
+	char *arg = str_arg_trim((char *)args);
+
+	/* A bare "save" is a missing path, not a report named "save" */
+	if (!strcmp(arg, "save")) {
+		printf("Usage: coverage save <path>\n");
+		return;
+	}
+
+	if (!strncmp(arg, "save", 4) && (arg[4] == ' ' || arg[4] == '\t')) {
+		coverage_save(ms, str_arg_trim(arg + 4));
+	} else {
+		coverage_report(ms, *arg ? arg : NULL);
+	}
+}
+
+static void snap_save_cmd(ms_ctx *ms, void *args)
+{
+	char *path = str_arg_trim((char *)args);
+
+	if (!*path) {
+		printf("Usage: snapsave <path>\n");
+		return;
+	}
+
+	if (!snap_save(ms, path)) printf("Saved snapshot to %s\n", path);
+}
+
+static void snap_load_cmd(ms_ctx *ms, void *args)
+{
+	char *path = str_arg_trim((char *)args);
+
+	if (!*path) {
+		printf("Usage: snapload <path>\n");
+		return;
+	}
+
+	if (!snap_load(ms, path)) printf("Restored snapshot from %s\n", path);
 }
 
 /* Debug support */
 void sigint(int sig)
 {
-	bp.hits++;
-	printf("\nReceived SIGINT, interrupting\n");
+	sigint_hits = 1;
 }
 
-void debug_init(ms_ctx* msctx, z80ex_mread_cb z80ex_mread)
+void debug_init(ms_ctx* ms, z80ex_mread_cb z80ex_mread)
 {
-	ms = msctx;
 	ms_mread = z80ex_mread;
 
-	bp.pc = -1;
-	bp.mr = -1;
-	bp.mw = -1;
-	bp.hits = 0;
+	ms->bp.pc = -1;
+	ms->bp.mr = -1;
+	ms->bp.mw = -1;
+	ms->bp.hits = 0;
+	ms->bp.total = 0;
+	ms->bp.sigint = 0;
+}
+
+void debug_sigint_init(ms_ctx *ms)
+{
+	ms->bp.sigint = 1;
 
 	// Override ctrl+c to drop to debug console
 #if defined(_MSC_VER)
@@ -255,14 +418,17 @@ void debug_init(ms_ctx* msctx, z80ex_mread_cb z80ex_mread)
 #endif
 }
 
-int debug_prompt(void)
+int debug_prompt(ms_ctx *ms)
 {
 	static int print_warn = 0;
 	int i;
 	unsigned long int val;
-	char buf[32];
+	char buf[128];
 
-	bp.hits = 0;
+	ms->bp.hits = 0;
+
+	// Don't let queued log output land in the middle of the prompt
+	log_flush();
 
 	if (!print_warn) {
 		printf("NOTE! THIS DEBUGGER IS ROUGH AND WILL LET YOU SHOOT "
@@ -277,93 +443,206 @@ int debug_prompt(void)
 
 		i = NUMCMDS;
 		while (i--) {
-			if(!strncmp(buf, cmds[i].cmd, cmds[i].cmdlen)) {
+			/* Match whole command words only, so e.g. "lcdhash"
+			 * is not also taken as "l" */
+			if(!strncmp(buf, cmds[i].cmd, cmds[i].cmdlen) &&
+			  (buf[cmds[i].cmdlen] == '\0' ||
+			   isspace((unsigned char)buf[cmds[i].cmdlen]))) {
 				if (i == 0) return -1; /* Hack, "q" */
 				if (i == 1) return 0;  /* Hack, "c" */
 				if (i == 2) {
-					bp.hits++;
+					ms->bp.hits++;
 					return 1;  /* Hack, "s" */
 				}
 				switch (cmds[i].arg) {
 				  case no_arg:
-					cmds[i].func(0);
+					cmds[i].func(ms, 0);
 					break;
 				  case int_arg:
 					val = strtoul(&(buf[cmds[i].cmdlen]), 0, 0);
-					cmds[i].func(&val);
+					cmds[i].func(ms, &val);
+					break;
+				  case str_arg:
+					cmds[i].func(ms, &(buf[cmds[i].cmdlen]));
 					break;
 				  default:
 					break;
 				}
+				break;
 			}
 		}
 	}
 }
 
-Z80EX_BYTE debug_dasm_readbyte (Z80EX_WORD addr, void *user_data)
+/* Disassembly cache
+ *
+ * Tracing disassembles every instruction run, mostly the same few loops over
+ * and over. Each instruction is disassembled once and kept, keyed by device
+ * and physical address so that code in different pages is told apart.
+ * Codeflash never changes. RAM and dataflash are written by the Z80, flash
+ * commands, snapshot restores and serial loads alike, so rather than hook
+ * each of those an entry for them keeps the bytes it was made from, and is
+ * made again once they no longer match.
+ */
+#define DASM_CACHE_LEN		4096	// Power of 2
+#define DASM_BYTES_MAX		4
+#define DASM_TEXT_LEN		48
+#define DASM_BUFFER_LEN		256
+
+struct dasm_ent {
+	// (dev + 1) << 20 | physical address, 0 if unused
+	uint32_t key;
+	uint8_t len;
+	uint8_t bytes[DASM_BYTES_MAX];
+
+	// "<instruction>  t=<tstates>[/<tstates>]", as traced
+	char text[DASM_TEXT_LEN];
+};
+
+struct ms_dasm {
+	struct dasm_ent ent[DASM_CACHE_LEN];
+
+	// For instructions that are not cached, e.g. spanning two slots
+	struct dasm_ent tmp;
+};
+
+/* Disassembler reads, without the side effects of a read by the Z80, e.g.
+ * on the dataflash command sequence, breakpoints or access counters */
+static Z80EX_BYTE debug_dasm_readbyte(Z80EX_WORD addr, void *user_data)
 {
-	int dbg_level_q = dbg_level;
-	Z80EX_BYTE val;
+	return mem_peek((ms_ctx *)user_data, addr);
+}
+
+/* Byte at physical address phys in dev, without the side effects of a read
+ * by the Z80, e.g. on the dataflash command sequence */
+static uint8_t dasm_peek(ms_ctx *ms, int dev, uint32_t phys)
+{
+	if (dev == CF) return ms->cf[phys];
+	if (dev == DF) return mem_rd(ms->df, phys);
+	return mem_rd(ms->ram, phys);
+}
+
+/* Disassembly of the instruction at Z80 address pc, from the cache if it is
+ * there and still what is in memory */
+static const struct dasm_ent *dasm_get(ms_ctx *ms, uint16_t pc)
+{
+	struct ms_dasm *d = ms->dasm;
+	struct dasm_ent *e;
+	char buf[DASM_BUFFER_LEN];
+	uint32_t phys, key;
+	int dev, i, len, t = 0, t2 = 0;
+
+	if (d == NULL) {
+		d = (struct ms_dasm *)calloc(1, sizeof(struct ms_dasm));
+		if (d == NULL) {
+			printf("Unable to allocate disassembly cache\n");
+			exit(EXIT_FAILURE);
+		}
+		ms->dasm = d;
+	}
 
-	dbg_level &= ~LOG_DBG;
-	val = ms_mread(ms->z80, addr, 0, user_data);
-	dbg_level = dbg_level_q;
+	dev = mem_phys(ms, pc, &phys);
+	key = ((uint32_t)(dev + 1) << 20) | phys;
+	e = &d->ent[(phys ^ (phys >> 12) ^ (dev << 9)) & (DASM_CACHE_LEN - 1)];
 
-	return val;
+	if (e->key == key) {
+		for (i = 0; dev != CF && i < e->len; i++) {
+			if (dasm_peek(ms, dev, phys + i) != e->bytes[i]) break;
+		}
+		if (dev == CF || i == e->len) return e;
+	}
+
+	memset(buf, 0, DASM_BUFFER_LEN);
+	len = z80ex_dasm(buf, DASM_BUFFER_LEN, 0, &t, &t2,
+	  debug_dasm_readbyte, pc, ms);
+	if (len > DASM_BYTES_MAX) len = DASM_BYTES_MAX;
+
+	/* Only cache what is all in one page of one memory device, the slots
+	 * either side could have anything mapped in next time */
+	if (!((dev == CF && phys < SZ_1M) || (dev == DF && phys < SZ_512K) ||
+	      (dev == RAM && phys < SZ_128K)) ||
+	    (pc & 0x3FFF) + len > 0x4000) {
+		e = &d->tmp;
+		key = 0;
+	}
+
+	e->key = key;
+	e->len = (uint8_t)len;
+	for (i = 0; key && i < len; i++)
+		e->bytes[i] = dasm_peek(ms, dev, phys + i);
+
+	if (t2) {
+		snprintf(e->text, DASM_TEXT_LEN, "%-15s  t=%d/%d", buf, t, t2);
+	} else {
+		snprintf(e->text, DASM_TEXT_LEN, "%-15s  t=%d", buf, t);
+	}
+
+	return e;
 }
 
-#define DASM_BUFFER_LEN 256
-void debug_dasm(void)
+void debug_dasm(ms_ctx *ms)
 {
-	char dasm_buffer[DASM_BUFFER_LEN];
-	int dasm_tstates = 0;
-	int dasm_tstates2 = 0;
+	const struct dasm_ent *e;
+	char sym[64];
+	uint16_t pc;
+
+	if (!debug_isbreak(ms) && !(dbg_level & LOG_TRACE)) return;
 
-	if (!debug_isbreak() && !(dbg_level & LOG_TRACE)) return;
+	pc = z80ex_get_reg(ms->z80, regPC);
+	e = dasm_get(ms, pc);
+	sym_format(ms, pc, sym, sizeof(sym));
+	log_trace(ms, "%04x: %s%s%s\n", pc, e->text, *sym ? "\t" : "", sym);
+}
 
-	memset(&dasm_buffer, 0, DASM_BUFFER_LEN);
-	z80ex_dasm(
-	  &dasm_buffer[0], DASM_BUFFER_LEN,
-	  0,
-	  &dasm_tstates, &dasm_tstates2,
-	  debug_dasm_readbyte,
-	  z80ex_get_reg(ms->z80, regPC),
-	  ms);
-	log_trace("%04x: %-15s  t=%d", z80ex_get_reg(ms->z80, regPC),
-	  dasm_buffer, dasm_tstates);
-	if(dasm_tstates2) {
-		log_trace("/%d", dasm_tstates2);
+void debug_free(ms_ctx *ms)
+{
+	free(ms->dasm);
+	ms->dasm = NULL;
+}
+
+int debug_isbreak(ms_ctx *ms)
+{
+	if (sigint_hits && ms->bp.sigint) {
+		sigint_hits = 0;
+		ms->bp.hits++;
+		printf("\nReceived SIGINT, interrupting\n");
 	}
-	log_trace("\n");
 
+	return !!ms->bp.hits;
 }
 
-int debug_isbreak(void)
+uint32_t debug_bp_total(ms_ctx *ms)
 {
-	return !!bp.hits;
+	return ms->bp.total;
 }
 
-int debug_testbp(enum bp_type type, Z80EX_WORD addr)
+int debug_testbp(ms_ctx *ms, enum bp_type type, Z80EX_WORD addr)
 {
 	switch (type) {
 	  case bpPC:
-		if (addr == bp.pc) {
-			printf("Reached breakpoint on PC, 0x%04X\n", bp.pc);
-			bp.hits++;
+		if (addr == ms->bp.pc) {
+			log_flush();
+			printf("Reached breakpoint on PC, 0x%04X\n", ms->bp.pc);
+			ms->bp.hits++;
+			ms->bp.total++;
 		}
 		break;
 	  case bpMR:
-		if (addr == bp.mr) {
+		if (addr == ms->bp.mr) {
+			log_flush();
 			printf("Reached breakpoint on MEM read, 0x%04X\n",
-			  bp.mr);
-			bp.hits++;
+			  ms->bp.mr);
+			ms->bp.hits++;
+			ms->bp.total++;
 		}
 		break;
 	  case bpMW:
-		if (addr == bp.mw) {
+		if (addr == ms->bp.mw) {
+			log_flush();
 			printf("Reached breakpoint on MEM write, 0x%04X\n",
-			  bp.mw);
-			bp.hits++;
+			  ms->bp.mw);
+			ms->bp.hits++;
+			ms->bp.total++;
 		}
 		break;
 	  default:
@@ -371,5 +650,5 @@ int debug_testbp(enum bp_type type, Z80EX_WORD addr)
 		break;
 	}
 
-	return debug_isbreak();
+	return debug_isbreak(ms);
 }
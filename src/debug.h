@@ -14,9 +14,14 @@ enum bp_type {
  * The z80ex_dasm() call uses the mread callback to read the instruction at the
  * current PC. In order to get that info, the mread callback, which uses ms_ctx
  * as the user_data, need to both be passed to this function.
- * This additionally sets up a signal handler for SIGINT to catch ctrl+c
+ * Breakpoints are per instance, see ms_ctx.bp.
  */
-void debug_init(ms_ctx* msctx, z80ex_mread_cb z80ex_mread);
+void debug_init(ms_ctx* ms, z80ex_mread_cb z80ex_mread);
+
+/* Set up a signal handler for SIGINT to catch ctrl+c, and have it break in to
+ * this instance. Only the instance driven from the terminal should do this.
+ */
+void debug_sigint_init(ms_ctx *ms);
 
 /* Provide interactive prompt.
  * When called, will consume the terminal to provide a simple interactive debug
@@ -26,7 +31,7 @@ void debug_init(ms_ctx* msctx, z80ex_mread_cb z80ex_mread);
  * Calling debug_prompt() will clear any currently hit breakpoints, but will not
  * clear the breakpoint address.
  */
-int debug_prompt(void);
+int debug_prompt(ms_ctx *ms);
 
 /* Disassemble current instruction at PC.
  * Note that the PC must be at the start of a full instruction when this is
@@ -34,8 +39,14 @@ int debug_prompt(void);
  * This will only do anything if trace output is enabled, or if debug_isbreak
  * is true, i.e. we've hit a breakpoint. See output of 'h' in interactive debug
  * interface for enabling/disabling trace.
+ * Instructions are disassembled once and cached by physical address, so
+ * tracing a hot loop costs little more than the output.
+ */
+void debug_dasm(ms_ctx *ms);
+
+/* Free the disassembly cache debug_dasm() keeps.
  */
-void debug_dasm(void);
+void debug_free(ms_ctx *ms);
 
 /* Test if breakpoint has been hit.
  * Breakpoints are set via interactive debug interface. They can be set on PC,
@@ -45,30 +56,20 @@ void debug_dasm(void);
  * If a breakpoint has been hit, this will return 1 and also cause debug_isbreak
  * to return 1.
  */
-int debug_testbp(enum bp_type type, Z80EX_WORD addr);
+int debug_testbp(ms_ctx *ms, enum bp_type type, Z80EX_WORD addr);
 
 /* Returns true if breakpoint was hit.
  * Call debug_testbp() to test a breakpoint. Once a breakpoint is hit, this func
  * will return 1 until debug_prompt() is called to clear the hit breakpoints.
  */
-int debug_isbreak(void);
+int debug_isbreak(ms_ctx *ms);
 
-/* Print error string.
- * Always goes to terminal
+/* Returns the number of breakpoints hit since init.
+ * Unlike debug_isbreak(), this is not cleared by debug_prompt().
  */
-void log_error(char *str, ...);
+uint32_t debug_bp_total(ms_ctx *ms);
 
-/* Print trace information
- * Will print information to terminal only when trace is enabled or if
- * debug_isbreak() is true.
- * See 'h' command of interactive debug interface for trace output control.
- */
-void log_trace(char *str, ...);
-
-/* Print debug information
- * Will print information to terminal only when debug is enabled.
- * See 'h' command of interactive debug interface for debug output control.
- */
-void log_debug(char *str, ...);
+/* log_error(), log_debug() and log_trace() */
+#include "log.h"
 
 #endif
@@ -0,0 +1,397 @@
+/* msemu-diff, compare how several codeflash versions behave
+ *
+ * Boots the same dataflash and input script on every codeflash given, in
+ * parallel and as fast as possible, keeping the LCD frame hash stream of each
+ * run (see framelog.h). The first codeflash is the reference. Every other
+ * run's stream is aligned against it: frames are matched by hash, ignoring
+ * when they were shown, and where the streams differ the shortest skip in
+ * either one that brings them back in step, within DIFF_WINDOW frames, is
+ * found. Each such divergence is reported along with the LCD of both runs
+ * at that point as PBM screenshots, <prefix>-<run>-<n>.pbm and
+ * <prefix>-<run>-<n>-ref.pbm for the reference.
+ *
+ * The report is JSON, written to the -o file rather than stdout, which the
+ * runs and their scripts print to. msemu-diff exits non-zero if any run
+ * diverged from the reference or failed.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "framelog.h"
+#include "lcd.h"
+#include "msemu.h"
+#include "pool.h"
+#include "tool.h"
+
+#include <SDL2/SDL.h>
+#include <z80ex/z80ex.h>
+#if defined(_MSC_VER)
+	#include "platform/windows/getopt.h"
+#else
+	#include <getopt.h>
+#endif
+
+#define DIFF_LIMIT_MS		600000
+#define DIFF_TSTATES_MS		(MS_CPU_HZ / 1000)
+
+// Frames either stream may skip to get back in step
+#define DIFF_WINDOW		512
+
+// Divergences reported per run before giving up on it
+#define DIFF_MAX		100
+
+struct diff_div {
+	size_t ref_pos;		// First frame that differs in each stream
+	size_t pos;
+	size_t ref_skip;	// Frames skipped in each to get back in step
+	size_t skip;
+	int resynced;
+};
+
+struct diff_run {
+	const char *cf_path;
+	const uint8_t *cf;
+
+	// Results
+	const char *status;
+	int exit;
+	uint64_t tstates;
+	uint16_t pc;
+	struct framelog_stream st;
+	double secs;
+
+	// Compared to the reference
+	struct diff_div *divs;
+	int ndivs;
+	size_t matched;
+};
+
+struct diff_opts {
+	char *df_path;
+	char *script_path;
+	uint64_t limit_ms;
+	int64_t epoch;
+};
+
+static struct diff_opts dopts;
+
+static void usage(const char *path_arg)
+{
+	printf(
+	  "\nMailstation Emulator firmware differ\n\n"
+
+	  "Usage: \n"
+	  "  %s [-d <path>] [-s <path>] [-t <ms>] [--epoch <secs>] [-j <threads>]\n"
+	  "     [-p <prefix>] -o <path> <codeflash> <codeflash> ...\n"
+	  "  %s -h | --help\n\n"
+
+	  "  -d <path>, --dataflash <path>  Dataflash image every run starts from,\n"
+	  "                                 never written back. Blank if not given\n"
+	  "  -s <path>, --script <path>     Input script, see src/script.h\n"
+	  "  -t <ms>, --time <ms>           Emulated time to run for, or the most\n"
+	  "                                 the script may take (def: %d)\n"
+	  "  --epoch <secs>                 RTC start and RAM seed, see msemu --epoch\n"
+	  "                                 (def: %d)\n"
+	  "  -j <n>, --jobs <n>             Worker threads (def: one per CPU)\n"
+	  "  -p <prefix>, --screenshots <prefix>\n"
+	  "                                 Start of screenshot paths (def: diff)\n"
+	  "  -o <path>, --output <path>     Write the JSON report to <path>\n"
+	  "  -h, --help                     Show this help\n\n"
+
+	  "The first codeflash is the reference the others are compared to.\n",
+	  path_arg, path_arg, DIFF_LIMIT_MS, TOOL_EPOCH);
+}
+
+static void diff_run(void *arg, int worker)
+{
+	struct diff_run *r = (struct diff_run *)arg;
+	ms_opts opts;
+	ms_ctx *ms;
+	uint64_t start, end;
+	int ret;
+
+	(void)worker;
+	start = SDL_GetPerformanceCounter();
+
+	ms_opts_init(&opts);
+	opts.cf_shared = r->cf;
+	opts.df_path = dopts.df_path;
+	opts.df_save_to_disk = 0;
+	opts.script_path = dopts.script_path;
+	opts.epoch = dopts.epoch;
+
+	r->status = "error";
+	ms = ms_create(&opts);
+	if (ms == NULL) return;
+
+	framelog_keep(ms, 1);
+	if (dopts.script_path == NULL) ms_power_on_reset(ms);
+
+	end = ms->tstates + dopts.limit_ms * DIFF_TSTATES_MS;
+	ret = ms_step(ms, end - ms->tstates);
+	if (ret == MS_STEP_SCRIPT) {
+		r->exit = ms->script_exit;
+		r->status = r->exit ? "failed" : "done";
+	} else if (ret == MS_STEP_DONE) {
+		r->status = dopts.script_path ? "timeout" : "done";
+	} else if (ret == MS_STEP_OFF) {
+		r->status = "off";
+	} else {
+		r->exit = ms->script_exit;
+		r->status = "failed";
+	}
+
+	r->tstates = ms->tstates;
+	r->pc = z80ex_get_reg(ms->z80, regPC);
+	framelog_take(ms, &r->st);
+	ms_destroy(ms);
+
+	r->secs = (double)(SDL_GetPerformanceCounter() - start) /
+	  SDL_GetPerformanceFrequency();
+}
+
+/* Find the fewest frames to skip, from a and b, to where the streams match
+ * again. Returns 0 if there is no match within DIFF_WINDOW of both */
+static int diff_resync(const struct framelog_stream *a, size_t i,
+  const struct framelog_stream *b, size_t j, size_t *skip_a, size_t *skip_b)
+{
+	size_t d, da;
+
+	for (d = 1; d <= 2 * DIFF_WINDOW; d++) {
+		for (da = 0; da <= d; da++) {
+			if (da > DIFF_WINDOW || d - da > DIFF_WINDOW) continue;
+			if (i + da >= a->len || j + d - da >= b->len) continue;
+			if (a->recs[i + da].hash != b->recs[j + d - da].hash)
+				continue;
+			*skip_a = da;
+			*skip_b = d - da;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void diff_align(const struct diff_run *ref, struct diff_run *r)
+{
+	const struct framelog_stream *a = &ref->st, *b = &r->st;
+	struct diff_div *div;
+	size_t i = 0, j = 0;
+
+	r->divs = (struct diff_div *)calloc(DIFF_MAX, sizeof(struct diff_div));
+	if (r->divs == NULL) {
+		printf("Unable to allocate diff\n");
+		exit(EXIT_FAILURE);
+	}
+
+	while ((i < a->len || j < b->len) && r->ndivs < DIFF_MAX) {
+		if (i < a->len && j < b->len &&
+		    a->recs[i].hash == b->recs[j].hash) {
+			i++;
+			j++;
+			r->matched++;
+			continue;
+		}
+
+		div = &r->divs[r->ndivs++];
+		div->ref_pos = i;
+		div->pos = j;
+		div->resynced = diff_resync(a, i, b, j, &div->ref_skip,
+		  &div->skip);
+		if (!div->resynced) {
+			// The rest of both streams differ, or one of them ended
+			div->ref_skip = a->len - i;
+			div->skip = b->len - j;
+		}
+		i += div->ref_skip;
+		j += div->skip;
+	}
+}
+
+/* Screenshot of frame pos of a run, at <prefix>-<run>-<div><suffix>.pbm.
+ * path is set to "" if there is no such frame */
+static int diff_shot(const struct diff_run *r, size_t pos, const char *prefix,
+  int run, int div, const char *suffix, char *path, size_t len)
+{
+	*path = '\0';
+	if (pos >= r->st.len) return MS_OK;
+
+	snprintf(path, len, "%s-%d-%d%s.pbm", prefix, run, div, suffix);
+	return lcd_buf_save_pbm(r->st.frames + (pos * FRAMELOG_FRAME_LEN),
+	  path);
+}
+
+static uint64_t diff_tstate(const struct diff_run *r, size_t pos)
+{
+	return (pos < r->st.len) ? r->st.recs[pos].tstate : r->tstates;
+}
+
+static int diff_report(const char *path, const char *prefix,
+  struct diff_run *runs, int cnt)
+{
+	struct diff_run *r, *ref = &runs[0];
+	struct diff_div *div;
+	char shot[1024], ref_shot[1024];
+	int i, k, err = 0;
+	FILE *fd;
+
+	fd = fopen(path, "w");
+	if (fd == NULL) {
+		log_error("Failed to open report '%s': %s\n", path,
+		  strerror(errno));
+		return MS_ERR;
+	}
+
+	fprintf(fd, "{\n  \"runs\": [\n");
+	for (i = 0; i < cnt; i++) {
+		r = &runs[i];
+		fprintf(fd, "    {\"codeflash\":");
+		tool_json_str(fd, r->cf_path);
+		fprintf(fd, ",\"status\":\"%s\",\"exit\":%d,\"tstates\":%llu,"
+		  "\"pc\":%u,\"frames\":%zu,\"seconds\":%.3f",
+		  r->status, r->exit, (unsigned long long)r->tstates, r->pc,
+		  r->st.len, r->secs);
+		if (i == 0) {
+			fprintf(fd, ",\"reference\":true}%s\n",
+			  (cnt > 1) ? "," : "");
+			continue;
+		}
+
+		fprintf(fd, ",\"matched\":%zu,\"divergences\":[", r->matched);
+		for (k = 0; k < r->ndivs; k++) {
+			div = &r->divs[k];
+			err |= diff_shot(ref, div->ref_pos, prefix, i, k + 1,
+			  "-ref", ref_shot, sizeof(ref_shot));
+			err |= diff_shot(r, div->pos, prefix, i, k + 1, "",
+			  shot, sizeof(shot));
+
+			fprintf(fd, "%s\n      {\"ref_frame\":%zu,"
+			  "\"ref_tstates\":%llu,\"ref_skipped\":%zu,"
+			  "\"frame\":%zu,\"tstates\":%llu,\"skipped\":%zu,"
+			  "\"resynced\":%s,\"ref_image\":", k ? "," : "",
+			  div->ref_pos,
+			  (unsigned long long)diff_tstate(ref, div->ref_pos),
+			  div->ref_skip, div->pos,
+			  (unsigned long long)diff_tstate(r, div->pos),
+			  div->skip, div->resynced ? "true" : "false");
+			tool_json_str(fd, ref_shot);
+			fprintf(fd, ",\"image\":");
+			tool_json_str(fd, shot);
+			fprintf(fd, "}");
+		}
+		fprintf(fd, "%s]}%s\n", r->ndivs ? "\n    " : "",
+		  (i + 1 < cnt) ? "," : "");
+	}
+	fprintf(fd, "  ]\n}\n");
+
+	if (fclose(fd)) {
+		log_error("Failed to write report '%s'\n", path);
+		return MS_ERR;
+	}
+
+	return err ? MS_ERR : MS_OK;
+}
+
+int main(int argc, char *argv[])
+{
+	struct diff_run *runs;
+	struct ms_pool *pool;
+	const char *prefix = "diff";
+	char *report = NULL;
+	int c, i, cnt, threads = 0, ret = EXIT_SUCCESS;
+	int option_index = 0;
+
+	static struct option long_options[] = {
+		{"dataflash", required_argument, 0, 'd'},
+		{"script", required_argument, 0, 's'},
+		{"time", required_argument, 0, 't'},
+		{"epoch", required_argument, 0, 'e'},
+		{"jobs", required_argument, 0, 'j'},
+		{"screenshots", required_argument, 0, 'p'},
+		{"output", required_argument, 0, 'o'},
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0},
+	};
+
+	dopts.limit_ms = DIFF_LIMIT_MS;
+	dopts.epoch = TOOL_EPOCH;
+
+	while ((c = getopt_long(argc, argv, "d:s:t:j:p:o:h", long_options,
+	    &option_index)) != -1) {
+		switch (c) {
+		case 'd':
+			dopts.df_path = optarg;
+			break;
+		case 's':
+			dopts.script_path = optarg;
+			break;
+		case 't':
+			dopts.limit_ms = strtoull(optarg, NULL, 0);
+			break;
+		case 'e':
+			dopts.epoch = strtoll(optarg, NULL, 0);
+			break;
+		case 'j':
+			threads = atoi(optarg);
+			break;
+		case 'p':
+			prefix = optarg;
+			break;
+		case 'o':
+			report = optarg;
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			exit(c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+	}
+	cnt = argc - optind;
+	if (cnt < 2 || report == NULL) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	log_start();
+
+	runs = (struct diff_run *)calloc(cnt, sizeof(struct diff_run));
+	if (runs == NULL) {
+		printf("Unable to allocate runs\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < cnt; i++) {
+		runs[i].cf_path = argv[optind + i];
+		runs[i].cf = ms_cf_load(runs[i].cf_path);
+		if (runs[i].cf == NULL) exit(EXIT_FAILURE);
+	}
+
+	pool = pool_create(threads);
+	if (pool == NULL) exit(EXIT_FAILURE);
+	for (i = 0; i < cnt; i++) pool_submit(pool, diff_run, &runs[i]);
+	pool_wait(pool);
+	pool_destroy(pool);
+
+	for (i = 1; i < cnt; i++) diff_align(&runs[0], &runs[i]);
+
+	if (diff_report(report, prefix, runs, cnt)) ret = EXIT_FAILURE;
+	for (i = 0; i < cnt; i++) {
+		if (strcmp(runs[i].status, "done") &&
+		    strcmp(runs[i].status, "off")) ret = EXIT_FAILURE;
+		if (runs[i].ndivs) ret = EXIT_FAILURE;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		framelog_stream_free(&runs[i].st);
+		free(runs[i].divs);
+		ms_cf_free(runs[i].cf);
+	}
+	free(runs);
+	log_stop();
+
+	return ret;
+}
@@ -0,0 +1,89 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "edges.h"
+#include "msemu.h"
+
+static uint8_t edges_bucket(uint8_t cnt)
+{
+	if (cnt < 3) return cnt;
+	if (cnt < 4) return 4;
+	if (cnt < 8) return 8;
+	if (cnt < 16) return 16;
+	if (cnt < 32) return 32;
+	if (cnt < 128) return 64;
+	return 128;
+}
+
+// Most of a map is never touched, skip over it eight at a time
+static int edges_zero8(const uint8_t *p)
+{
+	uint64_t w;
+
+	memcpy(&w, p, sizeof(w));
+	return !w;
+}
+
+void edges_start(ms_ctx *ms)
+{
+	if (ms->edges != NULL) return;
+
+	ms->edges = (struct ms_edges *)calloc(1, sizeof(struct ms_edges));
+	if (ms->edges == NULL) {
+		printf("Unable to allocate edge map\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+void edges_clear(ms_ctx *ms)
+{
+	memset(ms->edges->map, 0, EDGES_MAP_LEN);
+	ms->edges->prev = 0;
+}
+
+void edges_classify(uint8_t *map)
+{
+	int i, j;
+
+	for (i = 0; i < EDGES_MAP_LEN; i += 8) {
+		if (edges_zero8(&map[i])) continue;
+		for (j = i; j < i + 8; j++) map[j] = edges_bucket(map[j]);
+	}
+}
+
+int edges_merge(uint8_t *seen, const uint8_t *map)
+{
+	int i, j, ret = 0;
+
+	for (i = 0; i < EDGES_MAP_LEN; i += 8) {
+		if (edges_zero8(&map[i])) continue;
+		for (j = i; j < i + 8; j++) {
+			if (!(map[j] & ~seen[j])) continue;
+			if (!seen[j]) ret = 2;
+			else if (!ret) ret = 1;
+			seen[j] |= map[j];
+		}
+	}
+
+	return ret;
+}
+
+uint32_t edges_count(const uint8_t *seen)
+{
+	uint32_t n = 0;
+	int i;
+
+	for (i = 0; i < EDGES_MAP_LEN; i++) {
+		if (seen[i]) n++;
+	}
+
+	return n;
+}
+
+void edges_stop(ms_ctx *ms)
+{
+	free(ms->edges);
+	ms->edges = NULL;
+}
@@ -0,0 +1,79 @@
+#ifndef __EDGES_H__
+#define __EDGES_H__
+
+#include <stdint.h>
+#include "io.h"
+#include "msemu.h"
+
+/* Edge coverage, for guiding a fuzzer
+ *
+ * Works like AFL's: every transition from one instruction to the next bumps
+ * a hit counter in a map, indexed by the address of the instruction run
+ * xor'd with half the address of the one before it. Code in the two banked
+ * slots has its device and page folded in to its address, so the same PC in
+ * different pages counts as a different place.
+ *
+ * Between runs, counts are put in to buckets, 1, 2, 3, 4-7, 8-15, 16-31,
+ * 32-127 and 128+, and compared against the buckets seen by any earlier run
+ * to tell whether an input made the firmware do anything new.
+ */
+
+#define EDGES_MAP_LEN		65536
+
+struct ms_edges {
+	uint8_t map[EDGES_MAP_LEN];
+	uint16_t prev;
+};
+
+/**
+ * Start counting edges, with an empty map.
+ */
+void edges_start(ms_ctx *ms);
+
+/**
+ * Empty the map, before a new run.
+ */
+void edges_clear(ms_ctx *ms);
+
+/**
+ * Turn the hit counts in map in to buckets, one bit each.
+ */
+void edges_classify(uint8_t *map);
+
+/**
+ * Add the buckets in map, after edges_classify(), to seen, the buckets seen
+ * by all runs so far.
+ *
+ * Returns 2 if an edge was hit that never was before, 1 if only a count
+ * fell in to a new bucket, 0 if there was nothing new
+ */
+int edges_merge(uint8_t *seen, const uint8_t *map);
+
+/**
+ * Number of edges hit at least once in seen.
+ */
+uint32_t edges_count(const uint8_t *seen);
+
+void edges_stop(ms_ctx *ms);
+
+/* Count the step to the instruction at pc */
+static inline void edges_mark(ms_ctx *ms, uint16_t pc)
+{
+	struct ms_edges *e = ms->edges;
+	uint16_t loc = pc;
+
+	if (e == NULL) return;
+
+	if ((pc & 0xC000) == 0x4000) {
+		loc ^= (((ms->io[SLOT4_DEV] & 0x0F) << 8) |
+		  ms->io[SLOT4_PAGE]) * 0x9E37;
+	} else if ((pc & 0xC000) == 0x8000) {
+		loc ^= (((ms->io[SLOT8_DEV] & 0x0F) << 8) |
+		  ms->io[SLOT8_PAGE]) * 0x9E37;
+	}
+
+	e->map[(uint16_t)(loc ^ e->prev)]++;
+	e->prev = loc >> 1;
+}
+
+#endif // __EDGES_H__
@@ -0,0 +1,272 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "framelog.h"
+#include "hash.h"
+#include "lcd.h"
+#include "msemu.h"
+
+#define FRAMELOG_MAGIC		"MSLH"
+#define FRAMELOG_HDR_LEN	8
+#define FRAMELOG_REC_LEN	16
+
+struct ms_framelog {
+	uint64_t last_hash;
+	int have_last;
+
+	// Log being written
+	FILE *log;
+
+	// Golden log being compared against, and how far through it we are
+	int comparing;
+	struct framelog_rec *golden;
+	size_t golden_len;
+	size_t golden_pos;
+	int diverged;
+
+	// Records kept in memory, see framelog_keep()
+	int keep;
+	int keep_frames;
+	struct framelog_stream stream;
+};
+
+static void put64(uint8_t *p, uint64_t v)
+{
+	int i;
+
+	for (i = 0; i < 8; i++) p[i] = (uint8_t)(v >> (i * 8));
+}
+
+static uint64_t get64(const uint8_t *p)
+{
+	uint64_t v = 0;
+	int i;
+
+	for (i = 7; i >= 0; i--) v = (v << 8) | p[i];
+	return v;
+}
+
+static void framelog_stream_add(struct ms_framelog *fl, ms_ctx *ms,
+  uint64_t hash)
+{
+	struct framelog_stream *st = &fl->stream;
+
+	if (st->len == st->cap) {
+		st->cap = st->cap ? st->cap * 2 : 1024;
+		st->recs = (struct framelog_rec *)realloc(st->recs,
+		  st->cap * sizeof(struct framelog_rec));
+		if (fl->keep_frames)
+			st->frames = (uint8_t *)realloc(st->frames,
+			  st->cap * FRAMELOG_FRAME_LEN);
+		if (st->recs == NULL ||
+		    (fl->keep_frames && st->frames == NULL)) {
+			printf("Unable to allocate frame log\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	st->recs[st->len].tstate = ms->tstates;
+	st->recs[st->len].hash = hash;
+	if (fl->keep_frames) {
+		memcpy(st->frames + (st->len * FRAMELOG_FRAME_LEN),
+		  ms->lcd_dat1bit, FRAMELOG_FRAME_LEN);
+	}
+	st->len++;
+}
+
+static int framelog_load_golden(struct ms_framelog *fl, const char *path)
+{
+	uint8_t buf[FRAMELOG_REC_LEN];
+	FILE *fd;
+	size_t cap = 0;
+
+	fd = fopen(path, "rb");
+	if (!fd) {
+		log_error("Failed to open golden frame log '%s'\n", path);
+		return MS_ERR;
+	}
+
+	if (fread(buf, 1, FRAMELOG_HDR_LEN, fd) != FRAMELOG_HDR_LEN ||
+	    memcmp(buf, FRAMELOG_MAGIC, 4) ||
+	    (buf[4] | (buf[5] << 8) | (buf[6] << 16) | ((uint32_t)buf[7] << 24))
+	    != FRAMELOG_VERSION) {
+		log_error("'%s' is not a frame log\n", path);
+		fclose(fd);
+		return MS_ERR;
+	}
+
+	while (fread(buf, 1, FRAMELOG_REC_LEN, fd) == FRAMELOG_REC_LEN) {
+		if (fl->golden_len == cap) {
+			cap = cap ? cap * 2 : 1024;
+			fl->golden = (struct framelog_rec *)realloc(fl->golden,
+			  cap * sizeof(struct framelog_rec));
+			if (fl->golden == NULL) {
+				printf("Unable to allocate frame log\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		fl->golden[fl->golden_len].tstate = get64(buf);
+		fl->golden[fl->golden_len].hash = get64(buf + 8);
+		fl->golden_len++;
+	}
+	fclose(fd);
+
+	return MS_OK;
+}
+
+int framelog_init(ms_ctx *ms, const char *log_path, const char *cmp_path)
+{
+	struct ms_framelog *fl;
+	uint8_t hdr[FRAMELOG_HDR_LEN] = { 'M', 'S', 'L', 'H',
+	  FRAMELOG_VERSION, 0, 0, 0 };
+
+	if (log_path == NULL && cmp_path == NULL) return MS_OK;
+
+	fl = (struct ms_framelog *)calloc(1, sizeof(struct ms_framelog));
+	if (fl == NULL) {
+		printf("Unable to allocate frame log\n");
+		exit(EXIT_FAILURE);
+	}
+	ms->framelog = fl;
+
+	if (cmp_path != NULL) {
+		if (framelog_load_golden(fl, cmp_path)) {
+			framelog_deinit(ms);
+			return MS_ERR;
+		}
+		fl->comparing = 1;
+	}
+
+	if (log_path != NULL) {
+		fl->log = fopen(log_path, "wb");
+		if (!fl->log || fwrite(hdr, 1, sizeof(hdr), fl->log) !=
+		    sizeof(hdr)) {
+			log_error("Failed to open frame log '%s'\n", log_path);
+			framelog_deinit(ms);
+			return MS_ERR;
+		}
+	}
+
+	return MS_OK;
+}
+
+int framelog_frame(ms_ctx *ms)
+{
+	struct ms_framelog *fl = ms->framelog;
+	struct framelog_rec *g;
+	uint8_t rec[FRAMELOG_REC_LEN];
+	uint64_t hash;
+
+	if (fl == NULL || fl->diverged) return MS_OK;
+
+	hash = hash64(ms->lcd_dat1bit, (MS_LCD_WIDTH * MS_LCD_HEIGHT) / 8, 0);
+	if (fl->have_last && hash == fl->last_hash) return MS_OK;
+	fl->last_hash = hash;
+	fl->have_last = 1;
+
+	if (fl->keep) framelog_stream_add(fl, ms, hash);
+
+	if (fl->log) {
+		put64(rec, ms->tstates);
+		put64(rec + 8, hash);
+		fwrite(rec, 1, sizeof(rec), fl->log);
+	}
+
+	if (!fl->comparing) return MS_OK;
+
+	if (fl->golden_pos == fl->golden_len) {
+		log_error("Frame log diverged: frame %016llX @ %llu is past end "
+		  "of golden log\n", (unsigned long long)hash,
+		  (unsigned long long)ms->tstates);
+		fl->diverged = 1;
+		return MS_ERR;
+	}
+
+	g = &fl->golden[fl->golden_pos];
+	if (g->hash != hash || g->tstate != ms->tstates) {
+		log_error("Frame log diverged at record %zu:\n"
+		  "  expected %016llX @ %llu\n"
+		  "  got      %016llX @ %llu\n", fl->golden_pos,
+		  (unsigned long long)g->hash, (unsigned long long)g->tstate,
+		  (unsigned long long)hash, (unsigned long long)ms->tstates);
+		fl->diverged = 1;
+		return MS_ERR;
+	}
+	fl->golden_pos++;
+
+	return MS_OK;
+}
+
+int framelog_finish(ms_ctx *ms)
+{
+	struct ms_framelog *fl = ms->framelog;
+
+	if (fl == NULL) return MS_OK;
+
+	if (fl->log) fflush(fl->log);
+	if (!fl->comparing || fl->diverged) return MS_OK;
+
+	if (fl->golden_pos < fl->golden_len) {
+		log_error("Frame log diverged: run ended after %zu of %zu "
+		  "records, next expected %016llX @ %llu\n", fl->golden_pos,
+		  fl->golden_len,
+		  (unsigned long long)fl->golden[fl->golden_pos].hash,
+		  (unsigned long long)fl->golden[fl->golden_pos].tstate);
+		return MS_ERR;
+	}
+
+	printf("Frame log matched all %zu records\n", fl->golden_len);
+
+	return MS_OK;
+}
+
+void framelog_keep(ms_ctx *ms, int frames)
+{
+	struct ms_framelog *fl = ms->framelog;
+
+	if (fl == NULL) {
+		fl = (struct ms_framelog *)calloc(1, sizeof(struct ms_framelog));
+		if (fl == NULL) {
+			printf("Unable to allocate frame log\n");
+			exit(EXIT_FAILURE);
+		}
+		ms->framelog = fl;
+	}
+
+	fl->keep = 1;
+	fl->keep_frames = frames;
+}
+
+void framelog_take(ms_ctx *ms, struct framelog_stream *st)
+{
+	struct ms_framelog *fl = ms->framelog;
+
+	memset(st, 0, sizeof(*st));
+	if (fl == NULL) return;
+
+	*st = fl->stream;
+	memset(&fl->stream, 0, sizeof(fl->stream));
+}
+
+void framelog_stream_free(struct framelog_stream *st)
+{
+	free(st->recs);
+	free(st->frames);
+	memset(st, 0, sizeof(*st));
+}
+
+void framelog_deinit(ms_ctx *ms)
+{
+	struct ms_framelog *fl = ms->framelog;
+
+	if (fl == NULL) return;
+
+	if (fl->log) fclose(fl->log);
+	free(fl->golden);
+	framelog_stream_free(&fl->stream);
+	free(fl);
+	ms->framelog = NULL;
+}
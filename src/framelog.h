@@ -0,0 +1,88 @@
+#ifndef __FRAMELOG_H__
+#define __FRAMELOG_H__
+
+#include <stdint.h>
+#include "lcd.h"
+#include "msemu.h"
+
+/* LCD frame hash log
+ *
+ * At the end of every frame, i.e. every 64 Hz interrupt period, the 1-bit LCD
+ * buffer is hashed. Whenever the hash differs from the previous frame, a
+ * record of the emulated T state and the new hash is written to the log.
+ * This gives a compact trace of everything that was shown on screen which
+ * can be compared against a known good "golden" log from an earlier run.
+ *
+ * The log is binary, all values little endian:
+ *   Header:  "MSLH", uint32_t version
+ *   Records: uint64_t tstate, uint64_t hash
+ *
+ * For runs to be comparable they must be deterministic. See the --epoch
+ * option, which fixes the RTC and the initial contents of RAM.
+ */
+
+#define FRAMELOG_VERSION	1
+
+// Bytes in a copy of the 1-bit LCD buffer
+#define FRAMELOG_FRAME_LEN	((MS_LCD_WIDTH * MS_LCD_HEIGHT) / 8)
+
+struct framelog_rec {
+	uint64_t tstate;
+	uint64_t hash;
+};
+
+/* A run's records kept in memory, see framelog_keep(). With frames kept,
+ * frames holds FRAMELOG_FRAME_LEN bytes of 1-bit LCD buffer per record */
+struct framelog_stream {
+	struct framelog_rec *recs;
+	uint8_t *frames;
+	size_t len;
+	size_t cap;
+};
+
+/**
+ * Set up frame hashing.
+ *
+ * *ms		- Pointer to ms_ctx struct
+ * *log_path	- Path to write log of this run to, may be NULL
+ * *cmp_path	- Path of golden log to compare this run against, may be NULL
+ *
+ * Returns MS_OK on success, MS_ERR if a file could not be opened or the
+ * golden log is invalid
+ */
+int framelog_init(ms_ctx *ms, const char *log_path, const char *cmp_path);
+
+/**
+ * Hash the LCD at the end of a frame and log/compare it if it changed.
+ *
+ * Returns MS_OK, or MS_ERR if the run diverged from the golden log
+ */
+int framelog_frame(ms_ctx *ms);
+
+/**
+ * Finish up a run. When comparing, this checks the whole golden log was
+ * matched.
+ *
+ * Returns MS_OK, or MS_ERR if the run ended before the golden log did
+ */
+int framelog_finish(ms_ctx *ms);
+
+/**
+ * Also keep every record in memory, e.g. to compare runs with each other
+ * rather than against a file. Can be used with or without framelog_init().
+ *
+ * frames	- Keep a copy of the LCD with each record as well
+ */
+void framelog_keep(ms_ctx *ms, int frames);
+
+/**
+ * Hand the records kept so far over to st, which is freed with
+ * framelog_stream_free(). Keeping carries on with an empty stream.
+ */
+void framelog_take(ms_ctx *ms, struct framelog_stream *st);
+
+void framelog_stream_free(struct framelog_stream *st);
+
+void framelog_deinit(ms_ctx *ms);
+
+#endif // __FRAMELOG_H__
@@ -0,0 +1,633 @@
+/* msemu-fuzz, coverage guided fuzzing of the firmware's input handling
+ *
+ * Every run starts from the same snapshot, taken once the firmware is
+ * waiting for the input being fuzzed (see snapshot.h, and the debugger's
+ * snapsave command). The input is one of, picked with -m:
+ *
+ *	keys	Each byte is a key, counting through every key in the matrix
+ *		(see kbd.c) modulo the number of keys. The key is pressed and
+ *		released, or with the top bit set, pressed if it is up and
+ *		released if it is down, to hold modifiers over other keys.
+ *		At most MS_KBD_QUEUE_LEN / 2 bytes
+ *	df	Bytes written over the dataflash from -r <offset>:<len> on, e.g.
+ *		file system content the firmware is about to parse. At most
+ *		<len> bytes, the rest of the region is left as in the snapshot
+ *
+ * A run restores the snapshot, copying back only the 256 byte pages of RAM
+ * and dataflash the previous run wrote, applies the input and lets the
+ * firmware run for -b milliseconds of emulated time. Inputs whose edge
+ * coverage (see edges.h) shows something no earlier run did are added to the
+ * corpus that later inputs are mutated from.
+ *
+ * A run crashes if the PC reaches the -C address, 0x0000 by default as the
+ * firmware only ends up there by resetting, and hangs if no interrupt was
+ * taken for -H milliseconds of emulated time, e.g. spinning with interrupts
+ * off. Inputs are written to <prefix>-crash-<n>, <prefix>-hang-<n> and, for
+ * corpus additions, <prefix>-queue-<n>, any of which can be given back as a
+ * seed. Only crashes and hangs that hit an edge no earlier one did are
+ * written, the same as AFL's unique crashes.
+ *
+ * Each worker thread runs its own emulator. Progress goes to stdout once a
+ * second until -n runs or -t seconds are done. msemu-fuzz exits non-zero if
+ * it found any crash or hang.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "edges.h"
+#include "kbd.h"
+#include "mem.h"
+#include "msemu.h"
+#include "pool.h"
+#include "sizes.h"
+#include "snapshot.h"
+#include "tool.h"
+
+#include <SDL2/SDL.h>
+#if defined(_MSC_VER)
+	#include "platform/windows/getopt.h"
+#else
+	#include <getopt.h>
+#endif
+
+#define FUZZ_TSTATES_MS		(MS_CPU_HZ / 1000)
+#define FUZZ_BUDGET_MS		500
+#define FUZZ_HANG_MS		250
+#define FUZZ_TIME		60
+
+#define FUZZ_KEYS_MAX		(MS_KBD_QUEUE_LEN / 2)
+
+enum fuzz_mode {
+	FUZZ_KEYS,
+	FUZZ_DF,
+};
+
+enum fuzz_result {
+	FUZZ_OK,
+	FUZZ_CRASH,
+	FUZZ_HANG,
+};
+
+struct fuzz_input {
+	uint8_t *data;
+	size_t len;
+};
+
+struct fuzz_opts {
+	const char *snap_path;
+	const char *df_path;
+	const uint8_t *cf;
+	int64_t epoch;
+	enum fuzz_mode mode;
+	uint32_t df_offs;
+	uint32_t df_len;
+	uint64_t budget_ms;
+	uint64_t hang_ms;
+	int32_t crash_pc;
+	uint64_t max_runs;
+	const char *prefix;
+};
+
+static struct fuzz_opts fopts;
+
+/* Shared between workers, under lock */
+static struct {
+	SDL_mutex *lock;
+
+	struct fuzz_input *corpus;
+	int ncorpus;
+	int size;
+
+	// Edge buckets seen by any run, by any crash and by any hang
+	uint8_t seen[EDGES_MAP_LEN];
+	uint8_t seen_crash[EDGES_MAP_LEN];
+	uint8_t seen_hang[EDGES_MAP_LEN];
+
+	uint64_t runs;
+	int queued;
+	int crashes;
+	int hangs;
+	int err;
+
+	SDL_atomic_t stop;
+	SDL_atomic_t running;
+} fz;
+
+// Keys in the matrix, in row order
+static struct {
+	int row;
+	int bit;
+} fuzz_keys[KBD_ROWS * 8];
+static int fuzz_nkeys;
+
+static void usage(const char *path_arg)
+{
+	printf(
+	  "\nMailstation Emulator fuzzer\n\n"
+
+	  "Usage: \n"
+	  "  %s -c <path> [-d <path>] [-m keys|df] [-r <offset>:<len>] [-b <ms>]\n"
+	  "     [-H <ms>] [-C <addr>] [--epoch <secs>] [-j <threads>] [-n <runs>]\n"
+	  "     [-t <secs>] [-o <prefix>] <snapshot> [<seed> ...]\n"
+	  "  %s -h | --help\n\n"
+
+	  "  -c <path>, --codeflash <path>  Codeflash the snapshot was taken with\n"
+	  "  -d <path>, --dataflash <path>  Dataflash to start emulators with, never\n"
+	  "                                 written back. The snapshot replaces it\n"
+	  "  -m <mode>, --mode <mode>       What the input is: keys, key presses, or\n"
+	  "                                 df, dataflash content (def: keys)\n"
+	  "  -r <offset>:<len>, --region <offset>:<len>\n"
+	  "                                 Dataflash the input is written over in df\n"
+	  "                                 mode\n"
+	  "  -b <ms>, --budget <ms>         Emulated time per run (def: %d)\n"
+	  "  -H <ms>, --hang <ms>           Emulated time without an interrupt that\n"
+	  "                                 counts as a hang (def: %d)\n"
+	  "  -C <addr>, --crash-pc <addr>   PC that counts as a crash, -1 for none\n"
+	  "                                 (def: 0x0000)\n"
+	  "  --epoch <secs>                 RTC start, see msemu --epoch (def: %d)\n"
+	  "  -j <n>, --jobs <n>             Worker threads (def: one per CPU)\n"
+	  "  -n <runs>, --runs <runs>       Stop after this many runs\n"
+	  "  -t <secs>, --time <secs>       Stop after this long, 0 for no limit\n"
+	  "                                 (def: %d)\n"
+	  "  -o <prefix>, --output <prefix> Start of paths inputs are written to\n"
+	  "                                 (def: fuzz)\n"
+	  "  -h, --help                     Show this help\n\n"
+
+	  "Seeds are input files to start the corpus with. See the top of src/fuzz.c\n"
+	  "for the input formats.\n",
+	  path_arg, path_arg, FUZZ_BUDGET_MS, FUZZ_HANG_MS, TOOL_EPOCH,
+	  FUZZ_TIME);
+}
+
+static size_t fuzz_max_len(void)
+{
+	return (fopts.mode == FUZZ_KEYS) ? FUZZ_KEYS_MAX : fopts.df_len;
+}
+
+/* xorshift64, each worker has its own */
+static uint32_t fuzz_rand(uint64_t *rng)
+{
+	*rng ^= *rng << 13;
+	*rng ^= *rng >> 7;
+	*rng ^= *rng << 17;
+
+	return (uint32_t)(*rng >> 32);
+}
+
+static void fuzz_add(const uint8_t *data, size_t len)
+{
+	struct fuzz_input *in;
+
+	if (fz.ncorpus == fz.size) {
+		fz.size = fz.size ? fz.size * 2 : 64;
+		fz.corpus = (struct fuzz_input *)realloc(fz.corpus,
+		  fz.size * sizeof(struct fuzz_input));
+		if (fz.corpus == NULL) {
+			printf("Unable to allocate corpus\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	in = &fz.corpus[fz.ncorpus];
+	in->data = (uint8_t *)malloc(len ? len : 1);
+	if (in->data == NULL) {
+		printf("Unable to allocate corpus\n");
+		exit(EXIT_FAILURE);
+	}
+	if (len) memcpy(in->data, data, len);
+	in->len = len;
+	fz.ncorpus++;
+}
+
+static int fuzz_write(const char *kind, int n, const uint8_t *data,
+  size_t len)
+{
+	char path[1024];
+	FILE *fd;
+	int err;
+
+	snprintf(path, sizeof(path), "%s-%s-%d", fopts.prefix, kind, n);
+	fd = fopen(path, "wb");
+	if (fd == NULL) {
+		log_error("Failed to open '%s': %s\n", path, strerror(errno));
+		return MS_ERR;
+	}
+	err = (fwrite(data, 1, len, fd) != len);
+	err |= fclose(fd);
+	if (err) {
+		log_error("Failed to write '%s'\n", path);
+		return MS_ERR;
+	}
+
+	return MS_OK;
+}
+
+/* Pick an input from the corpus, sometimes spliced with a second one, and
+ * apply a stack of random changes to it. buf holds fuzz_max_len() bytes.
+ * Returns the new length */
+static size_t fuzz_mutate(uint64_t *rng, uint8_t *buf)
+{
+	const struct fuzz_input *a, *b;
+	size_t max = fuzz_max_len(), len, pos, cut, n;
+	int i, ops;
+
+	SDL_LockMutex(fz.lock);
+	a = &fz.corpus[fuzz_rand(rng) % fz.ncorpus];
+	len = (a->len < max) ? a->len : max;
+	memcpy(buf, a->data, len);
+	if (fz.ncorpus > 1 && !(fuzz_rand(rng) % 8)) {
+		b = &fz.corpus[fuzz_rand(rng) % fz.ncorpus];
+		cut = len ? fuzz_rand(rng) % len : 0;
+		if (cut < b->len) {
+			n = b->len - cut;
+			if (cut + n > max) n = max - cut;
+			memcpy(buf + cut, b->data + cut, n);
+			len = cut + n;
+		}
+	}
+	SDL_UnlockMutex(fz.lock);
+
+	ops = 1 << (1 + (fuzz_rand(rng) % 4));
+	for (i = 0; i < ops; i++) {
+		pos = len ? fuzz_rand(rng) % len : 0;
+		switch (fuzz_rand(rng) % 6) {
+		  case 0: // Flip a bit
+			if (len) buf[pos] ^= 1 << (fuzz_rand(rng) % 8);
+			break;
+		  case 1: // Random byte
+			if (len) buf[pos] = fuzz_rand(rng);
+			break;
+		  case 2: // Nudge a byte up or down
+			if (len) buf[pos] += (fuzz_rand(rng) % 33) - 16;
+			break;
+		  case 3: // Insert random bytes
+			n = 1 + (fuzz_rand(rng) % 4);
+			if (len + n > max) break;
+			memmove(buf + pos + n, buf + pos, len - pos);
+			for (cut = 0; cut < n; cut++)
+				buf[pos + cut] = fuzz_rand(rng);
+			len += n;
+			break;
+		  case 4: // Delete bytes
+			n = 1 + (fuzz_rand(rng) % 4);
+			if (pos + n > len) break;
+			memmove(buf + pos, buf + pos + n, len - pos - n);
+			len -= n;
+			break;
+		  case 5: // Repeat a run of bytes somewhere else
+			if (!len) break;
+			cut = fuzz_rand(rng) % len;
+			n = 1 + (fuzz_rand(rng) % (len - cut));
+			if (len + n > max) break;
+			memmove(buf + pos + n, buf + pos, len - pos);
+			if (cut >= pos) cut += n;
+			memmove(buf + pos, buf + cut, n);
+			len += n;
+			break;
+		}
+	}
+
+	return len;
+}
+
+static void fuzz_apply(ms_ctx *ms, const uint8_t *in, size_t len)
+{
+	uint8_t held[KBD_ROWS * 8] = { 0 };
+	size_t i;
+	int k;
+
+	if (fopts.mode == FUZZ_DF) {
+		mem_put(ms->df, fopts.df_offs, in, len);
+		snap_dirty_range(ms, DF, fopts.df_offs, len);
+		return;
+	}
+
+	for (i = 0; i < len; i++) {
+		k = (in[i] & 0x7F) % fuzz_nkeys;
+		if (in[i] & 0x80) {
+			held[k] = !held[k];
+			kbd_queue(ms, fuzz_keys[k].row, fuzz_keys[k].bit, held[k]);
+		} else {
+			kbd_queue(ms, fuzz_keys[k].row, fuzz_keys[k].bit, 1);
+			kbd_queue(ms, fuzz_keys[k].row, fuzz_keys[k].bit, 0);
+		}
+	}
+}
+
+static enum fuzz_result fuzz_exec(ms_ctx *ms, const struct ms_snap *snap,
+  const uint8_t *in, size_t len)
+{
+	uint64_t end, step;
+	uint64_t quiet = 0;
+	uint32_t ints;
+	int ret;
+
+	snap_restore(ms, snap);
+	edges_clear(ms);
+	ms->watch_hit = 0;
+	fuzz_apply(ms, in, len);
+
+	end = ms->tstates + fopts.budget_ms * FUZZ_TSTATES_MS;
+	ints = ms->int_count;
+	while (ms->tstates < end) {
+		step = end - ms->tstates;
+		if (step > MS_INT_PERIOD) step = MS_INT_PERIOD;
+		ret = ms_step(ms, step);
+		if (ms->watch_hit) return FUZZ_CRASH;
+		if (ret != MS_STEP_DONE) break;
+
+		if (ms->int_count != ints) {
+			ints = ms->int_count;
+			quiet = 0;
+		} else if ((quiet += step) >= fopts.hang_ms * FUZZ_TSTATES_MS) {
+			return FUZZ_HANG;
+		}
+	}
+
+	return FUZZ_OK;
+}
+
+static void fuzz_worker(void *arg, int worker)
+{
+	struct ms_snap *snap = NULL;
+	enum fuzz_result res;
+	ms_opts opts;
+	ms_ctx *ms;
+	uint8_t *buf;
+	uint64_t rng;
+	size_t len;
+	int n;
+
+	(void)arg;
+
+	buf = (uint8_t *)malloc(fuzz_max_len() ? fuzz_max_len() : 1);
+	if (buf == NULL) {
+		printf("Unable to allocate input\n");
+		exit(EXIT_FAILURE);
+	}
+	rng = ((uint64_t)(worker + 1) * 0x9E3779B97F4A7C15ULL) ^
+	  SDL_GetPerformanceCounter();
+	if (!rng) rng = 1;
+
+	ms_opts_init(&opts);
+	opts.cf_shared = fopts.cf;
+	opts.df_path = (char *)fopts.df_path;
+	opts.df_save_to_disk = 0;
+	opts.epoch = fopts.epoch;
+
+	ms = ms_create(&opts);
+	if (ms == NULL || snap_load(ms, fopts.snap_path)) {
+		SDL_LockMutex(fz.lock);
+		fz.err = 1;
+		SDL_UnlockMutex(fz.lock);
+		SDL_AtomicSet(&fz.stop, 1);
+		goto out;
+	}
+	edges_start(ms);
+	snap_track(ms);
+	snap = snap_take(ms);
+	ms->watch_pc = fopts.crash_pc;
+
+	while (!SDL_AtomicGet(&fz.stop)) {
+		len = fuzz_mutate(&rng, buf);
+		res = fuzz_exec(ms, snap, buf, len);
+		edges_classify(ms->edges->map);
+
+		SDL_LockMutex(fz.lock);
+		fz.runs++;
+		if (res == FUZZ_CRASH) {
+			if (edges_merge(fz.seen_crash, ms->edges->map)) {
+				n = fz.crashes++;
+				fuzz_write("crash", n, buf, len);
+			}
+		} else if (res == FUZZ_HANG) {
+			if (edges_merge(fz.seen_hang, ms->edges->map)) {
+				n = fz.hangs++;
+				fuzz_write("hang", n, buf, len);
+			}
+		} else if (edges_merge(fz.seen, ms->edges->map)) {
+			fuzz_add(buf, len);
+			n = fz.queued++;
+			fuzz_write("queue", n, buf, len);
+		}
+		if (fopts.max_runs && fz.runs >= fopts.max_runs)
+			SDL_AtomicSet(&fz.stop, 1);
+		SDL_UnlockMutex(fz.lock);
+	}
+
+out:
+	snap_free(snap);
+	ms_destroy(ms);
+	free(buf);
+	SDL_AtomicAdd(&fz.running, -1);
+}
+
+static int fuzz_seed(const char *path)
+{
+	uint8_t *buf;
+	size_t max = fuzz_max_len(), len;
+	FILE *fd;
+
+	fd = fopen(path, "rb");
+	if (fd == NULL) {
+		log_error("Failed to open seed '%s': %s\n", path,
+		  strerror(errno));
+		return MS_ERR;
+	}
+	buf = (uint8_t *)malloc(max ? max : 1);
+	if (buf == NULL) {
+		printf("Unable to allocate input\n");
+		exit(EXIT_FAILURE);
+	}
+	len = fread(buf, 1, max, fd);
+	fclose(fd);
+
+	fuzz_add(buf, len);
+	free(buf);
+
+	return MS_OK;
+}
+
+static void fuzz_status(uint32_t start, uint64_t *last_runs, uint32_t *last)
+{
+	uint32_t now = SDL_GetTicks();
+	uint64_t runs;
+	int corpus, crashes, hangs;
+	uint32_t edges;
+
+	SDL_LockMutex(fz.lock);
+	runs = fz.runs;
+	corpus = fz.ncorpus;
+	crashes = fz.crashes;
+	hangs = fz.hangs;
+	edges = edges_count(fz.seen);
+	SDL_UnlockMutex(fz.lock);
+
+	printf("%us: %llu runs, %.0f/s, corpus %d, edges %u, crashes %d, "
+	  "hangs %d\n", (now - start) / 1000, (unsigned long long)runs,
+	  (now != *last) ?
+	  (double)(runs - *last_runs) * 1000 / (now - *last) : 0.0,
+	  corpus, edges, crashes, hangs);
+	fflush(stdout);
+
+	*last_runs = runs;
+	*last = now;
+}
+
+int main(int argc, char *argv[])
+{
+	struct ms_pool *pool;
+	const char *cf_path = NULL;
+	uint64_t time_s = FUZZ_TIME, last_runs = 0;
+	uint32_t start, last;
+	char *end;
+	int c, i, threads = 0, ret = EXIT_SUCCESS;
+	int option_index = 0;
+
+	static struct option long_options[] = {
+		{"codeflash", required_argument, 0, 'c'},
+		{"dataflash", required_argument, 0, 'd'},
+		{"mode", required_argument, 0, 'm'},
+		{"region", required_argument, 0, 'r'},
+		{"budget", required_argument, 0, 'b'},
+		{"hang", required_argument, 0, 'H'},
+		{"crash-pc", required_argument, 0, 'C'},
+		{"epoch", required_argument, 0, 'e'},
+		{"jobs", required_argument, 0, 'j'},
+		{"runs", required_argument, 0, 'n'},
+		{"time", required_argument, 0, 't'},
+		{"output", required_argument, 0, 'o'},
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0},
+	};
+
+	fopts.epoch = TOOL_EPOCH;
+	fopts.budget_ms = FUZZ_BUDGET_MS;
+	fopts.hang_ms = FUZZ_HANG_MS;
+	fopts.crash_pc = 0x0000;
+	fopts.prefix = "fuzz";
+
+	while ((c = getopt_long(argc, argv, "c:d:m:r:b:H:C:j:n:t:o:h",
+	    long_options, &option_index)) != -1) {
+		switch (c) {
+		case 'c':
+			cf_path = optarg;
+			break;
+		case 'd':
+			fopts.df_path = optarg;
+			break;
+		case 'm':
+			if (!strcmp(optarg, "keys")) {
+				fopts.mode = FUZZ_KEYS;
+			} else if (!strcmp(optarg, "df")) {
+				fopts.mode = FUZZ_DF;
+			} else {
+				log_error("Unknown mode '%s'\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'r':
+			fopts.df_offs = strtoul(optarg, &end, 0);
+			if (*end != ':') {
+				log_error("Region must be <offset>:<len>\n");
+				exit(EXIT_FAILURE);
+			}
+			fopts.df_len = strtoul(end + 1, NULL, 0);
+			break;
+		case 'b':
+			fopts.budget_ms = strtoull(optarg, NULL, 0);
+			break;
+		case 'H':
+			fopts.hang_ms = strtoull(optarg, NULL, 0);
+			break;
+		case 'C':
+			fopts.crash_pc = strtol(optarg, NULL, 0);
+			break;
+		case 'e':
+			fopts.epoch = strtoll(optarg, NULL, 0);
+			break;
+		case 'j':
+			threads = atoi(optarg);
+			break;
+		case 'n':
+			fopts.max_runs = strtoull(optarg, NULL, 0);
+			break;
+		case 't':
+			time_s = strtoull(optarg, NULL, 0);
+			break;
+		case 'o':
+			fopts.prefix = optarg;
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			exit(c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+	}
+	if (cf_path == NULL || argc - optind < 1) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	fopts.snap_path = argv[optind];
+	if (fopts.mode == FUZZ_DF && (!fopts.df_len ||
+	    fopts.df_offs > SZ_512K || fopts.df_len > SZ_512K - fopts.df_offs)) {
+		log_error("df mode needs a region inside the dataflash, -r\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < KBD_ROWS * 8; i++) {
+		if (kbd_name(i / 8, i % 8) == NULL) continue;
+		fuzz_keys[fuzz_nkeys].row = i / 8;
+		fuzz_keys[fuzz_nkeys].bit = i % 8;
+		fuzz_nkeys++;
+	}
+
+	for (i = optind + 1; i < argc; i++) {
+		if (fuzz_seed(argv[i])) exit(EXIT_FAILURE);
+	}
+	if (!fz.ncorpus) fuzz_add(NULL, 0);
+
+	fz.lock = SDL_CreateMutex();
+	if (fz.lock == NULL) {
+		log_error("Failed to create lock: %s\n", SDL_GetError());
+		exit(EXIT_FAILURE);
+	}
+
+	log_start();
+
+	fopts.cf = ms_cf_load(cf_path);
+	if (fopts.cf == NULL) exit(EXIT_FAILURE);
+
+	pool = pool_create(threads);
+	if (pool == NULL) exit(EXIT_FAILURE);
+	SDL_AtomicSet(&fz.running, pool_threads(pool));
+	for (i = 0; i < pool_threads(pool); i++)
+		pool_submit(pool, fuzz_worker, NULL);
+
+	start = last = SDL_GetTicks();
+	while (SDL_AtomicGet(&fz.running)) {
+		SDL_Delay(100);
+		if (time_s && SDL_GetTicks() - start >= time_s * 1000)
+			SDL_AtomicSet(&fz.stop, 1);
+		if (SDL_GetTicks() - last >= 1000)
+			fuzz_status(start, &last_runs, &last);
+	}
+	pool_wait(pool);
+	pool_destroy(pool);
+	fuzz_status(start, &last_runs, &last);
+
+	if (fz.err || fz.crashes || fz.hangs) ret = EXIT_FAILURE;
+
+	for (i = 0; i < fz.ncorpus; i++) free(fz.corpus[i].data);
+	free(fz.corpus);
+	SDL_DestroyMutex(fz.lock);
+	ms_cf_free(fopts.cf);
+	log_stop();
+
+	return ret;
+}
@@ -0,0 +1,223 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "fwdb.h"
+#include "msemu.h"
+
+#include <SDL2/SDL.h>
+
+/* Built in firmware, add an entry with the hash printed at start. Images
+ * that are not firmware at all are listed too, so that a codeflash dump
+ * that came out erased or all zeros is named as such rather than simply
+ * not booting */
+static const struct fw_profile fwdb_builtin[] = {
+	{ 0x93E8573813BAC8B4ULL, "erased", -1, -1, NULL, NULL },
+	{ 0x87D2A1B6E1163EF1ULL, "blank", -1, -1, NULL, NULL },
+	{ 0, NULL, -1, -1, NULL, NULL },
+};
+
+static const struct fw_profile fwdb_generic = {
+	0, "unknown", -1, -1, NULL, NULL
+};
+
+/* Firmware and paths added from files, shared by every instance */
+struct fwdb_entry {
+	struct fw_profile fw;
+	struct fwdb_entry *next;
+};
+
+struct fwdb_path {
+	char *path;
+	struct fwdb_path *next;
+};
+
+static struct fwdb_entry *fwdb_loaded;
+static struct fwdb_path *fwdb_paths;
+static SDL_SpinLock fwdb_lock;
+
+static char *fwdb_strdup(const char *str, size_t len)
+{
+	char *s;
+
+	s = (char *)malloc(len + 1);
+	if (s == NULL) {
+		printf("Unable to allocate firmware database\n");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(s, str, len);
+	s[len] = '\0';
+
+	return s;
+}
+
+/* Next whitespace separated word of *line, terminated in place. Returns NULL
+ * at the end of the line. Not strtok(), files may be loaded from any thread */
+static char *fwdb_word(char **line)
+{
+	char *p = *line + strspn(*line, " \t\r\n");
+	char *end;
+
+	if (*p == '\0') return NULL;
+	end = p + strcspn(p, " \t\r\n");
+	*line = end;
+	if (*end != '\0') {
+		*end = '\0';
+		*line = end + 1;
+	}
+
+	return p;
+}
+
+/* Parse one line in to fw. Returns MS_OK, or MS_ERR if it is invalid */
+static int fwdb_parse(char *line, struct fw_profile *fw)
+{
+	char *tok, *end, *val;
+
+	memset(fw, 0, sizeof(*fw));
+	fw->idle_pc = -1;
+	fw->boot_pc = -1;
+
+	tok = fwdb_word(&line);
+	fw->cf_hash = strtoull(tok, &end, 16);
+	if (end == tok || *end != '\0') return MS_ERR;
+
+	tok = fwdb_word(&line);
+	if (tok == NULL) return MS_ERR;
+	fw->name = tok;
+
+	while ((tok = fwdb_word(&line)) != NULL) {
+		val = strchr(tok, '=');
+		if (val == NULL || val[1] == '\0') return MS_ERR;
+		*val++ = '\0';
+
+		if (!strcmp(tok, "idle") || !strcmp(tok, "boot")) {
+			if (tok[0] == 'i') {
+				fw->idle_pc = (int32_t)strtoul(val, &end, 16);
+			} else {
+				fw->boot_pc = (int32_t)strtoul(val, &end, 16);
+			}
+			if (end == val || *end != '\0') return MS_ERR;
+		} else if (!strcmp(tok, "hle")) {
+			fw->hle = val;
+		} else if (!strcmp(tok, "symbols")) {
+			fw->sym_path = val;
+		} else {
+			return MS_ERR;
+		}
+	}
+
+	return MS_OK;
+}
+
+int fwdb_load(const char *path)
+{
+	struct fwdb_entry *e, *head = NULL, *tail = NULL;
+	struct fwdb_path *p;
+	struct fw_profile fw;
+	char line[1024], *s;
+	int lineno = 0, ret = MS_OK;
+	FILE *fd;
+
+	SDL_AtomicLock(&fwdb_lock);
+	for (p = fwdb_paths; p != NULL; p = p->next) {
+		if (!strcmp(p->path, path)) break;
+	}
+	SDL_AtomicUnlock(&fwdb_lock);
+	if (p != NULL) return MS_OK;
+
+	fd = fopen(path, "r");
+	if (fd == NULL) {
+		log_error("Failed to open firmware database '%s'\n", path);
+		return MS_ERR;
+	}
+
+	while (fgets(line, sizeof(line), fd) != NULL) {
+		lineno++;
+		s = line + strspn(line, " \t");
+		if (*s == '#' || *s == '\r' || *s == '\n' || *s == '\0')
+			continue;
+
+		if (fwdb_parse(s, &fw)) {
+			log_error("%s:%d: Invalid firmware\n", path, lineno);
+			ret = MS_ERR;
+			break;
+		}
+
+		e = (struct fwdb_entry *)calloc(1, sizeof(struct fwdb_entry));
+		if (e == NULL) {
+			printf("Unable to allocate firmware database\n");
+			exit(EXIT_FAILURE);
+		}
+		e->fw = fw;
+		e->fw.name = fwdb_strdup(fw.name, strlen(fw.name));
+		if (fw.hle != NULL)
+			e->fw.hle = fwdb_strdup(fw.hle, strlen(fw.hle));
+		if (fw.sym_path != NULL) {
+			e->fw.sym_path = fwdb_strdup(fw.sym_path,
+			  strlen(fw.sym_path));
+		}
+
+		// Later lines take precedence, same as later files
+		e->next = head;
+		head = e;
+		if (tail == NULL) tail = e;
+	}
+	fclose(fd);
+
+	if (ret) {
+		while (head != NULL) {
+			e = head->next;
+			free((char *)head->fw.name);
+			free((char *)head->fw.hle);
+			free((char *)head->fw.sym_path);
+			free(head);
+			head = e;
+		}
+		return ret;
+	}
+
+	p = (struct fwdb_path *)calloc(1, sizeof(struct fwdb_path));
+	if (p == NULL) {
+		printf("Unable to allocate firmware database\n");
+		exit(EXIT_FAILURE);
+	}
+	p->path = fwdb_strdup(path, strlen(path));
+
+	SDL_AtomicLock(&fwdb_lock);
+	if (tail != NULL) {
+		tail->next = fwdb_loaded;
+		fwdb_loaded = head;
+	}
+	p->next = fwdb_paths;
+	fwdb_paths = p;
+	SDL_AtomicUnlock(&fwdb_lock);
+
+	return MS_OK;
+}
+
+const struct fw_profile *fwdb_lookup(uint64_t cf_hash)
+{
+	const struct fw_profile *fw;
+	struct fwdb_entry *e;
+
+	SDL_AtomicLock(&fwdb_lock);
+	for (e = fwdb_loaded; e != NULL; e = e->next) {
+		if (e->fw.cf_hash == cf_hash) break;
+	}
+	SDL_AtomicUnlock(&fwdb_lock);
+	if (e != NULL) return &e->fw;
+
+	for (fw = fwdb_builtin; fw->name != NULL; fw++) {
+		if (fw->cf_hash == cf_hash) return fw;
+	}
+
+	return &fwdb_generic;
+}
+
+int fwdb_known(const struct fw_profile *fw)
+{
+	return fw != &fwdb_generic;
+}
@@ -0,0 +1,68 @@
+#ifndef __FWDB_H__
+#define __FWDB_H__
+
+#include <stdint.h>
+#include "msemu.h"
+
+/* Firmware database
+ *
+ * Idle loops, HLE routines, the address at which booting is done and symbol
+ * maps all depend on exactly which codeflash is loaded. cf_init() hashes the
+ * codeflash with hash64() and looks the hash up here, and the profile found
+ * is used by everything else. Codeflash that is not known gets a generic
+ * profile, which only skips over HALTs.
+ *
+ * Known firmware is in a table built in to fwdb.c. More can be added at run
+ * time from a plain text file, with one firmware per line:
+ *
+ *   <hash> <name> [idle=<addr>] [boot=<addr>] [hle=<table>] [symbols=<path>]
+ *
+ * hash is the 16 hex digit hash of the codeflash, as printed at start. idle
+ * is the physical codeflash address, page * 0x4000 + offset, of a loop that
+ * does nothing but wait for the next interrupt. boot is the physical
+ * codeflash address of code that is reached once the firmware has booted
+ * and waits for input, see the waitboot script command. table is the name
+ * of a table of hooks in hle.c, and path a symbol map that is loaded unless
+ * one is given on the command line. Addresses are hex. Blank lines and
+ * lines starting with '#' are ignored. Firmware added from a file is looked
+ * up before the built in table, so an entry there can be overridden.
+ */
+
+struct fw_profile {
+	uint64_t cf_hash;
+	const char *name;
+
+	// Physical codeflash address of the idle loop, -1 if unknown
+	int32_t idle_pc;
+
+	// Physical codeflash address reached once booting is done, -1 if unknown
+	int32_t boot_pc;
+
+	// Name of the HLE hook table, symbol map path, NULL if none
+	const char *hle;
+	const char *sym_path;
+};
+
+/**
+ * Add firmware from a database file. Loading the same path again does
+ * nothing. Profiles are never freed, instances may point at them for as long
+ * as the process runs.
+ *
+ * Returns MS_OK on success, MS_ERR if the file could not be read or has
+ * invalid lines
+ */
+int fwdb_load(const char *path);
+
+/**
+ * Find the profile for a codeflash hash.
+ *
+ * Returns the profile, or the generic one if the firmware is not known
+ */
+const struct fw_profile *fwdb_lookup(uint64_t cf_hash);
+
+/**
+ * Whether a profile is the generic one for unknown firmware.
+ */
+int fwdb_known(const struct fw_profile *fw);
+
+#endif // __FWDB_H__
@@ -0,0 +1,107 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hash.h"
+
+/* Implementation of XXH64 as described in the xxHash specification.
+ * Inputs are read a byte at a time so the results do not depend on host
+ * endianness or alignment.
+ */
+
+#define P64_1	0x9E3779B185EBCA87ULL
+#define P64_2	0xC2B2AE3D27D4EB4FULL
+#define P64_3	0x165667B19E3779F9ULL
+#define P64_4	0x85EBCA77C2B2AE63ULL
+#define P64_5	0x27D4EB2F165667C5ULL
+
+static uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const uint8_t *p)
+{
+	return (uint64_t)p[0] | ((uint64_t)p[1] << 8) |
+	  ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+	  ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) |
+	  ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+static uint32_t read32(const uint8_t *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+	  ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t round64(uint64_t acc, uint64_t input)
+{
+	acc += input * P64_2;
+	acc = rotl64(acc, 31);
+	return acc * P64_1;
+}
+
+static uint64_t merge64(uint64_t acc, uint64_t val)
+{
+	acc ^= round64(0, val);
+	return acc * P64_1 + P64_4;
+}
+
+uint64_t hash64(const void *buf, size_t len, uint64_t seed)
+{
+	const uint8_t *p = (const uint8_t *)buf;
+	const uint8_t *end = p + len;
+	uint64_t v1, v2, v3, v4;
+	uint64_t h;
+
+	if (len >= 32) {
+		v1 = seed + P64_1 + P64_2;
+		v2 = seed + P64_2;
+		v3 = seed;
+		v4 = seed - P64_1;
+
+		do {
+			v1 = round64(v1, read64(p));
+			v2 = round64(v2, read64(p + 8));
+			v3 = round64(v3, read64(p + 16));
+			v4 = round64(v4, read64(p + 24));
+			p += 32;
+		} while (p <= end - 32);
+
+		h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) +
+		  rotl64(v4, 18);
+		h = merge64(h, v1);
+		h = merge64(h, v2);
+		h = merge64(h, v3);
+		h = merge64(h, v4);
+	} else {
+		h = seed + P64_5;
+	}
+
+	h += (uint64_t)len;
+
+	while (p + 8 <= end) {
+		h ^= round64(0, read64(p));
+		h = rotl64(h, 27) * P64_1 + P64_4;
+		p += 8;
+	}
+
+	if (p + 4 <= end) {
+		h ^= (uint64_t)read32(p) * P64_1;
+		h = rotl64(h, 23) * P64_2 + P64_3;
+		p += 4;
+	}
+
+	while (p < end) {
+		h ^= (*p) * P64_5;
+		h = rotl64(h, 11) * P64_1;
+		p++;
+	}
+
+	h ^= h >> 33;
+	h *= P64_2;
+	h ^= h >> 29;
+	h *= P64_3;
+	h ^= h >> 32;
+
+	return h;
+}
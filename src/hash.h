@@ -0,0 +1,17 @@
+#ifndef __HASH_H__
+#define __HASH_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Fast, non-cryptographic 64-bit hash of a buffer. This is XXH64, so values
+ * match those generated by other xxHash implementations.
+ *
+ * *buf		- Pointer to data to hash
+ * len		- Length of data in bytes
+ * seed		- Initial seed, 0 unless there is reason otherwise
+ */
+uint64_t hash64(const void *buf, size_t len, uint64_t seed);
+
+#endif // __HASH_H__
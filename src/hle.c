@@ -0,0 +1,426 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "fwdb.h"
+#include "hle.h"
+#include "msemu.h"
+#include "sizes.h"
+
+#include <z80ex/z80ex.h>
+
+// Memory callbacks, see msemu.c
+Z80EX_BYTE z80ex_mread(Z80EX_CONTEXT *cpu, Z80EX_WORD addr, int m1_state,
+  void *user_data);
+void z80ex_mwrite(Z80EX_CONTEXT *cpu, Z80EX_WORD addr, Z80EX_BYTE val,
+  void *user_data);
+
+// Flags set by the block copies
+#define HLE_FLAG_3		0x08
+#define HLE_FLAG_5		0x20
+#define HLE_FLAGS_KEPT		0xC1	// S, Z and C
+
+/* Tables of hooks, sorted or not, by the name firmware profiles use. None
+ * yet, profiles hook the generic handlers below by address */
+static const struct hle_table hle_tables[] = {
+	{ NULL, NULL, 0 },
+};
+
+/* Whether the code at the PC is the len bytes at code */
+static int hle_code(ms_ctx *ms, const uint8_t *code, int len)
+{
+	uint16_t pc = z80ex_get_reg(ms->z80, regPC);
+	int i;
+
+	for (i = 0; i < len; i++) {
+		if (mem_peek(ms, (uint16_t)(pc + i)) != code[i]) return 0;
+	}
+
+	return 1;
+}
+
+/* Count cnt opcode fetches in the R register, as the Z80 would have */
+static void hle_add_r(ms_ctx *ms, uint32_t cnt)
+{
+	uint16_t r = z80ex_get_reg(ms->z80, regR);
+
+	z80ex_set_reg(ms->z80, regR, (r & 0x80) | ((r + cnt) & 0x7F));
+}
+
+/* LDIR, or LDDR if dir is -1, with the registers as they are now.
+ *
+ * Returns the T states taken
+ */
+static int hle_block(ms_ctx *ms, int dir)
+{
+	uint16_t hl = z80ex_get_reg(ms->z80, regHL);
+	uint16_t de = z80ex_get_reg(ms->z80, regDE);
+	uint16_t bc = z80ex_get_reg(ms->z80, regBC);
+	uint16_t af = z80ex_get_reg(ms->z80, regAF);
+	uint32_t cnt = 0;
+	uint8_t val, n;
+	int tstates = 0;
+
+	// BC of 0 copies 64 KiB, the same as the Z80
+	do {
+		val = hle_rd(ms, hl);
+		hle_wr(ms, de, val);
+		hl = (uint16_t)(hl + dir);
+		de = (uint16_t)(de + dir);
+		bc--;
+		tstates += bc ? 21 : 16;
+		cnt++;
+	} while (bc);
+
+	/* H, N and P/V are cleared, the undocumented flags 3 and 5 come from
+	 * the last byte copied plus A */
+	n = (uint8_t)(val + (af >> 8));
+	af = (af & (0xFF00 | HLE_FLAGS_KEPT)) | (n & HLE_FLAG_3) |
+	  ((n & 0x02) ? HLE_FLAG_5 : 0);
+
+	z80ex_set_reg(ms->z80, regHL, hl);
+	z80ex_set_reg(ms->z80, regDE, de);
+	z80ex_set_reg(ms->z80, regBC, bc);
+	z80ex_set_reg(ms->z80, regAF, af);
+	hle_add_r(ms, cnt * 2);
+
+	return tstates;
+}
+
+static int hle_ldir(ms_ctx *ms)
+{
+	static const uint8_t code[] = { 0xED, 0xB0, 0xC9 };
+
+	if (!hle_code(ms, code, sizeof(code))) return -1;
+
+	hle_add_r(ms, 1);
+	return hle_block(ms, 1) + 10;
+}
+
+static int hle_lddr(ms_ctx *ms)
+{
+	static const uint8_t code[] = { 0xED, 0xB8, 0xC9 };
+
+	if (!hle_code(ms, code, sizeof(code))) return -1;
+
+	hle_add_r(ms, 1);
+	return hle_block(ms, -1) + 10;
+}
+
+static int hle_fill(ms_ctx *ms)
+{
+	static const uint8_t code[] = {
+		0x77,		// LD (HL),A
+		0x54,		// LD D,H
+		0x5D,		// LD E,L
+		0x13,		// INC DE
+		0x0B,		// DEC BC
+		0xED, 0xB0,	// LDIR
+		0xC9,		// RET
+	};
+	uint16_t hl = z80ex_get_reg(ms->z80, regHL);
+
+	if (!hle_code(ms, code, sizeof(code))) return -1;
+
+	hle_wr(ms, hl, z80ex_get_reg(ms->z80, regAF) >> 8);
+	z80ex_set_reg(ms->z80, regDE, (uint16_t)(hl + 1));
+	z80ex_set_reg(ms->z80, regBC,
+	  (uint16_t)(z80ex_get_reg(ms->z80, regBC) - 1));
+	hle_add_r(ms, 6);
+
+	return 7 + 4 + 4 + 6 + 6 + hle_block(ms, 1) + 10;
+}
+
+/* Generic handlers, hooked by name and address from profiles, see hle.h */
+static const struct hle_hook hle_generic[] = {
+	{ 0, "ldir", hle_ldir, 0 },
+	{ 0, "lddr", hle_lddr, 0 },
+	{ 0, "fill", hle_fill, 0 },
+	{ 0, NULL, NULL, 0 },
+};
+
+/* First hook at or after addr */
+static int hle_find(const struct ms_hle *h, uint32_t addr)
+{
+	int lo = 0, hi = h->cnt, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (h->hooks[mid].addr < addr) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+static void hle_alloc(ms_ctx *ms)
+{
+	ms->hle = (struct ms_hle *)calloc(1, sizeof(struct ms_hle));
+	if (ms->hle == NULL) {
+		printf("Unable to allocate HLE hooks\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Hook what one item, len bytes at item, of a profile's list names */
+static void hle_start_item(ms_ctx *ms, const char *item, size_t len)
+{
+	const struct hle_table *t;
+	const struct hle_hook *g;
+	const char *at;
+	char *end;
+	unsigned long addr;
+	int i;
+
+	at = (const char *)memchr(item, '@', len);
+	if (at != NULL) {
+		for (g = hle_generic; g->name != NULL; g++) {
+			if (strlen(g->name) == (size_t)(at - item) &&
+			    !strncmp(g->name, item, at - item)) break;
+		}
+		addr = strtoul(at + 1, &end, 16);
+		if (g->name == NULL || end == at + 1 || end != item + len) {
+			log_error("Invalid HLE hook '%.*s' for firmware '%s'\n",
+			  (int)len, item, ms->fw->name);
+			return;
+		}
+		hle_register(ms, (uint32_t)addr, g->name, g->fn);
+		return;
+	}
+
+	for (t = hle_tables; t->name != NULL; t++) {
+		if (strlen(t->name) == len && !strncmp(t->name, item, len))
+			break;
+	}
+	if (t->name == NULL) {
+		log_error("No HLE table '%.*s' for firmware '%s'\n", (int)len,
+		  item, ms->fw->name);
+		return;
+	}
+
+	for (i = 0; i < t->cnt; i++) {
+		hle_register(ms, t->hooks[i].addr, t->hooks[i].name,
+		  t->hooks[i].fn);
+	}
+}
+
+void hle_start(ms_ctx *ms)
+{
+	const char *p, *end;
+
+	if (ms->hle != NULL || ms->fw->hle == NULL) return;
+
+	hle_alloc(ms);
+	ms->hle->table = ms->fw->hle;
+	for (p = ms->fw->hle; *p != '\0'; p = end + (*end == ',')) {
+		end = p + strcspn(p, ",");
+		if (end > p) hle_start_item(ms, p, end - p);
+	}
+}
+
+void hle_clone(ms_ctx *ms, const ms_ctx *parent)
+{
+	const struct ms_hle *p = parent->hle;
+	size_t len;
+
+	if (p == NULL) return;
+	hle_alloc(ms);
+
+	memcpy(ms->hle, p, sizeof(struct ms_hle));
+	ms->hle->hooks = NULL;
+	ms->hle->check.clone = NULL;
+	if (!p->cnt) return;
+
+	len = p->cnt * sizeof(struct hle_hook);
+	ms->hle->hooks = (struct hle_hook *)malloc(len);
+	if (ms->hle->hooks == NULL) {
+		printf("Unable to allocate HLE hooks\n");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(ms->hle->hooks, p->hooks, len);
+}
+
+int hle_register(ms_ctx *ms, uint32_t addr, const char *name, hle_fn fn)
+{
+	struct ms_hle *h;
+	struct hle_hook *hook;
+	int i;
+
+	if (addr >= SZ_1M) {
+		log_error("HLE hook '%s' at %05X is past the end of codeflash\n",
+		  name, addr);
+		return MS_ERR;
+	}
+
+	if (ms->hle == NULL) hle_alloc(ms);
+	h = ms->hle;
+
+	i = hle_find(h, addr);
+	if (i == h->cnt || h->hooks[i].addr != addr) {
+		h->hooks = (struct hle_hook *)realloc(h->hooks,
+		  (h->cnt + 1) * sizeof(struct hle_hook));
+		if (h->hooks == NULL) {
+			printf("Unable to allocate HLE hooks\n");
+			exit(EXIT_FAILURE);
+		}
+		memmove(&h->hooks[i + 1], &h->hooks[i],
+		  (h->cnt - i) * sizeof(struct hle_hook));
+		h->cnt++;
+	}
+
+	hook = &h->hooks[i];
+	hook->addr = addr;
+	hook->name = name;
+	hook->fn = fn;
+	hook->calls = 0;
+	h->map[(addr & 0xFFFF) >> 3] |= (1 << (addr & 7));
+
+	return MS_OK;
+}
+
+void hle_stop(ms_ctx *ms)
+{
+	if (ms->hle == NULL) return;
+
+	ms_destroy(ms->hle->check.clone);
+	free(ms->hle->hooks);
+	free(ms->hle);
+	ms->hle = NULL;
+}
+
+uint8_t hle_rd(ms_ctx *ms, uint16_t addr)
+{
+	return z80ex_mread(ms->z80, addr, 0, ms);
+}
+
+void hle_wr(ms_ctx *ms, uint16_t addr, uint8_t val)
+{
+	z80ex_mwrite(ms->z80, addr, val, ms);
+}
+
+/* The routine's RET, and count the T states it took. The return address is
+ * not read as the Z80 would, that would trip breakpoints and the dataflash
+ * command sequence */
+static void hle_ret(ms_ctx *ms, int tstates)
+{
+	uint16_t sp = z80ex_get_reg(ms->z80, regSP);
+
+	z80ex_set_reg(ms->z80, regPC,
+	  mem_peek(ms, sp) | (mem_peek(ms, (uint16_t)(sp + 1)) << 8));
+	z80ex_set_reg(ms->z80, regSP, (uint16_t)(sp + 2));
+
+	ms->tstates += tstates;
+	ms->int_tstates += tstates;
+}
+
+/* Run hook's handler on a clone, to compare with the Z80 routine that is
+ * left to run on ms */
+static void hle_check_start(ms_ctx *ms, const struct hle_hook *hook)
+{
+	struct hle_check *c = &ms->hle->check;
+	ms_ctx *clone;
+	uint16_t sp;
+	int tstates;
+
+	// One at a time, routines hooked inside this one are not checked
+	if (c->clone != NULL) return;
+
+	clone = ms_clone(ms);
+	tstates = hook->fn(clone);
+	if (tstates < 0) {
+		ms_destroy(clone);
+		return;
+	}
+	hle_ret(clone, tstates);
+
+	sp = z80ex_get_reg(ms->z80, regSP);
+	c->clone = clone;
+	c->addr = hook->addr;
+	c->name = hook->name;
+	c->ret_pc = mem_peek(ms, sp) | (mem_peek(ms, (uint16_t)(sp + 1)) << 8);
+	c->ret_sp = (uint16_t)(sp + 2);
+	c->start = ms->tstates;
+	c->int_tstates = ms->int_tstates;
+}
+
+/* Whether any of cnt pages differ, pages neither side wrote are the same */
+static int hle_pages_differ(struct ms_page *const *a,
+  struct ms_page *const *b, int cnt)
+{
+	int i;
+
+	for (i = 0; i < cnt; i++) {
+		if (a[i] != b[i] && memcmp(a[i]->data, b[i]->data, MS_PAGE_LEN))
+			return 1;
+	}
+
+	return 0;
+}
+
+void hle_check(ms_ctx *ms)
+{
+	struct hle_check *c = &ms->hle->check;
+	ms_ctx *clone = c->clone;
+	const char *diff = NULL;
+	int i;
+
+	if (z80ex_get_reg(ms->z80, regPC) != c->ret_pc ||
+	    z80ex_get_reg(ms->z80, regSP) != c->ret_sp) return;
+
+	// An interrupt may have run in the middle, nothing to compare
+	if (c->int_tstates + (ms->tstates - c->start) < MS_INT_PERIOD) {
+		if (ms->tstates != clone->tstates) diff = "T states";
+		for (i = regAF; diff == NULL && i <= regSP; i++) {
+			if (z80ex_get_reg(ms->z80, (Z80_REG_T)i) !=
+			    z80ex_get_reg(clone->z80, (Z80_REG_T)i))
+				diff = "registers";
+		}
+		if (diff == NULL && ((z80ex_get_reg(ms->z80, regR) ^
+		    z80ex_get_reg(clone->z80, regR)) & 0x7F))
+			diff = "R";
+		if (diff == NULL &&
+		    hle_pages_differ(ms->ram, clone->ram, MS_RAM_PAGES))
+			diff = "RAM";
+		if (diff == NULL &&
+		    hle_pages_differ(ms->df, clone->df, MS_DF_PAGES))
+			diff = "dataflash";
+	}
+
+	if (diff != NULL) {
+		ms->hle->mismatches++;
+		log_error("HLE %s at %05X does not match the Z80 routine, %s "
+		  "differ\n", c->name, c->addr, diff);
+	}
+
+	c->clone = NULL;
+	ms_destroy(clone);
+}
+
+int hle_call(ms_ctx *ms, uint32_t addr)
+{
+	struct ms_hle *h = ms->hle;
+	struct hle_hook *hook;
+	int i, tstates;
+
+	// Only the bitmap bit for the low 16 bits matched so far
+	i = hle_find(h, addr);
+	if (i == h->cnt || h->hooks[i].addr != addr) return 0;
+
+	hook = &h->hooks[i];
+	if (ms->verify != NULL) {
+		hle_check_start(ms, hook);
+		return 0;
+	}
+
+	tstates = hook->fn(ms);
+	if (tstates < 0) return 0;
+	hook->calls++;
+	hle_ret(ms, tstates);
+
+	return 1;
+}
@@ -0,0 +1,161 @@
+#ifndef __HLE_H__
+#define __HLE_H__
+
+#include <stdint.h>
+#include "mem.h"
+#include "msemu.h"
+
+/* High level emulation of firmware routines
+ *
+ * Some firmware routines are hot and simple to describe, e.g. copying or
+ * filling memory or drawing to the LCD a byte at a time. A C handler can run
+ * in place of such a routine. When the PC reaches the first instruction of
+ * the routine, the handler does what the routine would have, the T states
+ * the routine would have taken are counted, and the routine's RET is done.
+ *
+ * Routines are keyed by their physical address in the codeflash, i.e.
+ * page * 0x4000 + offset, so a routine in a banked page is only trapped
+ * while that page is mapped in. A bitmap of the low 16 bits of every hooked
+ * address keeps the check for each instruction to a single bit test.
+ *
+ * Where routines are depends on the firmware. The firmware database gives
+ * the hooks for the loaded codeflash, see fwdb.h, as a comma separated list
+ * of which each item is either the name of a table of hooks in hle.c, or
+ * <handler>@<addr> to hook one of the generic handlers below at physical
+ * codeflash address addr, in hex. Hooks can also be added at run time with
+ * hle_register().
+ *
+ * The generic handlers are for routines that are a common idiom rather than
+ * particular to one firmware. Each checks that the routine's code is what
+ * it expects before doing anything, and runs the Z80 routine if not:
+ *
+ *   ldir    LDIR; RET, copy BC bytes from HL up to DE
+ *   lddr    LDDR; RET, copy BC bytes from HL down to DE
+ *   fill    LD (HL),A; LD D,H; LD E,L; INC DE; DEC BC; LDIR; RET, fill BC
+ *           bytes from HL with A
+ *
+ * Trapped routines are not seen by breakpoints, coverage or the edge map,
+ * and an interrupt that falls due during one is taken once it returns.
+ *
+ * While lockstep verification is running, handlers are checked rather than
+ * used, as the other core would not know what a handler did. The handler is
+ * run on a clone of the machine, see ms_clone(), and the Z80 routine on the
+ * machine itself. Once the routine returns, the registers, T states, RAM and
+ * dataflash of both are compared and any difference is reported. A routine
+ * that an interrupt may have broken in to is not compared.
+ */
+
+#define HLE_MAP_LEN		(65536 / 8)
+
+/* Does what the routine at a hooked address does, using hle_rd() and
+ * hle_wr() for memory and z80ex_get_reg()/z80ex_set_reg() for registers.
+ *
+ * Returns the T states the routine would have taken, including its RET, or
+ * -1 to run the Z80 routine after all
+ */
+typedef int (*hle_fn)(ms_ctx *ms);
+
+struct hle_hook {
+	// Physical codeflash address of the first instruction of the routine
+	uint32_t addr;
+	const char *name;
+	hle_fn fn;
+
+	// Number of times the routine was trapped
+	uint64_t calls;
+};
+
+/* Hooks for one firmware, picked by name by its fw_profile */
+struct hle_table {
+	const char *name;
+	const struct hle_hook *hooks;
+	int cnt;
+};
+
+/* A handler run on a clone, to compare with the Z80 routine once it
+ * returns */
+struct hle_check {
+	ms_ctx *clone;
+	uint32_t addr;
+	const char *name;
+
+	// Where and when the routine returns to, and when it was trapped
+	uint16_t ret_pc;
+	uint16_t ret_sp;
+	uint64_t start;
+	int int_tstates;
+};
+
+struct ms_hle {
+	uint8_t map[HLE_MAP_LEN];
+
+	// Sorted by address
+	struct hle_hook *hooks;
+	int cnt;
+
+	// Hooks from the firmware profile, NULL if it has none
+	const char *table;
+
+	// Check in progress while verifying, clone is NULL if none
+	struct hle_check check;
+	uint64_t mismatches;
+};
+
+/**
+ * Start trapping the routines in the firmware's table of hooks, if it has
+ * one.
+ */
+void hle_start(ms_ctx *ms);
+
+/**
+ * Give ms, a clone of parent, the same hooks as parent.
+ */
+void hle_clone(ms_ctx *ms, const ms_ctx *parent);
+
+/**
+ * Hook the routine at physical codeflash address addr, starting HLE if it is
+ * not yet. Replaces any hook already at addr.
+ *
+ * Returns MS_OK, or MS_ERR if addr is past the end of the codeflash
+ */
+int hle_register(ms_ctx *ms, uint32_t addr, const char *name, hle_fn fn);
+
+void hle_stop(ms_ctx *ms);
+
+/**
+ * Read or write memory at a Z80 address, through the slots as mapped at the
+ * time. For use by handlers.
+ */
+uint8_t hle_rd(ms_ctx *ms, uint16_t addr);
+void hle_wr(ms_ctx *ms, uint16_t addr, uint8_t val);
+
+/* Run the handler for the routine that starts at hooked physical address
+ * addr, see hle_trap(). Returns 1 if it ran */
+int hle_call(ms_ctx *ms, uint32_t addr);
+
+/* Compare the handler being checked with the Z80 routine if it has returned
+ * now */
+void hle_check(ms_ctx *ms);
+
+/* Check whether the instruction at pc is a hooked routine and if so run its
+ * handler in its place.
+ *
+ * Returns 1 if a handler ran, the PC is then the routine's return address
+ */
+static inline int hle_trap(ms_ctx *ms, uint16_t pc)
+{
+	struct ms_hle *h = ms->hle;
+	int32_t addr;
+
+	if (h == NULL) return 0;
+	if (h->check.clone != NULL) hle_check(ms);
+
+	addr = cf_pc_addr(ms, pc);
+	if (addr < 0) return 0;
+
+	if (!(h->map[(addr & 0xFFFF) >> 3] & (1 << (addr & 7)))) return 0;
+
+	return hle_call(ms, addr);
+}
+
+#endif // __HLE_H__
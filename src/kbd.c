@@ -0,0 +1,242 @@
+#include <ctype.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "debug.h"
+#include "kbd.h"
+#include "msemu.h"
+
+#define KBD_IDX(x)	((x) & (MS_KBD_QUEUE_LEN - 1))
+
+/* Names of each key in the keyboard matrix. This follows the same layout as
+ * the SDL translation table in ui.c; positions with no key are NULL. */
+static const char *const kbd_names[KBD_ROWS][8] = {
+	{ "MAIN", "BACK", "PRINT", "F1", "F2", "F3", "F4", "F5" },
+	{ NULL, NULL, NULL, "AT", "SIZE", "SPELL", "EMAIL", "PGUP" },
+	{ "BACKQUOTE", "1", "2", "3", "4", "5", "6", "7" },
+	{ "8", "9", "0", "MINUS", "EQUALS", "BACKSPACE", "BACKSLASH", "PGDN" },
+	{ "TAB", "Q", "W", "E", "R", "T", "Y", "U" },
+	{ "I", "O", "P", "LBRACKET", "RBRACKET", "SEMICOLON", "QUOTE", "ENTER" },
+	{ "CAPSLOCK", "A", "S", "D", "F", "G", "H", "J" },
+	{ "K", "L", "COMMA", "PERIOD", "SLASH", "UP", "DOWN", "RIGHT" },
+	{ "LSHIFT", "Z", "X", "C", "V", "B", "N", "M" },
+	{ "FN", NULL, NULL, "SPACE", NULL, NULL, "RSHIFT", "LEFT" },
+};
+
+/* Modifiers that may be needed to type a character */
+#define KBD_MOD_NONE	0
+#define KBD_MOD_SHIFT	1
+#define KBD_MOD_FN	2
+
+/* Punctuation that is typed with a modifier held. Everything else printable
+ * is either a letter, where uppercase is shifted, or its own key. */
+static const struct {
+	char c;
+	uint8_t mod;
+	const char *key;
+} kbd_chars[] = {
+	{ ' ', KBD_MOD_NONE, "SPACE" },
+	{ '\n', KBD_MOD_NONE, "ENTER" },
+	{ '\t', KBD_MOD_NONE, "TAB" },
+	{ '\b', KBD_MOD_NONE, "BACKSPACE" },
+	{ '`', KBD_MOD_NONE, "BACKQUOTE" },
+	{ '-', KBD_MOD_NONE, "MINUS" },
+	{ '=', KBD_MOD_NONE, "EQUALS" },
+	{ '\\', KBD_MOD_NONE, "BACKSLASH" },
+	{ '[', KBD_MOD_NONE, "LBRACKET" },
+	{ ']', KBD_MOD_NONE, "RBRACKET" },
+	{ ';', KBD_MOD_NONE, "SEMICOLON" },
+	{ '\'', KBD_MOD_NONE, "QUOTE" },
+	{ ',', KBD_MOD_NONE, "COMMA" },
+	{ '.', KBD_MOD_NONE, "PERIOD" },
+	{ '/', KBD_MOD_NONE, "SLASH" },
+	{ '~', KBD_MOD_SHIFT, "BACKQUOTE" },
+	{ '!', KBD_MOD_SHIFT, "1" },
+	{ '@', KBD_MOD_SHIFT, "2" },
+	{ '#', KBD_MOD_SHIFT, "3" },
+	{ '$', KBD_MOD_SHIFT, "4" },
+	{ '%', KBD_MOD_SHIFT, "5" },
+	{ '^', KBD_MOD_SHIFT, "6" },
+	{ '&', KBD_MOD_SHIFT, "7" },
+	{ '*', KBD_MOD_SHIFT, "8" },
+	{ '(', KBD_MOD_SHIFT, "9" },
+	{ ')', KBD_MOD_SHIFT, "0" },
+	{ '_', KBD_MOD_SHIFT, "MINUS" },
+	{ '+', KBD_MOD_SHIFT, "EQUALS" },
+	{ '|', KBD_MOD_SHIFT, "BACKSLASH" },
+	{ '{', KBD_MOD_SHIFT, "LBRACKET" },
+	{ '}', KBD_MOD_SHIFT, "RBRACKET" },
+	{ ':', KBD_MOD_SHIFT, "SEMICOLON" },
+	{ '"', KBD_MOD_SHIFT, "QUOTE" },
+	{ '<', KBD_MOD_SHIFT, "COMMA" },
+	{ '>', KBD_MOD_SHIFT, "PERIOD" },
+	{ '?', KBD_MOD_SHIFT, "SLASH" },
+};
+#define NUMCHARS (sizeof(kbd_chars) / sizeof(kbd_chars[0]))
+
+static void kbd_apply(ms_ctx *ms, int row, int bit, int down)
+{
+	if (down) {
+		ms->key_matrix[row] &= ~((uint8_t)1 << bit);
+	} else {
+		ms->key_matrix[row] |= ((uint8_t)1 << bit);
+	}
+}
+
+void kbd_init(ms_ctx *ms)
+{
+	memset(ms->key_matrix, 0xff, sizeof(ms->key_matrix));
+	ms->kbd_head = 0;
+	ms->kbd_tail = 0;
+	ms->kbd_next = 0;
+	ms->kbd_due = UINT64_MAX;
+}
+
+unsigned int kbd_pending(ms_ctx *ms)
+{
+	return ms->kbd_head - ms->kbd_tail;
+}
+
+unsigned int kbd_free(ms_ctx *ms)
+{
+	return MS_KBD_QUEUE_LEN - kbd_pending(ms);
+}
+
+const char *kbd_name(int row, int bit)
+{
+	if (row < 0 || row >= KBD_ROWS || bit < 0 || bit > 7) return NULL;
+
+	return kbd_names[row][bit];
+}
+
+int kbd_lookup(const char *name, int *row, int *bit)
+{
+	const char *n;
+	int i, j, k;
+
+	for (i = 0; i < KBD_ROWS; i++) {
+		for (j = 0; j < 8; j++) {
+			n = kbd_names[i][j];
+			if (n == NULL) continue;
+
+			for (k = 0; n[k] && toupper((unsigned char)name[k]) == n[k]; k++);
+			if (n[k] == '\0' && name[k] == '\0') {
+				*row = i;
+				*bit = j;
+				return MS_OK;
+			}
+		}
+	}
+
+	return MS_ERR;
+}
+
+int kbd_queue_char(ms_ctx *ms, char c)
+{
+	char name[2] = { 0, 0 };
+	const char *key = NULL;
+	int mod = KBD_MOD_NONE;
+	int row, bit, mrow = 0, mbit = 0;
+	unsigned int i;
+
+	if (isalnum((unsigned char)c)) {
+		if (isupper((unsigned char)c)) mod = KBD_MOD_SHIFT;
+		name[0] = c;
+		key = name;
+	} else {
+		for (i = 0; i < NUMCHARS; i++) {
+			if (kbd_chars[i].c == c) {
+				key = kbd_chars[i].key;
+				mod = kbd_chars[i].mod;
+				break;
+			}
+		}
+	}
+
+	if (key == NULL || kbd_lookup(key, &row, &bit)) return 0;
+	if (mod == KBD_MOD_SHIFT) kbd_lookup("LSHIFT", &mrow, &mbit);
+	if (mod == KBD_MOD_FN) kbd_lookup("FN", &mrow, &mbit);
+
+	if (kbd_free(ms) < (mod ? 4u : 2u)) return -1;
+
+	if (mod) kbd_queue(ms, mrow, mbit, 1);
+	kbd_queue(ms, row, bit, 1);
+	kbd_queue(ms, row, bit, 0);
+	if (mod) kbd_queue(ms, mrow, mbit, 0);
+
+	return mod ? 4 : 2;
+}
+
+int kbd_queue(ms_ctx *ms, int row, int bit, int down)
+{
+	ms_kbd_event *ev;
+	uint64_t stamp;
+
+	if (row < 0 || row >= KBD_ROWS || bit < 0 || bit > 7) {
+		log_error(" * KBD   Invalid key %d.%d\n", row, bit);
+		return MS_ERR;
+	}
+
+	if (ms->power_state == MS_POWERSTATE_OFF) {
+		kbd_apply(ms, row, bit, down);
+		return MS_OK;
+	}
+
+	if (kbd_pending(ms) == MS_KBD_QUEUE_LEN) {
+		log_error(" * KBD   Queue full, dropping key %d.%d\n", row, bit);
+		return MS_ERR;
+	}
+
+	/* Never apply sooner than now, and never sooner than one full scan
+	 * after the previous change */
+	stamp = ms->tstates;
+	if (stamp < ms->kbd_next) stamp = ms->kbd_next;
+	ms->kbd_next = stamp + MS_INT_PERIOD;
+
+	ev = &ms->kbd_queue[KBD_IDX(ms->kbd_head)];
+	ev->tstate = stamp;
+	ev->row = row;
+	ev->bit = bit;
+	ev->down = !!down;
+	ms->kbd_head++;
+
+	if (stamp < ms->kbd_due) ms->kbd_due = stamp;
+
+	return MS_OK;
+}
+
+void kbd_process(ms_ctx *ms)
+{
+	ms_kbd_event *ev;
+
+	while (kbd_pending(ms)) {
+		ev = &ms->kbd_queue[KBD_IDX(ms->kbd_tail)];
+		if (ev->tstate > ms->tstates) {
+			ms->kbd_due = ev->tstate;
+			return;
+		}
+
+		log_debug(LOG_KBD, " * KBD   %d.%d %s @ %llu\n", ev->row, ev->bit,
+		  ev->down ? "DOWN" : "UP", (unsigned long long)ms->tstates);
+		kbd_apply(ms, ev->row, ev->bit, ev->down);
+		ms->kbd_tail++;
+	}
+
+	ms->kbd_due = UINT64_MAX;
+}
+
+void kbd_flush(ms_ctx *ms)
+{
+	ms_kbd_event *ev;
+
+	while (kbd_pending(ms)) {
+		ev = &ms->kbd_queue[KBD_IDX(ms->kbd_tail)];
+		kbd_apply(ms, ev->row, ev->bit, ev->down);
+		ms->kbd_tail++;
+	}
+
+	ms->kbd_head = 0;
+	ms->kbd_tail = 0;
+	ms->kbd_next = ms->tstates;
+	ms->kbd_due = UINT64_MAX;
+}
@@ -0,0 +1,96 @@
+#ifndef __KBD_H__
+#define __KBD_H__
+
+#include <stdint.h>
+#include "msemu.h"
+
+/* Number of rows in the Mailstation keyboard matrix, each row is 8 keys */
+#define KBD_ROWS	10
+
+/**
+ * Reset the key matrix to all keys released and drop anything queued.
+ *
+ * *ms		- Pointer to ms_ctx struct
+ */
+void kbd_init(ms_ctx *ms);
+
+/**
+ * Queue a key press or release for the Mailstation keyboard matrix.
+ *
+ * The event is stamped with the emulated T state it should be applied at.
+ * Changes are spaced at least one keyboard scan (MS_INT_PERIOD) apart so
+ * that every press and release is seen by the firmware, no matter how
+ * quickly they were queued. If the Mailstation is powered off, no time is
+ * passing and no scan can be missed, so the change is applied immediately.
+ *
+ * *ms		- Pointer to ms_ctx struct
+ * row		- Matrix row, 0:9
+ * bit		- Bit in row, 0:7
+ * down		- Nonzero if the key is pressed, 0 if released
+ *
+ * Returns MS_OK, or MS_ERR if the queue is full and the event was dropped
+ */
+int kbd_queue(ms_ctx *ms, int row, int bit, int down);
+
+/**
+ * Look up a key in the Mailstation keyboard matrix by name.
+ *
+ * Names follow the layout of the keyboard matrix, e.g. "A", "1", "ENTER",
+ * "LSHIFT", "FN", "MAIN", "F1". See kbd_names[] in kbd.c for the full list.
+ * Matching is case insensitive.
+ *
+ * *name	- Key name
+ * *row		- Returns matrix row of key
+ * *bit		- Returns bit in row of key
+ *
+ * Returns MS_OK if found, MS_ERR otherwise
+ */
+int kbd_lookup(const char *name, int *row, int *bit);
+
+/**
+ * Return the name of the key at a position in the matrix, NULL if there is
+ * no key there.
+ */
+const char *kbd_name(int row, int bit);
+
+/**
+ * Queue the press and release of a key by name, plus any modifier needed.
+ * Typing a character queues the full sequence needed to produce it, e.g.
+ * 'A' is LSHIFT down, A down, A up, LSHIFT up.
+ *
+ * *ms		- Pointer to ms_ctx struct
+ * c		- ASCII character to type
+ *
+ * Returns the number of key events queued, 0 if the character cannot be
+ * typed, or -1 if the queue did not have room for the whole sequence. The
+ * queue is left untouched in the latter two cases.
+ */
+int kbd_queue_char(ms_ctx *ms, char c);
+
+/**
+ * Returns the number of events still waiting to be applied.
+ */
+unsigned int kbd_pending(ms_ctx *ms);
+
+/**
+ * Apply all queued events that are due at the current emulated T state.
+ * Should be called when ms->tstates >= ms->kbd_due.
+ *
+ * *ms		- Pointer to ms_ctx struct
+ */
+void kbd_process(ms_ctx *ms);
+
+/**
+ * Apply every queued event now, in order, and empty the queue. For when the
+ * Z80 stops running, e.g. at power off, and nothing would take them later.
+ *
+ * *ms		- Pointer to ms_ctx struct
+ */
+void kbd_flush(ms_ctx *ms);
+
+/**
+ * Returns the number of events that can still be queued.
+ */
+unsigned int kbd_free(ms_ctx *ms);
+
+#endif // __KBD_H__
@@ -4,14 +4,12 @@
 #include <string.h>
 
 #include "debug.h"
+#include "hash.h"
 #include "io.h"
+#include "lcd.h"
 #include "msemu.h"
 #include "ui.h"
 
-// Default screen size
-#define MS_LCD_WIDTH    320
-#define MS_LCD_HEIGHT   240
-
 //----------------------------------------------------------------------------
 //
 //  Emulates writing to Mailstation LCD device
@@ -24,9 +22,8 @@ int lcd_write(ms_ctx *ms, uint16_t newaddr, uint8_t val, int lcdnum)
 	int idx;
 
 	lcd_ptr = ms->lcd_dat1bit;
-	/* XXX: Magic number that points to where the start of the LCD_R half
-	 * is in the buffer */
-	if (lcdnum == LCD_R) lcd_ptr += 4800;
+	/* Skip to the start of the LCD_R half in the buffer */
+	if (lcdnum == LCD_R) lcd_ptr += MS_LCD_HALF_OFFS;
 
 	/* XXX: This might need to be reworked to use non-viewable LCD memory */
 	// Wraps memory address if out of bounds
@@ -34,7 +31,7 @@ int lcd_write(ms_ctx *ms, uint16_t newaddr, uint8_t val, int lcdnum)
 
 	// Check CAS bit on P2
 	if (io_read(ms, MISC2) & 8) {
-		log_debug(" * LCD%s W [%04X] <- %02X\n",
+		log_debug(LOG_DEV(lcdnum), " * LCD%s W [%04X] <- %02X\n",
 		  lcdnum == LCD_L ? "_L" : "_R", newaddr, val);
 
 		// Write data to currently selected LCD column.
@@ -53,14 +50,15 @@ int lcd_write(ms_ctx *ms, uint16_t newaddr, uint8_t val, int lcdnum)
 		if (lcdnum == LCD_R) x += 20;
 
 		// Write out all 8 bits to separate bytes, using the current emulated LCD color
-		for (n = 0; n < 8; n++) {
+		for (n = 0; ms->lcd_datRGBA8888 != NULL && n < 8; n++) {
 			idx = n + (x * 8) + (newaddr * 320);
 			ms->lcd_datRGBA8888[idx] = ((val >> n) & 1 ? UI_LCD_PIXEL_ON : UI_LCD_PIXEL_OFF);
 		}
+		ms->lcd_dirty = 1;
 
 	} else {
-		log_debug(" * LCD%s W [ CAS] <- %02X\n",
-		  lcdnum == LCD_L ? "_L" : "_R", newaddr, val);
+		log_debug(LOG_DEV(lcdnum), " * LCD%s W [ CAS] <- %02X\n",
+		  lcdnum == LCD_L ? "_L" : "_R", val);
 
 		// If CAS line is low, set current column instead
 		ms->lcd_cas = val;
@@ -79,9 +77,8 @@ uint8_t lcd_read(ms_ctx *ms, uint16_t newaddr, int lcdnum)
 	uint8_t ret;
 
 	lcd_ptr = ms->lcd_dat1bit;
-	/* XXX: Magic number that points to where the start of the LCD_R half
-	 * is in the buffer */
-	if (lcdnum == LCD_R) lcd_ptr += 4800;
+	/* Skip to the start of the LCD_R half in the buffer */
+	if (lcdnum == LCD_R) lcd_ptr += MS_LCD_HALF_OFFS;
 
 	/* XXX: This might need to be reworked to use non-viewable LCD memory */
 	// Wraps memory address if out of bounds
@@ -98,12 +95,82 @@ uint8_t lcd_read(ms_ctx *ms, uint16_t newaddr, int lcdnum)
 		ret = ms->lcd_cas;
 	}
 
-	log_debug(" * LCD%s R [%04X] -> %02X\n",
+	log_debug(LOG_DEV(lcdnum), " * LCD%s R [%04X] -> %02X\n",
 	  lcdnum == LCD_L ? "_L" : "_R", newaddr, ret);
 
 	return ret;
 }
 
+uint64_t lcd_region_hash(ms_ctx *ms, int x, int y, int w, int h)
+{
+	uint8_t buf[(MS_LCD_WIDTH / 8 + 1) * MS_LCD_HEIGHT];
+	uint8_t *ptr = buf;
+	int i, j;
+
+	if (x < 0) { w += x; x = 0; }
+	if (y < 0) { h += y; y = 0; }
+	if (x + w > MS_LCD_WIDTH) w = MS_LCD_WIDTH - x;
+	if (y + h > MS_LCD_HEIGHT) h = MS_LCD_HEIGHT - y;
+	if (w <= 0 || h <= 0) return hash64(NULL, 0, 0);
+
+	memset(buf, 0, sizeof(buf));
+	for (j = 0; j < h; j++) {
+		for (i = 0; i < w; i++) {
+			if (lcd_get_pixel(ms, x + i, y + j))
+				ptr[i / 8] |= (1 << (i % 8));
+		}
+		ptr += (w + 7) / 8;
+	}
+
+	return hash64(buf, ptr - buf, 0);
+}
+
+void lcd_refresh(ms_ctx *ms)
+{
+	int x, y;
+
+	for (y = 0; ms->lcd_datRGBA8888 != NULL && y < MS_LCD_HEIGHT; y++) {
+		for (x = 0; x < MS_LCD_WIDTH; x++) {
+			ms->lcd_datRGBA8888[x + (y * MS_LCD_WIDTH)] =
+			  lcd_get_pixel(ms, x, y) ? UI_LCD_PIXEL_ON :
+			  UI_LCD_PIXEL_OFF;
+		}
+	}
+	ms->lcd_dirty = 1;
+}
+
+int lcd_buf_save_pbm(const uint8_t *buf, const char *path)
+{
+	uint8_t row[MS_LCD_COLS], b;
+	FILE *fd;
+	int x, y, i, err;
+
+	fd = fopen(path, "wb");
+	if (fd == NULL) {
+		log_error("Failed to open '%s'\n", path);
+		return MS_ERR;
+	}
+
+	err = (fprintf(fd, "P4\n%d %d\n", MS_LCD_WIDTH, MS_LCD_HEIGHT) < 0);
+	for (y = 0; y < MS_LCD_HEIGHT; y++) {
+		// PBM has the leftmost pixel in the MSB
+		for (x = 0; x < MS_LCD_COLS; x++) {
+			b = lcd_buf_get_byte(buf, x, y);
+			row[x] = 0;
+			for (i = 0; i < 8; i++) row[x] |= ((b >> i) & 1) << (7 - i);
+		}
+		err |= (fwrite(row, 1, sizeof(row), fd) != sizeof(row));
+	}
+	err |= fclose(fd);
+
+	if (err) {
+		log_error("Failed to write '%s'\n", path);
+		return MS_ERR;
+	}
+
+	return MS_OK;
+}
+
 int lcd_init(ms_ctx *ms)
 {
 	if (ms->lcd_dat1bit == NULL) {
@@ -118,19 +185,22 @@ int lcd_init(ms_ctx *ms)
 			(MS_LCD_WIDTH * MS_LCD_HEIGHT) / 8);
 	}
 
-	if (ms->lcd_datRGBA8888 == NULL) {
+	/* The RGB buffer is only ever drawn by the UI, headless instances go
+	 * without it. This keeps ms_clone() cheap */
+	if (ms->lcd_datRGBA8888 == NULL && !ms->headless) {
 		ms->lcd_datRGBA8888 = (uint32_t *)calloc(
 			MS_LCD_WIDTH * MS_LCD_HEIGHT, sizeof(uint32_t));
 		if (ms->lcd_datRGBA8888 == NULL) {
 			printf("Unable to allocate RGB LCD buffer\n");
 			exit(EXIT_FAILURE);
 		}
-	} else {
+	} else if (ms->lcd_datRGBA8888 != NULL) {
 		memset(ms->lcd_datRGBA8888, '\0',
 			(MS_LCD_WIDTH * MS_LCD_HEIGHT) * sizeof(uint32_t));
 	}
 
 	ms->lcd_cas = 0;
+	ms->lcd_dirty = 1;
 
 	return MS_OK;
 }
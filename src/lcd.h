@@ -4,12 +4,24 @@
 #include <stdint.h>
 #include "msemu.h"
 
+// Default screen size
+#define MS_LCD_WIDTH    320
+#define MS_LCD_HEIGHT   240
+
+/* The 1-bit LCD buffer is laid out the way the LCD controllers see it. Each
+ * half of the screen is a separate controller, LCD_L is the left 160 pixels
+ * and LCD_R the right 160 pixels. Each byte is 8 horizontal pixels, LSB is
+ * the leftmost, and a controller stores 20 such columns of 240 rows.
+ * Columns are numbered from the right hand side of each half. */
+#define MS_LCD_HALF_OFFS	4800
+#define MS_LCD_COLS		(MS_LCD_WIDTH / 8)
+
 
 //----------------------------------------------------------------------------
 //
 //  Emulates writing to Mailstation LCD device
 //
-void lcd_write(ms_ctx *ms, uint16_t newaddr, uint8_t val, int lcdnum);
+int lcd_write(ms_ctx *ms, uint16_t newaddr, uint8_t val, int lcdnum);
 
 //----------------------------------------------------------------------------
 //
@@ -17,6 +29,66 @@ void lcd_write(ms_ctx *ms, uint16_t newaddr, uint8_t val, int lcdnum);
 //
 uint8_t lcd_read(ms_ctx *ms, uint16_t newaddr, int lcdnum);
 
+/**
+ * Return 8 horizontal pixels of the screen from a 1-bit LCD buffer, or a
+ * copy of one.
+ *
+ * *buf		- 1-bit LCD buffer, laid out as ms_ctx.lcd_dat1bit
+ * col		- Screen byte column counted from the left, 0:39
+ * y		- Screen row counted from the top, 0:239
+ *
+ * LSB of the return is the leftmost pixel, a set bit is a dark pixel.
+ */
+static inline uint8_t lcd_buf_get_byte(const uint8_t *buf, int col, int y)
+{
+	int offs = (col >= (MS_LCD_COLS / 2)) ? MS_LCD_HALF_OFFS : 0;
+
+	return buf[offs + y +
+	  (((MS_LCD_COLS / 2) - 1 - (col % (MS_LCD_COLS / 2))) * 240)];
+}
+
+/**
+ * Return 8 horizontal pixels of the screen from the 1-bit LCD buffer.
+ * See lcd_buf_get_byte()
+ */
+static inline uint8_t lcd_get_byte(ms_ctx *ms, int col, int y)
+{
+	return lcd_buf_get_byte(ms->lcd_dat1bit, col, y);
+}
+
+/**
+ * Return the state of a single pixel, 1 if dark, 0 if light.
+ */
+static inline int lcd_get_pixel(ms_ctx *ms, int x, int y)
+{
+	return (lcd_get_byte(ms, x / 8, y) >> (x % 8)) & 1;
+}
+
+/**
+ * Hash a rectangular region of the screen.
+ * Pixels are packed row by row so the same image at any position on screen
+ * hashes to the same value. The region is clipped to the screen.
+ *
+ * *ms		- Pointer to ms_ctx struct
+ * x, y		- Top left corner of region
+ * w, h		- Size of region in pixels
+ */
+uint64_t lcd_region_hash(ms_ctx *ms, int x, int y, int w, int h);
+
+/**
+ * Redraw the RGBA LCD buffer from the 1-bit buffer, e.g. after the 1-bit
+ * buffer was restored from a snapshot.
+ */
+void lcd_refresh(ms_ctx *ms);
+
+/**
+ * Write a 1-bit LCD buffer, laid out as ms_ctx.lcd_dat1bit, to path as a
+ * binary PBM image.
+ *
+ * Returns MS_OK on success, MS_ERR if the file could not be written
+ */
+int lcd_buf_save_pbm(const uint8_t *buf, const char *path);
+
 int lcd_init(ms_ctx *ms);
 
 int lcd_deinit(ms_ctx *ms);
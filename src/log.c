@@ -0,0 +1,603 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL2/SDL.h>
+
+#include "log.h"
+
+/* Number of records in the ring, must be a power of 2 */
+#define LOG_RING_LEN	2048
+#define LOG_MAX_ARGS	8
+#define LOG_TEXT_LEN	128
+
+/* Length modifiers of a conversion */
+enum log_len {
+	LEN_NONE = 0,
+	LEN_HH,
+	LEN_H,
+	LEN_L,
+	LEN_LL,
+	LEN_Z,
+	LEN_J,
+	LEN_T,
+	LEN_LD,
+};
+
+/* A queued message. seq is the ring position the record is free for, plus one
+ * once a message has been written to it, see log_write() and log_thread().
+ * Integers and pointers are stored widened to 64 bits, and strings as an
+ * offset in to text. If fmt is NULL, text is the formatted message. */
+struct log_rec {
+	SDL_atomic_t seq;
+	const char *fmt;
+	uint64_t args[LOG_MAX_ARGS];
+	char text[LOG_TEXT_LEN];
+};
+
+int dbg_level;
+uint32_t dbg_sections;
+uint32_t dbg_io_ports[8];
+
+/* Ports selected for the IO section, copied to dbg_io_ports while it is on */
+static uint32_t io_sel[8] = {
+	0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF,
+	0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF,
+};
+
+static const struct {
+	const char *name;
+	uint32_t bits;
+} log_section_names[] = {
+	{ "cf", LOG_CF },
+	{ "ram", LOG_RAM },
+	{ "lcd", LOG_LCD },
+	{ "df", LOG_DF },
+	{ "modem", LOG_MODEM },
+	{ "io", LOG_IO },
+	{ "int", LOG_INT },
+	{ "power", LOG_POWER },
+	{ "kbd", LOG_KBD },
+	{ "all", LOG_ALL },
+};
+#define NUM_SECTIONS (sizeof(log_section_names) / sizeof(log_section_names[0]))
+
+static struct log_rec *ring;
+static SDL_atomic_t head;
+static SDL_atomic_t done;
+static SDL_atomic_t sleeping;
+static SDL_atomic_t quit;
+static SDL_sem *avail;
+static SDL_Thread *thread;
+static int running;
+
+// Instances using the writer, and a lock for starting and stopping it
+static int users;
+static SDL_SpinLock users_lock;
+
+static enum log_len log_parse_len(const char **p)
+{
+	const char *s = *p;
+	enum log_len len = LEN_NONE;
+
+	switch (*s) {
+	  case 'h':
+		len = (s[1] == 'h') ? LEN_HH : LEN_H;
+		break;
+	  case 'l':
+		len = (s[1] == 'l') ? LEN_LL : LEN_L;
+		break;
+	  case 'z':
+		len = LEN_Z;
+		break;
+	  case 'j':
+		len = LEN_J;
+		break;
+	  case 't':
+		len = LEN_T;
+		break;
+	  case 'L':
+		len = LEN_LD;
+		break;
+	  default:
+		return LEN_NONE;
+	}
+
+	*p = s + ((len == LEN_HH || len == LEN_LL) ? 2 : 1);
+	return len;
+}
+
+/* Copy the arguments of a message in to a record. Returns 0 if they fit and
+ * every conversion is understood, non-zero if the message has to be
+ * formatted right away instead. */
+static int log_pack(struct log_rec *r, const char *fmt, va_list ap)
+{
+	const char *p = fmt, *s;
+	size_t used = 0, slen;
+	enum log_len len;
+	int n = 0;
+	int64_t v;
+
+	while ((p = strchr(p, '%')) != NULL) {
+		p++;
+		if (*p == '%') {
+			p++;
+			continue;
+		}
+
+		p += strspn(p, "-+ #0");
+		if (*p == '*') {
+			if (n >= LOG_MAX_ARGS) return 1;
+			r->args[n++] = (uint64_t)(int64_t)va_arg(ap, int);
+			p++;
+		} else {
+			p += strspn(p, "0123456789");
+		}
+		if (*p == '.') {
+			p++;
+			if (*p == '*') {
+				if (n >= LOG_MAX_ARGS) return 1;
+				r->args[n++] = (uint64_t)(int64_t)va_arg(ap, int);
+				p++;
+			} else {
+				p += strspn(p, "0123456789");
+			}
+		}
+
+		if (n >= LOG_MAX_ARGS) return 1;
+		len = log_parse_len(&p);
+
+		switch (*p++) {
+		  /* Signed and unsigned conversions of the same size are read
+		   * the same way, the sign is sorted out when printing */
+		  case 'd':
+		  case 'i':
+		  case 'u':
+		  case 'o':
+		  case 'x':
+		  case 'X':
+		  case 'c':
+			switch (len) {
+			  case LEN_L:
+				v = va_arg(ap, long);
+				break;
+			  case LEN_LL:
+				v = va_arg(ap, long long);
+				break;
+			  case LEN_Z:
+				v = (int64_t)va_arg(ap, size_t);
+				break;
+			  case LEN_J:
+				v = (int64_t)va_arg(ap, intmax_t);
+				break;
+			  case LEN_T:
+				v = (int64_t)va_arg(ap, ptrdiff_t);
+				break;
+			  default:
+				v = va_arg(ap, int);
+				break;
+			}
+			r->args[n++] = (uint64_t)v;
+			break;
+
+		  case 's':
+			s = va_arg(ap, const char *);
+			if (s == NULL) s = "(null)";
+			slen = strlen(s) + 1;
+			if (used + slen > LOG_TEXT_LEN) return 1;
+			memcpy(r->text + used, s, slen);
+			r->args[n++] = used;
+			used += slen;
+			break;
+
+		  case 'p':
+			r->args[n++] = (uint64_t)(uintptr_t)va_arg(ap, void *);
+			break;
+
+		  /* Floats are never logged at volume, and %n and anything
+		   * else unexpected is best left to vsnprintf() */
+		  default:
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Width or precision, copied or filled in from a '*' argument */
+static int log_unpack_num(const struct log_rec *r, const char **p, int *n,
+  char *spec, int k, int size)
+{
+	const char *s = *p;
+
+	if (*s == '*') {
+		k += snprintf(spec + k, size - k, "%d", (int)r->args[(*n)++]);
+		s++;
+	} else {
+		while (*s >= '0' && *s <= '9' && k < size - 1) spec[k++] = *s++;
+	}
+
+	*p = s;
+	return (k < size) ? k : size - 1;
+}
+
+static void log_unpack(FILE *f, const struct log_rec *r)
+{
+	/* Room for flags, width, precision, "ll" and the conversion */
+	char spec[48];
+	const char *p = r->fmt, *s;
+	enum log_len len;
+	uint64_t v;
+	int n = 0, k;
+
+	if (r->fmt == NULL) {
+		fputs(r->text, f);
+		return;
+	}
+
+	while ((s = strchr(p, '%')) != NULL) {
+		fwrite(p, 1, s - p, f);
+		p = s + 1;
+		if (*p == '%') {
+			fputc('%', f);
+			p++;
+			continue;
+		}
+
+		k = 0;
+		spec[k++] = '%';
+		while (*p && strchr("-+ #0", *p) && k < 16) spec[k++] = *p++;
+		k = log_unpack_num(r, &p, &n, spec, k, 24);
+		if (*p == '.') {
+			spec[k++] = *p++;
+			k = log_unpack_num(r, &p, &n, spec, k, 40);
+		}
+		len = log_parse_len(&p);
+		v = r->args[n++];
+
+		switch (*p) {
+		  case 'd':
+		  case 'i':
+			if (len == LEN_HH) v = (uint64_t)(signed char)v;
+			else if (len == LEN_H) v = (uint64_t)(short)v;
+			else if (len == LEN_NONE) v = (uint64_t)(int)v;
+			spec[k++] = 'l';
+			spec[k++] = 'l';
+			spec[k++] = *p;
+			spec[k] = '\0';
+			fprintf(f, spec, (long long)v);
+			break;
+		  case 'u':
+		  case 'o':
+		  case 'x':
+		  case 'X':
+			if (len == LEN_HH) v &= 0xFF;
+			else if (len == LEN_H) v &= 0xFFFF;
+			else if (len == LEN_NONE) v &= 0xFFFFFFFF;
+			else if (len == LEN_L && sizeof(long) < 8) v &= 0xFFFFFFFF;
+			spec[k++] = 'l';
+			spec[k++] = 'l';
+			spec[k++] = *p;
+			spec[k] = '\0';
+			fprintf(f, spec, (unsigned long long)v);
+			break;
+		  case 'c':
+			spec[k++] = 'c';
+			spec[k] = '\0';
+			fprintf(f, spec, (int)v);
+			break;
+		  case 's':
+			spec[k++] = 's';
+			spec[k] = '\0';
+			fprintf(f, spec, r->text + v);
+			break;
+		  case 'p':
+			spec[k++] = 'p';
+			spec[k] = '\0';
+			fprintf(f, spec, (void *)(uintptr_t)v);
+			break;
+		}
+		p++;
+	}
+
+	fputs(p, f);
+}
+
+static int log_thread(void *data)
+{
+	unsigned int tail = 0;
+	struct log_rec *r;
+	int stop = 0;
+
+	while (1) {
+		r = &ring[tail & (LOG_RING_LEN - 1)];
+		if ((unsigned int)SDL_AtomicGet(&r->seq) == tail + 1) {
+			log_unpack(stdout, r);
+			SDL_AtomicSet(&r->seq, tail + LOG_RING_LEN);
+			tail++;
+			continue;
+		}
+
+		/* Caught up */
+		fflush(stdout);
+		SDL_AtomicSet(&done, tail);
+		if (stop) break;
+
+		/* A record published just before quit was set may not have
+		 * been seen above, so drain once more before leaving */
+		if (SDL_AtomicGet(&quit)) {
+			stop = 1;
+			continue;
+		}
+
+		/* Check again after saying we're going to sleep, so a message
+		 * queued in between isn't left waiting. The timeout covers
+		 * a wake up that raced with this anyway. */
+		SDL_AtomicSet(&sleeping, 1);
+		if ((unsigned int)SDL_AtomicGet(&r->seq) != tail + 1)
+			SDL_SemWaitTimeout(avail, 10);
+		SDL_AtomicSet(&sleeping, 0);
+	}
+
+	return 0;
+}
+
+/* Parse "<port>" or "<first>-<last>" after "io:". Returns 0 on success */
+static int log_parse_ports(const char *s, int *first, int *last)
+{
+	char *end;
+
+	*first = *last = (int)strtol(s, &end, 0);
+	if (*end == '-') *last = (int)strtol(end + 1, &end, 0);
+
+	return (*end != '\0' || *first < 0 || *last > 0xFF || *first > *last);
+}
+
+int log_sections_set(const char *spec, int on)
+{
+	uint32_t sections = dbg_sections;
+	uint32_t sel[8];
+	char buf[128], *tok, *ports;
+	int i, port, first, last, io_all = 0;
+
+	memcpy(sel, io_sel, sizeof(sel));
+	snprintf(buf, sizeof(buf), "%s", spec);
+	tok = strtok(buf, ", \t\r\n");
+	if (tok == NULL) {
+		sections = on ? LOG_ALL : 0;
+		io_all = on;
+	}
+
+	for (; tok != NULL; tok = strtok(NULL, ", \t\r\n")) {
+		ports = strchr(tok, ':');
+		if (ports != NULL) *ports++ = '\0';
+
+		for (i = 0; i < (int)NUM_SECTIONS; i++) {
+			if (!strcmp(tok, log_section_names[i].name)) break;
+		}
+		if (i == NUM_SECTIONS) {
+			printf("Unknown debug section '%s'\n", tok);
+			return 1;
+		}
+
+		if (log_section_names[i].bits != LOG_IO) {
+			if (ports != NULL) {
+				printf("Only io takes a port range\n");
+				return 1;
+			}
+			if (on) sections |= log_section_names[i].bits;
+			else sections &= ~log_section_names[i].bits;
+			if (log_section_names[i].bits & LOG_IO) io_all = on;
+			continue;
+		}
+
+		if (ports == NULL) {
+			io_all = on;
+			if (on) sections |= LOG_IO;
+			else sections &= ~LOG_IO;
+			continue;
+		}
+
+		if (log_parse_ports(ports, &first, &last)) {
+			printf("Invalid port range '%s'\n", ports);
+			return 1;
+		}
+
+		/* Turning on a range while IO is off starts a new selection,
+		 * otherwise ranges add to or remove from the current one */
+		if (on && !(sections & LOG_IO)) memset(sel, 0, sizeof(sel));
+		for (port = first; port <= last; port++) {
+			if (on) sel[port >> 5] |= (1u << (port & 31));
+			else sel[port >> 5] &= ~(1u << (port & 31));
+		}
+		if (on) sections |= LOG_IO;
+	}
+
+	if (io_all) memset(sel, 0xFF, sizeof(sel));
+
+	memcpy(io_sel, sel, sizeof(sel));
+	for (i = 0; i < 8; i++) {
+		dbg_io_ports[i] = (sections & LOG_IO) ? io_sel[i] : 0;
+	}
+	dbg_sections = sections;
+
+	return 0;
+}
+
+void log_sections_show(void)
+{
+	int i, port, first;
+
+	printf("Debug sections on:");
+	for (i = 0; i < (int)NUM_SECTIONS; i++) {
+		if (log_section_names[i].bits == LOG_ALL) continue;
+		if (!(dbg_sections & log_section_names[i].bits)) continue;
+		if (log_section_names[i].bits != LOG_IO) {
+			printf(" %s", log_section_names[i].name);
+			continue;
+		}
+
+		/* List selected ports as ranges, unless it's all of them */
+		for (port = 0; port < 256; port += 32) {
+			if (io_sel[port >> 5] != 0xFFFFFFFF) break;
+		}
+		if (port >= 256) {
+			printf(" io");
+			continue;
+		}
+		for (port = 0; port < 256; port++) {
+			if (!(io_sel[port >> 5] & (1u << (port & 31)))) continue;
+			first = port;
+			while (port < 255 &&
+			       (io_sel[(port + 1) >> 5] & (1u << ((port + 1) & 31))))
+				port++;
+			if (first == port) printf(" io:0x%02X", first);
+			else printf(" io:0x%02X-0x%02X", first, port);
+		}
+	}
+	printf("\nAvailable:");
+	for (i = 0; i < (int)NUM_SECTIONS; i++) {
+		printf(" %s", log_section_names[i].name);
+	}
+	printf("\n");
+}
+
+static void log_wake(void)
+{
+	if (SDL_AtomicGet(&sleeping) && SDL_AtomicCAS(&sleeping, 1, 0))
+		SDL_SemPost(avail);
+}
+
+void log_write(const char *str, ...)
+{
+	struct log_rec *r;
+	unsigned int pos;
+	va_list argp, copy;
+	int diff;
+
+	va_start(argp, str);
+
+	if (!running) {
+		vprintf(str, argp);
+		va_end(argp);
+		return;
+	}
+
+	/* Claim the next free record. If the ring is full, the writer is
+	 * behind, wait for it rather than lose messages */
+	while (1) {
+		pos = (unsigned int)SDL_AtomicGet(&head);
+		r = &ring[pos & (LOG_RING_LEN - 1)];
+		diff = (int)((unsigned int)SDL_AtomicGet(&r->seq) - pos);
+		if (diff == 0) {
+			if (SDL_AtomicCAS(&head, (int)pos, (int)(pos + 1)))
+				break;
+		} else if (diff < 0) {
+			log_wake();
+			SDL_Delay(0);
+		}
+	}
+
+	va_copy(copy, argp);
+	r->fmt = str;
+	if (log_pack(r, str, argp)) {
+		r->fmt = NULL;
+		vsnprintf(r->text, LOG_TEXT_LEN, str, copy);
+	}
+	va_end(copy);
+	va_end(argp);
+
+	SDL_AtomicSet(&r->seq, (int)(pos + 1));
+	log_wake();
+}
+
+void log_flush(void)
+{
+	unsigned int target;
+
+	if (!running) {
+		fflush(stdout);
+		return;
+	}
+
+	target = (unsigned int)SDL_AtomicGet(&head);
+	while ((int)((unsigned int)SDL_AtomicGet(&done) - target) < 0) {
+		log_wake();
+		SDL_Delay(1);
+	}
+}
+
+void log_error(char *str, ...)
+{
+	va_list argp;
+
+	log_flush();
+
+	va_start(argp, str);
+	vprintf(str, argp);
+	va_end(argp);
+}
+
+static void log_start_writer(void)
+{
+	int i;
+
+	if (running) return;
+
+	ring = (struct log_rec *)calloc(LOG_RING_LEN, sizeof(struct log_rec));
+	if (ring == NULL) {
+		printf("Unable to allocate log ring\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < LOG_RING_LEN; i++) SDL_AtomicSet(&ring[i].seq, i);
+	SDL_AtomicSet(&head, 0);
+	SDL_AtomicSet(&done, 0);
+	SDL_AtomicSet(&sleeping, 0);
+	SDL_AtomicSet(&quit, 0);
+
+	/* Without a writer, everything is simply written right away */
+	avail = SDL_CreateSemaphore(0);
+	if (avail != NULL)
+		thread = SDL_CreateThread(log_thread, "log", NULL);
+	if (thread == NULL) {
+		if (avail != NULL) SDL_DestroySemaphore(avail);
+		avail = NULL;
+		free(ring);
+		ring = NULL;
+		return;
+	}
+
+	running = 1;
+}
+
+static void log_stop_writer(void)
+{
+	if (!running) return;
+
+	SDL_AtomicSet(&quit, 1);
+	SDL_SemPost(avail);
+	SDL_WaitThread(thread, NULL);
+	running = 0;
+
+	SDL_DestroySemaphore(avail);
+	free(ring);
+	avail = NULL;
+	thread = NULL;
+	ring = NULL;
+}
+
+void log_start(void)
+{
+	SDL_AtomicLock(&users_lock);
+	if (users++ == 0) log_start_writer();
+	SDL_AtomicUnlock(&users_lock);
+}
+
+void log_stop(void)
+{
+	SDL_AtomicLock(&users_lock);
+	if (users > 0 && --users == 0) log_stop_writer();
+	SDL_AtomicUnlock(&users_lock);
+}
@@ -0,0 +1,157 @@
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include <stdint.h>
+#include "config.h"
+
+/* Logging
+ *
+ * Debug and trace output can amount to a line for every memory access, far
+ * more than a terminal keeps up with. Rather than being formatted and written
+ * on the spot, those lines are packed in to a ring as the format string
+ * pointer plus the raw arguments and a background thread formats and writes
+ * them. The emulation thread only pays for copying a few words.
+ *
+ * Format strings must outlive the call, i.e. be string literals, which all of
+ * them are. %s arguments are copied, anything else is stored by value. A
+ * line whose arguments do not fit in a record is formatted right away and
+ * truncated to LOG_TEXT_LEN.
+ *
+ * Errors are always written right away, after anything already queued, so
+ * they are never lost or out of order. The queue is also drained before the
+ * debugger prompt is shown.
+ *
+ * Debug messages belong to a section, e.g. RAM accesses or the dataflash
+ * command state machine, and each section is turned on separately, with
+ * --debug on the command line or dbgon/dbgoff in the debugger. IO accesses
+ * can further be limited to ranges of ports, e.g. "io:0x05-0x08". Either way
+ * the check is a single test of a flag word.
+ *
+ * Debug and trace messages can be compiled out entirely by configuring with
+ * -DLOG_LEVEL=DEBUG (no trace) or -DLOG_LEVEL=ERROR (neither). Their
+ * arguments are then never evaluated. Stepping in the debugger still shows
+ * each instruction, as that goes through log_trace() only while stopped.
+ */
+
+#define LOG_LEVEL_TRACE	0
+#define LOG_LEVEL_DEBUG	1
+#define LOG_LEVEL_ERROR	2
+
+#if !defined(LOG_MIN_LEVEL)
+#define LOG_MIN_LEVEL	LOG_LEVEL_TRACE
+#endif
+
+// Bits of dbg_level, output that is enabled at run time
+enum levels {
+	LOG_TRACE = 0x01,
+};
+
+/* Debug sections, bits of dbg_sections. Memory accesses are split up by
+ * device, the first bits are in the same order as enum ms_dev_map */
+enum log_sections {
+	LOG_CF    = 0x0001,
+	LOG_RAM   = 0x0002,
+	LOG_LCD_L = 0x0004,
+	LOG_DF    = 0x0008,	// Including the command state machine
+	LOG_LCD_R = 0x0010,
+	LOG_MODEM = 0x0020,
+	LOG_IO    = 0x0040,	// Only set bit, see dbg_io_ports
+	LOG_INT   = 0x0080,
+	LOG_POWER = 0x0100,
+	LOG_KBD   = 0x0200,
+
+	LOG_LCD   = (LOG_LCD_L | LOG_LCD_R),
+	LOG_ALL   = 0x03FF,
+};
+
+// Section for accesses to a device, enum ms_dev_map
+#define LOG_DEV(dev)	(1 << (dev))
+
+extern int dbg_level;
+extern uint32_t dbg_sections;
+
+/* One bit per IO port, all clear unless the IO section is on */
+extern uint32_t dbg_io_ports[8];
+
+/**
+ * Start the background writer. Until then, and after log_stop(), everything
+ * is written right away. The writer is shared by every instance in the
+ * process, each calls this once from ms_init().
+ */
+void log_start(void);
+
+/**
+ * Write out everything queued and stop the background writer, once the last
+ * instance that started it is done with it.
+ */
+void log_stop(void);
+
+/**
+ * Wait for everything queued so far to be written.
+ */
+void log_flush(void);
+
+/**
+ * Turn debug sections on or off.
+ *
+ * *spec	- Comma or space separated section names, see "dbgon" in the
+ *		  debugger for the list. "io" may be followed by ":<port>" or
+ *		  ":<first>-<last>" to only cover some ports. Empty for all
+ * on		- 1 to turn on, 0 to turn off
+ *
+ * Returns 0 on success, non-zero if spec had an unknown section, in which
+ * case nothing is changed
+ */
+int log_sections_set(const char *spec, int on);
+
+/**
+ * Print the sections that are on, and the list of all of them.
+ */
+void log_sections_show(void);
+
+/**
+ * Queue a message. Use log_debug() or log_trace() rather than calling this
+ * directly.
+ */
+void log_write(const char *str, ...);
+
+/* Print error string.
+ * Always goes to terminal
+ */
+void log_error(char *str, ...);
+
+/* Print debug information
+ * Will print information to terminal only when the section, a LOG_* bit, is
+ * enabled. log_io() is the same for accesses to an IO port.
+ * See 'h' command of interactive debug interface for debug output control.
+ */
+#if LOG_MIN_LEVEL <= LOG_LEVEL_DEBUG
+#define log_debug(sec, ...) \
+	do { if (dbg_sections & (sec)) log_write(__VA_ARGS__); } while (0)
+#define log_io(port, ...) \
+	do { \
+		if (dbg_io_ports[((port) & 0xFF) >> 5] & (1u << ((port) & 31))) \
+			log_write(__VA_ARGS__); \
+	} while (0)
+#else
+#define log_debug(sec, ...)	do { } while (0)
+#define log_io(port, ...)	do { } while (0)
+#endif
+
+/* Print trace information
+ * Will print information to terminal only when trace is enabled or if
+ * debug_isbreak() is true for the instance ms.
+ * See 'h' command of interactive debug interface for trace output control.
+ */
+#if LOG_MIN_LEVEL <= LOG_LEVEL_TRACE
+#define log_trace(ms, ...) \
+	do { \
+		if ((dbg_level & LOG_TRACE) || debug_isbreak(ms)) \
+			log_write(__VA_ARGS__); \
+	} while (0)
+#else
+#define log_trace(ms, ...) \
+	do { if (debug_isbreak(ms)) log_write(__VA_ARGS__); } while (0)
+#endif
+
+#endif // __LOG_H__
@@ -2,9 +2,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include "debug.h"
+#include "fwdb.h"
 #include "mem.h"
 #include "msemu.h"
 #include "sizes.h"
+#include "stats.h"
 #include "ui.h"
 
 #include <SDL2/SDL.h>
@@ -21,7 +23,15 @@ void usage(const char *path_arg, const char *cf_path, const char *df_path)
 	  "\nMailstation Emulator\n\n"
 
 	  "Usage: \n"
-	  "  %s [-c <path] [-d <path> [-n]] [-l <path>] [POWER_OPTS]\n"
+	  "  %s [-c <path] [-d <path> [-n]] [-l <path>] [-s <path>] [--headless]\n"
+	  "     [--font <path>] [--lcd-log <path>] [--lcd-compare <path>]\n"
+	  "     [--epoch <secs>] [--capture <path>] [--shm <name>] [--gpu-scale]\n"
+	  "     [--pixel-grid] [--perf] [--stats <path>] [--metrics <dest>]\n"
+	  "     [--metrics-interval <secs>] [--metrics-prom] [--debug <sections>]\n"
+	  "     [--coverage <path>] [--coverage-merge <path>]\n"
+	  "     [--coverage-report <path>] [--symbols <path>] [--verify <core>]\n"
+	  "     [--verify-interval <n>] [--fwdb <path>] [--hle]\n"
+	  "     [--no-idle-skip] [POWER_OPTS]\n"
 	  "  %s -h | --help\n\n"
 
 	  "  -c <path>, --codeflash <path>  Path to codeflash ROM (def: %s)\n"
@@ -32,6 +42,53 @@ void usage(const char *path_arg, const char *cf_path, const char *df_path)
 	  "                                 normally initialized (e.g. poweron). RAM images are\n"
 	  "                                 never written back to disk. If not specified, RAM is\n"
 	  "                                 initialized with random data (normal for SRAM).\n"
+	  "  -s <path>, --script <path>     Run input script, see src/script.h for format\n"
+	  "  --headless                     Run without a window and as fast as possible.\n"
+	  "                                 Exits once the input script finishes\n"
+	  "  --font <path>                  Glyph table for reading text off of the LCD,\n"
+	  "                                 see src/text.h for format\n"
+	  "  --lcd-log <path>               Log hash of every changed LCD frame to file\n"
+	  "  --lcd-compare <path>           Compare LCD frame hashes against a log from a\n"
+	  "                                 previous run, stop at the first difference\n"
+	  "  --epoch <secs>                 Start RTC at <secs> since 1970 UTC, advancing\n"
+	  "                                 with emulated time, and use it to seed RAM\n"
+	  "                                 contents. Makes runs repeatable\n"
+	  "  --capture <path>               Record LCD to animated GIF file\n"
+	  "  --shm <name>                   Export LCD, RAM and IO state every frame to\n"
+	  "                                 POSIX shared memory <name>, see src/shm.h\n"
+	  "  --gpu-scale                    Let SDL stretch the LCD to fill the window,\n"
+	  "                                 rather than scaling by whole pixels on the CPU\n"
+	  "  --pixel-grid                   Separate LCD pixels with grid lines when the\n"
+	  "                                 window is large enough\n"
+	  "  --perf                         Show performance stats, on screen or once a\n"
+	  "                                 second in the terminal if headless. Right\n"
+	  "                                 ctrl + f toggles the overlay while running\n"
+	  "  --stats <path>                 Write device and port access counters as JSON\n"
+	  "                                 to <path> on exit and on SIGUSR1, '-' for stdout\n"
+	  "  --metrics <dest>               Write health metrics every few seconds to file\n"
+	  "                                 <dest>, or to UNIX socket <path> if <dest> is\n"
+	  "                                 unix:<path>. See src/metrics.h\n"
+	  "  --metrics-interval <secs>      Seconds between metrics snapshots (def: 10)\n"
+	  "  --metrics-prom                 Write metrics as Prometheus text, not JSON lines\n"
+	  "  --debug <sections>             Start with debug output on for a comma separated\n"
+	  "                                 list of sections: cf, ram, lcd, df, modem, io,\n"
+	  "                                 int, power, kbd or all. io may be limited to\n"
+	  "                                 ports with io:<port> or io:<first>-<last>\n"
+	  "  --coverage <path>              Track opcode fetches from CF, DF and RAM, added\n"
+	  "                                 to coverage file <path> on exit\n"
+	  "  --coverage-merge <path>        Merge in coverage from another file at start\n"
+	  "  --coverage-report <path>       Write coverage report on exit, '-' for stdout\n"
+	  "  --symbols <path>               Symbol map, see src/symbols.h for format\n"
+	  "  --verify <core>                Check CPU core <core> against z80ex in lockstep,\n"
+	  "                                 see src/verify.h. Cores: z80ex\n"
+	  "  --verify-interval <n>          Compare registers every <n> instructions (def: 1)\n"
+	  "  --fwdb <path>                  Add firmware from database <path> to the known\n"
+	  "                                 ones, see src/fwdb.h for format\n"
+	  "  --hle                          Run firmware routines known to the firmware\n"
+	  "                                 database in C, rather than on the Z80\n"
+	  "  --no-idle-skip                 Run the CPU while halted or in the firmware's\n"
+	  "                                 idle loop, rather than skipping to the next\n"
+	  "                                 interrupt\n"
 	  "  -h, --help                     This usage information\n\n"
 
 	  "POWER_OPTS:\n"
@@ -69,12 +126,37 @@ void usage(const char *path_arg, const char *cf_path, const char *df_path)
 #define BATT		3
 #define LOW_BATT	4
 #define NO_BATT		5
+#define HEADLESS	6
+#define FONT		7
+#define LCD_LOG		8
+#define LCD_COMPARE	9
+#define EPOCH		10
+#define CAPTURE		11
+#define SHM		12
+#define GPU_SCALE	13
+#define PIXEL_GRID	14
+#define PERF		15
+#define STATS		16
+#define METRICS		17
+#define METRICS_INTERVAL	18
+#define METRICS_PROM	19
+#define DEBUG_SECTIONS	20
+#define COVERAGE	21
+#define COVERAGE_MERGE	22
+#define COVERAGE_REPORT	23
+#define SYMBOLS		24
+#define VERIFY		25
+#define VERIFY_INTERVAL	26
+#define FWDB		27
+#define HLE		28
+#define NO_IDLE_SKIP	29
 int main(int argc, char** argv)
 {
 	int c;
 	int ret = 0;
 
 	ms_ctx ms;
+	int ui_flags = 0;
 
 	static struct option long_opts[] = {
 	  { "help", no_argument, NULL, 'h' },
@@ -86,6 +168,31 @@ int main(int argc, char** argv)
 	  { "batt", no_argument, NULL, BATT },
 	  { "low-batt", no_argument, NULL, LOW_BATT },
 	  { "no-batt", no_argument, NULL, NO_BATT },
+	  { "script", required_argument, NULL, 's' },
+	  { "headless", no_argument, NULL, HEADLESS },
+	  { "font", required_argument, NULL, FONT },
+	  { "lcd-log", required_argument, NULL, LCD_LOG },
+	  { "lcd-compare", required_argument, NULL, LCD_COMPARE },
+	  { "epoch", required_argument, NULL, EPOCH },
+	  { "capture", required_argument, NULL, CAPTURE },
+	  { "shm", required_argument, NULL, SHM },
+	  { "gpu-scale", no_argument, NULL, GPU_SCALE },
+	  { "pixel-grid", no_argument, NULL, PIXEL_GRID },
+	  { "perf", no_argument, NULL, PERF },
+	  { "stats", required_argument, NULL, STATS },
+	  { "metrics", required_argument, NULL, METRICS },
+	  { "metrics-interval", required_argument, NULL, METRICS_INTERVAL },
+	  { "metrics-prom", no_argument, NULL, METRICS_PROM },
+	  { "debug", required_argument, NULL, DEBUG_SECTIONS },
+	  { "coverage", required_argument, NULL, COVERAGE },
+	  { "coverage-merge", required_argument, NULL, COVERAGE_MERGE },
+	  { "coverage-report", required_argument, NULL, COVERAGE_REPORT },
+	  { "symbols", required_argument, NULL, SYMBOLS },
+	  { "verify", required_argument, NULL, VERIFY },
+	  { "verify-interval", required_argument, NULL, VERIFY_INTERVAL },
+	  { "fwdb", required_argument, NULL, FWDB },
+	  { "hle", no_argument, NULL, HLE },
+	  { "no-idle-skip", no_argument, NULL, NO_IDLE_SKIP },
 	/* TODO: Add argument to start with debug console open, e.g. execution
 	 * halted.
 	 */
@@ -94,16 +201,14 @@ int main(int argc, char** argv)
 
 	/* Prepare default options */
 	ms_opts options;
+	ms_opts_init(&options);
 	options.cf_path = strndup("codeflash.bin", 13);
 	options.df_path = strndup("dataflash.bin", 13);
-	options.ram_path = NULL;
-	options.df_save_to_disk = 1;
-	options.batt_start = BATT_HIGH;
-	options.ac_start = AC_GOOD;
+	options.headless = 0;
 
 	/* Process arguments */
 	while ((c = getopt_long(argc, argv,
-	  "hc:d:r:n", long_opts, NULL)) != -1) {
+	  "hc:d:r:s:n", long_opts, NULL)) != -1) {
 		switch(c) {
 		  case 'c':
 			options.cf_path = malloc(strlen(optarg)+1);
@@ -120,9 +225,84 @@ int main(int argc, char** argv)
 			/* TODO: Implement error handling here */
 			strncpy(options.ram_path, optarg, strlen(optarg)+1);
 			break;
+		  case 's':
+			options.script_path = optarg;
+			break;
 		  case 'n':
 			options.df_save_to_disk = 0;
 			break;
+		  case HEADLESS:
+			options.headless = 1;
+			break;
+		  case FONT:
+			options.font_path = optarg;
+			break;
+		  case LCD_LOG:
+			options.framelog_path = optarg;
+			break;
+		  case LCD_COMPARE:
+			options.framelog_cmp_path = optarg;
+			break;
+		  case EPOCH:
+			options.epoch = strtoll(optarg, NULL, 0);
+			break;
+		  case CAPTURE:
+			options.capture_path = optarg;
+			break;
+		  case SHM:
+			options.shm_name = optarg;
+			break;
+		  case GPU_SCALE:
+			ui_flags |= UI_GPU_SCALE;
+			break;
+		  case PIXEL_GRID:
+			ui_flags |= UI_PIXEL_GRID;
+			break;
+		  case PERF:
+			options.perf = 1;
+			break;
+		  case STATS:
+			options.stats_path = optarg;
+			break;
+		  case METRICS:
+			options.metrics_path = optarg;
+			break;
+		  case METRICS_INTERVAL:
+			options.metrics_interval = atoi(optarg);
+			break;
+		  case METRICS_PROM:
+			options.metrics_prom = 1;
+			break;
+		  case DEBUG_SECTIONS:
+			options.debug_sections = optarg;
+			break;
+		  case COVERAGE:
+			options.coverage_path = optarg;
+			break;
+		  case COVERAGE_MERGE:
+			options.coverage_merge_path = optarg;
+			break;
+		  case COVERAGE_REPORT:
+			options.coverage_report_path = optarg;
+			break;
+		  case SYMBOLS:
+			options.sym_path = optarg;
+			break;
+		  case VERIFY:
+			options.verify_core = optarg;
+			break;
+		  case VERIFY_INTERVAL:
+			options.verify_interval = atoi(optarg);
+			break;
+		  case FWDB:
+			options.fwdb_path = optarg;
+			break;
+		  case HLE:
+			options.hle = 1;
+			break;
+		  case NO_IDLE_SKIP:
+			options.idle_skip = 0;
+			break;
 		  case AC:
 			options.ac_start = AC_GOOD;
 			break;
@@ -148,7 +328,13 @@ int main(int argc, char** argv)
 	// Init mailstation w/ options
 	memset(&ms, '\0', sizeof(ms));
 	if (ms_init(&ms, &options) == MS_ERR) return 1;
-	ui_init(ms.lcd_datRGBA8888);
+	printf("Firmware: %s (%016llX)\n", ms.fw->name,
+	  (unsigned long long)ms.cf_hash);
+	if (!options.headless) ui_init(&ms, ui_flags);
+
+	debug_sigint_init(&ms);
+	if (options.stats_path != NULL) stats_sigusr1_init();
+	printf("\nPress ctrl+c to enter interactive Mailstation debugger\n");
 
 	// Run mailstation
 	ret = ms_run(&ms);
@@ -156,6 +342,7 @@ int main(int argc, char** argv)
 		log_error("mailstation existed with code %d.\n", ret);
 	}
 
+	ui_deinit(&ms);
 	ms_deinit(&ms, &options);
 
 	return ret;
@@ -1,7 +1,11 @@
 #include "debug.h"
+#include "fwdb.h"
+#include "hash.h"
 #include "mem.h"
 #include "msemu.h"
 #include "sizes.h"
+#include "snapshot.h"
+#include "stats.h"
 
 #include <assert.h>
 #include <ctype.h>
@@ -22,11 +26,11 @@ typedef SSIZE_T ssize_t;
  * will remain unlocked until successfully matching the lock set.
  */
 
-/* The dataflash buffer is used to track this state machine. Its a little
+/* A tracking byte, ms->df_wp, is used for this state machine. Its a little
  * clever so here is how it works:
  *
- * 512K+1 byte is allocated for the DF, the +1 is used to track the state
- *   of the lock/unlock pattern, and if the DF is able to be written
+ * The tracking byte holds the state of the lock/unlock pattern, and if the
+ *   DF is able to be written
  * The DF starts out in the locked state
  * In the state machine, only the least significant 13 bits of address
  *  matter for advancing to the next state. As quoted in the datasheet:
@@ -72,6 +76,110 @@ const uint16_t df_unlock_lock_arr[] = {
 	0x0000
 };
 
+/****************************************************
+ * Page Functions
+ ***************************************************/
+void mem_alloc(struct ms_page **tbl, int cnt)
+{
+	int i;
+
+	for (i = 0; i < cnt; i++) {
+		tbl[i] = (struct ms_page *)calloc(1, sizeof(struct ms_page));
+		if (tbl[i] == NULL) {
+			printf("Unable to allocate memory page\n");
+			exit(EXIT_FAILURE);
+		}
+		SDL_AtomicSet(&tbl[i]->refs, 1);
+	}
+}
+
+void mem_free(struct ms_page **tbl, int cnt)
+{
+	int i;
+
+	for (i = 0; i < cnt; i++) {
+		if (tbl[i] != NULL && SDL_AtomicDecRef(&tbl[i]->refs))
+			free(tbl[i]);
+		tbl[i] = NULL;
+	}
+}
+
+void mem_share(struct ms_page **dst, struct ms_page *const *src, int cnt)
+{
+	int i;
+
+	for (i = 0; i < cnt; i++) {
+		assert(dst[i] == NULL);
+		SDL_AtomicIncRef(&src[i]->refs);
+		dst[i] = src[i];
+	}
+}
+
+struct ms_page *mem_unshare(struct ms_page **pg)
+{
+	struct ms_page *copy;
+
+	copy = (struct ms_page *)malloc(sizeof(struct ms_page));
+	if (copy == NULL) {
+		printf("Unable to allocate memory page\n");
+		exit(EXIT_FAILURE);
+	}
+	SDL_AtomicSet(&copy->refs, 1);
+	memcpy(copy->data, (*pg)->data, MS_PAGE_LEN);
+
+	/* Whoever else had the page may have dropped it since it was seen to
+	 * be shared, in which case this was the last user */
+	if (SDL_AtomicDecRef(&(*pg)->refs)) free(*pg);
+	*pg = copy;
+
+	return copy;
+}
+
+void mem_get(struct ms_page *const *tbl, uint32_t addr, void *buf,
+  uint32_t len)
+{
+	uint8_t *p = (uint8_t *)buf;
+	uint32_t n;
+
+	while (len) {
+		n = MS_PAGE_LEN - (addr % MS_PAGE_LEN);
+		if (n > len) n = len;
+		memcpy(p, &tbl[addr / MS_PAGE_LEN]->data[addr % MS_PAGE_LEN], n);
+		p += n;
+		addr += n;
+		len -= n;
+	}
+}
+
+void mem_put(struct ms_page **tbl, uint32_t addr, const void *buf,
+  uint32_t len)
+{
+	const uint8_t *p = (const uint8_t *)buf;
+	uint32_t n;
+
+	while (len) {
+		n = MS_PAGE_LEN - (addr % MS_PAGE_LEN);
+		if (n > len) n = len;
+		memcpy(mem_wr(tbl, addr), p, n);
+		p += n;
+		addr += n;
+		len -= n;
+	}
+}
+
+void mem_fill(struct ms_page **tbl, uint32_t addr, uint8_t val, uint32_t len)
+{
+	uint32_t n;
+
+	while (len) {
+		n = MS_PAGE_LEN - (addr % MS_PAGE_LEN);
+		if (n > len) n = len;
+		memset(mem_wr(tbl, addr), val, n);
+		addr += n;
+		len -= n;
+	}
+}
+
 /* Helper functions for loading and saving a file to a buffer.
  *
  * Arguments for both are the same, buffer, file path, and size in bytes
@@ -111,15 +219,13 @@ static int buftofile(uint8_t *buf, const char *file_path, ssize_t sz)
  ***************************************************/
 int df_init(ms_ctx *ms, ms_opts *options)
 {
-	assert(ms->df == NULL);
+	uint8_t *buf;
+	int ret = MS_OK;
 
-	/* Allocate 512K+1 and store the state of the writeprotect in the +1
-	 * This should not and does not get written back to disk! */
-	ms->df = (uint8_t *)calloc(SZ_512K+1, sizeof(uint8_t));
-	if (ms->df == NULL) {
-		printf("Unable to allocate dataflash buffer\n");
-		exit(EXIT_FAILURE);
-	}
+	assert(ms->df[0] == NULL);
+
+	mem_alloc(ms->df, MS_DF_PAGES);
+	ms->df_wp = 0;
 
         /* Open dataflash and dump it in to a buffer.
          * The dataflash should be exactly 512 KiB.
@@ -128,38 +234,54 @@ int df_init(ms_ctx *ms, ms_opts *options)
          * It should never be longer either. If it is, we just pretend like
          * we didn't notice. This might be unwise behavior.
          */
-	if (!filetobuf(ms->df, options->df_path, SZ_512K)) {
+	if (options->df_path == NULL) return ENOENT;
+	buf = (uint8_t *)calloc(SZ_512K, sizeof(uint8_t));
+	if (buf == NULL) {
+		printf("Unable to allocate dataflash buffer\n");
+		exit(EXIT_FAILURE);
+	}
+	if (!filetobuf(buf, options->df_path, SZ_512K)) {
                 printf("Existing dataflash image not found at '%s', creating "
                   "a new dataflah image.\n", options->df_path);
-		return ENOENT;
+		ret = ENOENT;
+	} else {
+		mem_put(ms->df, 0, buf, SZ_512K);
 	}
+	free(buf);
 
-	return MS_OK;
+	return ret;
 }
 
 int df_deinit(ms_ctx *ms, ms_opts *options)
 {
+	uint8_t *buf;
 	int ret = MS_OK;
 
-	assert(ms->df != NULL);
+	if (ms->df[0] == NULL) return MS_OK;
 
-	if (options->df_save_to_disk) {
-		ret = buftofile(ms->df, options->df_path, SZ_512K);
+	if (options->df_save_to_disk && options->df_path != NULL) {
+		buf = (uint8_t *)malloc(SZ_512K);
+		if (buf == NULL) {
+			printf("Unable to allocate dataflash buffer\n");
+			exit(EXIT_FAILURE);
+		}
+		mem_get(ms->df, 0, buf, SZ_512K);
+		ret = buftofile(buf, options->df_path, SZ_512K);
+		free(buf);
 		if (ret < SZ_512K) {
 			printf("Failed writing dataflash, only wrote %d\n",
 			  ret);
 			ret = EIO;
 		}
 	}
-	free(ms->df);
-	ms->df = NULL;
+	mem_free(ms->df, MS_DF_PAGES);
 
 	return ret;
 };
 
 uint8_t df_read(ms_ctx *ms, unsigned int absolute_addr)
 {
-	volatile uint8_t *wp_track = (ms->df + SZ_512K);
+	volatile uint8_t *wp_track = &ms->df_wp;
 
 	/* See top of file for explanation of code protect and tracking it */
 
@@ -181,7 +303,7 @@ uint8_t df_read(ms_ctx *ms, unsigned int absolute_addr)
 		*wp_track &= ~(0x7);
 	}
 
-	return *(ms->df + absolute_addr);
+	return mem_rd(ms->df, absolute_addr);
 }
 
 /* Interpret commands intended for 28SF040 flash
@@ -199,32 +321,30 @@ uint8_t df_read(ms_ctx *ms, unsigned int absolute_addr)
  */
 int df_write(ms_ctx *ms, unsigned int absolute_addr, uint8_t val)
 {
-	static uint8_t cycle;
-	static uint8_t cmd;
-	volatile uint8_t *wp_track = (ms->df + SZ_512K);
+	volatile uint8_t *wp_track = &ms->df_wp;
 
 	/* ANY write to DF will break the current software protect state
 	 * machine sequence! */
 	*wp_track &= ~(0x7);
 
-	if (!cycle) {
+	if (!ms->df_cycle) {
 		switch (val) {
 		  case 0xFF: /* Reset dataflash, single cycle */
-			log_debug(" * DF    Reset\n");
+			log_debug(LOG_DF, " * DF    Reset\n");
 			break;
 		  case 0x00: /* Not sure what cmd is, but only one cycle? */
-			log_debug(" * DF    CMD 0x00\n");
+			log_debug(LOG_DF, " * DF    CMD 0x00\n");
 			break;
 		  case 0xC3: /* Not sure what cmd is, but only one cycle? */
-			log_debug(" * DF    CMD 0xC3\n");
+			log_debug(LOG_DF, " * DF    CMD 0xC3\n");
 			break;
 		  default:
-			cmd = val;
-			cycle++;
+			ms->df_cmd = val;
+			ms->df_cycle++;
 			break;
 		}
 	} else {
-		switch(cmd) {
+		switch(ms->df_cmd) {
 		  case 0x20: /* Sector erase, execute cmd is 0xD0 */
 			if (val != 0xD0) break;
 			if (!(*wp_track & 0x80)) {
@@ -232,16 +352,22 @@ int df_write(ms_ctx *ms, unsigned int absolute_addr, uint8_t val)
 				break;
 			}
 			absolute_addr &= 0xFFFFFF00;
-			log_debug(" * DF    Sector-Erase: 0x%X\n", absolute_addr);
-			memset((ms->df + absolute_addr), 0xFF, 0x100);
+			log_debug(LOG_DF, " * DF    Sector-Erase: 0x%X\n", absolute_addr);
+			mem_fill(ms->df, absolute_addr, 0xFF, 0x100);
+			snap_dirty_range(ms, DF, absolute_addr, 0x100);
+			STATS_INC(ms, df_erase);
+			ms->df_written += 0x100;
 			break;
 		  case 0x10: /* Byte program */
 			if (!(*wp_track & 0x80)) {
 				log_error(" * DF    Attempted byte program while DF locked!\n");
 				break;
 			}
-			log_debug(" * DF    W [%04X] <- %02X\n", absolute_addr,val);
-			*(ms->df + absolute_addr) = val;
+			log_debug(LOG_DF, " * DF    W [%04X] <- %02X\n", absolute_addr,val);
+			*mem_wr(ms->df, absolute_addr) = val;
+			snap_dirty(ms, DF, absolute_addr);
+			STATS_INC(ms, df_program);
+			ms->df_written++;
 			break;
 		  case 0x30: /* Chip erase, execute cmd is 0x30 */
 			if (val != 0x30) break;
@@ -249,21 +375,24 @@ int df_write(ms_ctx *ms, unsigned int absolute_addr, uint8_t val)
 				log_error(" * DF    Attempted chip erase while DF locked!\n");
 				break;
 			}
-			log_debug(" * DF    Chip erase\n");
-			memset(ms->df, 0xFF, SZ_512K);
+			log_debug(LOG_DF, " * DF    Chip erase\n");
+			mem_fill(ms->df, 0, 0xFF, SZ_512K);
+			snap_dirty_range(ms, DF, 0, SZ_512K);
+			STATS_INC(ms, df_chip_erase);
+			ms->df_written += SZ_512K;
 			break;
 		  case 0x90: /* Read ID */
 			/* XXX: Currently does not do any operation with this
 			 * command. Does not seem to affect MS operation though
 			 */
-			log_debug(" * DF    Read ID\n");
+			log_debug(LOG_DF, " * DF    Read ID\n");
 			break;
 		  default:
-			log_error(
-			  " * DF    INVALID CMD SEQ: %02X %02X\n", cmd, val);
+			log_error(" * DF    INVALID CMD SEQ: %02X %02X\n",
+			  ms->df_cmd, val);
 			break;
 		}
-		cycle = 0;
+		ms->df_cycle = 0;
 	}
 
 	return MS_OK;
@@ -273,12 +402,12 @@ int df_write(ms_ctx *ms, unsigned int absolute_addr, uint8_t val)
 /****************************************************
  * Codeflash Functions
  ***************************************************/
-int cf_init(ms_ctx *ms, ms_opts *options)
+const uint8_t *ms_cf_load(const char *path)
 {
-	assert(ms->cf == NULL);
+	uint8_t *cf;
 
-	ms->cf = (uint8_t *)calloc(SZ_1M, sizeof(uint8_t));
-	if (ms->cf == NULL) {
+	cf = (uint8_t *)calloc(SZ_1M, sizeof(uint8_t));
+	if (cf == NULL) {
 		printf("Unable to allocate codeflash buffer\n");
 		exit(EXIT_FAILURE);
 	}
@@ -290,23 +419,56 @@ int cf_init(ms_ctx *ms, ms_opts *options)
          * It should never be longer either. If it is, we just pretend like
          * we didn't notice. This might be unwise behavior.
          */
-	if (!filetobuf(ms->cf, options->cf_path, SZ_1M)) {
-                log_error("Failed to load codeflash from '%s'.\n", options->cf_path);
-		free(ms->cf);
-		ms->cf = NULL;
-                return ENOENT;
+	if (!filetobuf(cf, path, SZ_1M)) {
+                log_error("Failed to load codeflash from '%s'.\n", path);
+		free(cf);
+                return NULL;
         }
 
+	return cf;
+}
+
+void ms_cf_free(const uint8_t *cf)
+{
+	free((uint8_t *)cf);
+}
+
+int cf_init(ms_ctx *ms, ms_opts *options)
+{
+	assert(ms->cf == NULL);
+
+	/* The codeflash is only ever read, so a copy that is shared with
+	 * other instances can be used as is */
+	if (options->cf_shared != NULL) {
+		ms->cf = (uint8_t *)options->cf_shared;
+		ms->cf_shared = 1;
+	} else {
+		if (options->cf_path == NULL) {
+			log_error("No codeflash given\n");
+			return ENOENT;
+		}
+		ms->cf = (uint8_t *)ms_cf_load(options->cf_path);
+		if (ms->cf == NULL) return ENOENT;
+		ms->cf_shared = 0;
+	}
+
+	/* Find out which firmware this is, see fwdb.h. The hash is kept, it
+	 * is also what snapshots are checked against */
+	if (options->fwdb_path != NULL && fwdb_load(options->fwdb_path))
+		return ENOENT;
+	ms->cf_hash = hash64(ms->cf, SZ_1M, 0);
+	ms->fw = fwdb_lookup(ms->cf_hash);
+
 	return MS_OK;
 }
 
 int cf_deinit(ms_ctx *ms, ms_opts *options)
 {
-	assert(ms->cf != NULL);
+	if (ms->cf == NULL) return 0;
 
 	/* Once CF writing is implemented, add writeback process here */
 
-	free(ms->cf);
+	if (!ms->cf_shared) ms_cf_free(ms->cf);
 	ms->cf = NULL;
 
 	return 0;
@@ -345,17 +507,11 @@ int cf_write(ms_ctx *ms, unsigned int absolute_addr, uint8_t val)
  */
 int ram_init(ms_ctx *ms, ms_opts *options)
 {
-	int i;
+	int i, j;
 	uint8_t *ram_ptr;
 	int image_len;
 
-	if (ms->ram == NULL) {
-		ms->ram = (uint8_t *)malloc(SZ_128K);
-		if (ms->ram == NULL) {
-			printf("Unable to allocate RAM buffer\n");
-			exit(EXIT_FAILURE);
-		}
-
+	if (ms->ram[0] == NULL) {
 		/* If a RAM image file was specified, load it. Otherwise, the RAM
 		 * buffer will just keep its random contents.
 		 * The image file can really be any length. If it is shorter than
@@ -363,35 +519,45 @@ int ram_init(ms_ctx *ms, ms_opts *options)
 		 * was already populated with random contents.
 		 */
 		if (options->ram_path != NULL) {
-			ms->ram_image = (uint8_t *)malloc(SZ_128K);
+			ram_ptr = (uint8_t *)malloc(SZ_128K);
+			if (ram_ptr == NULL) {
+				printf("Unable to allocate RAM buffer\n");
+				exit(EXIT_FAILURE);
+			}
 			/* Buffer has been allocated, throw random data in it
 			 * to simulate SRAM startup */
-			ram_ptr = ms->ram_image;
-			for (i = 0; i < SZ_128K; i++) {
-				*ram_ptr = rand() & 0xFF;
-				ram_ptr++;
-			}
-			image_len = filetobuf(ms->ram_image, options->ram_path, SZ_128K);
+			for (i = 0; i < SZ_128K; i++)
+				ram_ptr[i] = ms_rand(ms) & 0xFF;
+			image_len = filetobuf(ram_ptr, options->ram_path, SZ_128K);
 			if (!image_len) {
 				log_error("Failed to load RAM image from '%s'.\n", options->ram_path);
-				free(ms->ram_image);
-				ms->ram_image = NULL;
+				free(ram_ptr);
 				return ENOENT;
 			}
+			mem_alloc(ms->ram_image, MS_RAM_PAGES);
+			mem_put(ms->ram_image, 0, ram_ptr, SZ_128K);
+			free(ram_ptr);
 	        }
 	}
 
+	snap_dirty_range(ms, RAM, 0, SZ_128K);
+
+	/* Old contents are thrown away rather than written over, so that
+	 * pages shared with a clone are not copied first */
+	mem_free(ms->ram, MS_RAM_PAGES);
+
 	/* If image_buf is not null, that is, an image was loaded in to it
 	 * at first ram_init() call, then reload those contents back in */
-	if (ms->ram_image != NULL) {
-		strncpy(ms->ram, ms->ram_image, SZ_128K);
+	if (ms->ram_image[0] != NULL) {
+		mem_share(ms->ram, ms->ram_image, MS_RAM_PAGES);
 	} else {
 		/* Buffer has been allocated, throw random data in it
 		 * to simulate SRAM startup */
-		ram_ptr = ms->ram;
-		for (i = 0; i < SZ_128K; i++) {
-			*ram_ptr = rand() & 0xFF;
-			ram_ptr++;
+		mem_alloc(ms->ram, MS_RAM_PAGES);
+		for (i = 0; i < MS_RAM_PAGES; i++) {
+			ram_ptr = ms->ram[i]->data;
+			for (j = 0; j < MS_PAGE_LEN; j++)
+				ram_ptr[j] = ms_rand(ms) & 0xFF;
 		}
 	}
 
@@ -400,20 +566,35 @@ int ram_init(ms_ctx *ms, ms_opts *options)
 
 int ram_deinit(ms_ctx *ms)
 {
-	free(ms->ram);
-	free(ms->ram_image);
-	ms->ram = NULL;
-	ms->ram_image = NULL;
+	mem_free(ms->ram, MS_RAM_PAGES);
+	mem_free(ms->ram_image, MS_RAM_PAGES);
 	return 0;
 }
 
+uint8_t mem_peek(ms_ctx *ms, uint16_t addr)
+{
+	uint32_t phys;
+
+	switch (mem_phys(ms, addr, &phys)) {
+	  case CF:
+		return (phys < SZ_1M) ? ms->cf[phys] : 0;
+	  case DF:
+		return (phys < SZ_512K) ? mem_rd(ms->df, phys) : 0;
+	  case RAM:
+		return (phys < SZ_128K) ? mem_rd(ms->ram, phys) : 0;
+	  default:
+		return 0;
+	}
+}
+
 uint8_t ram_read(ms_ctx *ms, unsigned int absolute_addr)
 {
-	return *(ms->ram + absolute_addr);
+	return mem_rd(ms->ram, absolute_addr);
 }
 
 int ram_write(ms_ctx *ms, unsigned int absolute_addr, uint8_t val)
 {
-	*(ms->ram + absolute_addr) = val;
+	*mem_wr(ms->ram, absolute_addr) = val;
+	snap_dirty(ms, RAM, absolute_addr);
 	return 0;
 }
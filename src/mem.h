@@ -3,8 +3,75 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include "io.h"
 #include "msemu.h"
 
+#include <SDL2/SDL.h>
+
+/* RAM and dataflash pages
+ *
+ * RAM and dataflash are not single buffers, each is a table of pointers to
+ * MS_PAGE_LEN byte pages. ms_clone() gives the new instance the same pages as
+ * the instance it was cloned from, so a page can be in the tables of any
+ * number of instances and counts how many. Reads go straight through the
+ * table. The first write to a page that is shared gives the writer a copy
+ * of its own, the other instances keep the original.
+ */
+struct ms_page {
+	SDL_atomic_t refs;
+	uint8_t data[MS_PAGE_LEN];
+};
+
+/**
+ * Fill cnt entries of tbl with new, zeroed, pages
+ */
+void mem_alloc(struct ms_page **tbl, int cnt);
+
+/**
+ * Drop cnt pages from tbl, freeing those no other table uses, and set the
+ * entries to NULL
+ */
+void mem_free(struct ms_page **tbl, int cnt);
+
+/**
+ * Point cnt entries of dst, which must be empty, at the pages in src
+ */
+void mem_share(struct ms_page **dst, struct ms_page *const *src, int cnt);
+
+/**
+ * Replace the shared page *pg with a copy that is only used by this table.
+ *
+ * Returns the copy
+ */
+struct ms_page *mem_unshare(struct ms_page **pg);
+
+/**
+ * Copy len bytes at addr out of, or in to, the pages in tbl. mem_fill()
+ * sets them all to val. A write only copies the pages it touches.
+ */
+void mem_get(struct ms_page *const *tbl, uint32_t addr, void *buf,
+  uint32_t len);
+void mem_put(struct ms_page **tbl, uint32_t addr, const void *buf,
+  uint32_t len);
+void mem_fill(struct ms_page **tbl, uint32_t addr, uint8_t val, uint32_t len);
+
+/* Byte at addr in tbl */
+static inline uint8_t mem_rd(struct ms_page *const *tbl, uint32_t addr)
+{
+	return tbl[addr / MS_PAGE_LEN]->data[addr % MS_PAGE_LEN];
+}
+
+/* Pointer to the byte at addr in tbl that is safe to write */
+static inline uint8_t *mem_wr(struct ms_page **tbl, uint32_t addr)
+{
+	struct ms_page *pg = tbl[addr / MS_PAGE_LEN];
+
+	if (SDL_AtomicGet(&pg->refs) > 1)
+		pg = mem_unshare(&tbl[addr / MS_PAGE_LEN]);
+
+	return &pg->data[addr % MS_PAGE_LEN];
+}
+
 /**
  * Initialize buffer, open file, and copy contents to buffer
  *
@@ -21,7 +88,8 @@ int ram_init(ms_ctx *ms, ms_opts *options);
  * *ms		- Pointer to ms_ctx struct
  * *options	- Pointer to ms_opts struct w/ file path and save to disk opts
  *
- * ram_deinit does not write buffer back to disk
+ * ram_deinit does not write buffer back to disk. All of them do nothing if
+ * the buffer was never set up
  */
 int df_deinit(ms_ctx *ms, ms_opts *options);
 int cf_deinit(ms_ctx *ms, ms_opts *options);
@@ -55,4 +123,45 @@ uint8_t ram_read(ms_ctx *ms, unsigned int absolute_addr);
 /* Unimplemented at this time */
 int cf_write(ms_ctx *ms, unsigned int absolute_addr, uint8_t val);
 
+/* Device, enum ms_dev_map, that Z80 address addr is in as the slots are
+ * mapped now. *phys is set to the address inside the device, page * 0x4000
+ * + offset */
+static inline int mem_phys(ms_ctx *ms, uint16_t addr, uint32_t *phys)
+{
+	switch (addr & 0xC000) {
+	  case 0x0000:
+		*phys = addr;
+		return CF;
+	  case 0x4000:
+		*phys = (ms->io[SLOT4_PAGE] * 0x4000) + (addr & 0x3FFF);
+		return ms->io[SLOT4_DEV] & 0x0F;
+	  case 0x8000:
+		*phys = (ms->io[SLOT8_PAGE] * 0x4000) + (addr & 0x3FFF);
+		return ms->io[SLOT8_DEV] & 0x0F;
+	  default:
+		*phys = addr & 0x3FFF;
+		return RAM;
+	}
+}
+
+/**
+ * Byte at Z80 address addr as the slots are mapped now, without the side
+ * effects of a read by the Z80: no breakpoints, coverage or dataflash
+ * command sequence. Reads 0 outside of codeflash, dataflash and RAM.
+ */
+uint8_t mem_peek(ms_ctx *ms, uint16_t addr);
+
+/* Physical codeflash address, page * 0x4000 + offset, of Z80 address pc as
+ * the slots are mapped now. -1 if pc is not in codeflash */
+static inline int32_t cf_pc_addr(ms_ctx *ms, uint16_t pc)
+{
+	if (pc < 0x4000) return pc;
+	if ((pc & 0xC000) == 0x4000 && (ms->io[SLOT4_DEV] & 0x0F) == CF)
+		return (ms->io[SLOT4_PAGE] * 0x4000) + (pc & 0x3FFF);
+	if ((pc & 0xC000) == 0x8000 && (ms->io[SLOT8_DEV] & 0x0F) == CF)
+		return (ms->io[SLOT8_PAGE] * 0x4000) + (pc & 0x3FFF);
+
+	return -1;
+}
+
 #endif // __FLASHOPS_H__
@@ -0,0 +1,365 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL2/SDL.h>
+
+#include "debug.h"
+#include "metrics.h"
+#include "msemu.h"
+
+#if !defined(_MSC_VER)
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#define METRICS_UNIX_PREFIX	"unix:"
+
+/* Values copied from the emulation thread */
+struct metrics_snap {
+	uint64_t tstates;
+	uint64_t frames;
+	uint64_t df_written;
+	uint32_t bp_hits;
+	int power;
+};
+
+struct ms_metrics {
+	char *path;
+	char *tmp_path;
+	int is_unix;
+	int prom;
+	uint32_t interval_ms;
+
+	// Only touched by the emulation thread
+	uint64_t frames;
+
+	/* Odd while the emulation thread is updating snap. The background
+	 * thread copies snap and retries if seq was odd or changed */
+	SDL_atomic_t seq;
+	struct metrics_snap snap;
+
+	// Only touched by the background thread
+	FILE *fd;
+	int sock;
+	uint64_t freq;
+	uint64_t start;
+	uint64_t last;
+	uint64_t last_tstates;
+
+	SDL_sem *quit;
+	SDL_Thread *thread;
+};
+
+static void metrics_read(struct ms_metrics *m, struct metrics_snap *snap)
+{
+	int seq;
+
+	do {
+		while ((seq = SDL_AtomicGet(&m->seq)) & 1) SDL_Delay(0);
+		memcpy(snap, &m->snap, sizeof(*snap));
+		// The copy must be done before seq is checked again
+		SDL_MemoryBarrierAcquire();
+	} while (SDL_AtomicGet(&m->seq) != seq);
+}
+
+/* Resident set size of this process in bytes, -1 if unknown */
+static long long metrics_rss(void)
+{
+#if defined(__linux__)
+	FILE *fd;
+	long long pages;
+
+	fd = fopen("/proc/self/statm", "r");
+	if (fd == NULL) return -1;
+	if (fscanf(fd, "%*s %lld", &pages) != 1) pages = -1;
+	fclose(fd);
+
+	if (pages < 0) return -1;
+	return pages * sysconf(_SC_PAGESIZE);
+#else
+	return -1;
+#endif
+}
+
+static int metrics_format(struct ms_metrics *m, char *buf, size_t len)
+{
+	struct metrics_snap s;
+	uint64_t now;
+	double uptime, secs, ratio = 0.0;
+	long long rss;
+	char rss_str[32];
+	int n;
+
+	metrics_read(m, &s);
+	rss = metrics_rss();
+	now = SDL_GetPerformanceCounter();
+
+	uptime = (double)(now - m->start) / m->freq;
+	secs = (double)(now - m->last) / m->freq;
+	if (secs > 0.0) {
+		ratio = ((double)(s.tstates - m->last_tstates) / MS_CPU_HZ) /
+		  secs;
+	}
+	m->last = now;
+	m->last_tstates = s.tstates;
+
+	if (m->prom) {
+		n = snprintf(buf, len,
+		  "# HELP msemu_uptime_seconds Host time since metrics started.\n"
+		  "# TYPE msemu_uptime_seconds gauge\n"
+		  "msemu_uptime_seconds %.3f\n"
+		  "# HELP msemu_tstates_total Z80 T states emulated.\n"
+		  "# TYPE msemu_tstates_total counter\n"
+		  "msemu_tstates_total %llu\n"
+		  "# HELP msemu_realtime_ratio Emulated time over host time.\n"
+		  "# TYPE msemu_realtime_ratio gauge\n"
+		  "msemu_realtime_ratio %.3f\n"
+		  "# HELP msemu_frames_total Emulated 64 Hz frames.\n"
+		  "# TYPE msemu_frames_total counter\n"
+		  "msemu_frames_total %llu\n"
+		  "# HELP msemu_df_written_bytes_total Dataflash bytes programmed or erased.\n"
+		  "# TYPE msemu_df_written_bytes_total counter\n"
+		  "msemu_df_written_bytes_total %llu\n"
+		  "# HELP msemu_breakpoint_hits_total Debugger breakpoints hit.\n"
+		  "# TYPE msemu_breakpoint_hits_total counter\n"
+		  "msemu_breakpoint_hits_total %u\n"
+		  "# HELP msemu_power_on Mailstation is powered on.\n"
+		  "# TYPE msemu_power_on gauge\n"
+		  "msemu_power_on %d\n",
+		  uptime, (unsigned long long)s.tstates, ratio,
+		  (unsigned long long)s.frames,
+		  (unsigned long long)s.df_written, s.bp_hits, s.power);
+		if (n >= 0 && (size_t)n < len && rss >= 0) {
+			n += snprintf(buf + n, len - n,
+			  "# HELP msemu_resident_memory_bytes Resident memory size.\n"
+			  "# TYPE msemu_resident_memory_bytes gauge\n"
+			  "msemu_resident_memory_bytes %lld\n", rss);
+		}
+		if (n >= 0 && (size_t)n < len && m->is_unix)
+			n += snprintf(buf + n, len - n, "# EOF\n");
+	} else {
+		if (rss >= 0) {
+			snprintf(rss_str, sizeof(rss_str), "%lld", rss);
+		} else {
+			strcpy(rss_str, "null");
+		}
+		n = snprintf(buf, len,
+		  "{\"uptime\":%.3f,\"tstates\":%llu,\"realtime\":%.3f,"
+		  "\"frames\":%llu,\"df_written\":%llu,\"bp_hits\":%u,"
+		  "\"rss\":%s,\"power\":%d}\n",
+		  uptime, (unsigned long long)s.tstates, ratio,
+		  (unsigned long long)s.frames,
+		  (unsigned long long)s.df_written, s.bp_hits, rss_str,
+		  s.power);
+	}
+
+	if (n < 0) n = 0;
+	if ((size_t)n >= len) n = (int)len - 1;
+
+	return n;
+}
+
+#if !defined(_MSC_VER)
+static void metrics_write_unix(struct ms_metrics *m, const char *buf,
+  int len)
+{
+	struct sockaddr_un addr;
+	ssize_t ret;
+
+	if (m->sock < 0) {
+		m->sock = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (m->sock < 0) return;
+
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, m->path, sizeof(addr.sun_path) - 1);
+		if (connect(m->sock, (struct sockaddr *)&addr,
+		    sizeof(addr)) < 0) {
+			close(m->sock);
+			m->sock = -1;
+			return;
+		}
+	}
+
+	while (len > 0) {
+		ret = send(m->sock, buf, len, MSG_NOSIGNAL);
+		if (ret < 0 && errno == EINTR) continue;
+		if (ret <= 0) {
+			close(m->sock);
+			m->sock = -1;
+			return;
+		}
+		buf += ret;
+		len -= ret;
+	}
+}
+#endif
+
+static void metrics_write(struct ms_metrics *m)
+{
+	char buf[2048];
+	FILE *fd;
+	int len;
+
+	len = metrics_format(m, buf, sizeof(buf));
+
+#if !defined(_MSC_VER)
+	if (m->is_unix) {
+		metrics_write_unix(m, buf, len);
+		return;
+	}
+#endif
+
+	if (!m->prom) {
+		fwrite(buf, 1, len, m->fd);
+		fflush(m->fd);
+		return;
+	}
+
+	/* Replace the whole file so a collector never reads half of it */
+	fd = fopen(m->tmp_path, "w");
+	if (fd == NULL) return;
+	fwrite(buf, 1, len, fd);
+	if (fclose(fd)) return;
+#if defined(_MSC_VER)
+	remove(m->path);
+#endif
+	rename(m->tmp_path, m->path);
+}
+
+static int metrics_thread(void *data)
+{
+	struct ms_metrics *m = (struct ms_metrics *)data;
+
+	while (SDL_SemWaitTimeout(m->quit, m->interval_ms) ==
+	       SDL_MUTEX_TIMEDOUT) {
+		metrics_write(m);
+	}
+
+	// One last snapshot on the way out
+	metrics_write(m);
+
+	return 0;
+}
+
+static void metrics_free(struct ms_metrics *m)
+{
+	if (m->quit) SDL_DestroySemaphore(m->quit);
+	if (m->fd) fclose(m->fd);
+#if !defined(_MSC_VER)
+	if (m->sock >= 0) close(m->sock);
+#endif
+	free(m->tmp_path);
+	free(m->path);
+	free(m);
+}
+
+int metrics_start(ms_ctx *ms, const char *dest, int interval, int prom)
+{
+	struct ms_metrics *m;
+	size_t len;
+
+	if (ms->metrics != NULL) return MS_OK;
+
+	m = (struct ms_metrics *)calloc(1, sizeof(struct ms_metrics));
+	if (m == NULL) {
+		printf("Unable to allocate metrics\n");
+		exit(EXIT_FAILURE);
+	}
+
+	m->prom = prom;
+	m->sock = -1;
+	if (interval < 1) interval = 1;
+	m->interval_ms = (uint32_t)interval * 1000;
+
+	if (!strncmp(dest, METRICS_UNIX_PREFIX, strlen(METRICS_UNIX_PREFIX))) {
+		dest += strlen(METRICS_UNIX_PREFIX);
+		m->is_unix = 1;
+	}
+
+	len = strlen(dest);
+	m->path = (char *)malloc(len + 1);
+	m->tmp_path = (char *)malloc(len + 5);
+	if (m->path == NULL || m->tmp_path == NULL) {
+		printf("Unable to allocate metrics\n");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(m->path, dest, len + 1);
+	snprintf(m->tmp_path, len + 5, "%s.tmp", dest);
+
+#if defined(_MSC_VER)
+	if (m->is_unix) {
+		log_error("Metrics over UNIX sockets are not supported\n");
+		metrics_free(m);
+		return MS_ERR;
+	}
+#endif
+
+	if (!m->is_unix && !m->prom) {
+		m->fd = fopen(m->path, "a");
+		if (m->fd == NULL) {
+			log_error("Unable to open metrics file %s\n", m->path);
+			metrics_free(m);
+			return MS_ERR;
+		}
+	}
+
+	m->freq = SDL_GetPerformanceFrequency();
+	m->start = m->last = SDL_GetPerformanceCounter();
+	m->last_tstates = ms->tstates;
+
+	ms->metrics = m;
+	metrics_publish(ms);
+
+	m->quit = SDL_CreateSemaphore(0);
+	if (m->quit != NULL)
+		m->thread = SDL_CreateThread(metrics_thread, "metrics", m);
+	if (m->thread == NULL) {
+		log_error("Failed to start metrics: %s\n", SDL_GetError());
+		ms->metrics = NULL;
+		metrics_free(m);
+		return MS_ERR;
+	}
+
+	return MS_OK;
+}
+
+void metrics_publish(ms_ctx *ms)
+{
+	struct ms_metrics *m = ms->metrics;
+
+	if (m == NULL) return;
+
+	SDL_AtomicAdd(&m->seq, 1);
+	m->snap.tstates = ms->tstates;
+	m->snap.frames = m->frames;
+	m->snap.df_written = ms->df_written;
+	m->snap.bp_hits = debug_bp_total(ms);
+	m->snap.power = (ms->power_state == MS_POWERSTATE_ON);
+	SDL_AtomicAdd(&m->seq, 1);
+}
+
+void metrics_frame(ms_ctx *ms)
+{
+	if (ms->metrics == NULL) return;
+
+	ms->metrics->frames++;
+	metrics_publish(ms);
+}
+
+void metrics_stop(ms_ctx *ms)
+{
+	struct ms_metrics *m = ms->metrics;
+
+	if (m == NULL) return;
+
+	metrics_publish(ms);
+	SDL_SemPost(m->quit);
+	SDL_WaitThread(m->thread, NULL);
+
+	ms->metrics = NULL;
+	metrics_free(m);
+}
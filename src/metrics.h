@@ -0,0 +1,70 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include "msemu.h"
+
+/* Periodic metrics output
+ *
+ * Reports the health of a running emulator so that a fleet of them can be
+ * monitored. Every few seconds a background thread writes a snapshot to a
+ * file, or to a UNIX socket if the destination is given as "unix:<path>".
+ *
+ * The emulation thread only copies a handful of counters in to a snapshot
+ * at the end of every frame, guarded by a sequence counter rather than a
+ * lock. The background thread retries its read if the sequence changed
+ * underneath it, so the emulation thread never waits on it.
+ *
+ * Snapshots are written as JSON, one object per line:
+ *
+ *   {"uptime":10.001,"tstates":120000000,"realtime":1.000,"frames":640,
+ *    "df_written":256,"bp_hits":0,"rss":9437184,"power":1}
+ *
+ * uptime	- Host seconds since metrics started
+ * tstates	- Z80 T states emulated
+ * realtime	- Emulated time over host time since the last snapshot, 1.0 is
+ *		  the speed of a real Mailstation
+ * frames	- Emulated 64 Hz frames
+ * df_written	- Bytes of dataflash programmed or erased
+ * bp_hits	- Debugger breakpoints hit
+ * rss		- Resident memory of the emulator in bytes, null if unknown
+ * power	- 1 if the Mailstation is powered on
+ *
+ * or with --metrics-prom, in the Prometheus text format with the same values
+ * named msemu_*. A Prometheus file is replaced as a whole on every snapshot
+ * so that a collector never sees a partial one, JSON lines are appended.
+ * Over a socket, each Prometheus snapshot ends with a "# EOF" line.
+ *
+ * A socket is connected to as a client, a collector must be listening on it.
+ * If it is not, or goes away, snapshots are dropped until it is back.
+ */
+
+/**
+ * Start writing metrics.
+ *
+ * *dest	- File path, or "unix:<path>" for a UNIX socket
+ * interval	- Seconds between snapshots
+ * prom		- Non-zero for Prometheus text rather than JSON lines
+ *
+ * Returns MS_OK on success, MS_ERR if the thread could not be started or
+ * sockets are not supported on this platform
+ */
+int metrics_start(ms_ctx *ms, const char *dest, int interval, int prom);
+
+/**
+ * Count a frame and update the snapshot. Called at the end of every frame,
+ * does nothing if metrics are not being written.
+ */
+void metrics_frame(ms_ctx *ms);
+
+/**
+ * Update the snapshot without counting a frame, e.g. on power changes.
+ */
+void metrics_publish(ms_ctx *ms);
+
+/**
+ * Write a last snapshot and stop the background thread.
+ * Does nothing if metrics are not being written.
+ */
+void metrics_stop(ms_ctx *ms);
+
+#endif // __METRICS_H__
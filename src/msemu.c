@@ -11,13 +11,29 @@
 #include <memory.h>
 #include <time.h>
 
+#include "capture.h"
+#include "coverage.h"
 #include "debug.h"
+#include "edges.h"
+#include "framelog.h"
+#include "fwdb.h"
+#include "hle.h"
 #include "mem.h"
+#include "metrics.h"
+#include "perf.h"
+#include "shm.h"
+#include "snapshot.h"
+#include "stats.h"
 #include "lcd.h"
 #include "msemu.h"
 #include "io.h"
+#include "kbd.h"
+#include "script.h"
 #include "sizes.h"
+#include "symbols.h"
+#include "text.h"
 #include "ui.h"
+#include "verify.h"
 
 #include <SDL2/SDL.h>
 #include <errno.h>
@@ -25,6 +41,10 @@
 #include <z80ex/z80ex.h>
 #include <z80ex/z80ex_dasm.h>
 
+/* Max time, in ms, to sleep waiting for UI events while nothing is being
+ * emulated. Only bounds how long a ctrl+c in the terminal can go unnoticed */
+#define MS_IDLE_WAIT_MS		250
+
 const char* const ms_dev_map_text[] = {
 	"CF",
 	"RAM",
@@ -62,20 +82,20 @@ static unsigned char hex2bcd (unsigned char x)
 static void ms_set_df_rnd_serial(ms_ctx *ms)
 {
 	int i;
-	uint8_t *df_buf = ms->df;
+	uint8_t sn[16];
+	uint8_t *df_buf = sn;
 	uint8_t rnd;
 
-	df_buf += DF_SN_OFFS;
-
 	for (i = 0; i < 15; i++) {
 		do {
-			rnd = rand();
+			rnd = ms_rand(ms);
 		} while (!isalnum(rnd));
 		*df_buf = rnd;
 		df_buf++;
 	}
 
 	*df_buf = '-';
+	mem_put(ms->df, DF_SN_OFFS, sn, sizeof(sn));
 }
 
 /* Check if serial number in dataflash buffer is valid for Mailstation
@@ -91,10 +111,11 @@ static void ms_set_df_rnd_serial(ms_ctx *ms)
 static int ms_serial_valid(ms_ctx *ms)
 {
 	int i;
-	uint8_t *df_buf = ms->df;
+	uint8_t sn[16];
+	uint8_t *df_buf = sn;
 	int ret = MS_OK;
 
-	df_buf += DF_SN_OFFS;
+	mem_get(ms->df, DF_SN_OFFS, sn, sizeof(sn));
 
 	for (i = 0; i < 16; i++) {
 		if (!isalnum(*df_buf) && *df_buf != '-') ret = MS_ERR;
@@ -123,7 +144,10 @@ void ms_power_on_reset(ms_ctx *ms)
 	io_init(ms);
 	ms->interrupt_mask = 0;
 	z80ex_reset(ms->z80);
-	ui_splashscreen_hide();
+	verify_sync(ms);
+	ui_splashscreen_hide(ms);
+	shm_publish(ms);
+	metrics_publish(ms);
 }
 
 //----------------------------------------------------------------------------
@@ -135,6 +159,10 @@ void ms_power_off(ms_ctx* ms)
 	ms->power_state = MS_POWERSTATE_OFF;
 	printf("POWER OFF\n");
 
+	/* Keys still queued would never be taken while off, and scripts wait
+	 * for the queue to drain */
+	kbd_flush(ms);
+
 	/* RAM needs to be re-initialized at power off. Simulating, as close
 	 * as possible, to real SRAM losing power and experiencing bit
 	 * corruption quickly. RAM is re-randomized, and if a bin was passed
@@ -142,7 +170,9 @@ void ms_power_off(ms_ctx* ms)
 	 */
 	ram_init(ms, NULL);
 
-	ui_splashscreen_show();
+	ui_splashscreen_show(ms);
+	shm_publish(ms);
+	metrics_publish(ms);
 }
 
 //----------------------------------------------------------------------------
@@ -153,6 +183,7 @@ void ms_power_hint(ms_ctx *ms)
 {
 	if (ms->power_state == MS_POWERSTATE_OFF &&
 	    ms->power_button_n == 0) {
+		log_debug(LOG_POWER, " * POWER Button wake\n");
 		ms_power_on_reset(ms);
 	}
 }
@@ -176,7 +207,7 @@ Z80EX_BYTE z80ex_mread(
 	int slot = ((addr & 0xC000) >> 14);
 	int dev, page;
 
-	debug_testbp(bpMR, addr);
+	debug_testbp(ms, bpMR, addr);
 
 	/* slot4 and slot8 are dynamic, if the requested address falls
 	 * in this range, then we need to set up the device we're going
@@ -208,6 +239,7 @@ Z80EX_BYTE z80ex_mread(
 		break;
 	}
 
+	STATS_INC(ms, dev_read[dev]);
 
 	/* Nearly all read functions are passed an absolute address inside the
 	 * device. This is generally calculated by taking the lower 14bits of
@@ -224,20 +256,28 @@ Z80EX_BYTE z80ex_mread(
 
 	  case MODEM:
 		ret = 0;
-		log_debug(" * MODEM R is not supported\n");
+		log_debug(LOG_MODEM, " * MODEM R is not supported\n");
 		break;
 
 	  case CF:
+		if (m1_state)
+			coverage_mark(ms, CF, (addr & ~0xC000) + (0x4000 * page));
 		ret = cf_read(ms, ((addr & ~0xC000) + (0x4000 * page)));
+		log_debug(LOG_CF, " * CF    R [%04X] -> %02X\n", addr, ret);
 		break;
 
 	  case DF:
+		if (m1_state)
+			coverage_mark(ms, DF, (addr & ~0xC000) + (0x4000 * page));
 		ret = df_read(ms, ((addr & ~0xC000) + (0x4000 * page)));
+		log_debug(LOG_DF, " * DF    R [%04X] -> %02X\n", addr, ret);
 		break;
 
 	  case RAM:
+		if (m1_state)
+			coverage_mark(ms, RAM, (addr & ~0xC000) + (0x4000 * page));
 		ret = ram_read(ms, ((addr & ~0xC000) + (0x4000 * page)));
-		log_debug(" * MEM   R [%04X] -> %02X\n", addr, ret);
+		log_debug(LOG_RAM, " * RAM   R [%04X] -> %02X\n", addr, ret);
 		break;
 
 	  default:
@@ -247,6 +287,8 @@ Z80EX_BYTE z80ex_mread(
 		break;
 	}
 
+	verify_access(ms, m1_state ? VE_MR_M1 : VE_MR, addr, ret);
+
 	return ret;
 }
 
@@ -268,7 +310,8 @@ void z80ex_mwrite(
 	int slot = ((addr & 0xC000) >> 14);
 	int dev = 0xFF, page = 0xFF;
 
-	debug_testbp(bpMW, addr);
+	verify_access(ms, VE_MW, addr, val);
+	debug_testbp(ms, bpMW, addr);
 
 	/* slot4 and slot8 are dynamic, if the requested address falls
 	 * in this range, then we need to set up the device we're going
@@ -300,6 +343,7 @@ void z80ex_mwrite(
 		break;
 	}
 
+	STATS_INC(ms, dev_write[dev]);
 
 	switch (dev) {
 	/* Nearly all read functions are passed an absolute address inside the
@@ -319,12 +363,12 @@ void z80ex_mwrite(
 		break;
 
 	  case MODEM:
-		log_debug(" * MODEM W is not supported\n");
+		log_debug(LOG_MODEM, " * MODEM W is not supported\n");
 		break;
 
 	  case RAM:
 		ram_write(ms, ((addr & ~0xC000) + (0x4000 * page)), val);
-		log_debug(" * MEM   W [%04X] <- %02X\n", addr, val);
+		log_debug(LOG_RAM, " * RAM   W [%04X] <- %02X\n", addr, val);
 		break;
 
 	  case CF:
@@ -340,6 +384,33 @@ void z80ex_mwrite(
 }
 
 
+/* Get the current time for the RTC. Normally this is the host's local time.
+ * With a fixed epoch, time starts there and advances with emulated time so
+ * that runs are repeatable; UTC is used so the host timezone doesn't matter.
+ * The result goes in tm, as instances on other threads may convert times
+ * at the same moment.
+ */
+static struct tm *ms_rtc_time(ms_ctx *ms, struct tm *tm)
+{
+	time_t now;
+
+	if (ms->epoch < 0) {
+		time(&now);
+#if defined(_MSC_VER)
+		return localtime_s(tm, &now) ? NULL : tm;
+#else
+		return localtime_r(&now, tm);
+#endif
+	}
+
+	now = (time_t)(ms->epoch + (int64_t)(ms->tstates / MS_CPU_HZ));
+#if defined(_MSC_VER)
+	return gmtime_s(tm, &now) ? NULL : tm;
+#else
+	return gmtime_r(&now, tm);
+#endif
+}
+
 /* z80ex Read from PORT callback function
  *
  * Return a Z80EX_BYTE (uint8_t) value of the requested PORT number.
@@ -357,8 +428,7 @@ Z80EX_BYTE z80ex_pread (
 
 	ms_ctx* ms = (ms_ctx*)user_data;
 
-	time_t theTime;
-	struct tm *rtc_time = NULL;
+	struct tm rtc_tm, *rtc_time = NULL;
 
 	uint16_t kbaddr;
 	uint8_t kbresult;
@@ -371,13 +441,14 @@ Z80EX_BYTE z80ex_pread (
 	 * be evaluated for the port number */
 	port &= 0xFF;
 
+	STATS_INC(ms, port_read[port]);
+
 	/* Get the time only if we're accessing timer registers */
 	if (port >= RTC_SEC && port <= RTC_10YR) {
-		time( &theTime );
-		rtc_time = localtime(&theTime);
+		rtc_time = ms_rtc_time(ms, &rtc_tm);
 	}
 
-	log_debug(" * IO    R [  %02X] -> %02X\n", port, io_read(ms, port));
+	log_io(port, " * IO    R [  %02X] -> %02X\n", port, io_read(ms, port));
 
 	switch (port) {
 	  case KEYBOARD:// emulate keyboard matrix output
@@ -464,6 +535,8 @@ Z80EX_BYTE z80ex_pread (
 		break;
 	}
 
+	verify_access(ms, VE_PR, port, ret);
+
 	return ret;
 }
 
@@ -487,17 +560,20 @@ void z80ex_pwrite (
 
 	ms_ctx* ms = (ms_ctx*)user_data;
 
+	verify_access(ms, VE_PW, port, val);
 
 	/* Z80 IO commands end up with the upper byte of the port address set,
 	 * this appears to be unused in the MS and only the lower byte should
 	 * be evaluated for the port number */
 	port &= 0xFF;
 
-	log_debug(" * IO    W [  %02X] <- %02X\n", port, val);
+	STATS_INC(ms, port_write[port]);
+
+	log_io(port, " * IO    W [  %02X] <- %02X\n", port, val);
 
 	switch (port) {
 	  case MISC2:
-		ui_update_led(!!(val & MISC2_LED_BIT));
+		ui_update_led(ms, !!(val & MISC2_LED_BIT));
 		io_write(ms, port, val);
 		break;
 
@@ -509,10 +585,24 @@ void z80ex_pwrite (
 
 	  // check for hardware power off bit in P28
 	  case UNKNOWN0x28:
+		log_debug(LOG_POWER, " * POWER P28 <- %02X\n", val);
 		if (val & 1) ms_power_off(ms);
 		io_write(ms, port, val);
 		break;
 
+	  // count changes to the memory map
+	  case SLOT4_DEV:
+	  case SLOT4_PAGE:
+		if (io_read(ms, port) != val) STATS_INC(ms, slot4_switch);
+		io_write(ms, port, val);
+		break;
+
+	  case SLOT8_DEV:
+	  case SLOT8_PAGE:
+		if (io_read(ms, port) != val) STATS_INC(ms, slot8_switch);
+		io_write(ms, port, val);
+		break;
+
 	  // otherwise just save written value
 	  default:
 		io_write(ms, port, val);
@@ -537,6 +627,10 @@ Z80EX_BYTE z80ex_intread (
 	Z80EX_CONTEXT *cpu,
 	void *user_data)
 {
+	ms_ctx* ms = (ms_ctx*)user_data;
+
+	verify_access(ms, VE_IR, 0, 0x00);
+
 	return 0x00;
 }
 
@@ -552,8 +646,6 @@ Z80EX_BYTE z80ex_intread (
  */
 int process_interrupts (ms_ctx* ms)
 {
-	static int icount = 0;
-
 	/* XXX: This is a hack and the whole interrupt system needs to be
 	 * refactored at some point in the future.
 	 * The next line is needed because of a potential condition where an
@@ -568,14 +660,15 @@ int process_interrupts (ms_ctx* ms)
 	if (!z80ex_int_possible(ms->z80)) return 0;
 
 	// Interrupt occurs at 64hz.  So this counter reduces to 1 sec intervals
-	if (icount++ >= 64)
+	if (ms->int_count++ >= 64)
 	{
-		icount = 0;
+		ms->int_count = 0;
 
 		// do time16 interrupt
 		if ((io_read(ms, IRQ_MASK) & 0x10) && !(ms->interrupt_mask & 0x10))
 		{
 			ms->interrupt_mask |= 0x10;
+			log_debug(LOG_INT, " * INT   Time16\n");
 			return z80ex_int(ms->z80);
 		}
 	}
@@ -584,6 +677,7 @@ int process_interrupts (ms_ctx* ms)
 	if ((io_read(ms, IRQ_MASK) & 2) && !(ms->interrupt_mask & 2))
 	{
 		ms->interrupt_mask |= 2;
+		log_debug(LOG_INT, " * INT   Keyboard\n");
 		return z80ex_int(ms->z80);
 	}
 
@@ -593,6 +687,7 @@ int process_interrupts (ms_ctx* ms)
 	 * and for some reason needs an interrupt more than just the two
 	 * masks that are used at the moment. There might be another timer?
 	 * Either way, this should be addressed at some point. */
+	log_debug(LOG_INT, " * INT   Unmasked\n");
 	return z80ex_int(ms->z80);
 	// Otherwise ignore this
 	return 0;
@@ -609,8 +704,9 @@ void ms_power_ac_set_status(ms_ctx *ms, int status)
 	} else {
 		ms->ac_status = status;
 	}
+	log_debug(LOG_POWER, " * POWER AC %s\n", ms->ac_status ? "GOOD" : "FAIL");
 
-	ui_update_ac(ms->ac_status);
+	ui_update_ac(ms, ms->ac_status);
 }
 
 /* Set battery voltage status, high, low, depleted
@@ -626,8 +722,48 @@ void ms_power_batt_set_status(ms_ctx *ms, int status)
 	} else {
 		ms->batt_status = status;
 	}
+	log_debug(LOG_POWER, " * POWER Battery %d\n", ms->batt_status);
 
-	ui_update_battery(ms->batt_status);
+	ui_update_battery(ms, ms->batt_status);
+}
+
+/* Release everything ms_init() set up, writing out the dataflash, counters
+ * and coverage first if save is set. Safe on a context that ms_init() only
+ * got part way through */
+static void ms_release(ms_ctx *ms, ms_opts *options, int save)
+{
+	if (save) {
+		if (options->stats_path != NULL)
+			stats_save(ms, options->stats_path);
+		if (options->coverage_path != NULL)
+			coverage_save(ms, options->coverage_path);
+		if (options->coverage_report_path != NULL)
+			coverage_report(ms, options->coverage_report_path);
+	} else {
+		// Nothing worth writing back from a machine that never ran
+		mem_free(ms->df, MS_DF_PAGES);
+	}
+	coverage_free(ms);
+	sym_free(ms);
+	script_free(ms);
+	text_free(ms);
+	framelog_deinit(ms);
+	capture_stop(ms);
+	shm_deinit(ms);
+	metrics_stop(ms);
+	perf_free(ms);
+	io_deinit(ms);
+	ram_deinit(ms);
+	lcd_deinit(ms);
+	cf_deinit(ms, options);
+	df_deinit(ms, options);
+	verify_stop(ms);
+	snap_untrack(ms);
+	edges_stop(ms);
+	hle_stop(ms);
+	debug_free(ms);
+	if (ms->z80 != NULL) z80ex_destroy(ms->z80);
+	ms->z80 = NULL;
 }
 
 int ms_init(ms_ctx* ms, ms_opts* options)
@@ -641,8 +777,21 @@ int ms_init(ms_ctx* ms, ms_opts* options)
 	 * 1bit buffer, this then translates to the 8bit buffer for SDLs use.
 	 */
 
-	/* Seed (non-critical) RNG with time */
-	srand((unsigned int)time(NULL));
+	if (options->debug_sections != NULL &&
+	    log_sections_set(options->debug_sections, 1)) return MS_ERR;
+
+	ms->opts = options;
+
+	/* Seed (non-critical) RNG with time, or the fixed epoch if one was
+	 * given so that RAM starts out the same every run. Instances created
+	 * in the same second still get different seeds */
+	ms->epoch = options->epoch;
+	if (ms->epoch < 0) {
+		ms->rng = (uint32_t)time(NULL) ^ (uint32_t)(uintptr_t)ms;
+	} else {
+		ms->rng = (uint32_t)ms->epoch;
+	}
+	ms->rng = (ms->rng * 2654435761u) | 1;
 
 	/* Initialize hardware states of the MailStation. */
 	ms->interrupt_mask = 0;
@@ -651,8 +800,11 @@ int ms_init(ms_ctx* ms, ms_opts* options)
 	ms_power_ac_set_status(ms, options->ac_start);
 	ms_power_batt_set_status(ms, options->batt_start);
 
-	/* Set up keyboard emulation array */
-	memset(ms->key_matrix, 0xff, sizeof(ms->key_matrix));
+	/* Set up keyboard emulation array and input queue */
+	kbd_init(ms);
+	ms->headless = options->headless;
+	ms->watch_pc = -1;
+	ms->watch_cf = -1;
 
 	/* Create and set up Z80 machine and access funcs */
 	ms->z80 = z80ex_create(
@@ -664,10 +816,10 @@ int ms_init(ms_ctx* ms, ms_opts* options)
 	);
 
 	/* Initialize buffers for emulating the various peripherals */
-	if (lcd_init(ms)) return MS_ERR;
-	if (io_init(ms)) return MS_ERR;
-	if (ram_init(ms, options)) return MS_ERR;
-	if (cf_init(ms, options) == ENOENT) return MS_ERR;
+	if (lcd_init(ms)) goto err;
+	if (io_init(ms)) goto err;
+	if (ram_init(ms, options)) goto err;
+	if (cf_init(ms, options) == ENOENT) goto err;
 
 	/* If opening a new, blank, DF buffer, then assign it a random MS
 	 * compatible serial number.
@@ -681,35 +833,180 @@ int ms_init(ms_ctx* ms, ms_opts* options)
 		printf("This may not be a dataflash image!\n\n");
 	}
 
+	if (options->font_path != NULL &&
+	    text_load_font(ms, options->font_path)) goto err;
+	if (options->script_path != NULL &&
+	    script_load(ms, options->script_path)) goto err;
+	if (framelog_init(ms, options->framelog_path,
+	    options->framelog_cmp_path)) goto err;
+	if (options->capture_path != NULL &&
+	    capture_start(ms, options->capture_path)) goto err;
+	if (options->shm_name != NULL &&
+	    shm_init(ms, options->shm_name)) goto err;
+	if (options->perf) perf_init(ms);
+	stats_init(ms, options->stats_path);
+	if (options->sym_path != NULL &&
+	    sym_load(ms, options->sym_path)) goto err;
+	/* A missing symbol map only costs the debugger its names, so do not
+	 * refuse to start over one named by a profile. */
+	if (options->sym_path == NULL && ms->fw->sym_path != NULL &&
+	    sym_load(ms, ms->fw->sym_path))
+		log_error("Failed to load symbol map of firmware '%s'\n",
+		  ms->fw->name);
+	if ((options->coverage_path != NULL ||
+	     options->coverage_merge_path != NULL ||
+	     options->coverage_report_path != NULL) &&
+	    coverage_init(ms, options->coverage_path)) goto err;
+	if (options->coverage_merge_path != NULL &&
+	    coverage_merge(ms, options->coverage_merge_path)) goto err;
+	if (options->metrics_path != NULL &&
+	    metrics_start(ms, options->metrics_path, options->metrics_interval,
+	    options->metrics_prom)) goto err;
+	if (options->verify_core != NULL &&
+	    verify_start(ms, options->verify_core, options->verify_interval))
+		goto err;
+	if (options->hle) hle_start(ms);
+	ms->idle_skip = options->idle_skip && ms->verify == NULL;
+
 	/* Set up debug hooks */
 	debug_init(ms, z80ex_mread);
-
-	printf("\nPress ctrl+c to enter interactive Mailstation debugger\n");
+	log_start();
 
 	return MS_OK;
-}
 
+err:
+	ms_release(ms, options, 0);
+	return MS_ERR;
+}
 int ms_deinit(ms_ctx *ms, ms_opts *options)
 {
-	io_deinit(ms);
-	ram_deinit(ms);
-	lcd_deinit(ms);
-	cf_deinit(ms, options);
-	df_deinit(ms, options);
+	ms_release(ms, options, 1);
+	log_stop();
 
 	return 0;
 }
 
+/* Show a new performance sample, on screen or in the terminal if there is
+ * no screen */
+static void ms_perf_report(ms_ctx *ms)
+{
+	char buf[256];
+	char *p;
+
+	perf_format(ms, buf, sizeof(buf));
+
+	if (!ms->headless) {
+		ui_set_overlay(ms, buf);
+		return;
+	}
+
+	for (p = buf; *p; p++) {
+		if (*p == '\n') *p = '|';
+	}
+	printf("%s\n", buf);
+}
+
+/* Nothing happens while the CPU is halted, or the firmware spins in its idle
+ * loop, until the next interrupt. Jump ahead to it, stopping short at the end
+ * of the run or the next queued key change. Time passes in whole 4 T state
+ * steps, the same as z80ex takes while halted, and R counts them */
+static void ms_idle_skip(ms_ctx *ms, uint64_t end)
+{
+	uint64_t until = ms->tstates + (MS_INT_PERIOD - ms->int_tstates);
+	uint64_t skip;
+	Z80EX_WORD r;
+
+	if (until > end) until = end;
+	if (until > ms->kbd_due) until = ms->kbd_due;
+	if (until <= ms->tstates) return;
+
+	skip = (until - ms->tstates + 3) & ~(uint64_t)3;
+	ms->int_tstates += (int)skip;
+	ms->tstates += skip;
+
+	if (z80ex_doing_halt(ms->z80)) {
+		r = z80ex_get_reg(ms->z80, regR);
+		z80ex_set_reg(ms->z80, regR,
+		  (r & 0x80) | ((r + (skip / 4)) & 0x7F));
+	}
+}
+
+/* Run the Z80 until the current interrupt period is up, or until the T state
+ * count reaches end, a breakpoint is hit or the PC a script waits for is
+ * reached. Once the period is up, take the interrupt and finish the frame.
+ *
+ * Returns MS_ERR if the frame did not match the frame log, MS_OK otherwise
+ */
+static int ms_exec(ms_ctx *ms, uint64_t end)
+{
+	/* XXX: interrupt_period can change if running at different freq */
+	int interrupt_period = MS_INT_PERIOD;
+	int tstates;
+	uint64_t start;
+	Z80EX_WORD pc;
+
+	while (ms->int_tstates < interrupt_period && ms->tstates < end) {
+		if (ms->tstates >= ms->kbd_due)
+			kbd_process(ms);
+
+		debug_dasm(ms);
+		start = ms->tstates;
+		verify_begin(ms, VE_STEP);
+		do {
+			tstates = z80ex_step(ms->z80);
+			ms->int_tstates += tstates;
+			ms->tstates += tstates;
+		} while (z80ex_last_op_type(ms->z80));
+		verify_end(ms, VE_STEP, (int)(ms->tstates - start));
+
+		pc = z80ex_get_reg(ms->z80, regPC);
+		while (hle_trap(ms, pc)) pc = z80ex_get_reg(ms->z80, regPC);
+		edges_mark(ms, pc);
+		if (debug_testbp(ms, bpPC, pc)) break;
+		if (pc == ms->watch_pc ||
+		    (ms->watch_cf >= 0 && cf_pc_addr(ms, pc) == ms->watch_cf)) {
+			ms->watch_hit = 1;
+			break;
+		}
+		if (ms->idle_skip && (z80ex_doing_halt(ms->z80) ||
+		    (ms->fw->idle_pc >= 0 &&
+		     cf_pc_addr(ms, pc) == ms->fw->idle_pc)))
+			ms_idle_skip(ms, end);
+	}
+
+	if (ms->int_tstates < interrupt_period) return MS_OK;
+
+	verify_begin(ms, VE_INT);
+	tstates = process_interrupts(ms);
+	verify_end(ms, VE_INT, tstates);
+	if (tstates) {
+		perf_int(ms);
+		STATS_INC(ms, ints);
+	}
+	ms->int_tstates += tstates;
+	ms->tstates += tstates;
+	ms->int_tstates %= interrupt_period;
+
+	/* End of a frame */
+	capture_frame(ms);
+	shm_publish(ms);
+	metrics_frame(ms);
+	if (framelog_frame(ms)) return MS_ERR;
+	if (verify_failed(ms)) return MS_ERR;
+
+	return MS_OK;
+}
+
 int ms_run(ms_ctx* ms)
 {
 	// TODO: Consider removing dependency on SDL here and having
 	//     hooks for the UI code to attach to instead.
 
 	int execute_counter = 0;
-	int tstate_counter = 0;
-	/* XXX: interrupt_period can change if running at different freq */
-	int interrupt_period = 187500;
 	int exitemu = 0;
+	int redraw = 1;
+	int exitcode = MS_OK;
+	int ret;
 	uint32_t lasttick = SDL_GetTicks();
 	uint32_t currenttick;
 
@@ -726,10 +1023,62 @@ int ms_run(ms_ctx* ms)
 
 	while (!exitemu)
 	{
-		if (debug_isbreak()) {
-			if (debug_prompt() == -1) break;
+		if (perf_tick(ms)) ms_perf_report(ms);
+		stats_poll(ms);
+
+		if (debug_isbreak(ms)) {
+			if (debug_prompt(ms) == -1) break;
 		}
 
+		/* Feed any scripted input. Once the script is done, a headless
+		 * emulator has nothing left to do. With a UI, control is just
+		 * handed back to the user. */
+		if (ms->script) {
+			ret = script_run(ms);
+			if (ret == SCRIPT_FAIL ||
+			    (ret == SCRIPT_DONE && ms->headless)) {
+				exitcode = ms->script_exit;
+				break;
+			}
+			if (ret == SCRIPT_DONE) script_free(ms);
+		}
+
+		/* While powered off, nothing but the splash screen is shown and
+		 * the only thing that can change that is user input. Rather
+		 * than spin on the event queue, sleep in the UI until an event
+		 * arrives and only redraw when one did. The wait is bounded so
+		 * a ctrl+c in the terminal still gets to the debugger promptly.
+		 *
+		 * A debugger break does not need the same treatment, the prompt
+		 * blocks on the terminal until a command is entered.
+		 *
+		 * Headless, the only thing that can power on the system is a
+		 * script. Without one, just sleep until ctrl+c.
+		 */
+		if (ms->power_state == MS_POWERSTATE_OFF) {
+			if (ms->headless) {
+				if (!ms->script) SDL_Delay(MS_IDLE_WAIT_MS);
+				continue;
+			}
+
+			if (redraw) {
+				perf_section(ms, PERF_UI);
+				ui_update_lcd(ms);
+				if (ui_render(ms)) perf_present(ms);
+				perf_section(ms, PERF_IDLE);
+				redraw = 0;
+			}
+
+			ret = ui_kbd_wait(ms, MS_IDLE_WAIT_MS);
+			if (ret < 0) break;
+			if (ret > 0) redraw = 1;
+
+			/* Don't let time spent asleep count towards execution */
+			lasttick = SDL_GetTicks();
+			continue;
+		}
+		redraw = 1;
+
 		/* XXX: Can replace with SDL_TICKS_PASSED with new
 		 * SDL version. */
 		currenttick = SDL_GetTicks();
@@ -746,51 +1095,231 @@ int ms_run(ms_ctx* ms)
 		 * stop and try to INT. The timer to raise an INT could be done
 		 * async to more accurately model the MS.
 		 *
-		 * The execution loop below will run until a pre-determined num
-		 * of T states has passed (based on default 12 MHz execution),
-		 * and the last Z80 step was a complete instruction and not a
-		 * prefix. Some opcodes actually have two bytes associated with
-		 * the actual instruction. After this, an INT is attempted.
+		 * The execution loop in ms_exec() will run until a
+		 * pre-determined num of T states has passed (based on default
+		 * 12 MHz execution), and the last Z80 step was a complete
+		 * instruction and not a prefix. Some opcodes actually have two
+		 * bytes associated with the actual instruction. After this, an
+		 * INT is attempted.
 		 *
 		 * Execution loop will only stop prematurely if a breakpoint on
-		 * the PC is hit. Interrupting with ctrl+c in terminal will
-		 * cause this loop to exit after the next instruction. Pressing
-		 * esc on the SDL window will only process after this loop has
-		 * completed.*/
+		 * the PC, or the PC a script is waiting for, is hit.
+		 * Interrupting with ctrl+c in terminal will cause this loop to
+		 * exit after the next instruction. Pressing esc on the SDL
+		 * window will only process after this loop has completed.
+		 *
+		 * Headless, there is nobody watching in real time, so bursts
+		 * are run back to back as fast as possible.*/
 		if (ms->power_state == MS_POWERSTATE_ON) {
+			perf_section(ms, PERF_EMU);
 			execute_counter += currenttick - lasttick;
-			if (execute_counter > 15 || debug_isbreak()) {
+			if (execute_counter > 15 || debug_isbreak(ms) ||
+			    ms->headless) {
 				if (execute_counter > 15) execute_counter = 0;
 
-				while (tstate_counter < interrupt_period) {
-					debug_dasm();
-					do {
-						tstate_counter += z80ex_step(ms->z80);
-					} while (z80ex_last_op_type(ms->z80));
-
-					if (debug_testbp(bpPC,
-					  z80ex_get_reg(ms->z80, regPC))) {
-						break;
-					}
+				if (ms_exec(ms, UINT64_MAX)) {
+					exitcode = MS_ERR;
+					break;
 				}
 			}
 
-			if (tstate_counter >= interrupt_period) {
-				tstate_counter += process_interrupts(ms);
-				tstate_counter %= interrupt_period;
+			perf_section(ms, PERF_IDLE);
+		}
+
+		// Update SDL ticks
+		lasttick = currenttick;
+
+		if (ms->headless) continue;
+
+		perf_section(ms, PERF_UI);
+		ui_update_lcd(ms);
+
+		if (ui_kbd_process(ms)) break;
+
+		if (ui_render(ms)) perf_present(ms);
+		perf_section(ms, PERF_IDLE);
+	}
+
+	if (framelog_finish(ms)) exitcode = MS_ERR;
+	if (verify_finish(ms)) exitcode = MS_ERR;
+
+	return exitcode;
+}
+
+int ms_step(ms_ctx *ms, uint64_t tstates)
+{
+	uint64_t end = ms->tstates + tstates;
+	int ret;
+
+	while (ms->tstates < end) {
+		stats_poll(ms);
+
+		if (debug_isbreak(ms)) {
+			ms->bp.hits = 0;
+			return MS_STEP_BREAK;
+		}
+
+		if (ms->script) {
+			ret = script_run(ms);
+			if (ret == SCRIPT_FAIL) return MS_STEP_ERR;
+			if (ret == SCRIPT_DONE) {
+				script_free(ms);
+				return MS_STEP_SCRIPT;
 			}
+		}
 
+		if (ms->power_state == MS_POWERSTATE_OFF) {
+			if (!ms->script) return MS_STEP_OFF;
+			continue;
 		}
 
-		ui_update_lcd();
+		if (ms_exec(ms, end)) return MS_STEP_ERR;
+	}
 
-		if (ui_kbd_process(ms)) break;
+	return MS_STEP_DONE;
+}
 
-		ui_render();
+void ms_opts_init(ms_opts *options)
+{
+	memset(options, 0, sizeof(*options));
+	options->df_save_to_disk = 1;
+	options->batt_start = BATT_HIGH;
+	options->ac_start = AC_GOOD;
+	options->headless = 1;
+	options->epoch = -1;
+	options->metrics_interval = 10;
+	options->verify_interval = 1;
+	options->hle = 0;
+	options->idle_skip = 1;
+}
 
-		// Update SDL ticks
-		lasttick = currenttick;
+ms_ctx *ms_create(ms_opts *options)
+{
+	ms_ctx *ms;
+
+	ms = (ms_ctx *)calloc(1, sizeof(ms_ctx));
+	if (ms == NULL) {
+		printf("Unable to allocate emulator\n");
+		exit(EXIT_FAILURE);
 	}
 
-	return MS_OK;
+	if (ms_init(ms, options)) {
+		free(ms);
+		return NULL;
+	}
+
+	return ms;
+}
+
+/* A clone owns the options it was made with, they are kept right after it
+ * so that ms_destroy() frees both */
+struct ms_clone {
+	ms_ctx ms;
+	ms_opts opts;
+};
+
+ms_ctx *ms_clone(ms_ctx *parent)
+{
+	struct ms_clone *c;
+	ms_ctx *ms;
+	int i;
+
+	c = (struct ms_clone *)malloc(sizeof(struct ms_clone));
+	if (c == NULL) {
+		printf("Unable to allocate emulator\n");
+		exit(EXIT_FAILURE);
+	}
+	ms = &c->ms;
+
+	/* Only what describes the machine carries over. The dataflash is
+	 * never written back, and the codeflash stays the parent's */
+	ms_opts_init(&c->opts);
+	c->opts.cf_path = parent->opts->cf_path;
+	c->opts.cf_shared = parent->cf;
+	c->opts.df_path = parent->opts->df_path;
+	c->opts.ram_path = parent->opts->ram_path;
+	c->opts.df_save_to_disk = 0;
+	c->opts.batt_start = parent->opts->batt_start;
+	c->opts.ac_start = parent->opts->ac_start;
+	c->opts.epoch = parent->opts->epoch;
+
+	/* Start from a copy of all of the machine state, then take back
+	 * everything that belongs to the parent alone */
+	memcpy(ms, parent, sizeof(ms_ctx));
+	ms->opts = &c->opts;
+	ms->cf_shared = 1;
+	ms->headless = 1;
+	ms->ui = NULL;
+	ms->script = NULL;
+	ms->text = NULL;
+	ms->framelog = NULL;
+	ms->capture = NULL;
+	ms->shm = NULL;
+	ms->perf = NULL;
+	ms->stats_path = NULL;
+	ms->metrics = NULL;
+	ms->coverage = NULL;
+	ms->syms = NULL;
+	ms->verify = NULL;
+	ms->dirty = NULL;
+	ms->edges = NULL;
+	ms->hle = NULL;
+	ms->dasm = NULL;
+	ms->bp.sigint = 0;
+
+	memset(ms->df, 0, sizeof(ms->df));
+	memset(ms->ram, 0, sizeof(ms->ram));
+	memset(ms->ram_image, 0, sizeof(ms->ram_image));
+	mem_share(ms->df, parent->df, MS_DF_PAGES);
+	mem_share(ms->ram, parent->ram, MS_RAM_PAGES);
+	if (parent->ram_image[0] != NULL)
+		mem_share(ms->ram_image, parent->ram_image, MS_RAM_PAGES);
+
+	// IO and the 1-bit LCD are small enough to copy outright
+	ms->io = NULL;
+	ms->lcd_dat1bit = NULL;
+	ms->lcd_datRGBA8888 = NULL;
+	io_init(ms);
+	lcd_init(ms);
+	memcpy(ms->io, parent->io, SZ_256);
+	memcpy(ms->lcd_dat1bit, parent->lcd_dat1bit,
+	  (MS_LCD_WIDTH * MS_LCD_HEIGHT) / 8);
+	ms->lcd_cas = parent->lcd_cas;
+	ms->lcd_dirty = parent->lcd_dirty;
+
+	ms->z80 = z80ex_create(
+		z80ex_mread, (void*)ms,
+		z80ex_mwrite, (void*)ms,
+		z80ex_pread, (void*)ms,
+		z80ex_pwrite, (void*)ms,
+		z80ex_intread, (void*)ms
+	);
+	for (i = 0; i <= regIFF2; i++) {
+		z80ex_set_reg(ms->z80, (Z80_REG_T)i,
+		  z80ex_get_reg(parent->z80, (Z80_REG_T)i));
+	}
+
+	hle_clone(ms, parent);
+	log_start();
+
+	return ms;
+}
+
+void ms_destroy(ms_ctx *ms)
+{
+	if (ms == NULL) return;
+
+	ui_deinit(ms);
+	ms_deinit(ms, ms->opts);
+	free(ms);
+}
+
+uint32_t ms_rand(ms_ctx *ms)
+{
+	/* xorshift32, plenty for SRAM noise and serial numbers */
+	ms->rng ^= ms->rng << 13;
+	ms->rng ^= ms->rng >> 17;
+	ms->rng ^= ms->rng << 5;
+
+	return ms->rng;
 }
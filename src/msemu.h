@@ -12,6 +12,22 @@
 #define MS_POWERSTATE_ON  1
 #define MS_POWERSTATE_OFF 0
 
+// Default Z80 clock rate
+#define MS_CPU_HZ         12000000
+
+/* Number of T states between the 64 Hz timer/keyboard interrupts when running
+ * at the default 12 MHz. */
+#define MS_INT_PERIOD     (MS_CPU_HZ / 64)
+
+/* Max number of key matrix changes that can be waiting to be applied */
+#define MS_KBD_QUEUE_LEN  1024
+
+/* RAM and dataflash are kept in pages of this many bytes, which instances
+ * cloned from one another share until written. See mem.h */
+#define MS_PAGE_LEN       4096
+#define MS_RAM_PAGES      (0x20000 / MS_PAGE_LEN)
+#define MS_DF_PAGES       (0x80000 / MS_PAGE_LEN)
+
 enum ms_dev_map {
 	CF    = 0x00,
 	RAM   = 0x01,
@@ -36,18 +52,107 @@ enum ms_batt_status {
 	BATT_CYCLE,
 };
 
+/* A single pending change to the key matrix. See kbd.h */
+typedef struct ms_kbd_event {
+	// Emulated T state at which the change is applied
+	uint64_t tstate;
+	uint8_t row;
+	uint8_t bit;
+	uint8_t down;
+} ms_kbd_event;
+
+/* Access counters, see stats.h. Devices are indexed by the device number as
+ * written to the slot registers, so that accesses to devices that do not
+ * exist are counted too */
+#define MS_STATS_DEVS     16
+
+struct ms_stats {
+	uint64_t dev_read[MS_STATS_DEVS];
+	uint64_t dev_write[MS_STATS_DEVS];
+	uint64_t port_read[256];
+	uint64_t port_write[256];
+	uint64_t slot4_switch;
+	uint64_t slot8_switch;
+	uint64_t ints;
+	uint64_t df_erase;
+	uint64_t df_chip_erase;
+	uint64_t df_program;
+};
+
+/* Debugger breakpoints, see debug.h. -1 if unused */
+struct ms_bp {
+	int32_t mr;
+	int32_t mw;
+	int32_t pc;
+
+	// Hit since the debugger prompt was last left, and since init
+	int32_t hits;
+	uint32_t total;
+
+	// Set on the one instance that ctrl+c in the terminal breaks in to
+	int sigint;
+};
+
+struct ms_opts;
+struct ms_script;
+struct ms_text;
+struct ms_framelog;
+struct ms_capture;
+struct ms_shm;
+struct ms_perf;
+struct ms_metrics;
+struct ms_coverage;
+struct ms_symbols;
+struct ms_verify;
+struct ms_dirty;
+struct ms_edges;
+struct fw_profile;
+struct ms_hle;
+struct ms_dasm;
+struct ms_page;
+struct ms_ui;
+
 typedef struct ms_ctx {
 	Z80EX_CONTEXT* z80;
 
+	// Options the instance was initialized with
+	struct ms_opts *opts;
+
 	uint8_t *io;
-	uint8_t *df;
+	struct ms_page *df[MS_DF_PAGES];
 	uint8_t *cf;
-	uint8_t *ram;
-	uint8_t *ram_image;
 
+	// Set if cf is shared with other instances and not owned by this one
+	int cf_shared;
+
+	/* hash64() of the codeflash, and what is known about the firmware in
+	 * it. See fwdb.h */
+	uint64_t cf_hash;
+	const struct fw_profile *fw;
+
+	// Skip ahead while idle, see ms_opts.idle_skip
+	int idle_skip;
+
+	/* Dataflash command state machine, cycle of the current command and
+	 * the command itself. See df_write() */
+	uint8_t df_cycle;
+	uint8_t df_cmd;
+
+	// Software data protection state of the dataflash, see mem.c
+	uint8_t df_wp;
+
+	/* RAM, and the image it is reloaded from at power on if one was
+	 * given. ram_image[0] is NULL otherwise */
+	struct ms_page *ram[MS_RAM_PAGES];
+	struct ms_page *ram_image[MS_RAM_PAGES];
+
+	// NULL if headless, only the UI draws the RGB buffer
 	uint32_t *lcd_datRGBA8888;
 	uint8_t *lcd_dat1bit;
 
+	// Set when the LCD buffers change, cleared once the UI has drawn them
+	int lcd_dirty;
+
 	// Stores current selected LCD column.
 	int lcd_cas;
 
@@ -57,6 +162,105 @@ typedef struct ms_ctx {
 
 	uint8_t key_matrix[10];
 
+	/* Key matrix changes are not written to key_matrix directly. They
+	 * are queued, stamped with the emulated T state they take effect at,
+	 * and applied by the execution loop once that time is reached. This
+	 * keeps presses and releases that arrive close together from being
+	 * merged before the firmware had a chance to scan them.
+	 * kbd_next is the earliest T state the next queued change may use.
+	 * kbd_due caches the stamp of the oldest queued event so the
+	 * execution loop only needs a single compare per instruction. */
+	ms_kbd_event kbd_queue[MS_KBD_QUEUE_LEN];
+	unsigned int kbd_head;
+	unsigned int kbd_tail;
+	uint64_t kbd_next;
+	uint64_t kbd_due;
+
+	// Total number of T states emulated since init
+	uint64_t tstates;
+
+	/* T states since the last interrupt period ended, and interrupt
+	 * periods since the last Time16 interrupt */
+	int int_tstates;
+	int int_count;
+
+	// State of the (non-critical) RNG, see ms_rand()
+	uint32_t rng;
+
+	// Debugger breakpoints
+	struct ms_bp bp;
+
+	// SDL window, if any. See ui.h
+	struct ms_ui *ui;
+
+	// Run without any UI and without pacing emulation to real time
+	int headless;
+
+	// Input script being run, if any. See script.h
+	struct ms_script *script;
+	int script_exit;
+
+	/* PC address watched on behalf of a script, -1 if unused. When the
+	 * PC reaches it, watch_hit is set and the current burst of execution
+	 * is cut short so the script can react right away. watch_cf is the
+	 * same for a physical codeflash address, so only hit with the right
+	 * page mapped in. */
+	int32_t watch_pc;
+	int32_t watch_cf;
+	int watch_hit;
+
+	// Glyph table for reading text off of the LCD, if any. See text.h
+	struct ms_text *text;
+
+	// LCD frame hash log, if enabled. See framelog.h
+	struct ms_framelog *framelog;
+
+	// LCD capture in progress, if any. See capture.h
+	struct ms_capture *capture;
+
+	// Shared memory state export, if enabled. See shm.h
+	struct ms_shm *shm;
+
+	// Performance statistics, if enabled. See perf.h
+	struct ms_perf *perf;
+
+	/* Access counters, only updated when built with ENABLE_STATS, and
+	 * where to write them on SIGUSR1. See stats.h */
+	struct ms_stats stats;
+	const char *stats_path;
+	int stats_seen;
+
+	// Periodic metrics output, if enabled. See metrics.h
+	struct ms_metrics *metrics;
+
+	// Bytes of dataflash programmed or erased since init
+	uint64_t df_written;
+
+	// Opcode fetch coverage, if enabled. See coverage.h
+	struct ms_coverage *coverage;
+
+	// Symbol map, if loaded. See symbols.h
+	struct ms_symbols *syms;
+
+	// Lockstep CPU verification, if enabled. See verify.h
+	struct ms_verify *verify;
+
+	// Pages of RAM and dataflash written, if tracked. See snapshot.h
+	struct ms_dirty *dirty;
+
+	// Edge hit counts for fuzzing, if enabled. See edges.h
+	struct ms_edges *edges;
+
+	// Firmware routines run in C, if enabled. See hle.h
+	struct ms_hle *hle;
+
+	// Disassembly cache, once traced. See debug_dasm()
+	struct ms_dasm *dasm;
+
+	/* If not negative, the RTC reports this many seconds since the Unix
+	 * epoch plus elapsed emulated time, rather than the host clock */
+	int64_t epoch;
+
 	// Holds current power state (on or off)
 	// XXX: I think this can go away?
 	uint8_t power_state;
@@ -88,6 +292,10 @@ typedef struct ms_opts {
 	// Codeflash path
 	char *cf_path;
 
+	/* Codeflash image shared between instances, used instead of cf_path
+	 * if not NULL. See ms_cf_load() */
+	const uint8_t *cf_shared;
+
 	// Dataflash path
 	char *df_path;
 
@@ -102,6 +310,70 @@ typedef struct ms_opts {
 
 	// Initial AC state;
 	int ac_start;
+
+	// Run without a UI, as fast as possible
+	int headless;
+
+	// Input script path, NULL if none
+	char *script_path;
+
+	// Glyph table path for reading LCD text, NULL if none
+	char *font_path;
+
+	// Paths to write LCD frame hash log to and to compare against
+	char *framelog_path;
+	char *framelog_cmp_path;
+
+	// Path to capture LCD to as an animated GIF, NULL if none
+	char *capture_path;
+
+	// Name of shared memory segment to export state to, NULL if none
+	char *shm_name;
+
+	// Track performance statistics from the start
+	int perf;
+
+	// Debug sections to turn on from the start, NULL if none. See log.h
+	char *debug_sections;
+
+	/* Coverage file to accumulate in to, another to merge in, and where to
+	 * write a report, each NULL if none */
+	char *coverage_path;
+	char *coverage_merge_path;
+	char *coverage_report_path;
+
+	// Symbol map path, NULL if none
+	char *sym_path;
+
+	// Path to write access counters to on exit, NULL if none
+	char *stats_path;
+
+	/* Where to write metrics to, NULL if none, seconds between snapshots,
+	 * and whether to use Prometheus text rather than JSON lines */
+	char *metrics_path;
+	int metrics_interval;
+	int metrics_prom;
+
+	/* CPU core to check against z80ex in lockstep, NULL if none, and
+	 * instructions between register comparisons */
+	char *verify_core;
+	int verify_interval;
+
+	/* Run the firmware's routines that have handlers in C rather than on
+	 * the Z80, see hle.h. Off by default, no firmware has a built-in
+	 * profile with hooks yet */
+	int hle;
+
+	// Firmware database to add to the built in one, NULL if none
+	char *fwdb_path;
+
+	/* Skip ahead to the next interrupt while the CPU is halted or in the
+	 * firmware's idle loop */
+	int idle_skip;
+
+	/* Fixed start time for the RTC, and seed for RAM contents, to make runs
+	 * repeatable. Negative to use the host clock */
+	int64_t epoch;
 } ms_opts;
 
 /**
@@ -110,7 +382,8 @@ typedef struct ms_opts {
  * ms      - ref to mailstation emulator
  * options - initialization options
  *
- * Returns `MS_OK` on success, error code on failure
+ * Returns `MS_OK` on success, error code on failure. On failure, everything
+ * set up so far has been released again and nothing is written to disk
  */
 int ms_init(ms_ctx* ms, ms_opts* options);
 int ms_deinit(ms_ctx* ms, ms_opts* options);
@@ -124,6 +397,99 @@ int ms_deinit(ms_ctx* ms, ms_opts* options);
  */
 int ms_run(ms_ctx* ms);
 
+/* Embedding
+ *
+ * Nothing in the core is global, any number of instances can be created and
+ * each run on a thread of its own, as long as a given instance is only ever
+ * used from one thread at a time. Instances without a window never touch
+ * SDL video or input. The debug output settings (see log.h) and the writer
+ * behind them are shared by every instance in the process.
+ *
+ * Codeflash is never written, so instances running the same firmware can
+ * share one copy of it, see ms_opts.cf_shared.
+ *
+ * A typical user of libmsemu does:
+ *
+ *	cf = ms_cf_load("codeflash.bin");
+ *	ms_opts_init(&opts);
+ *	opts.cf_shared = cf;
+ *	opts.df_path = "dataflash.bin";
+ *	opts.script_path = "boot.script";
+ *	ms = ms_create(&opts);
+ *	while (ms_step(ms, MS_CPU_HZ) == MS_STEP_DONE) ...;
+ *	ms_destroy(ms);
+ *	ms_cf_free(cf);
+ */
+
+// Return values of ms_step()
+#define MS_STEP_DONE      0	// Ran for the number of T states asked for
+#define MS_STEP_ERR       1	// Script failed or frame log mismatch
+#define MS_STEP_OFF       2	// Powered off, with no script to power on
+#define MS_STEP_BREAK     3	// Hit a breakpoint
+#define MS_STEP_SCRIPT    4	// Script finished, see ms_ctx.script_exit
+
+/**
+ * Set options to the defaults, headless with no files.
+ */
+void ms_opts_init(ms_opts *options);
+
+/**
+ * Allocate and initialize an emulator instance. options must stay valid
+ * until ms_destroy().
+ *
+ * Returns the new instance, or NULL on error
+ */
+ms_ctx *ms_create(ms_opts *options);
+
+/**
+ * Run an instance for a number of T states, as fast as possible.
+ *
+ * Scripted input is fed as the emulation goes, the same as ms_run(). A hit
+ * breakpoint stops the run early and is cleared, calling again continues.
+ *
+ * Returns one of MS_STEP_*
+ */
+int ms_step(ms_ctx *ms, uint64_t tstates);
+
+/**
+ * Create a new instance that is an exact copy of parent, at the same point in
+ * time, which then runs on its own.
+ *
+ * RAM and dataflash are not copied, the clone shares parent's pages until
+ * either of them writes one, so cloning costs about as much as the page
+ * tables and the 1-bit LCD buffer. Thousands of clones of one machine can be
+ * kept alive to explore different inputs from the same state.
+ *
+ * The clone is headless and has none of parent's window, script, logs,
+ * captures, coverage, verification or dirty tracking. It never writes its
+ * dataflash back to disk. It uses parent's codeflash, so unless that came
+ * from ms_opts.cf_shared, parent must outlive the clone. A HALT that is in
+ * progress is not carried over, the same as with snapshots. parent must not
+ * be running while it is cloned.
+ *
+ * Returns the new instance, free it with ms_destroy()
+ */
+ms_ctx *ms_clone(ms_ctx *parent);
+
+/**
+ * Deinitialize and free an instance from ms_create() or ms_clone().
+ */
+void ms_destroy(ms_ctx *ms);
+
+/**
+ * Load a codeflash image that can be shared between instances.
+ *
+ * Returns the image, NULL on error
+ */
+const uint8_t *ms_cf_load(const char *path);
+void ms_cf_free(const uint8_t *cf);
+
+/**
+ * Returns the next value of the instance's RNG. Seeded from the host clock,
+ * or ms_opts.epoch if set, so that runs with a fixed epoch are repeatable.
+ */
+uint32_t ms_rand(ms_ctx *ms);
+
 void ms_power_on_reset(ms_ctx *ms);
 void ms_power_hint(ms_ctx *ms);
 void ms_power_batt_set_status(ms_ctx *ms, int status);
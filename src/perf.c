@@ -0,0 +1,131 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL2/SDL.h>
+
+#include "msemu.h"
+#include "perf.h"
+
+struct ms_perf {
+	uint64_t freq;
+
+	// Counter value at the last section switch, and the current section
+	uint64_t last;
+	enum perf_section cur;
+
+	// Totals for the current window
+	uint64_t start;
+	uint64_t tstates;
+	uint64_t time[PERF_SECTIONS];
+	uint32_t frames;
+	uint32_t ints;
+
+	struct perf_stats stats;
+};
+
+void perf_init(ms_ctx *ms)
+{
+	struct ms_perf *p;
+
+	if (ms->perf != NULL) return;
+
+	p = (struct ms_perf *)calloc(1, sizeof(struct ms_perf));
+	if (p == NULL) {
+		printf("Unable to allocate performance stats\n");
+		exit(EXIT_FAILURE);
+	}
+
+	p->freq = SDL_GetPerformanceFrequency();
+	p->start = p->last = SDL_GetPerformanceCounter();
+	p->tstates = ms->tstates;
+	p->cur = PERF_IDLE;
+
+	ms->perf = p;
+}
+
+void perf_free(ms_ctx *ms)
+{
+	free(ms->perf);
+	ms->perf = NULL;
+}
+
+void perf_section(ms_ctx *ms, enum perf_section section)
+{
+	struct ms_perf *p = ms->perf;
+	uint64_t now;
+
+	if (p == NULL) return;
+
+	now = SDL_GetPerformanceCounter();
+	p->time[p->cur] += now - p->last;
+	p->last = now;
+	p->cur = section;
+}
+
+void perf_present(ms_ctx *ms)
+{
+	if (ms->perf) ms->perf->frames++;
+}
+
+void perf_int(ms_ctx *ms)
+{
+	if (ms->perf) ms->perf->ints++;
+}
+
+int perf_tick(ms_ctx *ms)
+{
+	struct ms_perf *p = ms->perf;
+	uint64_t now, elapsed;
+	float secs;
+	int i;
+
+	if (p == NULL) return 0;
+
+	now = SDL_GetPerformanceCounter();
+	elapsed = now - p->start;
+	if (elapsed < p->freq) return 0;
+
+	/* Close out the current section so the window adds up */
+	p->time[p->cur] += now - p->last;
+	p->last = now;
+
+	secs = (float)elapsed / (float)p->freq;
+	p->stats.fps = p->frames / secs;
+	p->stats.mhz = (float)(ms->tstates - p->tstates) / secs / 1000000.0f;
+	p->stats.realtime = (p->stats.mhz * 100.0f) /
+	  (MS_CPU_HZ / 1000000.0f);
+	p->stats.ints = (uint32_t)((p->ints / secs) + 0.5f);
+	for (i = 0; i < PERF_SECTIONS; i++) {
+		p->stats.pct[i] = (p->time[i] * 100.0f) / elapsed;
+		p->time[i] = 0;
+	}
+
+	p->start = now;
+	p->tstates = ms->tstates;
+	p->frames = 0;
+	p->ints = 0;
+
+	return 1;
+}
+
+int perf_format(ms_ctx *ms, char *buf, size_t len)
+{
+	struct perf_stats *s;
+	int n;
+
+	if (ms->perf == NULL || len == 0) return 0;
+	s = &ms->perf->stats;
+
+	n = snprintf(buf, len,
+	  "FPS  %5.1f\n"
+	  "Z80  %5.2f MHz %4.0f%%\n"
+	  "INT  %5u/s\n"
+	  "HOST emu %3.0f%% ui %3.0f%% idle %3.0f%%",
+	  s->fps, s->mhz, s->realtime, s->ints, s->pct[PERF_EMU],
+	  s->pct[PERF_UI], s->pct[PERF_IDLE]);
+	if (n < 0) n = 0;
+	if ((size_t)n >= len) n = (int)len - 1;
+
+	return n;
+}
@@ -0,0 +1,79 @@
+#ifndef __PERF_H__
+#define __PERF_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "msemu.h"
+
+/* Performance statistics
+ *
+ * Tracks how fast the emulator is running compared to a real Mailstation
+ * and where the host's time goes. The execution loop marks which section it
+ * is in, and the time between marks is charged to that section. Everything
+ * is summed over a one second window, at the end of which a new sample is
+ * ready for the on-screen overlay or, headless, the terminal.
+ *
+ * Times are wall clock time of the emulator thread. Idle is anything that
+ * is not emulation or UI work, i.e. waiting for the next burst or for input.
+ *
+ * Nothing is tracked unless enabled, either with --perf or by pressing
+ * right ctrl + f in the UI.
+ */
+
+enum perf_section {
+	PERF_IDLE = 0,
+	PERF_EMU,
+	PERF_UI,
+
+	PERF_SECTIONS,
+};
+
+struct perf_stats {
+	float fps;		// Frames presented per second
+	float mhz;		// Emulated Z80 clock
+	float realtime;		// Percent of real Mailstation speed
+	float pct[PERF_SECTIONS];	// Percent of host time in each section
+	uint32_t ints;		// Interrupts taken per second
+};
+
+/**
+ * Start tracking. Does nothing if already tracking.
+ */
+void perf_init(ms_ctx *ms);
+
+/**
+ * Stop tracking.
+ */
+void perf_free(ms_ctx *ms);
+
+/**
+ * Charge the time since the last call to the section the loop was in, and
+ * switch to a new section.
+ */
+void perf_section(ms_ctx *ms, enum perf_section section);
+
+/**
+ * Count a frame presented to the screen.
+ */
+void perf_present(ms_ctx *ms);
+
+/**
+ * Count an interrupt taken by the Z80.
+ */
+void perf_int(ms_ctx *ms);
+
+/**
+ * Called once per pass of the execution loop.
+ *
+ * Returns 1 if a new sample is ready, 0 otherwise
+ */
+int perf_tick(ms_ctx *ms);
+
+/**
+ * Format the last sample as text, lines separated by '\n'.
+ *
+ * Returns length of the text
+ */
+int perf_format(ms_ctx *ms, char *buf, size_t len);
+
+#endif // __PERF_H__
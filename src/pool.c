@@ -0,0 +1,270 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL2/SDL.h>
+
+#include "debug.h"
+#include "pool.h"
+
+#define POOL_DEQUE_START	64
+
+struct pool_task {
+	pool_fn fn;
+	void *arg;
+};
+
+/* Circular buffer of tasks, size is a power of two. The owner pushes and
+ * pops at tail, thieves take from head */
+struct pool_deque {
+	SDL_mutex *lock;
+	struct pool_task *tasks;
+	unsigned int size;
+	unsigned int head;
+	unsigned int tail;
+};
+
+struct pool_worker {
+	struct ms_pool *pool;
+	int idx;
+	SDL_Thread *thread;
+	SDL_threadID id;
+	struct pool_deque dq;
+};
+
+struct ms_pool {
+	int n;
+	int started;
+	struct pool_worker *w;
+
+	// Posted once per queued task, and once per worker to stop
+	SDL_sem *work;
+	SDL_atomic_t quit;
+
+	// Next worker to hand a task from outside of the pool to
+	SDL_atomic_t next;
+
+	// Tasks submitted but not yet finished, and pool_wait() on that
+	SDL_mutex *done_lock;
+	SDL_cond *done;
+	int pending;
+};
+
+static void pool_push(struct pool_deque *dq, pool_fn fn, void *arg)
+{
+	struct pool_task *tasks;
+	unsigned int i, cnt;
+
+	SDL_LockMutex(dq->lock);
+	cnt = dq->tail - dq->head;
+	if (cnt == dq->size) {
+		tasks = (struct pool_task *)malloc(
+		  dq->size * 2 * sizeof(struct pool_task));
+		if (tasks == NULL) {
+			printf("Unable to allocate task queue\n");
+			exit(EXIT_FAILURE);
+		}
+		for (i = 0; i < cnt; i++)
+			tasks[i] = dq->tasks[(dq->head + i) & (dq->size - 1)];
+		free(dq->tasks);
+		dq->tasks = tasks;
+		dq->size *= 2;
+		dq->head = 0;
+		dq->tail = cnt;
+	}
+	dq->tasks[dq->tail & (dq->size - 1)].fn = fn;
+	dq->tasks[dq->tail & (dq->size - 1)].arg = arg;
+	dq->tail++;
+	SDL_UnlockMutex(dq->lock);
+}
+
+// Newest task from the owner's end
+static int pool_pop(struct pool_deque *dq, struct pool_task *task)
+{
+	int ret = 0;
+
+	SDL_LockMutex(dq->lock);
+	if (dq->tail != dq->head) {
+		dq->tail--;
+		*task = dq->tasks[dq->tail & (dq->size - 1)];
+		ret = 1;
+	}
+	SDL_UnlockMutex(dq->lock);
+
+	return ret;
+}
+
+// Oldest task from the other end
+static int pool_steal(struct pool_deque *dq, struct pool_task *task)
+{
+	int ret = 0;
+
+	SDL_LockMutex(dq->lock);
+	if (dq->tail != dq->head) {
+		*task = dq->tasks[dq->head & (dq->size - 1)];
+		dq->head++;
+		ret = 1;
+	}
+	SDL_UnlockMutex(dq->lock);
+
+	return ret;
+}
+
+static int pool_take(struct ms_pool *pool, int idx, struct pool_task *task)
+{
+	int i;
+
+	if (pool_pop(&pool->w[idx].dq, task)) return 1;
+	for (i = 1; i < pool->n; i++) {
+		if (pool_steal(&pool->w[(idx + i) % pool->n].dq, task))
+			return 1;
+	}
+
+	return 0;
+}
+
+static int pool_thread(void *data)
+{
+	struct pool_worker *w = (struct pool_worker *)data;
+	struct ms_pool *pool = w->pool;
+	struct pool_task task;
+
+	for (;;) {
+		SDL_SemWait(pool->work);
+
+		/* Every post but the ones to stop is for a task that is in a
+		 * deque, or was taken by a worker that woke for another. Look
+		 * until one turns up */
+		while (!pool_take(pool, w->idx, &task)) {
+			if (SDL_AtomicGet(&pool->quit)) return 0;
+			SDL_Delay(0);
+		}
+
+		task.fn(task.arg, w->idx);
+
+		SDL_LockMutex(pool->done_lock);
+		if (--pool->pending == 0) SDL_CondBroadcast(pool->done);
+		SDL_UnlockMutex(pool->done_lock);
+	}
+}
+
+struct ms_pool *pool_create(int threads)
+{
+	struct ms_pool *pool;
+	struct pool_worker *w;
+	int i;
+
+	if (threads < 1) threads = SDL_GetCPUCount();
+	if (threads < 1) threads = 1;
+
+	pool = (struct ms_pool *)calloc(1, sizeof(struct ms_pool));
+	if (pool != NULL)
+		pool->w = (struct pool_worker *)calloc(threads,
+		  sizeof(struct pool_worker));
+	if (pool == NULL || pool->w == NULL) {
+		printf("Unable to allocate thread pool\n");
+		exit(EXIT_FAILURE);
+	}
+
+	pool->work = SDL_CreateSemaphore(0);
+	pool->done_lock = SDL_CreateMutex();
+	pool->done = SDL_CreateCond();
+	if (pool->work == NULL || pool->done_lock == NULL ||
+	    pool->done == NULL) {
+		log_error("Failed to create thread pool: %s\n", SDL_GetError());
+		goto err;
+	}
+
+	pool->n = threads;
+	for (i = 0; i < threads; i++) {
+		w = &pool->w[i];
+		w->pool = pool;
+		w->idx = i;
+		w->dq.size = POOL_DEQUE_START;
+		w->dq.tasks = (struct pool_task *)malloc(
+		  POOL_DEQUE_START * sizeof(struct pool_task));
+		if (w->dq.tasks == NULL) {
+			printf("Unable to allocate task queue\n");
+			exit(EXIT_FAILURE);
+		}
+		w->dq.lock = SDL_CreateMutex();
+		if (w->dq.lock == NULL) {
+			log_error("Failed to create thread pool: %s\n",
+			  SDL_GetError());
+			goto err;
+		}
+	}
+
+	for (i = 0; i < threads; i++) {
+		w = &pool->w[i];
+		w->thread = SDL_CreateThread(pool_thread, "pool", w);
+		if (w->thread == NULL) {
+			log_error("Failed to start thread pool: %s\n",
+			  SDL_GetError());
+			goto err;
+		}
+		w->id = SDL_GetThreadID(w->thread);
+		pool->started++;
+	}
+
+	return pool;
+
+err:
+	pool_destroy(pool);
+	return NULL;
+}
+
+int pool_threads(struct ms_pool *pool)
+{
+	return pool->n;
+}
+
+void pool_submit(struct ms_pool *pool, pool_fn fn, void *arg)
+{
+	SDL_threadID id = SDL_ThreadID();
+	int i;
+
+	SDL_LockMutex(pool->done_lock);
+	pool->pending++;
+	SDL_UnlockMutex(pool->done_lock);
+
+	// Keep work a task hands out on its own worker, for others to steal
+	for (i = 0; i < pool->n; i++) {
+		if (pool->w[i].id == id) break;
+	}
+	if (i == pool->n)
+		i = (unsigned int)SDL_AtomicAdd(&pool->next, 1) % pool->n;
+
+	pool_push(&pool->w[i].dq, fn, arg);
+	SDL_SemPost(pool->work);
+}
+
+void pool_wait(struct ms_pool *pool)
+{
+	SDL_LockMutex(pool->done_lock);
+	while (pool->pending) SDL_CondWait(pool->done, pool->done_lock);
+	SDL_UnlockMutex(pool->done_lock);
+}
+
+void pool_destroy(struct ms_pool *pool)
+{
+	int i;
+
+	if (pool == NULL) return;
+
+	if (pool->started) pool_wait(pool);
+
+	SDL_AtomicSet(&pool->quit, 1);
+	for (i = 0; i < pool->started; i++) SDL_SemPost(pool->work);
+	for (i = 0; i < pool->started; i++)
+		SDL_WaitThread(pool->w[i].thread, NULL);
+
+	for (i = 0; i < pool->n; i++) {
+		if (pool->w[i].dq.lock) SDL_DestroyMutex(pool->w[i].dq.lock);
+		free(pool->w[i].dq.tasks);
+	}
+	if (pool->done) SDL_DestroyCond(pool->done);
+	if (pool->done_lock) SDL_DestroyMutex(pool->done_lock);
+	if (pool->work) SDL_DestroySemaphore(pool->work);
+	free(pool->w);
+	free(pool);
+}
@@ -0,0 +1,52 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+/* Work stealing thread pool
+ *
+ * Every worker has a deque of tasks of its own. A worker runs tasks from the
+ * back of its own deque and, once that is empty, steals from the front of
+ * another worker's. Tasks submitted from outside of the pool are dealt out
+ * round robin, tasks submitted by a task go to the deque of the worker
+ * running it. Emulator runs vary a lot in length, stealing keeps every worker
+ * busy until the last task is taken without all of them contending on one
+ * queue.
+ *
+ * Each deque has a lock of its own. Tasks are expected to be whole emulator
+ * runs, next to which taking a lock costs nothing.
+ */
+
+struct ms_pool;
+
+// A task, worker is the index of the worker running it
+typedef void (*pool_fn)(void *arg, int worker);
+
+/**
+ * Start a pool with a number of worker threads, one per CPU if threads is
+ * less than 1.
+ *
+ * Returns the pool, NULL on error
+ */
+struct ms_pool *pool_create(int threads);
+
+/**
+ * Number of worker threads in the pool.
+ */
+int pool_threads(struct ms_pool *pool);
+
+/**
+ * Queue fn(arg) to be run by a worker. Can be called from a task.
+ */
+void pool_submit(struct ms_pool *pool, pool_fn fn, void *arg);
+
+/**
+ * Wait for every task submitted so far, including tasks those submit, to
+ * finish. Must not be called from a task.
+ */
+void pool_wait(struct ms_pool *pool);
+
+/**
+ * Stop the workers and free the pool. Any tasks still queued are run first.
+ */
+void pool_destroy(struct ms_pool *pool);
+
+#endif // __POOL_H__
@@ -0,0 +1,136 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SCALE_VEC	8
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SCALE_VEC	4
+#else
+#define SCALE_VEC	1
+#endif
+
+#include "lcd.h"
+#include "scale.h"
+
+/* Rows are built once per LCD row in struct scale_buf and then copied factor
+ * times. The vector stores below may run up to one vector past the end of a
+ * row or the table, so all three are padded */
+
+/* Fill count pixels starting at p with color c. With SIMD this may write
+ * up to SCALE_VEC - 1 pixels past the end, which is fine here as rows are
+ * always filled left to right and the row buffers are padded. */
+static inline void scale_fill(uint32_t *p, int count, uint32_t c)
+{
+#if SCALE_VEC == 8
+	__m256i v = _mm256_set1_epi32((int)c);
+	int i;
+
+	for (i = 0; i < count; i += 8)
+		_mm256_storeu_si256((__m256i *)(p + i), v);
+#elif SCALE_VEC == 4
+	__m128i v = _mm_set1_epi32((int)c);
+	int i;
+
+	for (i = 0; i < count; i += 4)
+		_mm_storeu_si128((__m128i *)(p + i), v);
+#else
+	int i;
+
+	for (i = 0; i < count; i++)
+		p[i] = c;
+#endif
+}
+
+static void scale_row(uint32_t *p, const uint8_t *lcd, int y,
+  const uint32_t *table, int factor)
+{
+	size_t run = (size_t)(8 * factor);
+	int col;
+
+	for (col = 0; col < MS_LCD_COLS; col++) {
+		memcpy(p, table + (lcd_buf_get_byte(lcd, col, y) * run),
+		  run * sizeof(uint32_t));
+		p += run;
+	}
+}
+
+/* Scaled run of every byte value, bit 0 leftmost as in the LCD buffer */
+static void scale_table(uint32_t *p, int factor, int gap,
+  const struct scale_colors *colors)
+{
+	int bits, b;
+
+	for (bits = 0; bits < 256; bits++) {
+		for (b = 0; b < 8; b++) {
+			scale_fill(p, factor - gap,
+			  ((bits >> b) & 1) ? colors->on : colors->off);
+			if (gap) scale_fill(p + factor - gap, gap, colors->grid);
+			p += factor;
+		}
+	}
+}
+
+static void scale_alloc(struct scale_buf *buf, int factor, int gap,
+  const struct scale_colors *colors)
+{
+	size_t len = (size_t)(MS_LCD_WIDTH * factor) + SCALE_VEC;
+	size_t table_len = (size_t)(256 * 8 * factor) + SCALE_VEC;
+
+	if (factor == buf->factor && gap == buf->gap &&
+	    !memcmp(colors, &buf->colors, sizeof(*colors)))
+		return;
+
+	free(buf->row);
+	free(buf->grid);
+	free(buf->table);
+	buf->row = (uint32_t *)malloc(len * sizeof(uint32_t));
+	buf->grid = (uint32_t *)malloc(len * sizeof(uint32_t));
+	buf->table = (uint32_t *)malloc(table_len * sizeof(uint32_t));
+	if (buf->row == NULL || buf->grid == NULL || buf->table == NULL) {
+		printf("Unable to allocate LCD scaler buffers\n");
+		exit(EXIT_FAILURE);
+	}
+	scale_fill(buf->grid, MS_LCD_WIDTH * factor, colors->grid);
+	scale_table(buf->table, factor, gap, colors);
+
+	buf->factor = factor;
+	buf->gap = gap;
+	buf->colors = *colors;
+}
+
+void scale_lcd(struct scale_buf *buf, const uint8_t *lcd, uint32_t *dst,
+  int pitch, int factor, int gap, const struct scale_colors *colors)
+{
+	size_t row_len = (size_t)(MS_LCD_WIDTH * factor) * sizeof(uint32_t);
+	int y, r;
+
+	if (gap >= factor) gap = 0;
+	scale_alloc(buf, factor, gap, colors);
+
+	for (y = 0; y < MS_LCD_HEIGHT; y++) {
+		scale_row(buf->row, lcd, y, buf->table, factor);
+		for (r = 0; r < factor - gap; r++) {
+			memcpy(dst, buf->row, row_len);
+			dst += pitch;
+		}
+		for (; r < factor; r++) {
+			memcpy(dst, buf->grid, row_len);
+			dst += pitch;
+		}
+	}
+}
+
+void scale_free(struct scale_buf *buf)
+{
+	free(buf->row);
+	free(buf->grid);
+	free(buf->table);
+	buf->row = NULL;
+	buf->grid = NULL;
+	buf->table = NULL;
+	buf->factor = 0;
+}
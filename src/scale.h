@@ -0,0 +1,57 @@
+#ifndef __SCALE_H__
+#define __SCALE_H__
+
+#include <stdint.h>
+
+/* LCD upscaler
+ *
+ * Converts the 1-bit LCD buffer straight to RGBA8888 at an integer scale,
+ * so the renderer only ever has to copy the result 1:1. This gives sharp,
+ * evenly sized pixels on every SDL renderer, including software renderers
+ * that have no scaling of their own worth using.
+ *
+ * Each LCD pixel becomes a factor x factor block. The last gap rows and
+ * columns of each block are drawn in the grid color to separate pixels the
+ * way a real LCD does.
+ *
+ * Each LCD byte, 8 pixels, is expanded at once by copying its scaled run
+ * from a 256 entry table, rebuilt whenever the factor, gap or colors
+ * change. Fills use AVX2 or SSE2 when the compiler targets them, and plain
+ * C otherwise.
+ */
+
+struct scale_colors {
+	uint32_t on;
+	uint32_t off;
+	uint32_t grid;
+};
+
+/* One scaled row of the LCD, a row of nothing but grid color and the
+ * scaled run of every byte value, kept between calls. Zero it before first
+ * use */
+struct scale_buf {
+	uint32_t *row;
+	uint32_t *grid;
+	uint32_t *table;
+	int factor;
+	int gap;
+	struct scale_colors colors;
+};
+
+/**
+ * Scale the whole LCD.
+ *
+ * *buf		- Buffers, rebuilt if factor, gap or colors change
+ * *lcd		- 1-bit LCD buffer, laid out as ms_ctx.lcd_dat1bit
+ * *dst		- Destination, at least 320*factor x 240*factor pixels
+ * pitch	- Distance between rows of dst, in pixels
+ * factor	- Scale factor, 1 or more
+ * gap		- Width of grid lines between pixels, less than factor
+ * *colors	- Colors to use
+ */
+void scale_lcd(struct scale_buf *buf, const uint8_t *lcd, uint32_t *dst,
+  int pitch, int factor, int gap, const struct scale_colors *colors);
+
+void scale_free(struct scale_buf *buf);
+
+#endif // __SCALE_H__
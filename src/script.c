@@ -0,0 +1,531 @@
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "fwdb.h"
+#include "kbd.h"
+#include "lcd.h"
+#include "msemu.h"
+#include "script.h"
+#include "text.h"
+
+enum script_ops {
+	OP_PRESS,
+	OP_RELEASE,
+	OP_TAP,
+	OP_TYPE,
+	OP_POWER,
+	OP_WAIT,
+	OP_WAITPC,
+	OP_WAITBOOT,
+	OP_WAITLCD,
+	OP_LCDHASH,
+	OP_TEXT,
+	OP_WAITTEXT,
+	OP_FONT,
+	OP_ECHO,
+	OP_QUIT,
+};
+
+/* Arguments a command takes are given as a string, one char per argument:
+ *   k - Key name
+ *   s - Quoted string
+ *   n - Number
+ */
+
+#define SCRIPT_MAX_ARGS		6
+#define SCRIPT_LINE_LEN		1024
+
+// Enough for a whole screen of the smallest text cells
+#define SCRIPT_TEXT_LEN		((MS_LCD_WIDTH + 1) * MS_LCD_HEIGHT + 1)
+
+/* Default time to hold the power button */
+#define SCRIPT_POWER_MS		100
+
+static const struct {
+	const char *name;
+	int op;
+	const char *args;
+	int min_args;
+} script_cmds[] = {
+	{ "press", OP_PRESS, "k", 1 },
+	{ "release", OP_RELEASE, "k", 1 },
+	{ "tap", OP_TAP, "k", 1 },
+	{ "type", OP_TYPE, "s", 1 },
+	{ "power", OP_POWER, "n", 0 },
+	{ "wait", OP_WAIT, "n", 1 },
+	{ "waitpc", OP_WAITPC, "nn", 1 },
+	{ "waitboot", OP_WAITBOOT, "n", 0 },
+	{ "waitlcd", OP_WAITLCD, "nnnnnn", 5 },
+	{ "lcdhash", OP_LCDHASH, "nnnn", 4 },
+	{ "text", OP_TEXT, "", 0 },
+	{ "waittext", OP_WAITTEXT, "nsn", 2 },
+	{ "font", OP_FONT, "s", 1 },
+	{ "echo", OP_ECHO, "s", 1 },
+	{ "quit", OP_QUIT, "n", 0 },
+};
+#define NUMCMDS (sizeof(script_cmds) / sizeof(script_cmds[0]))
+
+struct script_cmd {
+	int op;
+	int line;
+	int nargs;
+	// Key commands
+	int row;
+	int bit;
+	// String commands
+	char *str;
+	// Numeric commands
+	uint64_t args[SCRIPT_MAX_ARGS];
+};
+
+struct ms_script {
+	char *path;
+	struct script_cmd *cmds;
+	int ncmds;
+
+	// Index of current command and whether it has been started
+	int cur;
+	int started;
+
+	// Progress through a type command's string
+	size_t pos;
+
+	// T state that the current command finishes or times out at
+	uint64_t deadline;
+
+	// Buffer for text read from the screen
+	char *text;
+};
+
+#define MS_TO_TSTATES(x)	((uint64_t)(x) * (MS_CPU_HZ / 1000))
+
+/* Split the next token off of a line. Quoted strings have their escapes
+ * processed in place. Returns pointer to the token, NULL if there are no
+ * more. *quoted is set if the token was a quoted string.
+ */
+static char *script_token(char **line, int *quoted)
+{
+	char *p = *line;
+	char *tok, *out;
+
+	*quoted = 0;
+	while (isspace((unsigned char)*p)) p++;
+	if (*p == '\0' || *p == '#') return NULL;
+
+	if (*p != '"') {
+		tok = p;
+		while (*p && !isspace((unsigned char)*p)) p++;
+		if (*p) *p++ = '\0';
+		*line = p;
+		return tok;
+	}
+
+	/* Quoted string, unescape it in place */
+	*quoted = 1;
+	tok = out = ++p;
+	while (*p && *p != '"') {
+		if (*p == '\\' && p[1]) {
+			p++;
+			switch (*p) {
+			  case 'n':
+				*out++ = '\n';
+				break;
+			  case 't':
+				*out++ = '\t';
+				break;
+			  case 'b':
+				*out++ = '\b';
+				break;
+			  default:
+				*out++ = *p;
+				break;
+			}
+			p++;
+		} else {
+			*out++ = *p++;
+		}
+	}
+	if (*p == '"') p++;
+	*out = '\0';
+	*line = p;
+
+	return tok;
+}
+
+static int script_parse_line(struct script_cmd *cmd, char *line, int lineno,
+  const char *path)
+{
+	char *tok, *end;
+	int quoted;
+	unsigned int i;
+
+	memset(cmd, 0, sizeof(*cmd));
+	cmd->line = lineno;
+
+	tok = script_token(&line, &quoted);
+	if (tok == NULL) return 0;
+
+	for (i = 0; i < NUMCMDS; i++) {
+		if (!strcmp(tok, script_cmds[i].name)) break;
+	}
+	if (i == NUMCMDS) {
+		log_error("%s:%d: Unknown command '%s'\n", path, lineno, tok);
+		return -1;
+	}
+	cmd->op = script_cmds[i].op;
+
+	while ((tok = script_token(&line, &quoted)) != NULL) {
+		if (cmd->nargs == (int)strlen(script_cmds[i].args)) {
+			log_error("%s:%d: Too many arguments to '%s'\n", path,
+			  lineno, script_cmds[i].name);
+			return -1;
+		}
+
+		switch (script_cmds[i].args[cmd->nargs]) {
+		  case 'k':
+			if (kbd_lookup(tok, &cmd->row, &cmd->bit)) {
+				log_error("%s:%d: Unknown key '%s'\n", path,
+				  lineno, tok);
+				return -1;
+			}
+			break;
+		  case 's':
+			if (!quoted) {
+				log_error("%s:%d: Expected quoted string\n",
+				  path, lineno);
+				return -1;
+			}
+			free(cmd->str);
+			cmd->str = strdup(tok);
+			break;
+		  case 'n':
+			cmd->args[cmd->nargs] = strtoull(tok, &end, 0);
+			if (*end != '\0') {
+				log_error("%s:%d: Invalid number '%s'\n", path,
+				  lineno, tok);
+				return -1;
+			}
+			break;
+		}
+		cmd->nargs++;
+	}
+
+	if (cmd->nargs < script_cmds[i].min_args) {
+		log_error("%s:%d: Too few arguments to '%s'\n", path, lineno,
+		  script_cmds[i].name);
+		return -1;
+	}
+
+	return 1;
+}
+
+int script_load(ms_ctx *ms, const char *path)
+{
+	struct ms_script *sc;
+	struct script_cmd cmd;
+	char line[SCRIPT_LINE_LEN];
+	FILE *fd;
+	int lineno = 0;
+	int ret;
+
+	fd = fopen(path, "r");
+	if (!fd) {
+		log_error("Failed to open script '%s'\n", path);
+		return MS_ERR;
+	}
+
+	sc = (struct ms_script *)calloc(1, sizeof(struct ms_script));
+	if (sc == NULL) {
+		printf("Unable to allocate script\n");
+		exit(EXIT_FAILURE);
+	}
+	sc->path = strdup(path);
+	sc->text = (char *)malloc(SCRIPT_TEXT_LEN);
+	if (sc->text == NULL) {
+		printf("Unable to allocate script\n");
+		exit(EXIT_FAILURE);
+	}
+	ms->script = sc;
+
+	while (fgets(line, sizeof(line), fd)) {
+		lineno++;
+		ret = script_parse_line(&cmd, line, lineno, path);
+		if (ret < 0) {
+			fclose(fd);
+			free(cmd.str);
+			script_free(ms);
+			return MS_ERR;
+		}
+		if (ret == 0) continue;
+
+		sc->cmds = (struct script_cmd *)realloc(sc->cmds,
+		  (sc->ncmds + 1) * sizeof(struct script_cmd));
+		if (sc->cmds == NULL) {
+			printf("Unable to allocate script\n");
+			exit(EXIT_FAILURE);
+		}
+		sc->cmds[sc->ncmds++] = cmd;
+	}
+	fclose(fd);
+
+	ms->script_exit = 0;
+	ms->watch_pc = -1;
+	ms->watch_cf = -1;
+
+	return MS_OK;
+}
+
+void script_free(ms_ctx *ms)
+{
+	struct ms_script *sc = ms->script;
+	int i;
+
+	if (sc == NULL) return;
+
+	for (i = 0; i < sc->ncmds; i++) free(sc->cmds[i].str);
+	free(sc->cmds);
+	free(sc->path);
+	free(sc->text);
+	free(sc);
+	ms->script = NULL;
+	ms->watch_pc = -1;
+	ms->watch_cf = -1;
+}
+
+/* Set the deadline of a wait command from an optional timeout argument.
+ * A deadline of 0 means wait forever. */
+static void script_set_timeout(ms_ctx *ms, struct script_cmd *cmd, int arg)
+{
+	struct ms_script *sc = ms->script;
+
+	if (cmd->nargs > arg) {
+		sc->deadline = ms->tstates + MS_TO_TSTATES(cmd->args[arg]);
+	} else {
+		sc->deadline = 0;
+	}
+}
+
+static int script_timed_out(ms_ctx *ms, struct script_cmd *cmd)
+{
+	struct ms_script *sc = ms->script;
+
+	if (sc->deadline && ms->tstates >= sc->deadline) {
+		log_error("%s:%d: Timed out at PC 0x%04X\n", sc->path,
+		  cmd->line, z80ex_get_reg(ms->z80, regPC));
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Run a single command.
+ * Returns SCRIPT_RUNNING if the command is still in progress, SCRIPT_DONE if
+ * it completed and the next command can be run, or SCRIPT_FAIL.
+ * A quit command sets cur past the end of the script.
+ */
+static int script_step(ms_ctx *ms, struct script_cmd *cmd)
+{
+	struct ms_script *sc = ms->script;
+	char *text = sc->text;
+	int ret;
+
+	/* Anything that waits on emulated time first waits for all of the
+	 * keys queued before it to be delivered */
+	switch (cmd->op) {
+	  case OP_WAIT:
+	  case OP_WAITPC:
+	  case OP_WAITBOOT:
+	  case OP_WAITLCD:
+	  case OP_WAITTEXT:
+	  case OP_QUIT:
+		if (kbd_pending(ms)) return SCRIPT_RUNNING;
+
+		/* Time is not passing while powered off, nothing can change */
+		if (ms->power_state == MS_POWERSTATE_OFF && cmd->op != OP_WAIT &&
+		    cmd->op != OP_QUIT) {
+			log_error("%s:%d: Mailstation is powered off\n",
+			  sc->path, cmd->line);
+			return SCRIPT_FAIL;
+		}
+		break;
+	  default:
+		break;
+	}
+
+	switch (cmd->op) {
+	  case OP_PRESS:
+	  case OP_RELEASE:
+		if (!kbd_free(ms)) return SCRIPT_RUNNING;
+		kbd_queue(ms, cmd->row, cmd->bit, (cmd->op == OP_PRESS));
+		break;
+
+	  case OP_TAP:
+		if (kbd_free(ms) < 2) return SCRIPT_RUNNING;
+		kbd_queue(ms, cmd->row, cmd->bit, 1);
+		kbd_queue(ms, cmd->row, cmd->bit, 0);
+		break;
+
+	  case OP_TYPE:
+		if (!sc->started) sc->pos = 0;
+		sc->started = 1;
+		while (cmd->str[sc->pos]) {
+			ret = kbd_queue_char(ms, cmd->str[sc->pos]);
+			if (ret < 0) return SCRIPT_RUNNING;
+			if (ret == 0) {
+				log_error("%s:%d: Cannot type character 0x%02X\n",
+				  sc->path, cmd->line,
+				  (unsigned char)cmd->str[sc->pos]);
+				return SCRIPT_FAIL;
+			}
+			sc->pos++;
+		}
+		break;
+
+	  case OP_POWER:
+		/* The power button is not part of the key matrix, it is
+		 * wired to an IO pin. Hold it for long enough for the
+		 * firmware to see it, or until it powers the system off */
+		if (!sc->started) {
+			sc->started = 1;
+			sc->deadline = ms->tstates + MS_TO_TSTATES(
+			  cmd->nargs ? cmd->args[0] : SCRIPT_POWER_MS);
+			ms->power_button_n = 0;
+			ms_power_hint(ms);
+			return SCRIPT_RUNNING;
+		}
+		if (ms->power_state == MS_POWERSTATE_ON &&
+		    ms->tstates < sc->deadline)
+			return SCRIPT_RUNNING;
+		ms->power_button_n = 1;
+		break;
+
+	  case OP_WAIT:
+		if (ms->power_state == MS_POWERSTATE_OFF) break;
+		if (!sc->started) {
+			sc->started = 1;
+			sc->deadline = ms->tstates + MS_TO_TSTATES(cmd->args[0]);
+		}
+		if (ms->tstates < sc->deadline) return SCRIPT_RUNNING;
+		break;
+
+	  case OP_WAITPC:
+		if (!sc->started) {
+			sc->started = 1;
+			script_set_timeout(ms, cmd, 1);
+			ms->watch_pc = (int32_t)(cmd->args[0] & 0xFFFF);
+			ms->watch_hit = 0;
+		}
+		if (!ms->watch_hit) {
+			if (script_timed_out(ms, cmd)) return SCRIPT_FAIL;
+			return SCRIPT_RUNNING;
+		}
+		ms->watch_pc = -1;
+		break;
+
+	  case OP_WAITBOOT:
+		if (!sc->started) {
+			if (ms->fw->boot_pc < 0) {
+				log_error("%s:%d: Boot address of firmware '%s' is not "
+				  "known\n", sc->path, cmd->line, ms->fw->name);
+				return SCRIPT_FAIL;
+			}
+			sc->started = 1;
+			script_set_timeout(ms, cmd, 0);
+			ms->watch_cf = ms->fw->boot_pc;
+			ms->watch_hit = 0;
+		}
+		if (!ms->watch_hit) {
+			if (script_timed_out(ms, cmd)) return SCRIPT_FAIL;
+			return SCRIPT_RUNNING;
+		}
+		ms->watch_cf = -1;
+		break;
+
+	  case OP_WAITLCD:
+		if (!sc->started) {
+			sc->started = 1;
+			script_set_timeout(ms, cmd, 5);
+		}
+		if (lcd_region_hash(ms, cmd->args[0], cmd->args[1],
+		    cmd->args[2], cmd->args[3]) != cmd->args[4]) {
+			if (script_timed_out(ms, cmd)) return SCRIPT_FAIL;
+			return SCRIPT_RUNNING;
+		}
+		break;
+
+	  case OP_LCDHASH:
+		printf("lcdhash %d %d %d %d 0x%016llX\n", (int)cmd->args[0],
+		  (int)cmd->args[1], (int)cmd->args[2], (int)cmd->args[3],
+		  (unsigned long long)lcd_region_hash(ms, cmd->args[0],
+		  cmd->args[1], cmd->args[2], cmd->args[3]));
+		break;
+
+	  case OP_TEXT:
+		if (text_screen(ms, text, SCRIPT_TEXT_LEN) < 0) {
+			log_error("%s:%d: No glyph table loaded\n", sc->path,
+			  cmd->line);
+			return SCRIPT_FAIL;
+		}
+		printf("%s", text);
+		break;
+
+	  case OP_WAITTEXT:
+		if (!sc->started) {
+			if (!text_rows(ms)) {
+				log_error("%s:%d: No glyph table loaded\n",
+				  sc->path, cmd->line);
+				return SCRIPT_FAIL;
+			}
+			sc->started = 1;
+			script_set_timeout(ms, cmd, 2);
+		}
+		if (text_row(ms, (int)cmd->args[0], text, SCRIPT_TEXT_LEN) < 0 ||
+		    strstr(text, cmd->str) == NULL) {
+			if (script_timed_out(ms, cmd)) return SCRIPT_FAIL;
+			return SCRIPT_RUNNING;
+		}
+		break;
+
+	  case OP_FONT:
+		if (text_load_font(ms, cmd->str)) return SCRIPT_FAIL;
+		break;
+
+	  case OP_ECHO:
+		printf("%s\n", cmd->str);
+		break;
+
+	  case OP_QUIT:
+		ms->script_exit = cmd->nargs ? (int)cmd->args[0] : 0;
+		sc->cur = sc->ncmds;
+		break;
+	}
+
+	return SCRIPT_DONE;
+}
+
+int script_run(ms_ctx *ms)
+{
+	struct ms_script *sc = ms->script;
+	int ret;
+
+	if (sc == NULL) return SCRIPT_DONE;
+
+	while (sc->cur < sc->ncmds) {
+		ret = script_step(ms, &sc->cmds[sc->cur]);
+		if (ret == SCRIPT_RUNNING) return SCRIPT_RUNNING;
+		if (ret == SCRIPT_FAIL) {
+			ms->script_exit = MS_ERR;
+			return SCRIPT_FAIL;
+		}
+
+		/* A quit leaves cur past the end */
+		if (sc->cur < sc->ncmds) sc->cur++;
+		sc->started = 0;
+	}
+
+	return SCRIPT_DONE;
+}
@@ -0,0 +1,72 @@
+#ifndef __SCRIPT_H__
+#define __SCRIPT_H__
+
+#include "msemu.h"
+
+/* Scripted input
+ *
+ * A script is a plain text file with one command per line. Blank lines and
+ * anything after a '#' are ignored. Numbers may be decimal or 0x prefixed
+ * hex, times are in milliseconds of emulated time, and strings are enclosed
+ * in double quotes and may use \n, \t, \" and \\ escapes.
+ *
+ *   press <KEY>               Press and hold a key, see kbd_lookup() for names
+ *   release <KEY>             Release a held key
+ *   tap <KEY>                 Press and release a key
+ *   type "<string>"           Type a string, adding shift as needed
+ *   power [<ms>]              Press the power button and hold it for <ms>,
+ *                             100 ms by default
+ *   wait <ms>                 Let the Mailstation run for <ms>
+ *   waitpc <addr> [<ms>]      Run until the PC reaches <addr>. Fails if <ms>
+ *                             passes first, waits forever if not specified
+ *   waitboot [<ms>]           Run until the firmware is done booting, by the
+ *                             boot address in its profile, see fwdb.h.
+ *                             Fails if the boot address is not known
+ *   waitlcd <x> <y> <w> <h> <hash> [<ms>]
+ *                             Run until the LCD region hashes to <hash>
+ *   lcdhash <x> <y> <w> <h>   Print the hash of an LCD region, as used above
+ *   font "<path>"             Load a glyph table for reading text, see text.h
+ *   text                      Print the text currently on screen
+ *   waittext <row> "<string>" [<ms>]
+ *                             Run until the text on a row contains <string>
+ *   echo "<string>"           Print a string to the terminal
+ *   quit [<code>]             Stop emulation, exiting with <code>
+ *
+ * Key presses are fed through the keyboard queue, which paces them to the
+ * 64 Hz keyboard scan so none are missed. Every wait command first waits for
+ * all queued key presses to be delivered.
+ */
+
+/* Return values of script_run() */
+#define SCRIPT_RUNNING	0
+#define SCRIPT_DONE	1
+#define SCRIPT_FAIL	2
+
+/**
+ * Parse a script file and attach it to the emulator. It will start running
+ * the next time script_run() is called.
+ *
+ * *ms		- Pointer to ms_ctx struct
+ * *path	- Path to script file
+ *
+ * Returns MS_OK on success, MS_ERR if the file could not be opened or parsed
+ */
+int script_load(ms_ctx *ms, const char *path);
+
+/**
+ * Free any script attached to the emulator.
+ */
+void script_free(ms_ctx *ms);
+
+/**
+ * Advance the script as far as it can go at the current point in emulated
+ * time. Should be called regularly from the emulation loop, and immediately
+ * after the PC watch set by a script is hit.
+ *
+ * Returns SCRIPT_RUNNING while there is more to do, SCRIPT_DONE when the
+ * script has finished, or SCRIPT_FAIL if a command failed or timed out.
+ * ms->script_exit holds the code to exit with once done.
+ */
+int script_run(ms_ctx *ms);
+
+#endif // __SCRIPT_H__
@@ -0,0 +1,200 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "io.h"
+#include "lcd.h"
+#include "mem.h"
+#include "msemu.h"
+#include "shm.h"
+#include "sizes.h"
+
+#if !defined(_MSC_VER)
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SHM_LCD_LEN	((MS_LCD_WIDTH * MS_LCD_HEIGHT) / 8)
+#define SHM_RAM_LEN	SZ_128K
+#define SHM_IO_LEN	SZ_256
+
+struct ms_shm {
+	char *name;
+	struct ms_shm_hdr *hdr;
+	uint8_t *base;
+	size_t size;
+};
+
+/* Whether the existing segment name was left behind by an emulator that is
+ * no longer running. Anything that is not an msemu segment is left alone */
+static int shm_stale(const char *name)
+{
+	struct ms_shm_hdr *hdr;
+	struct stat st;
+	int fd, stale = 0;
+
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) return 0;
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(*hdr)) {
+		close(fd);
+		return 0;
+	}
+	hdr = (struct ms_shm_hdr *)mmap(NULL, sizeof(*hdr), PROT_READ,
+	  MAP_SHARED, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED) return 0;
+
+	if (hdr->magic == MS_SHM_MAGIC && hdr->version == MS_SHM_VERSION &&
+	    kill((pid_t)hdr->pid, 0) < 0 && errno == ESRCH) stale = 1;
+	munmap(hdr, sizeof(*hdr));
+
+	return stale;
+}
+
+int shm_init(ms_ctx *ms, const char *name)
+{
+	struct ms_shm *shm;
+	struct ms_shm_hdr *hdr;
+	size_t offs;
+	int fd;
+
+	shm = (struct ms_shm *)calloc(1, sizeof(struct ms_shm));
+	if (shm == NULL) {
+		printf("Unable to allocate shared memory export\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Lay out the buffers after the header, each 64 byte aligned */
+	offs = (sizeof(struct ms_shm_hdr) + 63) & ~63;
+	shm->size = offs + SHM_LCD_LEN + SHM_RAM_LEN + SHM_IO_LEN;
+
+	/* A segment left behind by an emulator that did not exit cleanly is
+	 * replaced rather than reused, readers holding the old one keep
+	 * seeing its last state */
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0 && errno == EEXIST && shm_stale(name)) {
+		shm_unlink(name);
+		fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	}
+	if (fd < 0 && errno == EEXIST) {
+		log_error("Shared memory '%s' is in use by another process\n",
+		  name);
+		free(shm);
+		return MS_ERR;
+	}
+	if (fd < 0) {
+		log_error("Failed to create shared memory '%s': %s\n", name,
+		  strerror(errno));
+		free(shm);
+		return MS_ERR;
+	}
+	if (ftruncate(fd, shm->size) < 0) {
+		log_error("Failed to size shared memory '%s': %s\n", name,
+		  strerror(errno));
+		close(fd);
+		shm_unlink(name);
+		free(shm);
+		return MS_ERR;
+	}
+	shm->base = (uint8_t *)mmap(NULL, shm->size, PROT_READ | PROT_WRITE,
+	  MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm->base == MAP_FAILED) {
+		log_error("Failed to map shared memory '%s': %s\n", name,
+		  strerror(errno));
+		shm_unlink(name);
+		free(shm);
+		return MS_ERR;
+	}
+
+	shm->name = strdup(name);
+	hdr = shm->hdr = (struct ms_shm_hdr *)shm->base;
+	hdr->magic = MS_SHM_MAGIC;
+	hdr->version = MS_SHM_VERSION;
+	hdr->size = (uint32_t)shm->size;
+	hdr->lcd_offs = (uint32_t)offs;
+	hdr->lcd_len = SHM_LCD_LEN;
+	hdr->ram_offs = hdr->lcd_offs + SHM_LCD_LEN;
+	hdr->ram_len = SHM_RAM_LEN;
+	hdr->io_offs = hdr->ram_offs + SHM_RAM_LEN;
+	hdr->io_len = SHM_IO_LEN;
+	hdr->pid = (uint32_t)getpid();
+
+	ms->shm = shm;
+	shm_publish(ms);
+	/* The initial state is not a frame */
+	hdr->frame = 0;
+
+	return MS_OK;
+}
+
+void shm_publish(ms_ctx *ms)
+{
+	struct ms_shm *shm = ms->shm;
+	struct ms_shm_hdr *hdr;
+
+	if (shm == NULL) return;
+	hdr = shm->hdr;
+
+	/* Writer side of the sequence lock. The release fence after going odd
+	 * keeps the data stores below from becoming visible before seq does */
+	__atomic_store_n(&hdr->seq, hdr->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	hdr->frame++;
+	hdr->tstate = ms->tstates;
+	hdr->flags = 0;
+	if (ms->power_state == MS_POWERSTATE_ON) hdr->flags |= MS_SHM_POWER_ON;
+	if (ms->io != NULL) {
+		if (ms->io[MISC2] & MISC2_LED_BIT) hdr->flags |= MS_SHM_LED_ON;
+		hdr->slot4_dev = ms->io[SLOT4_DEV];
+		hdr->slot4_page = ms->io[SLOT4_PAGE];
+		hdr->slot8_dev = ms->io[SLOT8_DEV];
+		hdr->slot8_page = ms->io[SLOT8_PAGE];
+		memcpy(shm->base + hdr->io_offs, ms->io, SHM_IO_LEN);
+	}
+	hdr->ac_status = (uint32_t)ms->ac_status;
+	hdr->batt_status = (uint32_t)ms->batt_status;
+	if (ms->lcd_dat1bit != NULL)
+		memcpy(shm->base + hdr->lcd_offs, ms->lcd_dat1bit, SHM_LCD_LEN);
+	if (ms->ram[0] != NULL)
+		mem_get(ms->ram, 0, shm->base + hdr->ram_offs, SHM_RAM_LEN);
+
+	__atomic_store_n(&hdr->seq, hdr->seq + 1, __ATOMIC_RELEASE);
+}
+
+void shm_deinit(ms_ctx *ms)
+{
+	struct ms_shm *shm = ms->shm;
+
+	if (shm == NULL) return;
+
+	munmap(shm->base, shm->size);
+	shm_unlink(shm->name);
+	free(shm->name);
+	free(shm);
+	ms->shm = NULL;
+}
+
+#else // defined(_MSC_VER)
+
+int shm_init(ms_ctx *ms, const char *name)
+{
+	log_error("Shared memory export is not supported on this platform\n");
+	return MS_ERR;
+}
+
+void shm_publish(ms_ctx *ms)
+{
+}
+
+void shm_deinit(ms_ctx *ms)
+{
+}
+
+#endif // defined(_MSC_VER)
@@ -0,0 +1,109 @@
+#ifndef __SHM_H__
+#define __SHM_H__
+
+#include <stdint.h>
+#include "msemu.h"
+
+/* Shared memory state export
+ *
+ * Publishes the machine state once per frame to a POSIX shared memory
+ * segment so that other processes on the same host can watch the emulator
+ * without a window or a socket. The segment is created with shm_open() under
+ * the name given to --shm (e.g. "/msemu0"), is read only for everyone but
+ * the emulator, and is removed when the emulator exits. A name in use by a
+ * running emulator is not taken over, only a segment whose writer has gone
+ * away without removing it is replaced.
+ *
+ * RAM, IO and the LCD are copied in to the segment rather than the segment
+ * being the emulator's own memory. RAM is a table of pages that are shared
+ * with clones and swapped for copies on write, see mem.h, so it can not live
+ * at a fixed place for readers. The copy is also what lets a reader get RAM
+ * as it was at the end of a frame, rather than as the Z80 is changing it.
+ * It is 128 KiB once per frame, a small part of what emulating the frame
+ * costs.
+ *
+ * The segment starts with struct ms_shm_hdr, and the buffers it describes
+ * follow at the given offsets from the start of the segment. All values are
+ * in host byte order. This header has no dependencies beyond stdint.h and
+ * the layout below, so readers may copy these definitions.
+ *
+ * Consistency is provided by a sequence lock. The emulator increments seq to
+ * an odd value before it starts to update the segment, and to an even value
+ * once it is done. A reader takes a consistent snapshot with:
+ *
+ *   do {
+ *       while ((s = load_acquire(&hdr->seq)) & 1) ;
+ *       copy what is needed
+ *       acquire fence
+ *   } while (load(&hdr->seq) != s);
+ *
+ * Readers that just want to know if anything changed can poll frame, which
+ * counts published updates. The state is published at the end of every
+ * emulated frame and when the Mailstation is powered on or off, so frame
+ * does not advance while it is powered off.
+ */
+
+#define MS_SHM_MAGIC		0x4D48534D	// "MSHM" in memory on LE hosts
+#define MS_SHM_VERSION		2
+
+// Indicator bits of ms_shm_hdr.flags
+#define MS_SHM_POWER_ON		(1 << 0)
+#define MS_SHM_LED_ON		(1 << 1)
+
+struct ms_shm_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;		// Size of the whole segment
+	uint32_t seq;		// Sequence lock, odd while being written
+
+	uint64_t frame;		// Number of frames published
+	uint64_t tstate;	// Emulated T states at time of publishing
+
+	uint32_t flags;		// MS_SHM_* indicator bits
+	uint32_t ac_status;	// enum ms_ac_status
+	uint32_t batt_status;	// enum ms_batt_status
+
+	/* Current slot mapping, enum ms_dev_map and page for slots 0x4000
+	 * and 0x8000. Also in the IO copy, but repeated here for convenience */
+	uint8_t slot4_dev;
+	uint8_t slot4_page;
+	uint8_t slot8_dev;
+	uint8_t slot8_page;
+
+	/* 1-bit LCD buffer, laid out as described in lcd.h. A set bit is a
+	 * dark pixel */
+	uint32_t lcd_offs;
+	uint32_t lcd_len;
+
+	// Copy of all 128 KiB of RAM
+	uint32_t ram_offs;
+	uint32_t ram_len;
+
+	// Copy of the IO port registers, indexed by port number
+	uint32_t io_offs;
+	uint32_t io_len;
+
+	// Process ID of the emulator writing the segment
+	uint32_t pid;
+};
+
+/**
+ * Create and map the shared memory segment.
+ *
+ * Returns MS_OK on success, MS_ERR if the segment could not be created or
+ * shared memory is not supported on this platform
+ */
+int shm_init(ms_ctx *ms, const char *name);
+
+/**
+ * Publish the current state. Called at the end of every frame, does nothing
+ * if not exporting.
+ */
+void shm_publish(ms_ctx *ms);
+
+/**
+ * Unmap and remove the shared memory segment.
+ */
+void shm_deinit(ms_ctx *ms);
+
+#endif // __SHM_H__
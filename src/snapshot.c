@@ -0,0 +1,305 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "lcd.h"
+#include "mem.h"
+#include "msemu.h"
+#include "sizes.h"
+#include "snapshot.h"
+#include "verify.h"
+
+#include <z80ex/z80ex.h>
+
+#define SNAP_REGS	(regIFF2 + 1)
+#define SNAP_LCD_LEN	((MS_LCD_WIDTH * MS_LCD_HEIGHT) / 8)
+#define SNAP_STATE_LEN	(10 + 8 + 4 + 4)
+#define SNAP_LEN	(16 + 8 + (SNAP_REGS * 2) + SNAP_STATE_LEN + SZ_256 + \
+			 SZ_128K + SZ_512K + 1 + SNAP_LCD_LEN)
+
+// Where RAM and dataflash are in a snapshot, for restoring single pages
+#define SNAP_RAM_OFFS	(SNAP_LEN - SNAP_LCD_LEN - 1 - SZ_512K - SZ_128K)
+#define SNAP_DF_OFFS	(SNAP_RAM_OFFS + SZ_128K)
+
+struct ms_snap {
+	uint8_t buf[SNAP_LEN];
+};
+
+static uint8_t *put(uint8_t *p, uint64_t v, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++) p[i] = (v >> (8 * i)) & 0xFF;
+	return p + len;
+}
+
+static uint64_t get(const uint8_t **p, int len)
+{
+	uint64_t v = 0;
+	int i;
+
+	for (i = 0; i < len; i++) v |= (uint64_t)(*p)[i] << (8 * i);
+	*p += len;
+	return v;
+}
+
+static uint8_t *put_buf(uint8_t *p, const void *buf, size_t len)
+{
+	memcpy(p, buf, len);
+	return p + len;
+}
+
+static const uint8_t *get_buf(const uint8_t *p, void *buf, size_t len)
+{
+	memcpy(buf, p, len);
+	return p + len;
+}
+
+static void snap_dirty_clear(ms_ctx *ms)
+{
+	struct ms_dirty *d = ms->dirty;
+	unsigned int i;
+
+	for (i = 0; i < d->cnt; i++) d->map[d->list[i]] = 0;
+	d->cnt = 0;
+}
+
+/* Write the machine's state to buf, SNAP_LEN bytes */
+static void snap_fill(ms_ctx *ms, uint8_t *buf)
+{
+	uint8_t *p;
+	int i;
+
+	p = put_buf(buf, "MSSN", 4);
+	p = put(p, SNAPSHOT_VERSION, 4);
+	p = put(p, ms->cf_hash, 8);
+	p = put(p, ms->tstates, 8);
+	for (i = 0; i < SNAP_REGS; i++)
+		p = put(p, z80ex_get_reg(ms->z80, (Z80_REG_T)i), 2);
+
+	p = put_buf(p, ms->key_matrix, 10);
+	p = put(p, ms->interrupt_mask, 1);
+	p = put(p, ms->power_state, 1);
+	p = put(p, ms->ac_status, 1);
+	p = put(p, ms->batt_status, 1);
+	p = put(p, ms->power_button_n, 1);
+	p = put(p, ms->df_cycle, 1);
+	p = put(p, ms->df_cmd, 1);
+	p = put(p, ms->lcd_cas, 1);
+	p = put(p, ms->int_count, 4);
+	p = put(p, ms->int_tstates, 4);
+
+	p = put_buf(p, ms->io, SZ_256);
+	mem_get(ms->ram, 0, p, SZ_128K);
+	mem_get(ms->df, 0, p + SZ_128K, SZ_512K);
+	p = put(p + SZ_128K + SZ_512K, ms->df_wp, 1);
+	p = put_buf(p, ms->lcd_dat1bit, SNAP_LCD_LEN);
+}
+
+/* Put the machine back to the state in buf, which has been checked. RAM and
+ * dataflash are copied whole, or only the pages written since dirty
+ * tracking was last cleared if dirty is set */
+static void snap_apply(ms_ctx *ms, const uint8_t *buf, int dirty)
+{
+	struct ms_dirty *d = ms->dirty;
+	const uint8_t *p = buf + 16;
+	uint32_t offs;
+	unsigned int i;
+
+	ms->tstates = get(&p, 8);
+	for (i = 0; i < SNAP_REGS; i++)
+		z80ex_set_reg(ms->z80, (Z80_REG_T)i, (Z80EX_WORD)get(&p, 2));
+
+	p = get_buf(p, ms->key_matrix, 10);
+	ms->interrupt_mask = get(&p, 1);
+	ms->power_state = get(&p, 1);
+	ms->ac_status = get(&p, 1);
+	ms->batt_status = get(&p, 1);
+	ms->power_button_n = get(&p, 1);
+	ms->df_cycle = get(&p, 1);
+	ms->df_cmd = get(&p, 1);
+	ms->lcd_cas = get(&p, 1);
+	ms->int_count = get(&p, 4);
+	ms->int_tstates = get(&p, 4);
+
+	p = get_buf(p, ms->io, SZ_256);
+	if (dirty) {
+		for (i = 0; i < d->cnt; i++) {
+			offs = d->list[i] * SNAP_PAGE;
+			if (offs < SZ_128K) {
+				mem_put(ms->ram, offs, buf + SNAP_RAM_OFFS + offs,
+				  SNAP_PAGE);
+			} else {
+				offs -= SZ_128K;
+				mem_put(ms->df, offs, buf + SNAP_DF_OFFS + offs,
+				  SNAP_PAGE);
+			}
+		}
+	} else {
+		mem_put(ms->ram, 0, p, SZ_128K);
+		mem_put(ms->df, 0, p + SZ_128K, SZ_512K);
+	}
+	p += SZ_128K + SZ_512K;
+	ms->df_wp = get(&p, 1);
+	if (d != NULL) {
+		snap_dirty_clear(ms);
+		d->base = NULL;
+	}
+
+	/* Redrawing the whole LCD costs more than the rest of a restore, skip
+	 * it if the LCD was left alone */
+	if (!dirty || memcmp(ms->lcd_dat1bit, p, SNAP_LCD_LEN)) {
+		get_buf(p, ms->lcd_dat1bit, SNAP_LCD_LEN);
+		lcd_refresh(ms);
+	}
+
+	/* Nothing queued belongs to the restored point in time */
+	ms->kbd_head = ms->kbd_tail = 0;
+	ms->kbd_next = ms->tstates;
+	ms->kbd_due = UINT64_MAX;
+
+	verify_sync(ms);
+}
+
+int snap_save(ms_ctx *ms, const char *path)
+{
+	uint8_t *buf;
+	FILE *fd;
+	int err;
+
+	buf = (uint8_t *)malloc(SNAP_LEN);
+	if (buf == NULL) {
+		printf("Unable to allocate snapshot\n");
+		exit(EXIT_FAILURE);
+	}
+	snap_fill(ms, buf);
+
+	fd = fopen(path, "wb");
+	if (fd == NULL) {
+		log_error("Failed to open snapshot '%s': %s\n", path,
+		  strerror(errno));
+		free(buf);
+		return MS_ERR;
+	}
+	err = (fwrite(buf, 1, SNAP_LEN, fd) != SNAP_LEN);
+	err |= fclose(fd);
+	free(buf);
+
+	if (err) {
+		log_error("Failed to write snapshot '%s'\n", path);
+		return MS_ERR;
+	}
+
+	return MS_OK;
+}
+
+int snap_load(ms_ctx *ms, const char *path)
+{
+	uint8_t *buf;
+	const uint8_t *p;
+	FILE *fd;
+	size_t len;
+
+	fd = fopen(path, "rb");
+	if (fd == NULL) {
+		log_error("Failed to open snapshot '%s': %s\n", path,
+		  strerror(errno));
+		return MS_ERR;
+	}
+
+	/* Read one byte more than a snapshot is, to catch longer files */
+	buf = (uint8_t *)malloc(SNAP_LEN + 1);
+	if (buf == NULL) {
+		printf("Unable to allocate snapshot\n");
+		exit(EXIT_FAILURE);
+	}
+	len = fread(buf, 1, SNAP_LEN + 1, fd);
+	fclose(fd);
+
+	p = buf;
+	if (len < 16 || memcmp(p, "MSSN", 4)) {
+		log_error("'%s' is not a snapshot\n", path);
+		goto err;
+	}
+	p += 4;
+	if (get(&p, 4) != SNAPSHOT_VERSION || len != SNAP_LEN) {
+		log_error("'%s' is not a version %d snapshot\n", path,
+		  SNAPSHOT_VERSION);
+		goto err;
+	}
+	if (get(&p, 8) != ms->cf_hash) {
+		log_error("'%s' was taken with a different codeflash\n", path);
+		goto err;
+	}
+
+	snap_apply(ms, buf, 0);
+	free(buf);
+
+	return MS_OK;
+
+err:
+	free(buf);
+	return MS_ERR;
+}
+
+struct ms_snap *snap_take(ms_ctx *ms)
+{
+	struct ms_snap *snap;
+
+	snap = (struct ms_snap *)malloc(sizeof(struct ms_snap));
+	if (snap == NULL) {
+		printf("Unable to allocate snapshot\n");
+		exit(EXIT_FAILURE);
+	}
+	snap_fill(ms, snap->buf);
+	if (ms->dirty != NULL) {
+		snap_dirty_clear(ms);
+		ms->dirty->base = snap;
+	}
+
+	return snap;
+}
+
+void snap_restore(ms_ctx *ms, const struct ms_snap *snap)
+{
+	struct ms_dirty *d = ms->dirty;
+
+	snap_apply(ms, snap->buf, d != NULL && d->base == snap);
+	if (d != NULL) d->base = snap;
+}
+
+void snap_free(struct ms_snap *snap)
+{
+	free(snap);
+}
+
+void snap_track(ms_ctx *ms)
+{
+	if (ms->dirty != NULL) return;
+
+	// No snapshot to compare against yet, the first restore copies all
+	ms->dirty = (struct ms_dirty *)calloc(1, sizeof(struct ms_dirty));
+	if (ms->dirty == NULL) {
+		printf("Unable to allocate dirty page map\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+void snap_dirty_range(ms_ctx *ms, int dev, uint32_t addr, uint32_t len)
+{
+	uint32_t end = addr + len;
+
+	if (ms->dirty == NULL || !len) return;
+
+	for (addr &= ~(SNAP_PAGE - 1); addr < end; addr += SNAP_PAGE)
+		snap_dirty(ms, dev, addr);
+}
+
+void snap_untrack(ms_ctx *ms)
+{
+	free(ms->dirty);
+	ms->dirty = NULL;
+}
@@ -0,0 +1,111 @@
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include <stdint.h>
+#include "msemu.h"
+#include "sizes.h"
+
+/* Machine snapshots
+ *
+ * A snapshot holds everything needed to carry on emulating from a point in
+ * time: CPU registers, RAM, dataflash, IO registers, both LCD controllers,
+ * key matrix, power and interrupt state, and the T state count. Loading one
+ * puts an initialized machine back in that state, e.g. to skip booting the
+ * firmware for every run of a batch.
+ *
+ * The codeflash is not saved, only its hash. Loading on top of a different
+ * codeflash fails. Key changes still waiting in the queue are not saved, so
+ * take snapshots with no keys being fed. z80ex can not restore a HALT in
+ * progress, a CPU halted when the snapshot was taken carries on as if the
+ * HALT had ended.
+ *
+ * The file is binary, all values little endian:
+ *   Header:  "MSSN", uint32_t version, uint64_t codeflash hash
+ *   State:   uint64_t tstates, uint16_t Z80 registers in Z80_REG_T order,
+ *            then the machine state as written by snap_save()
+ *   Buffers: IO, RAM, dataflash plus its protect state, 1-bit LCD
+ *
+ * Snapshots can also be kept in memory with snap_take(), to go back to the
+ * same point over and over, e.g. once per fuzzing run. With snap_track()
+ * on, writes to RAM and dataflash mark the SNAP_PAGE sized page written, and
+ * snap_restore() only copies back the pages marked since the same snapshot
+ * was last taken or restored. Everything else is small and always copied.
+ */
+
+#define SNAPSHOT_VERSION	1
+
+// Bytes per page of RAM and dataflash tracked, RAM pages come first
+#define SNAP_PAGE		256
+#define SNAP_PAGES		((SZ_128K + SZ_512K) / SNAP_PAGE)
+
+struct ms_snap;
+
+struct ms_dirty {
+	// Snapshot the marked pages differ from, NULL if unknown
+	const struct ms_snap *base;
+
+	uint8_t map[SNAP_PAGES];
+	uint16_t list[SNAP_PAGES];
+	unsigned int cnt;
+};
+
+/**
+ * Write a snapshot of the machine to path.
+ *
+ * Returns MS_OK on success, MS_ERR if the file could not be written
+ */
+int snap_save(ms_ctx *ms, const char *path);
+
+/**
+ * Restore the machine from a snapshot at path.
+ *
+ * Returns MS_OK on success, MS_ERR if the file could not be read, is not a
+ * snapshot, or was taken with a different codeflash. The machine is left
+ * untouched on error.
+ */
+int snap_load(ms_ctx *ms, const char *path);
+
+/**
+ * Keep a snapshot of the machine in memory.
+ *
+ * The snapshot does not belong to the machine, it may be restored on any
+ * other with the same codeflash and must be freed with snap_free().
+ */
+struct ms_snap *snap_take(ms_ctx *ms);
+
+/**
+ * Put the machine back to the point snap was taken at. Only pages written
+ * since snap was last taken or restored on this machine are copied if
+ * snap_track() is on.
+ */
+void snap_restore(ms_ctx *ms, const struct ms_snap *snap);
+
+void snap_free(struct ms_snap *snap);
+
+/**
+ * Start or stop tracking which pages of RAM and dataflash are written.
+ */
+void snap_track(ms_ctx *ms);
+void snap_untrack(ms_ctx *ms);
+
+/**
+ * Mark every page in len bytes from addr in dev, RAM or DF, as written.
+ */
+void snap_dirty_range(ms_ctx *ms, int dev, uint32_t addr, uint32_t len);
+
+/* Mark the page of addr in dev, RAM or DF, as written */
+static inline void snap_dirty(ms_ctx *ms, int dev, uint32_t addr)
+{
+	struct ms_dirty *d = ms->dirty;
+	uint32_t pg;
+
+	if (d == NULL) return;
+
+	pg = addr / SNAP_PAGE;
+	if (dev == DF) pg += SZ_128K / SNAP_PAGE;
+	if (d->map[pg]) return;
+	d->map[pg] = 1;
+	d->list[d->cnt++] = pg;
+}
+
+#endif // __SNAPSHOT_H__
@@ -0,0 +1,122 @@
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "msemu.h"
+#include "stats.h"
+
+extern const char* const ms_dev_map_text[];
+
+/* Counts SIGUSR1, each instance dumps once for every signal it has not
+ * seen yet */
+static volatile sig_atomic_t stats_signals;
+
+#if !defined(_MSC_VER)
+static void stats_sigusr1(int sig)
+{
+	stats_signals++;
+}
+#endif
+
+void stats_init(ms_ctx *ms, const char *path)
+{
+	memset(&ms->stats, 0, sizeof(ms->stats));
+	ms->stats_path = path;
+	ms->stats_seen = stats_signals;
+}
+
+void stats_sigusr1_init(void)
+{
+#if !defined(_MSC_VER)
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stats_sigusr1;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &sa, NULL);
+#endif
+}
+
+#if defined(ENABLE_STATS)
+static void stats_write(ms_ctx *ms, FILE *f)
+{
+	struct ms_stats *s = &ms->stats;
+	uint64_t inv_r = 0, inv_w = 0;
+	int i, first = 1;
+
+	fprintf(f, "{\n  \"tstates\": %llu,\n  \"devices\": {\n",
+	  (unsigned long long)ms->tstates);
+	for (i = 0; i < DEV_CNT; i++) {
+		fprintf(f, "    \"%s\": { \"read\": %llu, \"write\": %llu },\n",
+		  ms_dev_map_text[i], (unsigned long long)s->dev_read[i],
+		  (unsigned long long)s->dev_write[i]);
+	}
+	for (; i < MS_STATS_DEVS; i++) {
+		inv_r += s->dev_read[i];
+		inv_w += s->dev_write[i];
+	}
+	fprintf(f, "    \"invalid\": { \"read\": %llu, \"write\": %llu }\n"
+	  "  },\n  \"ports\": {", (unsigned long long)inv_r,
+	  (unsigned long long)inv_w);
+
+	for (i = 0; i < 256; i++) {
+		if (!s->port_read[i] && !s->port_write[i]) continue;
+		fprintf(f, "%s\n    \"0x%02X\": { \"read\": %llu, \"write\": %llu }",
+		  first ? "" : ",", i, (unsigned long long)s->port_read[i],
+		  (unsigned long long)s->port_write[i]);
+		first = 0;
+	}
+
+	fprintf(f, "\n  },\n"
+	  "  \"slot4_switches\": %llu,\n"
+	  "  \"slot8_switches\": %llu,\n"
+	  "  \"interrupts\": %llu,\n"
+	  "  \"df\": { \"sector_erase\": %llu, \"chip_erase\": %llu, "
+	  "\"program\": %llu }\n}\n",
+	  (unsigned long long)s->slot4_switch,
+	  (unsigned long long)s->slot8_switch,
+	  (unsigned long long)s->ints,
+	  (unsigned long long)s->df_erase,
+	  (unsigned long long)s->df_chip_erase,
+	  (unsigned long long)s->df_program);
+}
+#endif
+
+int stats_save(ms_ctx *ms, const char *path)
+{
+#if defined(ENABLE_STATS)
+	FILE *f = stdout;
+
+	if (path != NULL && strcmp(path, "-")) {
+		f = fopen(path, "w");
+		if (f == NULL) {
+			printf("Unable to open stats file %s\n", path);
+			return MS_ERR;
+		}
+	}
+
+	stats_write(ms, f);
+
+	if (f == stdout) {
+		fflush(f);
+	} else if (fclose(f)) {
+		printf("Unable to write stats file %s\n", path);
+		return MS_ERR;
+	}
+
+	return MS_OK;
+#else
+	printf("Access counters not built, configure with -DENABLE_STATS=ON\n");
+	return MS_ERR;
+#endif
+}
+
+void stats_poll(ms_ctx *ms)
+{
+	if (ms->stats_seen == stats_signals) return;
+
+	ms->stats_seen = stats_signals;
+	stats_save(ms, ms->stats_path);
+}
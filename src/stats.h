@@ -0,0 +1,72 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdio.h>
+#include "config.h"
+#include "msemu.h"
+
+/* Access counters
+ *
+ * Counts every memory access by device, every IO access by port, changes to
+ * the SLOT4 and SLOT8 mapping, interrupts taken, and dataflash erase and
+ * program operations. This shows where emulation time goes, and a firmware
+ * change that suddenly hammers a device stands out right away.
+ *
+ * Counting is a single increment in each access callback. It is compiled in
+ * unless built with -DENABLE_STATS=OFF, in which case STATS_INC() is empty.
+ *
+ * The counters are written out as JSON when the emulator exits if a path was
+ * given to --stats, whenever SIGUSR1 is received if the front end asked for
+ * it with stats_sigusr1_init(), and with the "stats" debugger command:
+ *
+ *   {
+ *     "tstates": 123456,
+ *     "devices": { "CF": { "read": 1, "write": 0 }, ... },
+ *     "ports": { "0x01": { "read": 1, "write": 2 }, ... },
+ *     "slot4_switches": 1,
+ *     "slot8_switches": 1,
+ *     "interrupts": 1,
+ *     "df": { "sector_erase": 0, "chip_erase": 0, "program": 0 }
+ *   }
+ *
+ * Only ports that were accessed are listed. Accesses to slots mapped to a
+ * device number that does not exist are counted under "invalid".
+ */
+
+#if defined(ENABLE_STATS)
+#define STATS_INC(ms, counter)	((ms)->stats.counter++)
+#else
+#define STATS_INC(ms, counter)	do { } while (0)
+#endif
+
+/**
+ * Clear the counters.
+ *
+ * *path	- Where to write the counters on exit or SIGUSR1, NULL for stdout
+ */
+void stats_init(ms_ctx *ms, const char *path);
+
+/* Set up a signal handler for SIGUSR1 that has every instance write its
+ * counters out on its next pass of the execution loop. The handler is
+ * process wide, so only a front end running a single instance should do
+ * this. Does nothing on Windows.
+ */
+void stats_sigusr1_init(void);
+
+/**
+ * Write the counters as JSON.
+ *
+ * *path	- File to write to, NULL or "-" for stdout
+ *
+ * Returns MS_OK on success, MS_ERR if the file could not be written or the
+ * counters were not compiled in
+ */
+int stats_save(ms_ctx *ms, const char *path);
+
+/**
+ * Called once per pass of the execution loop, writes the counters out if
+ * SIGUSR1 was received since the last call.
+ */
+void stats_poll(ms_ctx *ms);
+
+#endif // __STATS_H__
@@ -0,0 +1,342 @@
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "mem.h"
+#include "msemu.h"
+#include "symbols.h"
+
+extern const char* const ms_dev_map_text[];
+
+struct ms_symbols {
+	struct ms_sym *sym;
+	int cnt;
+	int size;
+
+	/* Last symbol found and the end of what it covers. Tracing looks up
+	 * every instruction, nearly always in the same routine as the last */
+	const struct ms_sym *last;
+	uint32_t last_end;
+};
+
+/* Device name, case insensitive. Returns enum ms_dev_map, or -1 */
+static int sym_parse_dev(const char *str, size_t len)
+{
+	size_t i;
+	int dev;
+
+	for (dev = 0; dev < DEV_CNT; dev++) {
+		if (strlen(ms_dev_map_text[dev]) != len) continue;
+		for (i = 0; i < len; i++) {
+			if (toupper((unsigned char)str[i]) !=
+			    ms_dev_map_text[dev][i]) break;
+		}
+		if (i == len) return dev;
+	}
+
+	return -1;
+}
+
+static void sym_destroy(struct ms_symbols *syms)
+{
+	int i;
+
+	for (i = 0; i < syms->cnt; i++) free(syms->sym[i].name);
+	free(syms->sym);
+	free(syms);
+}
+
+static int sym_cmp(const void *a, const void *b)
+{
+	const struct ms_sym *x = (const struct ms_sym *)a;
+	const struct ms_sym *y = (const struct ms_sym *)b;
+
+	if (x->dev != y->dev) return (x->dev < y->dev) ? -1 : 1;
+	if (x->addr != y->addr) return (x->addr < y->addr) ? -1 : 1;
+	return 0;
+}
+
+static void sym_add(struct ms_symbols *syms, int dev, uint32_t addr,
+  const char *name, size_t len)
+{
+	struct ms_sym *s;
+
+	if (syms->cnt == syms->size) {
+		syms->size = syms->size ? syms->size * 2 : 256;
+		syms->sym = (struct ms_sym *)realloc(syms->sym,
+		  syms->size * sizeof(struct ms_sym));
+		if (syms->sym == NULL) {
+			printf("Unable to allocate symbols\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	s = &syms->sym[syms->cnt++];
+	s->dev = (uint8_t)dev;
+	s->addr = addr;
+	s->name = (char *)malloc(len + 1);
+	if (s->name == NULL) {
+		printf("Unable to allocate symbols\n");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(s->name, name, len);
+	s->name[len] = '\0';
+}
+
+/* Next whitespace separated word of *line, terminated in place. Returns NULL
+ * at the end of the line */
+static char *sym_word(char **line)
+{
+	char *p = *line + strspn(*line, " \t\r\n");
+	char *end;
+
+	if (*p == '\0') return NULL;
+	end = p + strcspn(p, " \t\r\n");
+	*line = end;
+	if (*end != '\0') {
+		*end = '\0';
+		*line = end + 1;
+	}
+
+	return p;
+}
+
+/* Hex number in any of the ways linkers print them, 1234, 0x1234, $1234 or
+ * 1234h, that is all of str. Returns MS_OK, or MS_ERR if str is not one */
+static int sym_hex(const char *str, unsigned long *val)
+{
+	char *end;
+
+	if (*str == '$') str++;
+	if (!isxdigit((unsigned char)*str)) return MS_ERR;
+	*val = strtoul(str, &end, 16);
+	if (*end == 'h' || *end == 'H') end++;
+
+	return (*end == '\0') ? MS_OK : MS_ERR;
+}
+
+/* Plain map line, [<dev>:][<page>:]<addr> <name>. Returns MS_ERR if invalid */
+static int sym_parse_plain(struct ms_symbols *syms, char *p)
+{
+	char *start, *end, *colon;
+	unsigned long addr, page = 0;
+	int dev = CF, paged = 0;
+	size_t len;
+
+	colon = strchr(p, ':');
+	if (colon != NULL && colon < p + strcspn(p, " \t")) {
+		dev = sym_parse_dev(p, colon - p);
+		if (dev < 0) {
+			dev = CF;
+			page = strtoul(p, &end, 16);
+			if (end != colon) return MS_ERR;
+			paged = 1;
+		}
+		p = colon + 1;
+
+		colon = strchr(p, ':');
+		if (!paged && colon != NULL && colon < p + strcspn(p, " \t")) {
+			page = strtoul(p, &end, 16);
+			if (end != colon) return MS_ERR;
+			paged = 1;
+			p = colon + 1;
+		}
+	}
+
+	start = p;
+	addr = strtoul(start, &end, 16);
+	p = end + strspn(end, " \t");
+	len = strcspn(p, " \t\r\n");
+	if (end == start || len == 0) return MS_ERR;
+
+	if (paged) addr = (page * 0x4000) + (addr & 0x3FFF);
+	sym_add(syms, dev, (uint32_t)addr, p, len);
+
+	return MS_OK;
+}
+
+/* Linker map line, see symbols.h. Lines that are not symbols are skipped */
+static void sym_parse_linker(struct ms_symbols *syms, char *p)
+{
+	char *tok[3], *name = NULL, *colon;
+	unsigned long addr = 0, bank;
+	int i;
+
+	for (i = 0; i < 3; i++) tok[i] = sym_word(&p);
+	if (tok[0] == NULL || tok[1] == NULL) return;
+
+	if (!strcmp(tok[0], "DEF") && tok[2] != NULL) {
+		if (sym_hex(tok[2], &addr)) return;
+		name = tok[1];
+	} else if (!strcmp(tok[1], "=") && tok[2] != NULL) {
+		if (sym_hex(tok[2], &addr)) return;
+		name = tok[0];
+	} else if ((colon = strchr(tok[0], ':')) != NULL) {
+		*colon = '\0';
+		if (sym_hex(tok[0], &bank) || sym_hex(colon + 1, &addr)) return;
+		addr |= bank << 16;
+		name = tok[1];
+	} else if (strlen(tok[0]) >= 4) {
+		// sdcc pads addresses, keeps words like "Area" from matching
+		if (sym_hex(tok[0], &addr)) return;
+		name = tok[1];
+	}
+
+	if (name == NULL || !(isalpha((unsigned char)*name) || *name == '_'))
+		return;
+	if (!strncmp(name, "l__", 3) || !strncmp(name, "s__", 3)) return;
+
+	if (addr > 0xFFFF) {
+		sym_add(syms, CF, (uint32_t)(((addr >> 16) * 0x4000) +
+		  (addr & 0x3FFF)), name, strlen(name));
+	} else if (addr >= 0xC000) {
+		sym_add(syms, RAM, (uint32_t)(addr - 0xC000), name,
+		  strlen(name));
+	} else {
+		sym_add(syms, CF, (uint32_t)addr, name, strlen(name));
+	}
+}
+
+int sym_load(ms_ctx *ms, const char *path)
+{
+	struct ms_symbols *syms;
+	char line[256], *p;
+	const char *ext;
+	int linker, lineno = 0;
+	FILE *fd;
+
+	fd = fopen(path, "r");
+	if (fd == NULL) {
+		log_error("Failed to open symbol map '%s'\n", path);
+		return MS_ERR;
+	}
+
+	syms = (struct ms_symbols *)calloc(1, sizeof(struct ms_symbols));
+	if (syms == NULL) {
+		printf("Unable to allocate symbols\n");
+		exit(EXIT_FAILURE);
+	}
+
+	ext = strrchr(path, '.');
+	linker = (ext != NULL && (!strcmp(ext, ".map") || !strcmp(ext, ".sym")));
+
+	while (fgets(line, sizeof(line), fd) != NULL) {
+		lineno++;
+		p = line + strspn(line, " \t");
+		if (*p == '#' || *p == ';' || *p == '\r' || *p == '\n' ||
+		    *p == '\0') continue;
+
+		if (linker) {
+			sym_parse_linker(syms, p);
+		} else if (sym_parse_plain(syms, p)) {
+			log_error("%s:%d: Invalid symbol\n", path, lineno);
+			fclose(fd);
+			sym_destroy(syms);
+			return MS_ERR;
+		}
+	}
+	fclose(fd);
+
+	qsort(syms->sym, syms->cnt, sizeof(struct ms_sym), sym_cmp);
+
+	sym_free(ms);
+	ms->syms = syms;
+
+	return MS_OK;
+}
+
+void sym_free(ms_ctx *ms)
+{
+	if (ms->syms == NULL) return;
+
+	sym_destroy(ms->syms);
+	ms->syms = NULL;
+}
+
+const struct ms_sym *sym_lookup(ms_ctx *ms, int dev, uint32_t addr)
+{
+	struct ms_symbols *syms = ms->syms;
+	struct ms_sym key;
+	int lo, hi, mid;
+
+	if (syms == NULL || syms->cnt == 0) return NULL;
+
+	if (syms->last != NULL && syms->last->dev == dev &&
+	    syms->last->addr <= addr && addr < syms->last_end)
+		return syms->last;
+
+	/* Find the last symbol at or below (dev, addr) */
+	key.dev = (uint8_t)dev;
+	key.addr = addr;
+	lo = 0;
+	hi = syms->cnt;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (sym_cmp(&syms->sym[mid], &key) <= 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	if (lo == 0 || syms->sym[lo - 1].dev != dev) return NULL;
+
+	syms->last = &syms->sym[lo - 1];
+	syms->last_end = UINT32_MAX;
+	if (lo < syms->cnt && syms->sym[lo].dev == dev)
+		syms->last_end = syms->sym[lo].addr;
+
+	return syms->last;
+}
+
+const struct ms_sym *sym_lookup_z80(ms_ctx *ms, uint16_t addr, uint32_t *offs)
+{
+	const struct ms_sym *sym;
+	uint32_t phys;
+	int dev;
+
+	if (ms->syms == NULL) return NULL;
+
+	dev = mem_phys(ms, addr, &phys);
+	if (dev != CF && dev != DF && dev != RAM) return NULL;
+
+	/* A symbol in another page is not what the Z80 sees at addr, the page
+	 * it is in is not mapped in */
+	sym = sym_lookup(ms, dev, phys);
+	if (sym == NULL || (sym->addr ^ phys) >= 0x4000) return NULL;
+	*offs = phys - sym->addr;
+
+	return sym;
+}
+
+int sym_format(ms_ctx *ms, uint16_t addr, char *buf, size_t len)
+{
+	const struct ms_sym *sym;
+	uint32_t offs;
+
+	if (len) buf[0] = '\0';
+	sym = sym_lookup_z80(ms, addr, &offs);
+	if (sym == NULL || !len) return 0;
+
+	if (offs) {
+		snprintf(buf, len, "%s+0x%X", sym->name, offs);
+	} else {
+		snprintf(buf, len, "%s", sym->name);
+	}
+
+	return 1;
+}
+
+const struct ms_sym *sym_table(ms_ctx *ms, int *cnt)
+{
+	if (ms->syms == NULL) {
+		*cnt = 0;
+		return NULL;
+	}
+
+	*cnt = ms->syms->cnt;
+	return ms->syms->sym;
+}
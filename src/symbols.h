@@ -0,0 +1,80 @@
+#ifndef __SYMBOLS_H__
+#define __SYMBOLS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "msemu.h"
+
+/* Symbol maps
+ *
+ * Names for code and data in the codeflash, dataflash or RAM, keyed by the
+ * device and the address inside the device, i.e. page * 0x4000 + offset, so
+ * code in a banked page is named only while that page is mapped in. The map
+ * is plain text with one symbol per line:
+ *
+ *   [<dev>:][<page>:]<addr> <name>
+ *
+ * dev is one of cf, df or ram, cf if not given, and takes precedence over a
+ * page that reads the same. addr is hex, with or without a leading 0x. Given
+ * a page, only the low 14 bits of addr are used. Blank lines and lines
+ * starting with '#' or ';' are ignored.
+ *
+ * Files ending in .map or .sym are instead read as linker output, from sdcc
+ * (<addr> <name> [<module>]), z88dk (<name> = $<addr> ...), sdcc .noi style
+ * (DEF <name> <addr>) or <bank>:<addr> <name>. Lines that match none of these
+ * are skipped, as are sdcc's l__/s__ area symbols. Addresses are Z80
+ * addresses, with the bank above bit 16 as sdcc does for banked code; an
+ * address in 0xC000-0xFFFF with no bank is RAM, anything else codeflash.
+ *
+ * A symbol covers everything from its address up to the next symbol on the
+ * same device.
+ */
+
+struct ms_sym {
+	uint8_t dev;		// enum ms_dev_map
+	uint32_t addr;		// Address inside the device
+	char *name;
+};
+
+/**
+ * Load a symbol map, replacing any loaded before.
+ *
+ * Returns MS_OK on success, MS_ERR if the file could not be read or has
+ * invalid lines
+ */
+int sym_load(ms_ctx *ms, const char *path);
+
+void sym_free(ms_ctx *ms);
+
+/**
+ * Find the symbol covering an address.
+ *
+ * Returns the symbol, or NULL if there is none at or below addr on dev
+ */
+const struct ms_sym *sym_lookup(ms_ctx *ms, int dev, uint32_t addr);
+
+/**
+ * Find the symbol covering a Z80 address, as the slots are mapped now. Only
+ * symbols in the same page as addr are considered.
+ *
+ * Returns the symbol and sets *offs to addr's distance past its start, NULL
+ * if there is none
+ */
+const struct ms_sym *sym_lookup_z80(ms_ctx *ms, uint16_t addr, uint32_t *offs);
+
+/**
+ * Write the symbol covering Z80 address addr to buf, as <name> or
+ * <name>+0x<offset>.
+ *
+ * Returns 1 if there is one, otherwise 0 and buf is left empty
+ */
+int sym_format(ms_ctx *ms, uint16_t addr, char *buf, size_t len);
+
+/**
+ * All symbols, sorted by device then address.
+ *
+ * Returns the table and sets *cnt to its length, NULL if no map is loaded
+ */
+const struct ms_sym *sym_table(ms_ctx *ms, int *cnt);
+
+#endif // __SYMBOLS_H__
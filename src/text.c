@@ -0,0 +1,401 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "lcd.h"
+#include "msemu.h"
+#include "text.h"
+
+/* Cell pixels are packed 8 bits per row, rows 0:7 in lo and 8:15 in hi */
+struct text_glyph {
+	uint64_t lo;
+	uint64_t hi;
+	char c;		// 0 if the slot is unused
+};
+
+struct ms_text {
+	// Cell size and grid origin
+	int w;
+	int h;
+	int x;
+	int y;
+	int rows;
+	int cols;
+
+	// Masks of all pixels in a cell, used to invert a cell
+	uint64_t mask_lo;
+	uint64_t mask_hi;
+
+	// Open addressed hash table of glyphs, size is a power of 2
+	struct text_glyph *tbl;
+	uint32_t size;
+	uint32_t count;
+};
+
+#define TEXT_LINE_LEN	256
+
+static uint32_t text_hash(uint64_t lo, uint64_t hi, uint32_t size)
+{
+	uint64_t x = lo ^ (hi * 0x9E3779B97F4A7C15ULL);
+
+	x ^= x >> 29;
+	x *= 0xBF58476D1CE4E5B9ULL;
+	x ^= x >> 32;
+
+	return (uint32_t)x & (size - 1);
+}
+
+static char text_lookup(struct ms_text *t, uint64_t lo, uint64_t hi)
+{
+	uint32_t i = text_hash(lo, hi, t->size);
+
+	while (t->tbl[i].c) {
+		if (t->tbl[i].lo == lo && t->tbl[i].hi == hi) return t->tbl[i].c;
+		i = (i + 1) & (t->size - 1);
+	}
+
+	return 0;
+}
+
+static void text_insert(struct ms_text *t, uint64_t lo, uint64_t hi, char c)
+{
+	struct text_glyph *old = t->tbl;
+	uint32_t old_size = t->size;
+	uint32_t i;
+
+	/* Keep the table at most half full so probes stay short */
+	if ((t->count + 1) * 2 > t->size) {
+		t->size *= 2;
+		t->count = 0;
+		t->tbl = (struct text_glyph *)calloc(t->size,
+		  sizeof(struct text_glyph));
+		if (t->tbl == NULL) {
+			printf("Unable to allocate glyph table\n");
+			exit(EXIT_FAILURE);
+		}
+		for (i = 0; i < old_size; i++) {
+			if (old[i].c) text_insert(t, old[i].lo, old[i].hi,
+			  old[i].c);
+		}
+		free(old);
+	}
+
+	i = text_hash(lo, hi, t->size);
+	while (t->tbl[i].c) {
+		if (t->tbl[i].lo == lo && t->tbl[i].hi == hi) {
+			t->tbl[i].c = c;
+			return;
+		}
+		i = (i + 1) & (t->size - 1);
+	}
+
+	t->tbl[i].lo = lo;
+	t->tbl[i].hi = hi;
+	t->tbl[i].c = c;
+	t->count++;
+}
+
+/* Pack the pixels of a single cell. Cells that line up with the LCD bytes
+ * need one byte per row, otherwise the cell straddles two bytes. */
+static void text_cell(ms_ctx *ms, struct ms_text *t, int row, int col,
+  uint64_t *lo, uint64_t *hi)
+{
+	int px = t->x + (col * t->w);
+	int py = t->y + (row * t->h);
+	int bcol = px / 8;
+	int shift = px % 8;
+	unsigned int bits;
+	int r;
+
+	*lo = 0;
+	*hi = 0;
+
+	for (r = 0; r < t->h; r++) {
+		bits = lcd_get_byte(ms, bcol, py + r);
+		if (shift && (bcol + 1) < MS_LCD_COLS)
+			bits |= (lcd_get_byte(ms, bcol + 1, py + r) << 8);
+		bits = (bits >> shift) & ((1 << t->w) - 1);
+
+		if (r < 8) {
+			*lo |= ((uint64_t)bits << (r * 8));
+		} else {
+			*hi |= ((uint64_t)bits << ((r - 8) * 8));
+		}
+	}
+}
+
+static char text_match(ms_ctx *ms, struct ms_text *t, int row, int col)
+{
+	uint64_t lo, hi;
+	char c;
+
+	text_cell(ms, t, row, col, &lo, &hi);
+	if (!lo && !hi) return ' ';
+
+	c = text_lookup(t, lo, hi);
+	if (c) return c;
+
+	/* Try again as inverse video */
+	lo ^= t->mask_lo;
+	hi ^= t->mask_hi;
+	if (!lo && !hi) return ' ';
+
+	c = text_lookup(t, lo, hi);
+	if (c) return c;
+
+	return TEXT_UNKNOWN;
+}
+
+int text_init(ms_ctx *ms, int w, int h, int x, int y)
+{
+	struct ms_text *t;
+	int r;
+
+	if (w < 1 || w > TEXT_MAX_W || h < 1 || h > TEXT_MAX_H ||
+	    x < 0 || y < 0 || x + w > MS_LCD_WIDTH || y + h > MS_LCD_HEIGHT) {
+		log_error("Unsupported text cell %dx%d at %d,%d\n", w, h, x, y);
+		return MS_ERR;
+	}
+
+	text_free(ms);
+
+	t = (struct ms_text *)calloc(1, sizeof(struct ms_text));
+	if (t == NULL) {
+		printf("Unable to allocate glyph table\n");
+		exit(EXIT_FAILURE);
+	}
+
+	t->w = w;
+	t->h = h;
+	t->x = x;
+	t->y = y;
+	t->cols = (MS_LCD_WIDTH - x) / w;
+	t->rows = (MS_LCD_HEIGHT - y) / h;
+	for (r = 0; r < h; r++) {
+		if (r < 8) {
+			t->mask_lo |= ((uint64_t)((1 << w) - 1) << (r * 8));
+		} else {
+			t->mask_hi |= ((uint64_t)((1 << w) - 1) << ((r - 8) * 8));
+		}
+	}
+
+	t->size = 128;
+	t->tbl = (struct text_glyph *)calloc(t->size, sizeof(struct text_glyph));
+	if (t->tbl == NULL) {
+		printf("Unable to allocate glyph table\n");
+		exit(EXIT_FAILURE);
+	}
+
+	ms->text = t;
+
+	return MS_OK;
+}
+
+void text_free(ms_ctx *ms)
+{
+	if (ms->text == NULL) return;
+
+	free(ms->text->tbl);
+	free(ms->text);
+	ms->text = NULL;
+}
+
+int text_load_font(ms_ctx *ms, const char *path)
+{
+	char line[TEXT_LINE_LEN];
+	char *p, *end;
+	FILE *fd;
+	int lineno = 0;
+	int w, h, x, y, n;
+	unsigned long c;
+	uint64_t lo, hi, bits;
+
+	fd = fopen(path, "r");
+	if (!fd) {
+		log_error("Failed to open glyph table '%s'\n", path);
+		return MS_ERR;
+	}
+
+	text_free(ms);
+
+	while (fgets(line, sizeof(line), fd)) {
+		lineno++;
+		p = line + strspn(line, " \t");
+		if (*p == '#' || *p == '\n' || *p == '\r' || *p == '\0')
+			continue;
+
+		if (!strncmp(p, "cell", 4)) {
+			x = y = 0;
+			n = sscanf(p + 4, "%d %d %d %d", &w, &h, &x, &y);
+			if (n < 2 || text_init(ms, w, h, x, y)) goto err;
+			continue;
+		}
+
+		if (ms->text == NULL) {
+			log_error("%s:%d: Glyph before cell size\n", path,
+			  lineno);
+			goto err;
+		}
+
+		c = strtoul(p, &end, 16);
+		if (end == p || c < 0x20 || c > 0x7E) goto err;
+
+		lo = hi = 0;
+		for (n = 0; n < ms->text->h; n++) {
+			p = end;
+			bits = strtoul(p, &end, 16);
+			if (end == p) goto err;
+			if (n < 8) {
+				lo |= ((bits & 0xFF) << (n * 8));
+			} else {
+				hi |= ((bits & 0xFF) << ((n - 8) * 8));
+			}
+		}
+		lo &= ms->text->mask_lo;
+		hi &= ms->text->mask_hi;
+		text_insert(ms->text, lo, hi, (char)c);
+	}
+
+	fclose(fd);
+
+	if (ms->text == NULL) {
+		log_error("%s: No cell size specified\n", path);
+		return MS_ERR;
+	}
+
+	return MS_OK;
+
+err:
+	log_error("%s:%d: Invalid line in glyph table\n", path, lineno);
+	fclose(fd);
+	text_free(ms);
+	return MS_ERR;
+}
+
+static int text_glyph_cmp(const void *a, const void *b)
+{
+	return ((const struct text_glyph *)a)->c -
+	  ((const struct text_glyph *)b)->c;
+}
+
+int text_save_font(ms_ctx *ms, const char *path)
+{
+	struct ms_text *t = ms->text;
+	struct text_glyph *sorted;
+	FILE *fd;
+	uint32_t i, n = 0;
+	int r;
+
+	if (t == NULL || t->count == 0) {
+		log_error("No glyph table to save\n");
+		return MS_ERR;
+	}
+
+	fd = fopen(path, "w");
+	if (!fd) {
+		log_error("Failed to open glyph table '%s'\n", path);
+		return MS_ERR;
+	}
+
+	/* Write glyphs in order of character so the file diffs well */
+	sorted = (struct text_glyph *)malloc(t->count * sizeof(struct text_glyph));
+	if (sorted == NULL) {
+		printf("Unable to allocate glyph table\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < t->size; i++) {
+		if (t->tbl[i].c) sorted[n++] = t->tbl[i];
+	}
+	qsort(sorted, n, sizeof(struct text_glyph), text_glyph_cmp);
+
+	fprintf(fd, "# msemu glyph table\n");
+	fprintf(fd, "cell %d %d %d %d\n", t->w, t->h, t->x, t->y);
+	for (i = 0; i < n; i++) {
+		fprintf(fd, "%02X  ", (unsigned char)sorted[i].c);
+		for (r = 0; r < t->h; r++) {
+			fprintf(fd, " %02X", (unsigned int)(((r < 8) ?
+			  (sorted[i].lo >> (r * 8)) :
+			  (sorted[i].hi >> ((r - 8) * 8))) & 0xFF));
+		}
+		fprintf(fd, "  # %c\n", sorted[i].c);
+	}
+
+	free(sorted);
+	fclose(fd);
+
+	return MS_OK;
+}
+
+int text_learn(ms_ctx *ms, int row, int col, const char *str)
+{
+	struct ms_text *t;
+	uint64_t lo, hi;
+	int n = 0;
+
+	if (ms->text == NULL && text_init(ms, 8, 8, 0, 0)) return -1;
+	t = ms->text;
+
+	if (row < 0 || row >= t->rows || col < 0) return -1;
+
+	for (; *str && col < t->cols; str++, col++) {
+		if (*str == ' ' || *str < 0x20 || *str > 0x7E) continue;
+
+		text_cell(ms, t, row, col, &lo, &hi);
+		if (!lo && !hi) {
+			log_error("Cell %d,%d for '%c' is blank, skipping\n",
+			  row, col, *str);
+			continue;
+		}
+		text_insert(t, lo, hi, *str);
+		n++;
+	}
+
+	return n;
+}
+
+int text_rows(ms_ctx *ms)
+{
+	if (ms->text == NULL) return 0;
+
+	return ms->text->rows;
+}
+
+int text_row(ms_ctx *ms, int row, char *buf, size_t len)
+{
+	struct ms_text *t = ms->text;
+	int col;
+	int n = 0;
+
+	if (t == NULL || row < 0 || row >= t->rows || len == 0) return -1;
+
+	for (col = 0; col < t->cols && (size_t)n < len - 1; col++)
+		buf[n++] = text_match(ms, t, row, col);
+
+	while (n && buf[n - 1] == ' ') n--;
+	buf[n] = '\0';
+
+	return n;
+}
+
+int text_screen(ms_ctx *ms, char *buf, size_t len)
+{
+	int row;
+	int n = 0;
+	int ret;
+
+	if (ms->text == NULL || len == 0) return -1;
+
+	buf[0] = '\0';
+	for (row = 0; row < ms->text->rows; row++) {
+		ret = text_row(ms, row, buf + n, len - n);
+		if (ret < 0) break;
+		n += ret;
+		if ((size_t)n >= len - 1) break;
+		buf[n++] = '\n';
+		buf[n] = '\0';
+	}
+
+	return n;
+}
@@ -0,0 +1,90 @@
+#ifndef __TEXT_H__
+#define __TEXT_H__
+
+#include <stddef.h>
+#include "msemu.h"
+
+/* LCD text scraper
+ *
+ * Reads text back off of the LCD by matching fixed size cells of the 1-bit
+ * LCD buffer against a table of known glyphs. The screen is treated as a
+ * grid of cells, each cell's pixels are packed in to a key, and the key is
+ * looked up in a hash table of glyphs. Blank cells read as a space, cells
+ * that are the inverse of a known glyph (e.g. highlighted menu entries) read
+ * as that glyph, and anything else reads as TEXT_UNKNOWN.
+ *
+ * msemu does not ship the firmware font. The glyph table is loaded from a
+ * file, and can be built up from a live screen showing known text with
+ * text_learn() then written out with text_save_font(). Glyph files are plain
+ * text:
+ *
+ *   # Comment
+ *   cell <w> <h> [<x> <y>]   Cell size and the origin of the grid on screen
+ *   <code> <row0> <row1> ... ASCII code of a glyph followed by one hex byte
+ *                            per row of the cell, LSB is the leftmost pixel
+ *
+ * Cells may be up to 8 pixels wide and 16 pixels tall.
+ */
+
+#define TEXT_UNKNOWN	'?'
+
+#define TEXT_MAX_W	8
+#define TEXT_MAX_H	16
+
+/**
+ * Set up an empty glyph table with a grid of w x h cells starting at the
+ * screen position x, y. Replaces any existing table.
+ *
+ * Returns MS_OK, or MS_ERR if the cell size is not supported
+ */
+int text_init(ms_ctx *ms, int w, int h, int x, int y);
+
+/**
+ * Load a glyph table from a file, replacing any existing table.
+ *
+ * Returns MS_OK on success, MS_ERR if the file could not be read or parsed
+ */
+int text_load_font(ms_ctx *ms, const char *path);
+
+/**
+ * Write the current glyph table to a file.
+ *
+ * Returns MS_OK on success, MS_ERR on failure
+ */
+int text_save_font(ms_ctx *ms, const char *path);
+
+/**
+ * Learn glyphs from the screen. Each character of str is assigned the cell
+ * it currently covers, starting at the given cell row and column. Spaces are
+ * skipped. If no table exists yet, an 8x8 grid at 0,0 is used.
+ *
+ * Returns number of glyphs learned, or -1 on error
+ */
+int text_learn(ms_ctx *ms, int row, int col, const char *str);
+
+/**
+ * Read one row of text from the screen.
+ *
+ * *buf		- Buffer for text, NUL terminated. Trailing spaces are trimmed
+ * len		- Size of buf
+ *
+ * Returns length of the text, -1 if no glyph table is loaded or row is
+ * out of range
+ */
+int text_row(ms_ctx *ms, int row, char *buf, size_t len);
+
+/**
+ * Read the whole screen, rows separated by '\n'.
+ *
+ * Returns length of the text, -1 if no glyph table is loaded
+ */
+int text_screen(ms_ctx *ms, char *buf, size_t len);
+
+/**
+ * Number of rows of cells on screen, 0 if no glyph table is loaded.
+ */
+int text_rows(ms_ctx *ms);
+
+void text_free(ms_ctx *ms);
+
+#endif // __TEXT_H__
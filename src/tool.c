@@ -0,0 +1,18 @@
+#include <stdio.h>
+
+#include "tool.h"
+
+void tool_json_str(FILE *fd, const char *str)
+{
+	fputc('"', fd);
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\') {
+			fprintf(fd, "\\%c", *str);
+		} else if ((unsigned char)*str < 0x20) {
+			fprintf(fd, "\\u%04x", (unsigned char)*str);
+		} else {
+			fputc(*str, fd);
+		}
+	}
+	fputc('"', fd);
+}
@@ -0,0 +1,22 @@
+#ifndef __TOOL_H__
+#define __TOOL_H__
+
+/* Helpers shared by the msemu-batch, msemu-diff and msemu-fuzz front ends,
+ * built into each of them rather than into libmsemu */
+
+#include <stdio.h>
+
+// Default RTC start and RAM seed of the tools, 2000-01-01 00:00:00 UTC, so
+// runs are repeatable
+#define TOOL_EPOCH		946684800
+
+/**
+ * Write a string as a quoted JSON string, escaping quotes, backslashes and
+ * control characters.
+ *
+ * *fd		- File to write to
+ * *str		- NUL terminated string
+ */
+void tool_json_str(FILE *fd, const char *str);
+
+#endif // __TOOL_H__
@@ -5,64 +5,121 @@
 #include "fonts.h"
 #include "images.h"
 #include "io.h"
+#include "kbd.h"
 #include "msemu.h"
+#include "perf.h"
+#include "scale.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_image.h>
 #include <SDL2/SDL_ttf.h>
 
-// Main window
-SDL_Window* window = NULL;
-SDL_Renderer* renderer = NULL;
-SDL_RWops* stream = NULL;
 #define LOGICAL_WIDTH  640
 #define LOGICAL_HEIGHT 480
 
+/* All of the static images are packed in to a single atlas texture at init.
+ * The *_srcRect of each image below is relative to that image, its position
+ * in the atlas is added when the draw list is built. */
+enum ui_atlas_item {
+	UI_ATLAS_SPLASH,
+	UI_ATLAS_VERSION,
+	UI_ATLAS_LED,
+	UI_ATLAS_AC,
+	UI_ATLAS_BATTERY,
+	UI_ATLAS_GLYPHS,
+
+	UI_ATLAS_CNT,
+};
+
+/* Everything drawn from the atlas each frame. Only rebuilt when something
+ * it depends on changes, and nothing is drawn at all unless something on
+ * screen changed. */
+#define UI_DRAW_MAX 256
+struct ui_draw {
+	SDL_Rect src;
+	SDL_Rect dst;
+};
+
 // Splashscreen
-SDL_Surface* splashscreen_surface = NULL;
-SDL_Texture* splashscreen_tex = NULL;
-SDL_Rect splashscreen_srcRect = { 0, 0, 320, 128 };
-SDL_Rect splashscreen_dstRect = { 0, 112, LOGICAL_WIDTH, 256 };
-int splashscreen_show = 0;
+static const SDL_Rect splashscreen_srcRect = { 0, 0, 320, 128 };
+static const SDL_Rect splashscreen_dstRect = { 0, 112, LOGICAL_WIDTH, 256 };
 
 // Version
-SDL_Surface* version_surface = NULL;
-SDL_Texture* version_tex = NULL;
-SDL_Rect version_srcRect = { 0, 0, 72, 24 };
-SDL_Rect version_dstRect = { LOGICAL_WIDTH - 80, LOGICAL_HEIGHT - 142, 72, 24 };
-TTF_Font* font = NULL;
-SDL_Color font_color = { 0x9d, 0xe0, 0x8c };
+static const SDL_Rect version_srcRect = { 0, 0, 72, 24 };
+static const SDL_Rect version_dstRect = { LOGICAL_WIDTH - 80, LOGICAL_HEIGHT - 142, 72, 24 };
+static const SDL_Color font_color = { 0x9d, 0xe0, 0x8c };
+
+/* Overlay text, e.g. performance stats. Drawn a character at a time from a
+ * strip of pre-rendered printable ASCII glyphs in the atlas, so changing the
+ * text only means rebuilding the draw list */
+#define UI_GLYPH_FIRST ' '
+#define UI_GLYPH_LAST  '~'
+#define UI_GLYPH_CNT   (UI_GLYPH_LAST - UI_GLYPH_FIRST + 1)
+#define UI_OVERLAY_LEN 256
 
 // LCD
-SDL_Surface* lcd_surface = NULL;
-SDL_Texture* lcd_tex = NULL;
-SDL_Rect lcd_srcRect = { 0, 0, 320, 240 };
-SDL_Rect lcd_dstRect = { 0, 0, LOGICAL_WIDTH, LOGICAL_HEIGHT };
+static const SDL_Rect lcd_srcRect = { 0, 0, 320, 240 };
+static const SDL_Rect lcd_dstRect = { 0, 0, LOGICAL_WIDTH, LOGICAL_HEIGHT };
+static const struct scale_colors lcd_colors = {
+	UI_LCD_PIXEL_ON, UI_LCD_PIXEL_OFF, UI_LCD_PIXEL_GRID
+};
 
 // LED
 #define UI_LED_IMAGE_SIZE 32
-SDL_Surface* led_surface = NULL;
-SDL_Texture* led_tex = NULL;
-SDL_Rect led_srcRect = {0, 0 , UI_LED_IMAGE_SIZE, UI_LED_IMAGE_SIZE};
-SDL_Rect led_dstRect = {LOGICAL_WIDTH - 48, LOGICAL_HEIGHT - 96, UI_LED_IMAGE_SIZE, UI_LED_IMAGE_SIZE};
+static const SDL_Rect led_dstRect = {LOGICAL_WIDTH - 48, LOGICAL_HEIGHT - 96, UI_LED_IMAGE_SIZE, UI_LED_IMAGE_SIZE};
 
 // AC
 #define UI_AC_IMAGE_SIZE 32
-SDL_Surface* ac_surface = NULL;
-SDL_Texture* ac_tex = NULL;
-SDL_Rect ac_srcRect = {0, 0 , UI_AC_IMAGE_SIZE, UI_AC_IMAGE_SIZE};
-SDL_Rect ac_dstRect = {LOGICAL_WIDTH - 80, 72, UI_AC_IMAGE_SIZE, UI_AC_IMAGE_SIZE};
+static const SDL_Rect ac_dstRect = {LOGICAL_WIDTH - 80, 72, UI_AC_IMAGE_SIZE, UI_AC_IMAGE_SIZE};
 
 // Battery
 #define UI_BATTERY_IMAGE_SIZE 32
-SDL_Surface* battery_surface = NULL;
-SDL_Texture* battery_tex = NULL;
-SDL_Rect battery_srcRect = {0, 0 , UI_BATTERY_IMAGE_SIZE, UI_BATTERY_IMAGE_SIZE};
-SDL_Rect battery_dstRect = {LOGICAL_WIDTH - 48, 72, UI_BATTERY_IMAGE_SIZE, UI_BATTERY_IMAGE_SIZE};
+static const SDL_Rect battery_dstRect = {LOGICAL_WIDTH - 48, 72, UI_BATTERY_IMAGE_SIZE, UI_BATTERY_IMAGE_SIZE};
+
+struct ms_ui {
+	// Main window
+	SDL_Window *window;
+	SDL_Renderer *renderer;
+
+	SDL_Texture *atlas_tex;
+	SDL_Rect atlas_rect[UI_ATLAS_CNT];
+
+	struct ui_draw draw_list[UI_DRAW_MAX];
+	int draw_cnt;
+	int draw_dirty;
+	int redraw;
+
+	int splashscreen_show;
+
+	TTF_Font *font;
+	TTF_Font *overlay_font;
+	int glyph_w;
+	int glyph_h;
+	char overlay_text[UI_OVERLAY_LEN];
+	SDL_Rect overlay_rect;
+
+	/* Unless UI_GPU_SCALE is set, the LCD is scaled on the CPU in to a
+	 * texture that is exactly the size it is drawn at on screen. The
+	 * renderer is kept at an integer scale of the logical size so that
+	 * this is always a whole number of screen pixels per LCD pixel. */
+	SDL_Surface *lcd_surface;
+	SDL_Texture *lcd_tex;
+	int flags;
+	int lcd_factor;
+	int lcd_redraw;
+	struct scale_buf scale;
+
+	// Current image of each indicator, only x changes
+	SDL_Rect led_srcRect;
+	SDL_Rect ac_srcRect;
+	SDL_Rect battery_srcRect;
+};
 
 // Keyboard
 // This table translates PC scancodes to the Mailstation key matrix
-static int32_t sdl_to_ms_kbd_LUT[10][8] = {
+static const int32_t sdl_to_ms_kbd_LUT[10][8] = {
 	{ SDLK_HOME, SDLK_END, SDLK_INSERT, SDLK_F1, SDLK_F2, SDLK_F3, SDLK_F4, SDLK_F5 },
 	{ 0, 0, 0, SDLK_F6, SDLK_F7, SDLK_F8, SDLK_F9, SDLK_PAGEUP },
 	{ SDLK_BACKQUOTE, SDLK_1, SDLK_2, SDLK_3, SDLK_4, SDLK_5, SDLK_6, SDLK_7 },
@@ -75,307 +132,660 @@ static int32_t sdl_to_ms_kbd_LUT[10][8] = {
 	{ SDLK_LCTRL, 0, 0, SDLK_SPACE, 0, 0, SDLK_RSHIFT, SDLK_LEFT }
 };
 
-/* XXX: This needs rework still*/
-void ui_init(uint32_t* ms_lcd_buffer)
+/* Open addressed hash of the above table, keycode -> index in to the LUT.
+ * Built by the first ui_init() in the process so translating a key event
+ * does not need to walk the whole LUT, and only ever read after that, so
+ * every instance can share it. Must be a power of 2 and comfortably larger
+ * than the LUT. */
+#define UI_KBD_HASH_SIZE 256
+static struct {
+	int32_t keycode;
+	uint8_t idx;
+} sdl_to_ms_kbd_hash[UI_KBD_HASH_SIZE];
+static SDL_SpinLock sdl_to_ms_kbd_hash_lock;
+static int sdl_to_ms_kbd_hash_built;
+
+static uint32_t ui_kbd_hash(int32_t keycode)
 {
-	/* Initialize SDL, SDL_IMG, & SDL_TTF */
-	if (SDL_Init(SDL_INIT_EVERYTHING) != 0) {
-		printf("Failed to initialize SDL: %s\n", SDL_GetError());
-		abort();
+	/* SDL keycodes are either ASCII or a scancode with bit 30 set, fold
+	 * the high bits down before the multiplicative hash */
+	uint32_t k = (uint32_t)keycode;
+
+	k ^= k >> 16;
+	return (k * 2654435761u) >> 24;
+}
+
+static void ui_kbd_hash_init(void)
+{
+	const int32_t *keytbl_ptr = &sdl_to_ms_kbd_LUT[0][0];
+	uint32_t i, h;
+
+	SDL_AtomicLock(&sdl_to_ms_kbd_hash_lock);
+	if (sdl_to_ms_kbd_hash_built) {
+		SDL_AtomicUnlock(&sdl_to_ms_kbd_hash_lock);
+		return;
 	}
 
-	if (IMG_Init(IMG_INIT_PNG) != IMG_INIT_PNG) {
-		printf("Failed to initialize SDL_IMG: %s\n", IMG_GetError());
-		abort();
+	for (i = 0; i < (sizeof(sdl_to_ms_kbd_LUT)/sizeof(int32_t)); i++) {
+		if (!keytbl_ptr[i]) continue;
+
+		h = ui_kbd_hash(keytbl_ptr[i]);
+		while (sdl_to_ms_kbd_hash[h].keycode)
+			h = (h + 1) & (UI_KBD_HASH_SIZE - 1);
+		sdl_to_ms_kbd_hash[h].keycode = keytbl_ptr[i];
+		sdl_to_ms_kbd_hash[h].idx = i;
 	}
 
-	if (TTF_Init() != 0) {
-		printf("Failed to initialize SDL_TTF: %s\n", TTF_GetError());
+	sdl_to_ms_kbd_hash_built = 1;
+	SDL_AtomicUnlock(&sdl_to_ms_kbd_hash_lock);
+}
+
+/* (Re)create the LCD texture to match the current size of the LCD on
+ * screen. Called at init and whenever the window changes size */
+static void ui_lcd_resize(struct ms_ui *ui)
+{
+	float scale_x, scale_y;
+	int factor;
+
+	if (ui->flags & UI_GPU_SCALE) return;
+
+	/* With integer scaling, the renderer scale is how many screen pixels
+	 * each logical pixel covers, and the LCD is twice the logical size */
+	SDL_RenderGetScale(ui->renderer, &scale_x, &scale_y);
+	factor = (int)(((lcd_dstRect.w * scale_x) / lcd_srcRect.w) + 0.5f);
+	if (factor < 1) factor = 1;
+	if (factor == ui->lcd_factor && ui->lcd_tex) return;
+
+	if (ui->lcd_tex) SDL_DestroyTexture(ui->lcd_tex);
+	ui->lcd_tex = SDL_CreateTexture(ui->renderer, SDL_PIXELFORMAT_RGBA8888,
+	  SDL_TEXTUREACCESS_STREAMING, lcd_srcRect.w * factor,
+	  lcd_srcRect.h * factor);
+	if (!ui->lcd_tex) {
+		printf("Error creating LCD texture: %s\n", SDL_GetError());
 		abort();
 	}
 
-	/* Create/configure window & renderer */
-	window = SDL_CreateWindow(
-		"MailStation EMUlator",
-		SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
-		LOGICAL_WIDTH, LOGICAL_HEIGHT, SDL_WINDOW_RESIZABLE);
-
-	renderer = SDL_CreateRenderer(window, -1, 0);
-	SDL_SetRenderDrawColor(renderer, 0x00, 0x00, 0x00, 0xff);
+	ui->lcd_factor = factor;
+	ui->lcd_redraw = 1;
+}
 
-	// This allows us to assume the window size is 320x240,
-	// but SDL will scale/letterbox it to whatever size the window is.
-	SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "nearest");
-	SDL_RenderSetLogicalSize(renderer, LOGICAL_WIDTH, LOGICAL_HEIGHT);
+static SDL_Surface *ui_load_png(const uint8_t *png, int size,
+  const char *name)
+{
+	SDL_RWops *stream;
+	SDL_Surface *surface;
 
-	/* Prepare the Splashscreen surface */
-	stream = SDL_RWFromConstMem(splash_png, splash_png_size);
+	stream = SDL_RWFromConstMem(png, size);
 	if (!stream) {
-		printf("Error creating Splashscreen stream: %s\n", SDL_GetError());
+		printf("Error creating %s stream: %s\n", name, SDL_GetError());
 		abort();
 	}
 
-	splashscreen_surface = IMG_LoadPNG_RW(stream);
-	if (!splashscreen_surface) {
-		printf("Error creating Splashscreen surface: %s\n", SDL_GetError());
+	surface = IMG_LoadPNG_RW(stream);
+	if (!surface) {
+		printf("Error creating %s surface: %s\n", name, SDL_GetError());
 		abort();
 	}
 
-	splashscreen_tex = SDL_CreateTextureFromSurface(renderer, splashscreen_surface);
-		if (!splashscreen_tex) {
-		printf("Error creating Splashscreen texture: %s\n", SDL_GetError());
-		abort();
+	return surface;
+}
+
+/* Pack the images in to one texture. The splash screen takes up the first
+ * row, and everything else goes in a second row below it. Frees the
+ * surfaces once done. */
+static void ui_atlas_init(struct ms_ui *ui, SDL_Surface **surfaces)
+{
+	SDL_Rect *atlas_rect = ui->atlas_rect;
+	SDL_Surface *atlas;
+	int w = 0, h = 0, x = 0;
+	int i;
+
+	for (i = 0; i < UI_ATLAS_CNT; i++) {
+		atlas_rect[i].w = surfaces[i]->w;
+		atlas_rect[i].h = surfaces[i]->h;
+		if (i == UI_ATLAS_SPLASH) continue;
+		atlas_rect[i].x = x;
+		atlas_rect[i].y = surfaces[UI_ATLAS_SPLASH]->h;
+		x += surfaces[i]->w;
+		if (surfaces[i]->h > h) h = surfaces[i]->h;
 	}
+	w = (x > surfaces[UI_ATLAS_SPLASH]->w) ? x : surfaces[UI_ATLAS_SPLASH]->w;
+	h += surfaces[UI_ATLAS_SPLASH]->h;
 
-	/* Prepare the Version surface */
-	stream = SDL_RWFromConstMem(kongtext_ttf, kongtext_ttf_size);
-	if (!stream) {
-		printf("Error creating font stream: %s\n", SDL_GetError());
+	atlas = SDL_CreateRGBSurfaceWithFormat(0, w, h, 32,
+	  SDL_PIXELFORMAT_RGBA32);
+	if (!atlas) {
+		printf("Error creating atlas surface: %s\n", SDL_GetError());
 		abort();
 	}
 
-	font = TTF_OpenFontRW(stream, 0, 16);
-	if (!font) {
-		printf("Failed to load font: %s\n", TTF_GetError());
-		abort();
+	for (i = 0; i < UI_ATLAS_CNT; i++) {
+		/* Copy pixels and alpha as they are rather than blending them
+		 * on to the empty atlas */
+		SDL_SetSurfaceBlendMode(surfaces[i], SDL_BLENDMODE_NONE);
+		if (SDL_BlitSurface(surfaces[i], NULL, atlas, &atlas_rect[i])) {
+			printf("Error packing atlas: %s\n", SDL_GetError());
+			abort();
+		}
+		SDL_FreeSurface(surfaces[i]);
 	}
 
-	version_surface = TTF_RenderText_Blended_Wrapped(
-		font, VERSION_STR, font_color, LOGICAL_WIDTH);
-	if (!version_surface) {
-		printf("Error creating Version surface: %s\n", TTF_GetError());
+	ui->atlas_tex = SDL_CreateTextureFromSurface(ui->renderer, atlas);
+	if (!ui->atlas_tex) {
+		printf("Error creating atlas texture: %s\n", SDL_GetError());
 		abort();
 	}
+	SDL_SetTextureBlendMode(ui->atlas_tex, SDL_BLENDMODE_BLEND);
+	SDL_FreeSurface(atlas);
+}
 
-	version_tex = SDL_CreateTextureFromSurface(renderer, version_surface);
-	if (!version_tex) {
-		printf("Error creating Version texture: %s\n", SDL_GetError());
-		abort();
+static void ui_draw_add(struct ms_ui *ui, enum ui_atlas_item item,
+  const SDL_Rect *src, const SDL_Rect *dst)
+{
+	struct ui_draw *d;
+	int lim;
+
+	if (ui->draw_cnt == UI_DRAW_MAX) return;
+	d = &ui->draw_list[ui->draw_cnt++];
+
+	d->src = *src;
+	d->dst = *dst;
+
+	/* Clip to the image, and shrink dst to match, the same as drawing
+	 * from a texture of its own would. Otherwise a source rect larger
+	 * than the image would pull in its neighbors in the atlas */
+	lim = ui->atlas_rect[item].w - d->src.x;
+	if (d->src.w > lim) {
+		d->dst.w = (d->dst.w * lim) / d->src.w;
+		d->src.w = lim;
+	}
+	lim = ui->atlas_rect[item].h - d->src.y;
+	if (d->src.h > lim) {
+		d->dst.h = (d->dst.h * lim) / d->src.h;
+		d->src.h = lim;
 	}
 
-	/* Prepare the MailStation LCD surface */
-	lcd_surface = SDL_CreateRGBSurfaceFrom(ms_lcd_buffer, 320, 240, 32, 1280, 0, 0, 0, 0);
-	if (!lcd_surface) {
-		printf("Error creating LCD surface: %s\n", SDL_GetError());
-		abort();
+	d->src.x += ui->atlas_rect[item].x;
+	d->src.y += ui->atlas_rect[item].y;
+}
+
+/* Add the overlay text to the draw list and size the box behind it */
+static void ui_draw_overlay(struct ms_ui *ui)
+{
+	SDL_Rect src = { 0, 0, ui->glyph_w, ui->glyph_h };
+	SDL_Rect dst = { 0, 0, ui->glyph_w, ui->glyph_h };
+	SDL_Rect *rect = &ui->overlay_rect;
+	int col = 0, cols = 0, rows = 0;
+	char *c;
+
+	rect->w = rect->h = 0;
+	if (!ui->overlay_text[0]) return;
+
+	for (c = ui->overlay_text; *c; c++) {
+		if (*c == '\n') {
+			rows++;
+			col = 0;
+			continue;
+		}
+		if (*c > UI_GLYPH_FIRST && *c <= UI_GLYPH_LAST) {
+			src.x = (*c - UI_GLYPH_FIRST) * ui->glyph_w;
+			dst.x = rect->x + ui->glyph_w + (col * ui->glyph_w);
+			dst.y = rect->y + (ui->glyph_h / 2) +
+			  (rows * ui->glyph_h);
+			ui_draw_add(ui, UI_ATLAS_GLYPHS, &src, &dst);
+		}
+		col++;
+		if (col > cols) cols = col;
 	}
+	rows++;
 
-	lcd_tex = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, 320, 240);
-	if (!lcd_tex) {
-		printf("Error creating LCD texture: %s\n", SDL_GetError());
-		abort();
+	rect->w = (cols + 2) * ui->glyph_w;
+	rect->h = (rows + 1) * ui->glyph_h;
+}
+
+/* Rebuild the list of what to draw from the atlas */
+static void ui_draw_build(struct ms_ui *ui)
+{
+	ui->draw_cnt = 0;
+
+	if (ui->splashscreen_show) {
+		ui_draw_add(ui, UI_ATLAS_SPLASH, &splashscreen_srcRect,
+		  &splashscreen_dstRect);
+		ui_draw_add(ui, UI_ATLAS_VERSION, &version_srcRect,
+		  &version_dstRect);
 	}
+	ui_draw_add(ui, UI_ATLAS_LED, &ui->led_srcRect, &led_dstRect);
+	ui_draw_add(ui, UI_ATLAS_AC, &ui->ac_srcRect, &ac_dstRect);
+	ui_draw_add(ui, UI_ATLAS_BATTERY, &ui->battery_srcRect,
+	  &battery_dstRect);
+	ui_draw_overlay(ui);
 
-	/* Prepare the MailStation LED surface */
-	stream = SDL_RWFromConstMem(led_png, led_png_size);
+	ui->draw_dirty = 0;
+}
+
+/* Note that something the draw list depends on changed */
+static void ui_draw_changed(struct ms_ui *ui)
+{
+	ui->draw_dirty = 1;
+	ui->redraw = 1;
+}
+
+static TTF_Font *ui_load_font(int size)
+{
+	SDL_RWops *stream;
+	TTF_Font *font;
+
+	stream = SDL_RWFromConstMem(kongtext_ttf, kongtext_ttf_size);
 	if (!stream) {
-		printf("Error creating LED stream: %s\n", SDL_GetError());
+		printf("Error creating font stream: %s\n", SDL_GetError());
 		abort();
 	}
 
-	led_surface = IMG_LoadPNG_RW(stream);
-	if (!led_surface) {
-		printf("Error creating LED surface: %s\n", SDL_GetError());
+	font = TTF_OpenFontRW(stream, 1, size);
+	if (!font) {
+		printf("Failed to load font: %s\n", TTF_GetError());
 		abort();
 	}
 
-	led_tex = SDL_CreateTextureFromSurface(renderer, led_surface);
-	if (!led_tex) {
-		printf("Error creating LED texture: %s\n", SDL_GetError());
+	return font;
+}
+
+/* XXX: This needs rework still*/
+void ui_init(ms_ctx *ms, int flags)
+{
+	SDL_Surface *surfaces[UI_ATLAS_CNT];
+	char glyphs[UI_GLYPH_CNT + 1];
+	struct ms_ui *ui;
+	int i;
+
+	if (ms->ui != NULL) return;
+
+	ui = (struct ms_ui *)calloc(1, sizeof(struct ms_ui));
+	if (ui == NULL) {
+		printf("Unable to allocate UI\n");
+		exit(EXIT_FAILURE);
 	}
 
-	/* Prepare the MailStation AC surface */
-	stream = SDL_RWFromConstMem(ac_png, ac_png_size);
-	if (!stream) {
-		printf("Error creating AC stream: %s\n", SDL_GetError());
+	ui->flags = flags;
+	ui->draw_dirty = 1;
+	ui->redraw = 1;
+	ui->lcd_redraw = 1;
+	ui->overlay_rect.x = 4;
+	ui->overlay_rect.y = 4;
+	ui->led_srcRect.w = ui->led_srcRect.h = UI_LED_IMAGE_SIZE;
+	ui->ac_srcRect.w = ui->ac_srcRect.h = UI_AC_IMAGE_SIZE;
+	ui->battery_srcRect.w = ui->battery_srcRect.h = UI_BATTERY_IMAGE_SIZE;
+	ui->ac_srcRect.x = UI_AC_IMAGE_SIZE * ms->ac_status;
+	ui->battery_srcRect.x = UI_BATTERY_IMAGE_SIZE * ms->batt_status;
+
+	/* Initialize SDL, SDL_IMG, & SDL_TTF */
+	if (SDL_Init(SDL_INIT_EVERYTHING) != 0) {
+		printf("Failed to initialize SDL: %s\n", SDL_GetError());
 		abort();
 	}
 
-	ac_surface = IMG_LoadPNG_RW(stream);
-	if (!ac_surface) {
-		printf("Error creating AC surface: %s\n", SDL_GetError());
+	if (IMG_Init(IMG_INIT_PNG) != IMG_INIT_PNG) {
+		printf("Failed to initialize SDL_IMG: %s\n", IMG_GetError());
 		abort();
 	}
 
-	ac_tex = SDL_CreateTextureFromSurface(renderer, ac_surface);
-	if (!ac_tex) {
-		printf("Error creating AC texture: %s\n", SDL_GetError());
+	if (TTF_Init() != 0) {
+		printf("Failed to initialize SDL_TTF: %s\n", TTF_GetError());
+		abort();
 	}
 
-	/* Prepare the MailStation Battery surface */
-	stream = SDL_RWFromConstMem(battery_png, battery_png_size);
-	if (!stream) {
-		printf("Error creating Battery stream: %s\n", SDL_GetError());
+	/* Create/configure window & renderer */
+	ui->window = SDL_CreateWindow(
+		"MailStation EMUlator",
+		SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
+		LOGICAL_WIDTH, LOGICAL_HEIGHT, SDL_WINDOW_RESIZABLE);
+
+	ui->renderer = SDL_CreateRenderer(ui->window, -1, 0);
+	SDL_SetRenderDrawColor(ui->renderer, 0x00, 0x00, 0x00, 0xff);
+
+	// This allows us to assume the window size is 320x240,
+	// but SDL will scale/letterbox it to whatever size the window is.
+	SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "nearest");
+	SDL_RenderSetLogicalSize(ui->renderer, LOGICAL_WIDTH, LOGICAL_HEIGHT);
+	if (!(ui->flags & UI_GPU_SCALE))
+		SDL_RenderSetIntegerScale(ui->renderer, SDL_TRUE);
+
+	/* Prepare the static images and pack them in to the atlas */
+	surfaces[UI_ATLAS_SPLASH] = ui_load_png(splash_png, splash_png_size,
+	  "Splashscreen");
+	surfaces[UI_ATLAS_LED] = ui_load_png(led_png, led_png_size, "LED");
+	surfaces[UI_ATLAS_AC] = ui_load_png(ac_png, ac_png_size, "AC");
+	surfaces[UI_ATLAS_BATTERY] = ui_load_png(battery_png, battery_png_size,
+	  "Battery");
+
+	/* Prepare the Version surface */
+	ui->font = ui_load_font(16);
+	surfaces[UI_ATLAS_VERSION] = TTF_RenderText_Blended_Wrapped(
+		ui->font, VERSION_STR, font_color, LOGICAL_WIDTH);
+	if (!surfaces[UI_ATLAS_VERSION]) {
+		printf("Error creating Version surface: %s\n", TTF_GetError());
+		abort();
+	}
+
+	/* Prepare the overlay glyphs. The font is fixed width, so one
+	 * rendered string of every glyph can be cut in to equal cells */
+	ui->overlay_font = ui_load_font(8);
+	for (i = 0; i < UI_GLYPH_CNT; i++) glyphs[i] = UI_GLYPH_FIRST + i;
+	glyphs[UI_GLYPH_CNT] = '\0';
+	surfaces[UI_ATLAS_GLYPHS] = TTF_RenderText_Blended(ui->overlay_font,
+		glyphs, font_color);
+	if (!surfaces[UI_ATLAS_GLYPHS]) {
+		printf("Error creating glyph surface: %s\n", TTF_GetError());
 		abort();
 	}
+	ui->glyph_w = surfaces[UI_ATLAS_GLYPHS]->w / UI_GLYPH_CNT;
+	ui->glyph_h = surfaces[UI_ATLAS_GLYPHS]->h;
+
+	ui_atlas_init(ui, surfaces);
 
-	battery_surface = IMG_LoadPNG_RW(stream);
-	if (!battery_surface) {
-		printf("Error creating Battery surface: %s\n", SDL_GetError());
+	/* Prepare the MailStation LCD surface */
+	ui->lcd_surface = SDL_CreateRGBSurfaceFrom(ms->lcd_datRGBA8888, 320,
+	  240, 32, 1280, 0, 0, 0, 0);
+	if (!ui->lcd_surface) {
+		printf("Error creating LCD surface: %s\n", SDL_GetError());
 		abort();
 	}
 
-	battery_tex = SDL_CreateTextureFromSurface(renderer, battery_surface);
-	if (!battery_tex) {
-		printf("Error creating Battery texture: %s\n", SDL_GetError());
+	if (ui->flags & UI_GPU_SCALE) {
+		ui->lcd_tex = SDL_CreateTexture(ui->renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, 320, 240);
+		if (!ui->lcd_tex) {
+			printf("Error creating LCD texture: %s\n", SDL_GetError());
+			abort();
+		}
+	} else {
+		ui_lcd_resize(ui);
 	}
+
+	ui_kbd_hash_init();
+
+	ms->ui = ui;
 }
 
-void ui_splashscreen_show()
+void ui_deinit(ms_ctx *ms)
 {
-	splashscreen_show = 1;
+	struct ms_ui *ui = ms->ui;
+
+	if (ui == NULL) return;
+
+	scale_free(&ui->scale);
+	SDL_DestroyTexture(ui->lcd_tex);
+	SDL_FreeSurface(ui->lcd_surface);
+	SDL_DestroyTexture(ui->atlas_tex);
+	TTF_CloseFont(ui->overlay_font);
+	TTF_CloseFont(ui->font);
+	SDL_DestroyRenderer(ui->renderer);
+	SDL_DestroyWindow(ui->window);
+	free(ui);
+	ms->ui = NULL;
 }
 
-void ui_splashscreen_hide()
+void ui_splashscreen_show(ms_ctx *ms)
 {
-	splashscreen_show = 0;
+	if (ms->ui == NULL) return;
+
+	ms->ui->splashscreen_show = 1;
+	ui_draw_changed(ms->ui);
+}
+
+void ui_splashscreen_hide(ms_ctx *ms)
+{
+	if (ms->ui == NULL) return;
+
+	ms->ui->splashscreen_show = 0;
+	ui_draw_changed(ms->ui);
 }
 
-void ui_update_led(uint8_t on)
+void ui_update_led(ms_ctx *ms, uint8_t on)
 {
-	led_srcRect.x = UI_LED_IMAGE_SIZE * on;
+	struct ms_ui *ui = ms->ui;
+
+	if (ui == NULL) return;
+
+	if (ui->led_srcRect.x == UI_LED_IMAGE_SIZE * on) return;
+	ui->led_srcRect.x = UI_LED_IMAGE_SIZE * on;
+	ui_draw_changed(ui);
 }
 
-void ui_update_ac(uint8_t on){
-	ac_srcRect.x = UI_AC_IMAGE_SIZE * on;
+void ui_update_ac(ms_ctx *ms, uint8_t on)
+{
+	if (ms->ui == NULL) return;
+
+	ms->ui->ac_srcRect.x = UI_AC_IMAGE_SIZE * on;
+	ui_draw_changed(ms->ui);
 }
 
-void ui_update_battery(int status)
+void ui_update_battery(ms_ctx *ms, int status)
 {
-	battery_srcRect.x = UI_BATTERY_IMAGE_SIZE * status;
+	if (ms->ui == NULL) return;
+
+	ms->ui->battery_srcRect.x = UI_BATTERY_IMAGE_SIZE * status;
+	ui_draw_changed(ms->ui);
 }
 
-void ui_update_lcd()
+void ui_update_lcd(ms_ctx *ms)
 {
-	if (SDL_UpdateTexture(lcd_tex, &lcd_srcRect, lcd_surface->pixels, lcd_surface->pitch) != 0)  {
+	struct ms_ui *ui = ms->ui;
+	void *pixels;
+	int pitch;
+
+	if (ui == NULL) return;
+
+	if (!ms->lcd_dirty && !ui->lcd_redraw) return;
+	ms->lcd_dirty = 0;
+	ui->lcd_redraw = 0;
+	ui->redraw = 1;
+
+	if (ui->flags & UI_GPU_SCALE) {
+		if (SDL_UpdateTexture(ui->lcd_tex, &lcd_srcRect, ui->lcd_surface->pixels, ui->lcd_surface->pitch) != 0)  {
+			printf("Failed to update LCD: %s\n", SDL_GetError());
+		}
+		return;
+	}
+
+	if (SDL_LockTexture(ui->lcd_tex, NULL, &pixels, &pitch) != 0) {
 		printf("Failed to update LCD: %s\n", SDL_GetError());
+		return;
 	}
+	/* Grid lines are only worth drawing once pixels are big enough that
+	 * they do not swallow the pixels themselves */
+	scale_lcd(&ui->scale, ms->lcd_dat1bit, (uint32_t *)pixels, pitch / 4,
+	  ui->lcd_factor,
+	  (ui->flags & UI_PIXEL_GRID) ? (ui->lcd_factor / 4) : 0,
+	  &lcd_colors);
+	SDL_UnlockTexture(ui->lcd_tex);
 }
 
-void ui_render()
+void ui_set_overlay(ms_ctx *ms, const char *text)
 {
-	SDL_RenderClear(renderer);
+	struct ms_ui *ui = ms->ui;
 
-	if (splashscreen_show) {
-		// Render Splashscreen
-		SDL_RenderCopy(
-			renderer, splashscreen_tex,
-			&splashscreen_srcRect, &splashscreen_dstRect);
-		SDL_RenderCopy(
-			renderer, version_tex,
-			&version_srcRect, &version_dstRect);
-	} else {
-		// Render LCD
+	if (ui == NULL) return;
+
+	if (text == NULL) text = "";
+	if (!strncmp(ui->overlay_text, text, sizeof(ui->overlay_text))) return;
+
+	strncpy(ui->overlay_text, text, sizeof(ui->overlay_text) - 1);
+	ui->overlay_text[sizeof(ui->overlay_text) - 1] = '\0';
+	ui_draw_changed(ui);
+}
+
+int ui_render(ms_ctx *ms)
+{
+	struct ms_ui *ui = ms->ui;
+	int i;
+
+	/* The last frame presented is still on screen */
+	if (ui == NULL || !ui->redraw) return 0;
+	ui->redraw = 0;
+
+	if (ui->draw_dirty) ui_draw_build(ui);
+
+	SDL_RenderClear(ui->renderer);
+
+	// Render LCD, unless it is covered by the splashscreen
+	if (!ui->splashscreen_show) {
 		SDL_RenderCopy(
-			renderer, lcd_tex,
-			&lcd_srcRect, &lcd_dstRect);
+			ui->renderer, ui->lcd_tex,
+			NULL, &lcd_dstRect);
 	}
 
-	// Render LED
-	SDL_RenderCopy(
-		renderer, led_tex,
-		&led_srcRect, &led_dstRect);
+	// Darken the area behind the overlay text
+	if (ui->overlay_rect.w) {
+		SDL_SetRenderDrawBlendMode(ui->renderer, SDL_BLENDMODE_BLEND);
+		SDL_SetRenderDrawColor(ui->renderer, 0x00, 0x00, 0x00, 0xc0);
+		SDL_RenderFillRect(ui->renderer, &ui->overlay_rect);
+		SDL_SetRenderDrawColor(ui->renderer, 0x00, 0x00, 0x00, 0xff);
+	}
 
-		// Render AC
-	SDL_RenderCopy(
-		renderer, ac_tex,
-		&ac_srcRect, &ac_dstRect);
+	/* Everything else comes from the atlas. Consecutive copies from the
+	 * same texture are batched by SDL in to a single draw */
+	for (i = 0; i < ui->draw_cnt; i++) {
+		SDL_RenderCopy(
+			ui->renderer, ui->atlas_tex,
+			&ui->draw_list[i].src, &ui->draw_list[i].dst);
+	}
 
-		// Render Battery
-	SDL_RenderCopy(
-		renderer, battery_tex,
-		&battery_srcRect, &battery_dstRect);
+	SDL_RenderPresent(ui->renderer);
 
-	SDL_RenderPresent(renderer);
+	return 1;
 }
 
 /* Translate real input keys to MS keyboard matrix
  *
- * The lookup matrix is currently [10][8], we just walk the whole thing like
- * one long buffer and do the math later to figure out exactly what bit was
- * pressed.
+ * The lookup matrix is [10][8], directly mapping the MS matrix of 10 bytes to
+ * represent the whole keyboard. The hash gives the index of the key in the
+ * matrix as if it were one long buffer; divide by 8 to get the row the key
+ * falls in, and mod 8 to get the bit in that row.
  *
- * TODO: Would it make sense to rework keyTranslateTable to a single buffer
- * anyway? Right now the declaration looks crowded and would need some rework
- * already.
+ * The change is queued rather than written to the matrix so that it is
+ * applied at the right point in emulated time, see kbd_queue().
  */
-static void ui_set_ms_kbd(ms_ctx* ms, int scancode, int eventtype)
+static void ui_set_ms_kbd(ms_ctx* ms, int32_t keycode, int eventtype)
 {
-	uint32_t i = 0;
-	int32_t *keytbl_ptr = &sdl_to_ms_kbd_LUT[0][0];
+	uint32_t h = ui_kbd_hash(keycode);
 
-	for (i = 0; i < (sizeof(sdl_to_ms_kbd_LUT)/sizeof(int32_t)); i++) {
-		if (scancode == *(keytbl_ptr + i)) {
-			/* Couldn't avoid the magic numbers below. As noted,
-			 * kTT array is [10][8], directly mapping the MS matrix
-			 * of 10 bytes to represent the whole keyboard. Divide
-			 * by 8 to get the uint8_t the scancode falls in, and mod
-			 * 8 to get the bit in that uint8_t that matches the code.
-			 */
-			if (eventtype == SDL_KEYDOWN) {
-				ms->key_matrix[i/8] &= ~((uint8_t)1 << (i%8));
-				break;
-			} else {
-				ms->key_matrix[i/8] |= ((uint8_t)1 << (i%8));
-				break;
-			}
+	if (!keycode) return;
+
+	while (sdl_to_ms_kbd_hash[h].keycode) {
+		if (sdl_to_ms_kbd_hash[h].keycode == keycode) {
+			kbd_queue(ms, sdl_to_ms_kbd_hash[h].idx / 8,
+			  sdl_to_ms_kbd_hash[h].idx % 8,
+			  (eventtype == SDL_KEYDOWN));
+			return;
 		}
+		h = (h + 1) & (UI_KBD_HASH_SIZE - 1);
+	}
+}
+
+/* Handle a single SDL event.
+ *
+ * Returns 1 if the event requests that the emulator exit, 0 otherwise.
+ */
+static int ui_process_event(ms_ctx *ms, SDL_Event *event)
+{
+	/* Exit if SDL quits, or Escape key was pushed */
+	if ((event->type == SDL_QUIT) ||
+	  ((event->type == SDL_KEYDOWN) &&
+		(event->key.keysym.sym == SDLK_ESCAPE))) {
+		return 1;
+	}
 
+	if (event->type == SDL_WINDOWEVENT) {
+		if (event->window.event == SDL_WINDOWEVENT_SIZE_CHANGED)
+			ui_lcd_resize(ms->ui);
+		/* Anything that might have disturbed what is on screen */
+		ms->ui->redraw = 1;
+		return 0;
+	}
+
+	/* Handle other input events */
+	if ((event->type == SDL_KEYDOWN) ||
+	  (event->type == SDL_KEYUP)) {
+
+		/* First, check to see if F12 was pressed */
+		if (event->key.keysym.sym == SDLK_F12) {
+			if (event->type == SDL_KEYDOWN) {
+				ms->power_button_n = 0;
+			} else if (event->type == SDL_KEYUP) {
+				ms->power_button_n = 1;
+			}
+			ms_power_hint(ms);
+		}
+		/* Keys pressed while right ctrl is held */
+		if (event->key.keysym.mod & KMOD_RCTRL) {
+			if (event->type == SDL_KEYDOWN) {
+				switch (event->key.keysym.sym) {
+				  /* Reset whole system */
+				  case SDLK_r:
+					ms_power_on_reset(ms);
+					break;
+				  case SDLK_a:
+					ms_power_ac_set_status(ms, AC_TOGGLE);
+					break;
+				  case SDLK_b:
+					ms_power_batt_set_status(ms, BATT_CYCLE);
+					break;
+				  /* Toggle performance overlay */
+				  case SDLK_f:
+					if (ms->perf) {
+						perf_free(ms);
+						ui_set_overlay(ms, NULL);
+					} else {
+						perf_init(ms);
+						ui_set_overlay(ms, "Measuring...");
+					}
+					break;
+				  default:
+					break;
+				}
+			}
+		} else if (!event->key.repeat) {
+			/* Proces the key for the MS. Host key repeat is ignored,
+			 * the firmware does its own repeat for held keys. */
+			ui_set_ms_kbd(ms, event->key.keysym.sym, event->type);
+		}
 	}
+
+	return 0;
 }
 
 int ui_kbd_process(ms_ctx *ms)
 {
 
 	SDL_Event event;
+
+	if (ms->ui == NULL) return 0;
+
 	// Check SDL events
 	while (SDL_PollEvent(&event))
 	{
-		/* Exit if SDL quits, or Escape key was pushed */
-		if ((event.type == SDL_QUIT) ||
-		  ((event.type == SDL_KEYDOWN) &&
-			(event.key.keysym.sym == SDLK_ESCAPE))) {
-			return 1;
-		}
+		if (ui_process_event(ms, &event)) return 1;
+	}
 
+	return 0;
+}
 
-		/* Handle other input events */
-		if ((event.type == SDL_KEYDOWN) ||
-		  (event.type == SDL_KEYUP)) {
+int ui_kbd_wait(ms_ctx *ms, uint32_t timeout)
+{
+	SDL_Event event;
 
-			/* First, check to see if F12 was pressed */
-			if (event.key.keysym.sym == SDLK_F12) {
-				if (event.type == SDL_KEYDOWN) {
-					ms->power_button_n = 0;
-				} else if (event.type == SDL_KEYUP) {
-					ms->power_button_n = 1;
-				}
-				ms_power_hint(ms);
-			}
-			/* Keys pressed while right ctrl is held */
-			if (event.key.keysym.mod & KMOD_RCTRL) {
-				if (event.type == SDL_KEYDOWN) {
-					switch (event.key.keysym.sym) {
-					  /* Reset whole system */
-					  case SDLK_r:
-						ms_power_on_reset(ms);
-						break;
-					  case SDLK_a:
-						ms_power_ac_set_status(ms, AC_TOGGLE);
-						break;
-					  case SDLK_b:
-						ms_power_batt_set_status(ms, BATT_CYCLE);
-						break;
-					  default:
-						break;
-					}
-				}
-			} else {
-				/* Proces the key for the MS */
-				ui_set_ms_kbd(ms, event.key.keysym.sym, event.type);
-			}
-		}
+	if (ms->ui == NULL) {
+		SDL_Delay(timeout);
+		return 0;
 	}
 
-	return 0;
+	/* Sleep in SDL until something happens or the timeout expires. Once
+	 * woken, drain anything else that queued up behind the first event */
+	if (!SDL_WaitEventTimeout(&event, timeout)) return 0;
+
+	do {
+		if (ui_process_event(ms, &event)) return -1;
+	} while (SDL_PollEvent(&event));
+
+	return 1;
 }
@@ -8,58 +8,93 @@
 // RGBA8888 colors
 #define UI_COLOR_DIM_GREEN (0x9de08c00)
 #define UI_COLOR_DARK_GREY (0x26211400)
+#define UI_COLOR_PALE_GREEN (0xa9e89900)
 
 
 // These are the colors used for the LCD screen
-#define UI_LCD_PIXEL_ON  UI_COLOR_DARK_GREY
-#define UI_LCD_PIXEL_OFF UI_COLOR_DIM_GREEN
+#define UI_LCD_PIXEL_ON   UI_COLOR_DARK_GREY
+#define UI_LCD_PIXEL_OFF  UI_COLOR_DIM_GREEN
+#define UI_LCD_PIXEL_GRID UI_COLOR_PALE_GREEN
+
+// Flags for ui_init()
+#define UI_GPU_SCALE      (1 << 0)	// Let SDL stretch the LCD
+#define UI_PIXEL_GRID     (1 << 1)	// Draw gaps between LCD pixels
+
+/* The UI is per instance, hung off of ms_ctx.ui. All of the functions below do
+ * nothing for an instance without one.
+ */
 
 int ui_kbd_process(ms_ctx *ms);
 
 /**
- * Initializes the user interface.
+ * Blocks until an input or window event arrives, or until timeout ms have
+ * passed, then processes all pending events like ui_kbd_process().
+ *
+ * Used while nothing is being emulated so an idle emulator does not spin.
+ *
+ * Returns -1 if the emulator should exit, 1 if any events were processed,
+ * and 0 if the timeout expired with nothing to do.
+ */
+int ui_kbd_wait(ms_ctx *ms, uint32_t timeout);
+
+/**
+ * Initializes the user interface, a window showing the LCD of ms.
  *
  * This interface is generic to avoid polluting the emulator code
  * with SDL code.
  *
- * \param lcd_buffer    - pointer to the Mailstation 8-bit LCD buffer
+ * \param ms            - instance to show
+ * \param flags         - UI_* flags
  */
-void ui_init(uint32_t* lcd_buffer);
+void ui_init(ms_ctx *ms, int flags);
+
+/**
+ * Closes the window, if any.
+ */
+void ui_deinit(ms_ctx *ms);
 
 /**
  * Shows the splash screen.
  */
-void ui_splashscreen_show();
+void ui_splashscreen_show(ms_ctx *ms);
 
 /**
  * Hides the splash screen.
  */
-void ui_splashscreen_hide();
+void ui_splashscreen_hide(ms_ctx *ms);
 
 /**
  * Turn LED on and off.
  */
-void ui_update_led(uint8_t on);
+void ui_update_led(ms_ctx *ms, uint8_t on);
 
 /**
  * Set AC status indicator.
  */
-void ui_update_ac(uint8_t on);
+void ui_update_ac(ms_ctx *ms, uint8_t on);
 
 /**
  * Set battery status indicator.
  */
-void ui_update_battery(int status);
+void ui_update_battery(ms_ctx *ms, int status);
 
 /**
  * Tells the UI to update the LCD texture
- * from the LCD buffer.
+ * from the LCD buffer, if the LCD changed.
  */
-void ui_update_lcd();
+void ui_update_lcd(ms_ctx *ms);
 
 /**
- * Renders the UI
+ * Set text to show over the top left of the screen, lines separated by '\n'.
+ * NULL or an empty string hides it.
+ */
+void ui_set_overlay(ms_ctx *ms, const char *text);
+
+/**
+ * Renders the UI, if anything on screen changed.
+ *
+ * Returns 1 if a new frame was presented, 0 otherwise
  */
-void ui_render();
+int ui_render(ms_ctx *ms);
 
 #endif // _UI_H_
@@ -0,0 +1,522 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL2/SDL.h>
+
+#include "debug.h"
+#include "msemu.h"
+#include "verify.h"
+
+#include <z80ex/z80ex.h>
+
+#define VERIFY_REGS	(regIFF2 + 1)
+
+#define EV_TYPE(e)	((e) >> 24)
+#define EV_ADDR(e)	(((e) >> 8) & 0xFFFF)
+#define EV_VAL(e)	((e) & 0xFF)
+
+static const char* const verify_reg_names[VERIFY_REGS] = {
+	"AF", "BC", "DE", "HL", "AF'", "BC'", "DE'", "HL'", "IX", "IY", "PC",
+	"SP", "I", "R", "R7", "IM", "IFF1", "IFF2",
+};
+
+struct verify_checker {
+	const struct verify_core *core;
+	void *cpu;
+	struct verify_bus bus;
+
+	/* Chunks are filled by the machine and read by the checker in turn.
+	 * full is posted for each chunk handed over, free for each given
+	 * back */
+	uint32_t *chunks[VERIFY_CHUNKS];
+	uint32_t len[VERIFY_CHUNKS];
+	int fill;
+	SDL_sem *full;
+	SDL_sem *free;
+	SDL_Thread *thread;
+	SDL_atomic_t failed;
+
+	// Only touched by the checker thread until it is done
+	int cur;
+	uint32_t rpos;
+	uint64_t insns;
+	uint64_t ref_insns;
+	uint16_t ref_regs[VERIFY_REGS];
+	int mismatch;
+};
+
+/* The second core. This is z80ex again until there is another core to
+ * check, which still checks that the effects log replays exactly */
+struct verify_z80ex {
+	Z80EX_CONTEXT *z80;
+	const struct verify_bus *bus;
+	void *user;
+};
+
+static Z80EX_BYTE vz_mread(Z80EX_CONTEXT *cpu, Z80EX_WORD addr, int m1_state,
+  void *user_data)
+{
+	struct verify_z80ex *z = (struct verify_z80ex *)user_data;
+
+	return z->bus->mread(z->user, addr, m1_state);
+}
+
+static void vz_mwrite(Z80EX_CONTEXT *cpu, Z80EX_WORD addr, Z80EX_BYTE val,
+  void *user_data)
+{
+	struct verify_z80ex *z = (struct verify_z80ex *)user_data;
+
+	z->bus->mwrite(z->user, addr, val);
+}
+
+static Z80EX_BYTE vz_pread(Z80EX_CONTEXT *cpu, Z80EX_WORD port,
+  void *user_data)
+{
+	struct verify_z80ex *z = (struct verify_z80ex *)user_data;
+
+	return z->bus->pread(z->user, port);
+}
+
+static void vz_pwrite(Z80EX_CONTEXT *cpu, Z80EX_WORD port, Z80EX_BYTE val,
+  void *user_data)
+{
+	struct verify_z80ex *z = (struct verify_z80ex *)user_data;
+
+	z->bus->pwrite(z->user, port, val);
+}
+
+static Z80EX_BYTE vz_intread(Z80EX_CONTEXT *cpu, void *user_data)
+{
+	struct verify_z80ex *z = (struct verify_z80ex *)user_data;
+
+	return z->bus->intread(z->user);
+}
+
+static void *vz_create(const struct verify_bus *bus, void *user)
+{
+	struct verify_z80ex *z;
+
+	z = (struct verify_z80ex *)calloc(1, sizeof(struct verify_z80ex));
+	if (z == NULL) {
+		printf("Unable to allocate verify core\n");
+		exit(EXIT_FAILURE);
+	}
+	z->bus = bus;
+	z->user = user;
+	z->z80 = z80ex_create(vz_mread, z, vz_mwrite, z, vz_pread, z,
+	  vz_pwrite, z, vz_intread, z);
+
+	return z;
+}
+
+static void vz_destroy(void *cpu)
+{
+	struct verify_z80ex *z = (struct verify_z80ex *)cpu;
+
+	z80ex_destroy(z->z80);
+	free(z);
+}
+
+static void vz_reset(void *cpu)
+{
+	z80ex_reset(((struct verify_z80ex *)cpu)->z80);
+}
+
+static int vz_step(void *cpu)
+{
+	struct verify_z80ex *z = (struct verify_z80ex *)cpu;
+	int tstates = 0;
+
+	do {
+		tstates += z80ex_step(z->z80);
+	} while (z80ex_last_op_type(z->z80));
+
+	return tstates;
+}
+
+static int vz_intr(void *cpu)
+{
+	struct verify_z80ex *z = (struct verify_z80ex *)cpu;
+
+	// The machine never asks when it is not possible, see process_interrupts()
+	if (!z80ex_int_possible(z->z80)) return 0;
+	return z80ex_int(z->z80);
+}
+
+static uint16_t vz_get_reg(void *cpu, int reg)
+{
+	return z80ex_get_reg(((struct verify_z80ex *)cpu)->z80, (Z80_REG_T)reg);
+}
+
+static void vz_set_reg(void *cpu, int reg, uint16_t val)
+{
+	z80ex_set_reg(((struct verify_z80ex *)cpu)->z80, (Z80_REG_T)reg, val);
+}
+
+static const struct verify_core verify_cores[] = {
+	{ "z80ex", vz_create, vz_destroy, vz_reset, vz_step, vz_intr,
+	  vz_get_reg, vz_set_reg },
+};
+#define NUM_CORES (sizeof(verify_cores) / sizeof(verify_cores[0]))
+
+/* Checker thread */
+
+static uint32_t chk_get(struct verify_checker *c)
+{
+	while (c->cur < 0 || c->rpos == c->len[c->cur]) {
+		if (c->cur >= 0) SDL_SemPost(c->free);
+		SDL_SemWait(c->full);
+		c->cur = (c->cur + 1) % VERIFY_CHUNKS;
+		c->rpos = 0;
+	}
+
+	return c->chunks[c->cur][c->rpos++];
+}
+
+static void ev_fmt(char *buf, size_t len, int type, uint16_t addr,
+  int val)
+{
+	char v[8] = "";
+
+	if (val >= 0) snprintf(v, sizeof(v), " %02X", val);
+
+	switch (type) {
+	  case VE_MR:
+		snprintf(buf, len, "memory read  [%04X] ->%s", addr, v);
+		break;
+	  case VE_MR_M1:
+		snprintf(buf, len, "opcode fetch [%04X] ->%s", addr, v);
+		break;
+	  case VE_MW:
+		snprintf(buf, len, "memory write [%04X] <-%s", addr, v);
+		break;
+	  case VE_PR:
+		snprintf(buf, len, "IO read      [%04X] ->%s", addr, v);
+		break;
+	  case VE_PW:
+		snprintf(buf, len, "IO write     [%04X] <-%s", addr, v);
+		break;
+	  case VE_IR:
+		snprintf(buf, len, "interrupt vector read ->%s", v);
+		break;
+	  case VE_STEP:
+		snprintf(buf, len, "instruction start");
+		break;
+	  case VE_END:
+		snprintf(buf, len, "end after %u T states", addr);
+		break;
+	  case VE_QUIT:
+		snprintf(buf, len, "end of log");
+		break;
+	  default:
+		snprintf(buf, len, "event %d", type);
+		break;
+	}
+}
+
+static void chk_mismatch(struct verify_checker *c, const char *what,
+  uint32_t expect, int type, uint16_t addr, int val)
+{
+	char exp_str[64], got_str[64];
+	uint16_t reg;
+	int i;
+
+	c->mismatch = 1;
+	SDL_AtomicSet(&c->failed, 1);
+
+	ev_fmt(exp_str, sizeof(exp_str), EV_TYPE(expect), EV_ADDR(expect),
+	  (EV_TYPE(expect) == VE_END) ? -1 : (int)EV_VAL(expect));
+	ev_fmt(got_str, sizeof(got_str), type, addr, val);
+
+	log_error("Lockstep mismatch in %s core, instruction %llu: %s\n",
+	  c->core->name, (unsigned long long)c->insns, what);
+	if (expect) {
+		log_error("  expected %s\n  got      %s\n", exp_str, got_str);
+	}
+	log_error("  reg   machine (insn %llu)  %s\n",
+	  (unsigned long long)c->ref_insns, c->core->name);
+	for (i = 0; i < VERIFY_REGS; i++) {
+		reg = c->core->get_reg(c->cpu, i);
+		log_error("  %-5s %04X                %04X%s\n",
+		  verify_reg_names[i], c->ref_regs[i], reg,
+		  (reg != c->ref_regs[i]) ? " *" : "");
+	}
+}
+
+/* The core's bus accesses, each must be the next entry in the log */
+static uint32_t chk_expect(struct verify_checker *c, int type, uint16_t addr,
+  int val)
+{
+	uint32_t e;
+
+	if (c->mismatch) return 0;
+
+	e = chk_get(c);
+	if (EV_TYPE(e) != (uint32_t)type || EV_ADDR(e) != addr ||
+	    (val >= 0 && EV_VAL(e) != (uint32_t)val)) {
+		chk_mismatch(c, "bus access differs", e, type, addr, val);
+		return 0;
+	}
+
+	return e;
+}
+
+static uint8_t chk_mread(void *user, uint16_t addr, int m1)
+{
+	return EV_VAL(chk_expect((struct verify_checker *)user,
+	  m1 ? VE_MR_M1 : VE_MR, addr, -1));
+}
+
+static void chk_mwrite(void *user, uint16_t addr, uint8_t val)
+{
+	chk_expect((struct verify_checker *)user, VE_MW, addr, val);
+}
+
+static uint8_t chk_pread(void *user, uint16_t port)
+{
+	return EV_VAL(chk_expect((struct verify_checker *)user, VE_PR, port,
+	  -1));
+}
+
+static void chk_pwrite(void *user, uint16_t port, uint8_t val)
+{
+	chk_expect((struct verify_checker *)user, VE_PW, port, val);
+}
+
+static uint8_t chk_intread(void *user)
+{
+	return EV_VAL(chk_expect((struct verify_checker *)user, VE_IR, 0, -1));
+}
+
+static void chk_end(struct verify_checker *c, int tstates)
+{
+	uint32_t e;
+
+	if (c->mismatch) return;
+
+	e = chk_get(c);
+	if (EV_TYPE(e) != VE_END) {
+		chk_mismatch(c, "core made fewer bus accesses", e, VE_END,
+		  tstates, -1);
+	} else if (EV_ADDR(e) != (uint32_t)tstates) {
+		chk_mismatch(c, "T states differ", e, VE_END, tstates, -1);
+	}
+}
+
+static void chk_regs(struct verify_checker *c, int sync)
+{
+	int i;
+
+	for (i = 0; i < VERIFY_REGS; i++) c->ref_regs[i] = chk_get(c);
+	c->ref_insns = c->insns;
+
+	if (sync) {
+		c->core->reset(c->cpu);
+		for (i = 0; i < VERIFY_REGS; i++)
+			c->core->set_reg(c->cpu, i, c->ref_regs[i]);
+		return;
+	}
+
+	for (i = 0; i < VERIFY_REGS; i++) {
+		if (c->core->get_reg(c->cpu, i) != c->ref_regs[i]) {
+			chk_mismatch(c, "registers differ", 0, 0, 0, -1);
+			return;
+		}
+	}
+}
+
+static int verify_thread(void *data)
+{
+	struct verify_checker *c = (struct verify_checker *)data;
+	uint32_t e;
+
+	for (;;) {
+		e = chk_get(c);
+		if (EV_TYPE(e) == VE_QUIT) break;
+
+		// Once something differed, only keep the machine going
+		if (c->mismatch) continue;
+
+		switch (EV_TYPE(e)) {
+		  case VE_STEP:
+			c->insns++;
+			chk_end(c, c->core->step(c->cpu));
+			break;
+		  case VE_INT:
+			chk_end(c, c->core->intr(c->cpu));
+			break;
+		  case VE_REGS:
+			chk_regs(c, 0);
+			break;
+		  case VE_SYNC:
+			chk_regs(c, 1);
+			break;
+		  default:
+			chk_mismatch(c, "log out of step", e, VE_STEP, 0, -1);
+			break;
+		}
+	}
+
+	return 0;
+}
+
+/* Machine side */
+
+void verify_next(struct ms_verify *v)
+{
+	struct verify_checker *c = v->chk;
+
+	c->len[c->fill] = v->pos;
+	SDL_SemPost(c->full);
+	SDL_SemWait(c->free);
+	c->fill = (c->fill + 1) % VERIFY_CHUNKS;
+	v->buf = c->chunks[c->fill];
+	v->pos = 0;
+}
+
+void verify_regs(ms_ctx *ms, int type)
+{
+	struct ms_verify *v = ms->verify;
+	int i;
+
+	if (v->pos + 1 + VERIFY_REGS > VERIFY_CHUNK_LEN) verify_next(v);
+
+	v->buf[v->pos++] = (uint32_t)type << 24;
+	for (i = 0; i < VERIFY_REGS; i++)
+		v->buf[v->pos++] = z80ex_get_reg(ms->z80, (Z80_REG_T)i);
+}
+
+void verify_sync(ms_ctx *ms)
+{
+	if (ms->verify == NULL) return;
+
+	verify_regs(ms, VE_SYNC);
+}
+
+int verify_failed(ms_ctx *ms)
+{
+	if (ms->verify == NULL) return 0;
+
+	return SDL_AtomicGet(&ms->verify->chk->failed);
+}
+
+int verify_start(ms_ctx *ms, const char *core, int interval)
+{
+	const struct verify_core *vc = NULL;
+	struct ms_verify *v;
+	struct verify_checker *c;
+	int i;
+
+	if (ms->verify != NULL) return MS_OK;
+
+	for (i = 0; i < (int)NUM_CORES; i++) {
+		if (!strcmp(verify_cores[i].name, core)) vc = &verify_cores[i];
+	}
+	if (vc == NULL) {
+		log_error("Unknown CPU core '%s', available:", core);
+		for (i = 0; i < (int)NUM_CORES; i++)
+			log_error(" %s", verify_cores[i].name);
+		log_error("\n");
+		return MS_ERR;
+	}
+
+	v = (struct ms_verify *)calloc(1, sizeof(struct ms_verify));
+	c = (struct verify_checker *)calloc(1, sizeof(struct verify_checker));
+	if (v == NULL || c == NULL) {
+		printf("Unable to allocate lockstep verification\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < VERIFY_CHUNKS; i++) {
+		c->chunks[i] = (uint32_t *)malloc(
+		  VERIFY_CHUNK_LEN * sizeof(uint32_t));
+		if (c->chunks[i] == NULL) {
+			printf("Unable to allocate lockstep verification\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	v->chk = c;
+	v->buf = c->chunks[0];
+	v->interval = (interval < 1) ? 1 : interval;
+
+	c->core = vc;
+	c->bus.mread = chk_mread;
+	c->bus.mwrite = chk_mwrite;
+	c->bus.pread = chk_pread;
+	c->bus.pwrite = chk_pwrite;
+	c->bus.intread = chk_intread;
+	c->cpu = c->core->create(&c->bus, c);
+	c->cur = -1;
+
+	ms->verify = v;
+
+	// The machine holds one chunk, the rest are free
+	c->full = SDL_CreateSemaphore(0);
+	c->free = SDL_CreateSemaphore(VERIFY_CHUNKS - 1);
+	if (c->full != NULL && c->free != NULL)
+		c->thread = SDL_CreateThread(verify_thread, "verify", c);
+	if (c->thread == NULL) {
+		log_error("Failed to start lockstep verification: %s\n",
+		  SDL_GetError());
+		verify_stop(ms);
+		return MS_ERR;
+	}
+
+	verify_sync(ms);
+
+	return MS_OK;
+}
+
+/* Let the checker through the rest of the log and wait for it */
+static void verify_join(struct ms_verify *v)
+{
+	struct verify_checker *c = v->chk;
+
+	if (c->thread == NULL) return;
+
+	verify_put(v, (uint32_t)VE_QUIT << 24);
+	c->len[c->fill] = v->pos;
+	SDL_SemPost(c->full);
+	SDL_WaitThread(c->thread, NULL);
+	c->thread = NULL;
+}
+
+int verify_finish(ms_ctx *ms)
+{
+	struct ms_verify *v = ms->verify;
+	struct verify_checker *c;
+	int ret = MS_OK;
+
+	if (v == NULL) return MS_OK;
+	c = v->chk;
+
+	verify_join(v);
+	if (SDL_AtomicGet(&c->failed)) {
+		ret = MS_ERR;
+	} else {
+		printf("Lockstep verified %llu instructions against %s core\n",
+		  (unsigned long long)c->insns, c->core->name);
+	}
+	verify_stop(ms);
+
+	return ret;
+}
+
+void verify_stop(ms_ctx *ms)
+{
+	struct ms_verify *v = ms->verify;
+	struct verify_checker *c;
+	int i;
+
+	if (v == NULL) return;
+	c = v->chk;
+
+	verify_join(v);
+	if (c->cpu != NULL) c->core->destroy(c->cpu);
+	if (c->full != NULL) SDL_DestroySemaphore(c->full);
+	if (c->free != NULL) SDL_DestroySemaphore(c->free);
+	for (i = 0; i < VERIFY_CHUNKS; i++) free(c->chunks[i]);
+	free(c);
+	free(v);
+	ms->verify = NULL;
+}
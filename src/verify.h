@@ -0,0 +1,169 @@
+#ifndef __VERIFY_H__
+#define __VERIFY_H__
+
+#include <stdint.h>
+#include "msemu.h"
+
+/* Lockstep CPU verification
+ *
+ * Checks a second CPU core against the z80ex core that runs the machine.
+ * While the machine runs, every bus access the CPU makes, memory reads and
+ * writes, IO reads and writes and interrupt vector reads, is recorded in an
+ * effects log along with where each instruction and interrupt starts and
+ * ends. A background thread replays the log on the core being checked: its
+ * reads are answered from the log, and its writes, IO traffic and T states
+ * per instruction must match what the machine's CPU did. Every interval
+ * instructions the registers of both are compared too.
+ *
+ * Since the core being checked only ever sees the log, it needs none of the
+ * rest of the machine and the machine only pays for appending to the log.
+ * The log is handed over in chunks, the machine only waits if the checker
+ * falls more than VERIFY_CHUNKS chunks behind.
+ *
+ * On the first mismatch, what was expected and what the core did is shown
+ * along with the registers of both, the machine's as of the last register
+ * comparison. The run then stops at the end of the current frame.
+ *
+ * Reset and snapshot restore copy the machine's registers over to the core.
+ */
+
+// Events per chunk of effects log, and chunks in flight
+#define VERIFY_CHUNK_LEN	65536
+#define VERIFY_CHUNKS		8
+
+// Effects log entries, type in the top byte
+enum verify_event {
+	VE_MR = 1,		// Memory read, addr and value
+	VE_MR_M1,		// Opcode fetch, addr and value
+	VE_MW,			// Memory write, addr and value
+	VE_PR,			// IO read, port and value
+	VE_PW,			// IO write, port and value
+	VE_IR,			// Interrupt vector read, value
+	VE_STEP,		// Start of an instruction
+	VE_INT,			// Start of an interrupt
+	VE_END,			// End of either, T states in addr
+	VE_REGS,		// Registers to compare against follow
+	VE_SYNC,		// Registers to copy over follow
+	VE_QUIT,		// End of the log
+};
+
+/* Z80 CPU core, as seen by the checker. Bus accesses go to the callbacks
+ * passed to create() */
+struct verify_bus {
+	uint8_t (*mread)(void *user, uint16_t addr, int m1);
+	void (*mwrite)(void *user, uint16_t addr, uint8_t val);
+	uint8_t (*pread)(void *user, uint16_t port);
+	void (*pwrite)(void *user, uint16_t port, uint8_t val);
+	uint8_t (*intread)(void *user);
+};
+
+struct verify_core {
+	const char *name;
+	void *(*create)(const struct verify_bus *bus, void *user);
+	void (*destroy)(void *cpu);
+	void (*reset)(void *cpu);
+	// Run one whole instruction, prefixes included. Returns T states
+	int (*step)(void *cpu);
+	// Take a maskable interrupt. Returns T states, 0 if not taken
+	int (*intr)(void *cpu);
+	// Registers are numbered as z80ex's Z80_REG_T
+	uint16_t (*get_reg)(void *cpu, int reg);
+	void (*set_reg)(void *cpu, int reg, uint16_t val);
+};
+
+struct verify_checker;
+
+struct ms_verify {
+	// Chunk being filled by the machine
+	uint32_t *buf;
+	uint32_t pos;
+
+	// Set while the machine's CPU is running, bus accesses are logged
+	int active;
+
+	// Instructions until the next register comparison
+	int interval;
+	int count;
+
+	struct verify_checker *chk;
+};
+
+/**
+ * Start checking the core named core against the machine's CPU.
+ *
+ * interval	- Compare registers every this many instructions
+ *
+ * Returns MS_OK on success, MS_ERR if there is no such core
+ */
+int verify_start(ms_ctx *ms, const char *core, int interval);
+
+/**
+ * Copy the machine's registers over to the checked core, after they were
+ * changed other than by running the CPU.
+ */
+void verify_sync(ms_ctx *ms);
+
+/**
+ * Returns non-zero once the checked core has not matched.
+ */
+int verify_failed(ms_ctx *ms);
+
+/**
+ * Wait for the checker to go through the whole log and show the result.
+ *
+ * Returns MS_OK, or MS_ERR if the checked core did not match
+ */
+int verify_finish(ms_ctx *ms);
+
+void verify_stop(ms_ctx *ms);
+
+// Hand a full chunk to the checker and start the next one
+void verify_next(struct ms_verify *v);
+
+// Log the machine's registers as type VE_REGS or VE_SYNC
+void verify_regs(ms_ctx *ms, int type);
+
+static inline void verify_put(struct ms_verify *v, uint32_t e)
+{
+	if (v->pos == VERIFY_CHUNK_LEN) verify_next(v);
+	v->buf[v->pos++] = e;
+}
+
+/* Log a bus access by the machine's CPU */
+static inline void verify_access(ms_ctx *ms, int type, uint16_t addr,
+  uint8_t val)
+{
+	struct ms_verify *v = ms->verify;
+
+	if (v == NULL || !v->active) return;
+
+	verify_put(v, ((uint32_t)type << 24) | ((uint32_t)addr << 8) | val);
+}
+
+/* Around each instruction or interrupt, type VE_STEP or VE_INT */
+static inline void verify_begin(ms_ctx *ms, int type)
+{
+	struct ms_verify *v = ms->verify;
+
+	if (v == NULL) return;
+
+	verify_put(v, (uint32_t)type << 24);
+	v->active = 1;
+}
+
+static inline void verify_end(ms_ctx *ms, int type, int tstates)
+{
+	struct ms_verify *v = ms->verify;
+
+	if (v == NULL) return;
+
+	v->active = 0;
+	verify_put(v, ((uint32_t)VE_END << 24) |
+	  ((uint32_t)(tstates & 0xFFFF) << 8));
+	if (type == VE_STEP && ++v->count >= v->interval) {
+		v->count = 0;
+		verify_regs(ms, VE_REGS);
+	}
+}
+
+#endif // __VERIFY_H__